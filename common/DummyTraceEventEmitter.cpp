@@ -14,9 +14,10 @@ void TraceEvent::emitOneRecordingIfEnabled(const std::string &recording)
     (void) recording;
 }
 
-void TraceEvent::emitOneRecording(const std::string &recording)
+void TraceEvent::emitRecordings(const char* data, std::size_t size)
 {
-    (void) recording;
+    (void) data;
+    (void) size;
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
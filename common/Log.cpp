@@ -11,16 +11,24 @@
 #include <sys/prctl.h>
 #include <sys/syscall.h>
 #endif
+#include <pthread.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Poco/AutoPtr.h>
 #include <Poco/ConsoleChannel.h>
@@ -30,6 +38,7 @@
 #include <Poco/SplitterChannel.h>
 
 #include "Log.hpp"
+#include "LogRing.hpp"
 #include "Util.hpp"
 
 namespace Log
@@ -289,11 +298,301 @@ namespace Log
         signalLog(buffer);
     }
 
+    /// Write all of @iov out to @fd, resuming partial writes. Signal safe.
+    static void writeAll(int fd, struct iovec* iov, int count)
+    {
+        constexpr int MaxIOVecs = 256;
+        while (count > 0)
+        {
+            ssize_t written = ::writev(fd, iov, std::min(count, MaxIOVecs));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            while (count > 0 && written >= static_cast<ssize_t>(iov->iov_len))
+            {
+                written -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+
+            if (count > 0)
+            {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+    }
+
+    /// Set in the child process after a fork, where the writer thread doesn't exist.
+    static std::atomic<bool> ForkedChild(false);
+
+    /// Writes the log out from a background thread.
+    ///
+    /// Each logging thread copies its formatted records into a Ring of its own,
+    /// so the threads never block on the console or the log file, nor on each
+    /// other. The writer thread drains the rings in batches: with writev() when
+    /// logging to the plain console, otherwise through the wrapped channel, which
+    /// rotates log files and colors the console. Records that don't fit in a full
+    /// ring are dropped; that is logged, with their count.
+    ///
+    /// Records are written out in order per thread, and in batches across threads.
+    class AsyncChannel : public Poco::Channel
+    {
+    public:
+        /// The size of the ring of each logging thread.
+        static constexpr std::size_t RingCapacity = 256 * 1024;
+
+        /// The longest records are written out after, unless woken up earlier.
+        static constexpr std::chrono::milliseconds FlushInterval = std::chrono::milliseconds(50);
+
+        /// The records to take from a ring at a time, not to hold back the others.
+        static constexpr std::size_t MaxBatchRecords = 1024;
+
+        AsyncChannel(const AutoPtr<Channel>& channel, const std::string& name, bool toStderr)
+            : _channel(channel)
+            , _name(name)
+            , _toStderr(toStderr)
+            , _running(false)
+            , _stop(false)
+            , _wakeup(false)
+            , _droppedTotal(0)
+        {
+        }
+
+        void start()
+        {
+            _running = true;
+            _thread.reset(new std::thread([this]() { run(); }));
+        }
+
+        /// Stops the writer thread, once it has written everything out.
+        /// Records logged afterwards are written synchronously.
+        void stop()
+        {
+            if (!_running.exchange(false) || ForkedChild)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+
+            _cv.notify_one();
+            _thread->join();
+
+            // What was logged while stopping.
+            drain();
+        }
+
+        void log(const Message& msg) override
+        {
+            if (!_running || ForkedChild)
+            {
+                _channel->log(msg);
+                return;
+            }
+
+            Ring& ring = getThreadRing();
+            const std::string& text = msg.getText();
+            if (!ring.push(msg.getPriority(), text.data(), text.size())
+                || msg.getPriority() <= Message::PRIO_ERROR || ring.used() > RingCapacity / 2)
+            {
+                wakeup();
+            }
+        }
+
+        /// Best effort writing out of the pending records, from a fatal signal handler.
+        /// Records the writer thread is writing out at the same time may be duplicated.
+        void signalFlush()
+        {
+            if (!_running || ForkedChild || !_toStderr)
+                return;
+
+            std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+            if (!lock.owns_lock())
+                return;
+
+            for (const auto& ring : _rings)
+            {
+                ring->peek(
+                    [](int, const char* text, std::size_t size) {
+                        struct iovec iov = { const_cast<char*>(text), size };
+                        writeAll(STDERR_FILENO, &iov, 1);
+                    },
+                    RingCapacity);
+            }
+        }
+
+        std::size_t droppedCount() const { return _droppedTotal; }
+
+    protected:
+        ~AsyncChannel() override
+        {
+            if (ForkedChild)
+                _thread.release(); // There is no thread to join in the child.
+            else
+                stop();
+        }
+
+    private:
+        /// Keeps the ring of the thread until it exits, and what it logged is written out.
+        struct ThreadRing
+        {
+            std::shared_ptr<Ring> _ring;
+
+            ~ThreadRing()
+            {
+                if (_ring)
+                    _ring->setOrphaned();
+            }
+        };
+
+        static thread_local ThreadRing CurrentThreadRing;
+
+        Ring& getThreadRing()
+        {
+            std::shared_ptr<Ring>& ring = CurrentThreadRing._ring;
+            if (!ring)
+            {
+                ring = std::make_shared<Ring>(RingCapacity);
+                std::lock_guard<std::mutex> lock(_mutex);
+                _rings.push_back(ring);
+            }
+
+            return *ring;
+        }
+
+        void wakeup()
+        {
+            if (!_wakeup.exchange(true))
+                _cv.notify_one();
+        }
+
+        void run()
+        {
+            Util::setThreadName("log_writer");
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (!_stop)
+            {
+                _cv.wait_for(lock, FlushInterval, [this]() { return _wakeup || _stop; });
+                _wakeup = false;
+
+                lock.unlock();
+                drain();
+                lock.lock();
+            }
+        }
+
+        /// Writes out what is in the rings; only called by the writer thread, or once it's stopped.
+        void drain()
+        {
+            std::vector<std::shared_ptr<Ring>> rings;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _rings.erase(std::remove_if(_rings.begin(), _rings.end(),
+                                            [](const std::shared_ptr<Ring>& ring) {
+                                                return ring->isOrphaned() && ring->empty();
+                                            }),
+                             _rings.end());
+                rings = _rings;
+            }
+
+            std::size_t dropped = 0;
+            std::size_t truncated = 0;
+            _iov.clear();
+            _positions.clear();
+            for (const auto& ring : rings)
+            {
+                dropped += ring->takeDropped();
+                truncated += ring->takeTruncated();
+
+                const std::size_t position = ring->peek(
+                    [this](int priority, const char* text, std::size_t size) {
+                        if (_toStderr)
+                        {
+                            struct iovec iov = { const_cast<char*>(text), size };
+                            _iov.push_back(iov);
+                        }
+                        else
+                        {
+                            // Without the newline, the channel adds its own.
+                            _channel->log(Message(_name, std::string(text, size - 1),
+                                                  static_cast<Message::Priority>(priority)));
+                        }
+                    },
+                    MaxBatchRecords);
+
+                _positions.emplace_back(ring.get(), position);
+            }
+
+            if (!_iov.empty())
+                writeAll(STDERR_FILENO, _iov.data(), _iov.size());
+
+            for (const auto& pair : _positions)
+                pair.first->release(pair.second);
+
+            if (dropped || truncated)
+            {
+                _droppedTotal += dropped;
+
+                char buffer[1024];
+                std::string notice = prefix<sizeof(buffer) - 1>(buffer, "WRN");
+                notice += "Dropped " + std::to_string(dropped) + " and truncated "
+                          + std::to_string(truncated)
+                          + " log record(s): logging faster than the log can be written out.";
+                if (_toStderr)
+                {
+                    notice += '\n';
+                    struct iovec iov = { &notice[0], notice.size() };
+                    writeAll(STDERR_FILENO, &iov, 1);
+                }
+                else
+                    _channel->log(Message(_name, notice, Message::PRIO_WARNING));
+            }
+        }
+
+        AutoPtr<Channel> _channel;
+        const std::string _name;
+        /// Write the records out with writev() rather than through the channel.
+        const bool _toStderr;
+
+        std::atomic<bool> _running;
+        std::unique_ptr<std::thread> _thread;
+
+        /// Protects _rings, and _stop for the condition variable.
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::vector<std::shared_ptr<Ring>> _rings;
+        bool _stop;
+        std::atomic<bool> _wakeup;
+
+        /// Used by the writer thread only, kept to avoid reallocating.
+        std::vector<struct iovec> _iov;
+        std::vector<std::pair<Ring*, std::size_t>> _positions;
+
+        std::atomic<std::size_t> _droppedTotal;
+    };
+
+    constexpr std::size_t AsyncChannel::RingCapacity;
+    constexpr std::chrono::milliseconds AsyncChannel::FlushInterval;
+    constexpr std::size_t AsyncChannel::MaxBatchRecords;
+    thread_local AsyncChannel::ThreadRing AsyncChannel::CurrentThreadRing;
+
+    /// The asynchronous channel, when enabled. Never released, as it must
+    /// outlive the threads that log, including at exit.
+    static AsyncChannel* AsyncSink = nullptr;
+
     void initialize(const std::string& name,
                     const std::string& logLevel,
                     const bool withColor,
                     const bool logToFile,
-                    const std::map<std::string, std::string>& config)
+                    const std::map<std::string, std::string>& config,
+                    const bool async)
     {
         Static.setName(name);
         std::ostringstream oss;
@@ -331,6 +630,24 @@ namespace Log
          * */
         channel->open();
 
+#if !MOBILEAPP
+        if (async && !AsyncSink)
+        {
+            // The console channels write to stderr, one record at a time.
+            AsyncSink = new AsyncChannel(channel, name, !logToFile && !withColor);
+            AsyncSink->duplicate();
+            AsyncSink->start();
+            channel = AsyncSink;
+
+            pthread_atfork(nullptr, nullptr, []() { ForkedChild = true; });
+
+            // Write the pending records out on exit.
+            std::atexit([]() { AsyncSink->stop(); });
+        }
+#else
+        (void)async;
+#endif
+
         try
         {
             auto& logger = Poco::Logger::create(Static.getName(), channel, Poco::Message::PRIO_TRACE);
@@ -379,6 +696,9 @@ namespace Log
     void shutdown()
     {
 #if !MOBILEAPP
+        if (AsyncSink)
+            AsyncSink->stop();
+
         IsShutdown = true;
 
         Poco::Logger::shutdown();
@@ -414,6 +734,17 @@ namespace Log
     {
         return Static.getLevel();
     }
+
+    std::size_t droppedCount()
+    {
+        return AsyncSink ? AsyncSink->droppedCount() : 0;
+    }
+
+    void signalFlush()
+    {
+        if (AsyncSink)
+            AsyncSink->signalFlush();
+    }
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
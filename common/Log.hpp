@@ -59,11 +59,14 @@ inline std::ostream& operator<<(std::ostream& os, const std::chrono::microsecond
 namespace Log
 {
     /// Initialize the logging system.
+    /// With @async, the log is written out from a background thread, and the
+    /// threads logging never block on it. Not for processes that fork without exec.
     void initialize(const std::string& name,
                     const std::string& logLevel,
                     const bool withColor,
                     const bool logToFile,
-                    const std::map<std::string, std::string>& config);
+                    const std::map<std::string, std::string>& config,
+                    const bool async = false);
 
     /// Returns the underlying logging system. Return value is effectively thread-local.
     Poco::Logger& logger();
@@ -107,6 +110,11 @@ namespace Log
     void signalLog(const char* message);
     /// Signal log number
     void signalLogNumber(std::size_t num);
+    /// Signal safe (best effort) writing out of the asynchronous log records not yet written.
+    void signalFlush();
+
+    /// The number of records the asynchronous log dropped, as it couldn't keep up.
+    std::size_t droppedCount();
 
     /// The following is to write streaming logs.
     /// Log::info() << "Value: 0x" << std::hex << value
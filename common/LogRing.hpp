@@ -0,0 +1,169 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace Log
+{
+/// A single-producer, single-consumer ring of log records.
+///
+/// The producing thread copies its formatted records in, without locks or
+/// allocations. The consumer reads them in place, each record contiguous
+/// and newline-terminated, so they can be handed to writev() as they are,
+/// and releases them once written out. When the ring is full, records are
+/// dropped and counted, rather than blocking the producer.
+class Ring
+{
+    struct Header
+    {
+        uint32_t _size; //< Of the text, including the newline.
+        int32_t _priority; //< Negative for the padding up to the end of the ring.
+    };
+
+    static constexpr std::size_t Alignment = sizeof(Header);
+
+    static std::size_t aligned(std::size_t size)
+    {
+        return (size + Alignment - 1) & ~(Alignment - 1);
+    }
+
+public:
+    /// @capacity must be a power of two.
+    explicit Ring(std::size_t capacity)
+        : _data(new char[capacity])
+        , _capacity(capacity)
+        , _maxTextSize(capacity / 4 - sizeof(Header) - 1)
+        , _head(0)
+        , _tail(0)
+        , _dropped(0)
+        , _truncated(0)
+        , _orphaned(false)
+    {
+        assert(capacity >= 64 && (capacity & (capacity - 1)) == 0
+               && "Ring capacity must be a power of two");
+    }
+
+    std::size_t capacity() const { return _capacity; }
+
+    /// The longest text kept whole; longer records are truncated.
+    std::size_t maxTextSize() const { return _maxTextSize; }
+
+    /// Producer: appends a record with @len bytes of @text, and a newline.
+    /// Returns false, counting the record as dropped, when there is no room.
+    bool push(int priority, const char* text, std::size_t len)
+    {
+        if (len > _maxTextSize)
+        {
+            len = _maxTextSize;
+            _truncated.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const std::size_t need = aligned(sizeof(Header) + len + 1);
+        std::size_t head = _head.load(std::memory_order_relaxed);
+        const std::size_t tail = _tail.load(std::memory_order_acquire);
+
+        // Records don't wrap around: pad to the end if needed.
+        const std::size_t offset = head & (_capacity - 1);
+        const std::size_t toEnd = _capacity - offset;
+        const std::size_t pad = toEnd < need ? toEnd : 0;
+        if (head + pad + need - tail > _capacity)
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if (pad)
+        {
+            const Header padding = { static_cast<uint32_t>(pad - sizeof(Header)), -1 };
+            std::memcpy(_data.get() + offset, &padding, sizeof(Header));
+            head += pad;
+        }
+
+        char* record = _data.get() + (head & (_capacity - 1));
+        const Header header = { static_cast<uint32_t>(len + 1), priority };
+        std::memcpy(record, &header, sizeof(Header));
+        std::memcpy(record + sizeof(Header), text, len);
+        record[sizeof(Header) + len] = '\n';
+
+        _head.store(head + need, std::memory_order_release);
+        return true;
+    }
+
+    /// The number of bytes in use, as seen by the producer.
+    std::size_t used() const
+    {
+        return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const
+    {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed);
+    }
+
+    /// Consumer: calls @callback(priority, text, size) for up to @maxRecords
+    /// records, the text including its newline. Returns the position to
+    /// pass to release() once done with them; they stay valid until then.
+    template <typename Callback> std::size_t peek(Callback callback, std::size_t maxRecords) const
+    {
+        std::size_t tail = _tail.load(std::memory_order_relaxed);
+        const std::size_t head = _head.load(std::memory_order_acquire);
+        for (std::size_t count = 0; tail != head && count < maxRecords;)
+        {
+            const char* record = _data.get() + (tail & (_capacity - 1));
+            Header header;
+            std::memcpy(&header, record, sizeof(Header));
+            if (header._priority < 0)
+            {
+                tail += sizeof(Header) + header._size;
+                continue;
+            }
+
+            callback(header._priority, record + sizeof(Header), header._size);
+            tail += aligned(sizeof(Header) + header._size);
+            ++count;
+        }
+
+        return tail;
+    }
+
+    /// Consumer: frees the records before @position, as returned by peek().
+    void release(std::size_t position) { _tail.store(position, std::memory_order_release); }
+
+    /// Consumer: the number of records dropped since the last call.
+    std::size_t takeDropped() { return _dropped.exchange(0, std::memory_order_relaxed); }
+
+    /// Consumer: the number of records truncated since the last call.
+    std::size_t takeTruncated() { return _truncated.exchange(0, std::memory_order_relaxed); }
+
+    /// The producing thread has exited: no more records will come.
+    void setOrphaned() { _orphaned = true; }
+    bool isOrphaned() const { return _orphaned; }
+
+private:
+    std::unique_ptr<char[]> _data;
+    const std::size_t _capacity;
+    const std::size_t _maxTextSize;
+
+    /// Positions only ever grow; they are masked to index the data.
+    std::atomic<std::size_t> _head;
+    std::atomic<std::size_t> _tail;
+
+    std::atomic<std::size_t> _dropped;
+    std::atomic<std::size_t> _truncated;
+    std::atomic<bool> _orphaned;
+};
+
+} // namespace Log
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
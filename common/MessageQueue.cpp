@@ -8,9 +8,13 @@
 #include <config.h>
 
 #include "MessageQueue.hpp"
+#include <cerrno>
 #include <climits>
+#include <cstdlib>
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <sstream>
 
 #include <Poco/JSON/JSON.h>
 #include <Poco/JSON/Object.h>
@@ -20,10 +24,199 @@
 #include "Log.hpp"
 #include <TileDesc.hpp>
 
+void MessageQueue::put_impl(const Payload& value)
+{
+    const StringVector tokens = Util::tokenize(value.data(), value.size());
+
+    Item item(value);
+    item._target = tokens[0];
+    if (tokens.size() == 1)
+    {
+        item._kind = Kind::Single;
+    }
+    else if (tokens.equals(1, "key") || tokens.equals(1, "mouse") || tokens.equals(1, "windowkey"))
+    {
+        item._kind = Kind::Input;
+    }
+    else if (tokens.equals(1, "textinput"))
+    {
+        item._kind = Kind::TextInput;
+        const std::string newMsg = combineTextInput(tokens, item._key);
+        if (!newMsg.empty())
+            item._payload = Payload(newMsg.data(), newMsg.data() + newMsg.size());
+    }
+    else if (tokens.equals(1, "removetextcontext"))
+    {
+        item._kind = Kind::RemoveText;
+        const std::string newMsg = combineRemoveText(tokens, item._key);
+        if (!newMsg.empty())
+            item._payload = Payload(newMsg.data(), newMsg.data() + newMsg.size());
+    }
+
+    push(std::move(item));
+}
+
+void MessageQueue::push(Item&& item)
+{
+    item._seq = _nextSeq++;
+    switch (item._kind)
+    {
+        case Kind::Single:
+            _lastSingle = item._seq;
+            break;
+        case Kind::Input:
+            _barriers[item._target]._input = item._seq;
+            break;
+        case Kind::TextInput:
+            _barriers[item._target]._textInput = item._seq;
+            break;
+        case Kind::RemoveText:
+            _barriers[item._target]._removeText = item._seq;
+            break;
+        default:
+            break;
+    }
+
+    _queue.push_back(std::move(item));
+    if (!_queue.back()._key.empty())
+        _index.emplace(_queue.back()._key, std::prev(_queue.end()));
+}
+
+MessageQueue::Queue::iterator MessageQueue::erase(Queue::iterator it)
+{
+    if (!it->_key.empty())
+    {
+        const auto range = _index.equal_range(it->_key);
+        for (auto entry = range.first; entry != range.second; ++entry)
+        {
+            if (entry->second == it)
+            {
+                _index.erase(entry);
+                break;
+            }
+        }
+    }
+
+    return _queue.erase(it);
+}
+
+std::vector<MessageQueue::Queue::iterator> MessageQueue::find(const std::string& key)
+{
+    std::vector<Queue::iterator> result;
+    const auto range = _index.equal_range(key);
+    for (auto entry = range.first; entry != range.second; ++entry)
+        result.push_back(entry->second);
+
+    std::sort(result.begin(), result.end(),
+              [](const Queue::iterator& lhs, const Queue::iterator& rhs)
+              { return lhs->_seq < rhs->_seq; });
+    return result;
+}
+
+MessageQueue::Queue::iterator MessageQueue::findLast(const std::string& key)
+{
+    Queue::iterator result = _queue.end();
+    const auto range = _index.equal_range(key);
+    for (auto entry = range.first; entry != range.second; ++entry)
+    {
+        if (result == _queue.end() || entry->second->_seq > result->_seq)
+            result = entry->second;
+    }
+
+    return result;
+}
+
+std::string MessageQueue::combineTextInput(const StringVector& tokens, std::string& key)
+{
+    std::string id;
+    std::string text;
+    if (!LOOLProtocol::getTokenString(tokens, "id", id) ||
+        !LOOLProtocol::getTokenString(tokens, "text", text))
+        return std::string();
+
+    key = tokens[0] + " textinput " + id;
+    const auto it = findLast(key);
+    if (it == _queue.end())
+        return std::string();
+
+    // If any messages of these types are present before the current ("textinput") message,
+    // no combination is possible.
+    const Barriers& barriers = _barriers[tokens[0]];
+    if (it->_seq < _lastSingle || it->_seq < barriers._input || it->_seq < barriers._removeText)
+        return std::string();
+
+    const std::string queuedMessage(it->_payload.data(), it->_payload.size());
+    StringVector queuedTokens = Util::tokenize(queuedMessage);
+
+    std::string queuedText;
+    if (!LOOLProtocol::getTokenString(queuedTokens, "text", queuedText))
+        return std::string();
+
+    // Remove the queued textinput message and combine it with the current one
+    erase(it);
+
+    std::string newMsg = queuedTokens[0] + " textinput id=" + id + " text=" + queuedText + text;
+
+    LOG_TRC("Combined [" << queuedMessage << "] with current message to [" << newMsg << "]");
+
+    return newMsg;
+}
+
+std::string MessageQueue::combineRemoveText(const StringVector& tokens, std::string& key)
+{
+    std::string id;
+    int before;
+    int after;
+    if (!LOOLProtocol::getTokenString(tokens, "id", id) ||
+        !LOOLProtocol::getTokenInteger(tokens, "before", before) ||
+        !LOOLProtocol::getTokenInteger(tokens, "after", after))
+        return std::string();
+
+    key = tokens[0] + " removetextcontext " + id;
+    const auto it = findLast(key);
+    if (it == _queue.end())
+        return std::string();
+
+    // If any messages of these types are present before the current (removetextcontext)
+    // message, no combination is possible.
+    const Barriers& barriers = _barriers[tokens[0]];
+    if (it->_seq < _lastSingle || it->_seq < barriers._input || it->_seq < barriers._textInput)
+        return std::string();
+
+    const std::string queuedMessage(it->_payload.data(), it->_payload.size());
+
+    int queuedBefore;
+    int queuedAfter;
+    if (!LOOLProtocol::getTokenIntegerFromMessage(queuedMessage, "before", queuedBefore) ||
+        !LOOLProtocol::getTokenIntegerFromMessage(queuedMessage, "after", queuedAfter))
+        return std::string();
+
+    // Remove the queued removetextcontext message and combine it with the current one
+    erase(it);
+
+    std::string newMsg = tokens[0] + " removetextcontext id=" + id +
+        " before=" + std::to_string(queuedBefore + before) +
+        " after=" + std::to_string(queuedAfter + after);
+
+    LOG_TRC("Combined [" << queuedMessage << "] with current message to [" << newMsg << "]");
+
+    return newMsg;
+}
+
 void TileQueue::put_impl(const Payload& value)
 {
+    // The invalidations held back go before whatever comes after them,
+    // only consecutive ones are merged.
+    if (!_invalidations.empty())
+        flushInvalidations();
+
     const std::string firstToken = LOOLProtocol::getFirstToken(value);
 
+    // Prerendering is only for when there is nothing else to do,
+    // the callbacks being just the fallout of what was done.
+    if (_prerendering && firstToken != "prerendertiles" && firstToken != "callback")
+        cancelPrerender();
+
     if (firstToken == "canceltiles")
     {
         const std::string msg = std::string(value.data(), value.size());
@@ -32,8 +225,7 @@ void TileQueue::put_impl(const Payload& value)
                                << " in queue.");
         const std::string seqs = msg.substr(12);
         StringVector tokens(Util::tokenize(seqs, ','));
-        getQueue().erase(std::remove_if(getQueue().begin(), getQueue().end(),
-                [&tokens](const Payload& v)
+        remove_if([&tokens](const Payload& v)
                 {
                     const std::string s(v.data(), v.size());
                     // Tile is for a thumbnail, don't cancel it
@@ -50,7 +242,7 @@ void TileQueue::put_impl(const Payload& value)
 
                     return false;
 
-                }), getQueue().end());
+                });
 
         // Don't push canceltiles into the queue.
         LOG_TRC("After canceltiles have " << getQueue().size() << " in queue.");
@@ -66,63 +258,94 @@ void TileQueue::put_impl(const Payload& value)
         {
             const std::string newMsg = tile.serialize("tile");
 
-            removeTileDuplicate(newMsg);
-
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            // Only previews have an id, which is serialized as such.
+            putTile(Payload(newMsg.data(), newMsg.data() + newMsg.size()), tile, tile.getId() >= 0);
+        }
+        return;
+    }
+    else if (firstToken == "prerendertiles")
+    {
+        // The tiles the clients are likely to scroll to next, for the cache.
+        const TileCombined tileCombined = TileCombined::parse(std::string(value.data(), value.size()));
+        for (const auto& tile : tileCombined.getTiles())
+        {
+            const std::string newMsg = tile.serialize("tile");
+            putTile(Payload(newMsg.data(), newMsg.data() + newMsg.size()), tile, false, true);
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeTileDuplicate(std::string(value.data(), value.size()));
+        const StringVector tokens = Util::tokenize(value.data(), value.size());
 
-        MessageQueue::put_impl(value);
+        std::string id;
+        putTile(value, TileDesc::parse(tokens), LOOLProtocol::getTokenString(tokens, "id", id));
         return;
     }
     else if (firstToken == "callback")
     {
-        const std::string newMsg = removeCallbackDuplicate(std::string(value.data(), value.size()));
+        Item item(value);
+        item._kind = Kind::Callback;
+        item._target = firstToken;
 
-        if (newMsg.empty())
-        {
-            MessageQueue::put_impl(value);
-        }
-        else
-        {
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
-        }
+        const std::string newMsg = removeCallbackDuplicate(std::string(value.data(), value.size()), item);
+        if (!newMsg.empty())
+            item._payload = Payload(newMsg.data(), newMsg.data() + newMsg.size());
 
+        push(std::move(item));
         return;
     }
 
     MessageQueue::put_impl(value);
 }
 
-void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+void TileQueue::putTile(const Payload& value, const TileDesc& tile, bool preview, bool prerender)
 {
-    assert(LOOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+    assert(LOOLProtocol::matchPrefix("tile", value));
+
+    Item item(value);
+    item._kind = Kind::Tile;
+    item._target = "tile";
+    item._tile = Util::make_unique<TileDesc>(tile);
+    item._preview = preview;
+    item._prerender = prerender;
 
     // Ver is always provided at this point and it is necessary to
     // return back to clients the last rendered version of a tile
     // in case there are new invalidations and requests while rendering.
     // Here we compare duplicates without 'ver' since that's irrelevant.
-    size_t newMsgPos = tileMsg.find(" ver");
-    if (newMsgPos == std::string::npos)
+    static const std::string ver(" ver");
+    const auto verPos = std::search(value.begin(), value.end(), ver.begin(), ver.end());
+    item._key.assign(value.begin(), verPos != value.end() ? verPos : value.end() - 1);
+
+    const auto duplicate = findLast(item._key);
+    if (duplicate != getQueue().end() && prerender)
     {
-        newMsgPos = tileMsg.size() - 1;
+        LOG_TRC("Tile to prerender is already queued: " << LOOLProtocol::getAbbreviatedMessage(value));
+        return;
     }
 
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    if (duplicate != getQueue().end())
     {
-        auto& it = getQueue()[i];
-        if (it.size() > newMsgPos &&
-            strncmp(tileMsg.data(), it.data(), newMsgPos) == 0)
-        {
-            LOG_TRC("Remove duplicate tile request: " << std::string(it.data(), it.size()) << " -> " << LOOLProtocol::getAbbreviatedMessage(tileMsg));
-            getQueue().erase(getQueue().begin() + i);
-            break;
-        }
+        LOG_TRC("Remove duplicate tile request: "
+                << std::string(duplicate->_payload.data(), duplicate->_payload.size()) << " -> "
+                << LOOLProtocol::getAbbreviatedMessage(value));
+        erase(duplicate);
     }
+
+    _prerendering = _prerendering || prerender;
+    push(std::move(item));
+}
+
+void TileQueue::cancelPrerender()
+{
+    Queue& queue = getQueue();
+    const std::size_t before = queue.size();
+    for (auto it = queue.begin(); it != queue.end(); )
+        it = (it->_prerender ? erase(it) : std::next(it));
+
+    LOG_TRC("Cancelled prerendering " << before - queue.size() << " tiles.");
+    _prerendering = false;
 }
 
 namespace {
@@ -182,9 +405,57 @@ bool extractRectangle(const StringVector& tokens, int& x, int& y, int& w, int& h
     return true;
 }
 
+
+/// Invalidations are merged on the grid of 256 pixel tiles at 100% zoom, in twips.
+constexpr int InvalidationGrid = 3840;
+
+/// The most regions kept per part, the closest ones are merged beyond that.
+constexpr std::size_t MaxInvalidationRegions = 8;
+
+/// The number of grid cells the rectangle touches.
+std::int64_t countGridCells(const Util::Rectangle& rect)
+{
+    const auto cells = [](std::int64_t from, std::int64_t to)
+    {
+        // Round the start down and the end up, also when negative.
+        const std::int64_t first = (from >= 0 ? from : from - InvalidationGrid + 1) / InvalidationGrid;
+        const std::int64_t last = (to >= 0 ? to + InvalidationGrid - 1 : to) / InvalidationGrid;
+        return std::max<std::int64_t>(last - first, 1);
+    };
+
+    return cells(rect.getLeft(), rect.getRight()) * cells(rect.getTop(), rect.getBottom());
+}
+
+Util::Rectangle unite(const Util::Rectangle& a, const Util::Rectangle& b)
+{
+    Util::Rectangle result;
+    result.setLeft(std::min(a.getLeft(), b.getLeft()));
+    result.setTop(std::min(a.getTop(), b.getTop()));
+    result.setRight(std::max(a.getRight(), b.getRight()));
+    result.setBottom(std::max(a.getBottom(), b.getBottom()));
+    return result;
+}
+
+/// How many more grid cells invalidating the union of the two would cost
+/// than invalidating them separately.
+std::int64_t mergeCost(const Util::Rectangle& a, const Util::Rectangle& b)
+{
+    return countGridCells(unite(a, b)) - countGridCells(a) - countGridCells(b);
+}
+
+/// Parse a number of an invalidation payload, which must fit an int.
+bool parseInvalidationValue(const std::string& token, std::int64_t& value)
+{
+    const char* str = token.c_str();
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoll(str, &end, 10);
+    return end > str && errno != ERANGE && value >= INT_MIN && value <= INT_MAX;
+}
+
 }
 
-std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
+std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg, Item& item)
 {
     assert(LOOLProtocol::matchPrefix("callback", callbackMsg, /*ignoreWhitespace*/ true));
 
@@ -199,6 +470,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
         return std::string();
 
     const auto callbackType = static_cast<LibreOfficeKitCallbackType>(pair.first);
+    item._callbackType = pair.first;
 
     switch (callbackType)
     {
@@ -209,42 +481,34 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
             if (!extractRectangle(tokens, msgX, msgY, msgW, msgH, msgPart))
                 return std::string();
 
+            // Only the invalidations of the same view and part can be merged.
+            item._key = tokens[0] + ' ' + tokens[1] + ' ' + tokens[2] + ' ' + std::to_string(msgPart);
+            item._part = msgPart;
+
             bool performedMerge = false;
 
-            // we always travel the entire queue
-            std::size_t i = 0;
-            while (i < getQueue().size())
+            // Merging moves an invalidation to the end of the queue, so only those
+            // after the last of the other messages can be merged with.
+            uint64_t barrier = 0;
+            for (auto it = getQueue().rbegin(); it != getQueue().rend(); ++it)
             {
-                auto& it = getQueue()[i];
-
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 3)
+                if (it->_callbackType != LOK_CALLBACK_INVALIDATE_TILES)
                 {
-                    ++i;
-                    continue;
-                }
-
-                // not a invalidation callback
-                if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1]
-                    || queuedTokens[2] != tokens[2])
-                {
-                    ++i;
-                    continue;
+                    barrier = it->_seq;
+                    break;
                 }
+            }
 
-                int queuedX, queuedY, queuedW, queuedH, queuedPart;
-
-                if (!extractRectangle(queuedTokens, queuedX, queuedY, queuedW, queuedH, queuedPart))
-                {
-                    ++i;
+            // we always travel all the invalidations of this part
+            for (const Queue::iterator& it : find(item._key))
+            {
+                if (it->_seq < barrier)
                     continue;
-                }
 
-                if (msgPart != queuedPart)
-                {
-                    ++i;
-                    continue;
-                }
+                const int queuedX = it->_x;
+                const int queuedY = it->_y;
+                const int queuedW = it->_width;
+                const int queuedH = it->_height;
 
                 // the invalidation in the queue is fully covered by the message,
                 // just remove it
@@ -252,12 +516,12 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     && queuedY + queuedH <= msgY + msgH)
                 {
                     LOG_TRC("Removing smaller invalidation: "
-                            << std::string(it.data(), it.size()) << " -> " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << msgX << ' ' << msgY << ' '
-                            << msgW << ' ' << msgH << ' ' << msgPart);
+                            << std::string(it->_payload.data(), it->_payload.size()) << " -> "
+                            << tokens[0] << ' ' << tokens[1] << ' ' << tokens[2] << ' ' << msgX
+                            << ' ' << msgY << ' ' << msgW << ' ' << msgH << ' ' << msgPart);
 
                     // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
+                    erase(it);
                     continue;
                 }
 
@@ -274,17 +538,14 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     const int reasonableSizeX = 4 * 3840; // 4x tile at 100% zoom
                     const int reasonableSizeY = 2 * 3840; // 2x tile at 100% zoom
                     if (joinW > reasonableSizeX || joinH > reasonableSizeY)
-                    {
-                        ++i;
                         continue;
-                    }
 
                     LOG_TRC("Merging invalidations: "
-                            << std::string(it.data(), it.size()) << " and " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << msgX << ' ' << msgY << ' '
-                            << msgW << ' ' << msgH << ' ' << msgPart << " -> " << tokens[0] << ' '
-                            << tokens[1] << ' ' << tokens[2] << ' ' << joinX << ' ' << joinY << ' '
-                            << joinW << ' ' << joinH << ' ' << msgPart);
+                            << std::string(it->_payload.data(), it->_payload.size()) << " and "
+                            << tokens[0] << ' ' << tokens[1] << ' ' << tokens[2] << ' ' << msgX
+                            << ' ' << msgY << ' ' << msgW << ' ' << msgH << ' ' << msgPart << " -> "
+                            << tokens[0] << ' ' << tokens[1] << ' ' << tokens[2] << ' ' << joinX
+                            << ' ' << joinY << ' ' << joinW << ' ' << joinH << ' ' << msgPart);
 
                     msgX = joinX;
                     msgY = joinY;
@@ -293,13 +554,15 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     performedMerge = true;
 
                     // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
-                    continue;
+                    erase(it);
                 }
-
-                ++i;
             }
 
+            item._x = msgX;
+            item._y = msgY;
+            item._width = msgW;
+            item._height = msgH;
+
             if (performedMerge)
             {
                 std::size_t pre = tokens[0].size() + tokens[1].size() + tokens[2].size() + 3;
@@ -332,32 +595,14 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                 return std::string();
 
             // remove obsolete states of the same .uno: command
-            for (std::size_t i = 0; i < getQueue().size(); ++i)
+            item._key = tokens[0] + ' ' + tokens[1] + ' ' + tokens[2] + ' ' + unoCommand;
+            const auto it = findLast(item._key);
+            if (it != getQueue().end())
             {
-                auto& it = getQueue()[i];
-
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 4)
-                    continue;
-
-                if (queuedTokens[0] != tokens[0] || queuedTokens[1] != tokens[1]
-                    || queuedTokens[2] != tokens[2])
-                    continue;
-
-                // callback, the same target, state changed; now check it's
-                // the same .uno: command
-                std::string queuedUnoCommand = extractUnoCommand(queuedTokens[3]);
-                if (queuedUnoCommand.empty())
-                    continue;
-
-                if (unoCommand == queuedUnoCommand)
-                {
-                    LOG_TRC("Remove obsolete uno command: "
-                            << std::string(it.data(), it.size()) << " -> "
-                            << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
-                    break;
-                }
+                LOG_TRC("Remove obsolete uno command: "
+                        << std::string(it->_payload.data(), it->_payload.size()) << " -> "
+                        << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
+                erase(it);
             }
         }
         break;
@@ -375,49 +620,20 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                                          || callbackType == LOK_CALLBACK_CELL_VIEW_CURSOR
                                          || callbackType == LOK_CALLBACK_VIEW_CURSOR_VISIBLE);
 
-            const std::string viewId
-                = (isViewCallback ? extractViewId(callbackMsg, tokens) : std::string());
+            // we additionally need to ensure that the payload of view callbacks
+            // is about the same viewid (otherwise we'd merge them all views into
+            // one)
+            item._key = tokens[0] + ' ' + tokens[1] + ' ' + tokens[2];
+            if (isViewCallback)
+                item._key += " viewid=" + extractViewId(callbackMsg, tokens);
 
-            for (std::size_t i = 0; i < getQueue().size(); ++i)
+            const auto it = findLast(item._key);
+            if (it != getQueue().end())
             {
-                const auto& it = getQueue()[i];
-
-                // skip non-callbacks quickly
-                if (!LOOLProtocol::matchPrefix("callback", it))
-                    continue;
-
-                StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-                if (queuedTokens.size() < 3)
-                    continue;
-
-                if (!isViewCallback
-                    && (queuedTokens.equals(1, tokens, 1) && queuedTokens.equals(2, tokens, 2)))
-                {
-                    LOG_TRC("Remove obsolete callback: "
-                            << std::string(it.data(), it.size()) << " -> "
-                            << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
-                    break;
-                }
-                else if (isViewCallback
-                         && (queuedTokens.equals(1, tokens, 1)
-                             && queuedTokens.equals(2, tokens, 2)))
-                {
-                    // we additionally need to ensure that the payload is about
-                    // the same viewid (otherwise we'd merge them all views into
-                    // one)
-                    const std::string queuedViewId
-                        = extractViewId(std::string(it.data(), it.size()), queuedTokens);
-
-                    if (viewId == queuedViewId)
-                    {
-                        LOG_TRC("Remove obsolete view callback: "
-                                << std::string(it.data(), it.size()) << " -> "
-                                << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
-                        getQueue().erase(getQueue().begin() + i);
-                        break;
-                    }
-                }
+                LOG_TRC("Remove obsolete " << (isViewCallback ? "view callback: " : "callback: ")
+                        << std::string(it->_payload.data(), it->_payload.size()) << " -> "
+                        << LOOLProtocol::getAbbreviatedMessage(callbackMsg));
+                erase(it);
             }
         }
         break;
@@ -430,10 +646,114 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
     return std::string();
 }
 
-int TileQueue::priority(const std::string& tileMsg)
+void TileQueue::invalidate(const std::string& payload)
+{
+    const StringVector tokens(Util::tokenize(payload, ','));
+
+    // The payload is "x, y, width, height, part", or "EMPTY, part" for the whole part.
+    std::int64_t values[5];
+    const bool wholePart = (tokens.size() == 2 && tokens.equals(0, "EMPTY") &&
+                            parseInvalidationValue(tokens[1], values[4]));
+    if (!wholePart &&
+        !(tokens.size() == 5 &&
+          parseInvalidationValue(tokens[0], values[0]) &&
+          parseInvalidationValue(tokens[1], values[1]) &&
+          parseInvalidationValue(tokens[2], values[2]) && values[2] >= 0 &&
+          parseInvalidationValue(tokens[3], values[3]) && values[3] >= 0 &&
+          parseInvalidationValue(tokens[4], values[4])))
+    {
+        // "EMPTY" for all the parts supersedes everything before it.
+        if (tokens.size() == 1 && tokens.equals(0, "EMPTY"))
+            _invalidations.clear();
+
+        // Anything else is for the session to make sense of, after the invalidations before it.
+        flushInvalidations();
+        put("callback all " + std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + ' ' + payload);
+        return;
+    }
+
+    Util::Rectangle rect(0, 0, INT_MAX, INT_MAX);
+    if (!wholePart)
+    {
+        rect.setLeft(values[0]);
+        rect.setTop(values[1]);
+        rect.setRight(std::min<std::int64_t>(values[0] + values[2], INT_MAX));
+        rect.setBottom(std::min<std::int64_t>(values[1] + values[3], INT_MAX));
+    }
+
+    std::vector<Util::Rectangle>& regions = _invalidations[values[4]];
+
+    // Absorb the regions that cost no extra tiles to merge with, as long as there are any.
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (auto it = regions.begin(); it != regions.end(); ++it)
+        {
+            if (mergeCost(rect, *it) <= 0)
+            {
+                rect = unite(rect, *it);
+                regions.erase(it);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    regions.push_back(rect);
+
+    if (regions.size() > MaxInvalidationRegions)
+    {
+        // Too scattered, merge the two that are the cheapest to.
+        std::size_t first = 0;
+        std::size_t second = 1;
+        std::int64_t lowestCost = std::numeric_limits<std::int64_t>::max();
+        for (std::size_t i = 0; i < regions.size(); ++i)
+        {
+            for (std::size_t j = i + 1; j < regions.size(); ++j)
+            {
+                const std::int64_t cost = mergeCost(regions[i], regions[j]);
+                if (cost < lowestCost)
+                {
+                    lowestCost = cost;
+                    first = i;
+                    second = j;
+                }
+            }
+        }
+
+        regions[first] = unite(regions[first], regions[second]);
+        regions.erase(regions.begin() + second);
+    }
+}
+
+void TileQueue::flushInvalidations()
 {
-    TileDesc tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
+    // Taken out first, as putting them flushes what is held.
+    std::map<int, std::vector<Util::Rectangle>> invalidations;
+    invalidations.swap(_invalidations);
+
+    for (const auto& pair : invalidations)
+    {
+        const int part = pair.first;
+        for (const Util::Rectangle& rect : pair.second)
+        {
+            std::ostringstream oss;
+            oss << "callback all " << LOK_CALLBACK_INVALIDATE_TILES << ' ';
+            if (rect.getLeft() == 0 && rect.getTop() == 0 && rect.getRight() == INT_MAX &&
+                rect.getBottom() == INT_MAX)
+                oss << "EMPTY, " << part;
+            else
+                oss << rect.getLeft() << ", " << rect.getTop() << ", " << rect.getWidth() << ", "
+                    << rect.getHeight() << ", " << part;
+
+            put(oss.str());
+        }
+    }
+}
 
+int TileQueue::priority(const TileDesc& tile)
+{
     for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
     {
         auto& cursor = _cursorPositions[_viewOrder[i]];
@@ -447,73 +767,63 @@ int TileQueue::priority(const std::string& tileMsg)
 
 void TileQueue::deprioritizePreviews()
 {
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    Queue& queue = getQueue();
+    for (size_t i = 0; i < queue.size(); ++i)
     {
-        const Payload front = getQueue().front();
-        const std::string message(front.data(), front.size());
-
         // stop at the first non-tile or non-'id' (preview) message
-        std::string id;
-        if (!LOOLProtocol::matchPrefix("tile", message) ||
-            !LOOLProtocol::getTokenStringFromMessage(message, "id", id))
+        const Item& front = queue.front();
+        if (front._kind != Kind::Tile || !front._preview)
         {
             break;
         }
 
-        getQueue().erase(getQueue().begin());
-        getQueue().push_back(front);
+        queue.splice(queue.end(), queue, queue.begin());
     }
 }
 
 TileQueue::Payload TileQueue::get_impl()
 {
-    LOG_TRC("MessageQueue depth: " << getQueue().size());
-
-    const Payload front = getQueue().front();
+    Queue& queue = getQueue();
+    LOG_TRC("MessageQueue depth: " << queue.size());
 
-    std::string msg(front.data(), front.size());
+    Item& front = queue.front();
 
-    std::string id;
-    bool isTile = LOOLProtocol::matchPrefix("tile", msg);
-    bool isPreview = isTile && LOOLProtocol::getTokenStringFromMessage(msg, "id", id);
+    const bool isTile = (front._kind == Kind::Tile);
+    const bool isPreview = isTile && front._preview;
     if (!isTile || isPreview)
     {
         // Don't combine non-tiles or tiles with id.
-        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
-        getQueue().erase(getQueue().begin());
+        LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(front._payload));
+        Payload result = std::move(front._payload);
+        erase(queue.begin());
 
         // de-prioritize the other tiles with id - usually the previews in
         // Impress
         if (isPreview)
             deprioritizePreviews();
 
-        return front;
+        return result;
     }
 
     // We are handling a tile; first try to find one that is at the cursor's
     // position, otherwise handle the one that is at the front
-    int prioritized = 0;
+    Queue::iterator prioritized = queue.begin();
     int prioritySoFar = -1;
-    for (size_t i = 0; i < getQueue().size(); ++i)
+    for (auto it = queue.begin(); it != queue.end(); ++it)
     {
-        auto& it = getQueue()[i];
-        const std::string prio(it.data(), it.size());
-
         // avoid starving - stop the search when we reach a non-tile,
         // otherwise we may keep growing the queue of unhandled stuff (both
         // tiles and non-tiles)
-        if (!LOOLProtocol::matchPrefix("tile", prio) ||
-            LOOLProtocol::getTokenStringFromMessage(prio, "id", id))
+        if (it->_kind != Kind::Tile || it->_preview)
         {
             break;
         }
 
-        const int p = priority(prio);
+        const int p = priority(*it->_tile);
         if (p > prioritySoFar)
         {
             prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
+            prioritized = it;
 
             // found the highest priority already?
             if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
@@ -523,44 +833,39 @@ TileQueue::Payload TileQueue::get_impl()
         }
     }
 
-    getQueue().erase(getQueue().begin() + prioritized);
-
     std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
+    tiles.emplace_back(*prioritized->_tile);
+    erase(prioritized);
 
     // Combine as many tiles as possible with the top one.
-    for (size_t i = 0; i < getQueue().size(); )
+    for (auto it = queue.begin(); it != queue.end(); )
     {
-        auto& it = getQueue()[i];
-        msg = std::string(it.data(), it.size());
-        if (!LOOLProtocol::matchPrefix("tile", msg) ||
-            LOOLProtocol::getTokenStringFromMessage(msg, "id", id))
+        if (it->_kind != Kind::Tile || it->_preview)
         {
             // Don't combine non-tiles or tiles with id.
-            ++i;
+            ++it;
             continue;
         }
 
-        TileDesc tile2 = TileDesc::parse(msg);
-        LOG_TRC("Combining candidate: " << LOOLProtocol::getAbbreviatedMessage(msg));
+        LOG_TRC("Combining candidate: " << LOOLProtocol::getAbbreviatedMessage(it->_payload));
 
         // Check if it's on the same row.
-        if (tiles[0].canCombine(tile2))
+        if (tiles[0].canCombine(*it->_tile))
         {
-            tiles.emplace_back(tile2);
-            getQueue().erase(getQueue().begin() + i);
+            tiles.emplace_back(*it->_tile);
+            it = erase(it);
         }
         else
         {
-            ++i;
+            ++it;
         }
     }
 
-    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueue().size() << " in queue.");
+    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << queue.size() << " in queue.");
 
     if (tiles.size() == 1)
     {
-        msg = tiles[0].serialize("tile");
+        const std::string msg = tiles[0].serialize("tile");
         LOG_TRC("MessageQueue res: " << LOOLProtocol::getAbbreviatedMessage(msg));
         return Payload(msg.data(), msg.data() + msg.size());
     }
@@ -9,13 +9,20 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <cstdint>
 #include <functional>
+#include <iterator>
+#include <list>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "Log.hpp"
 #include "Protocol.hpp"
+#include "Rectangle.hpp"
+#include <TileDesc.hpp>
 
 /// Thread-safe message queue (FIFO).
 class MessageQueue
@@ -24,6 +31,8 @@ public:
     typedef std::vector<char> Payload;
 
     MessageQueue()
+        : _nextSeq(1)
+        , _lastSingle(0)
     {
     }
 
@@ -82,103 +91,104 @@ public:
     /// Thread safe remove_if.
     void remove_if(const std::function<bool(const Payload&)>& pred)
     {
-        std::remove_if(_queue.begin(), _queue.end(), pred);
+        for (auto it = _queue.begin(); it != _queue.end(); )
+            it = (pred(it->_payload) ? erase(it) : std::next(it));
     }
 
 protected:
-    virtual void put_impl(const Payload& value)
+    /// What a queued message is, as far as merging and prioritizing it goes.
+    enum class Kind
     {
-        StringVector tokens = Util::tokenize(value.data(), value.size());
-        if (tokens[1] == "textinput")
-        {
-            const std::string newMsg = combineTextInput(tokens);
-            if (!newMsg.empty())
-            {
-                _queue.push_back(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
-                return;
-            }
-        }
-        else if (tokens[1] == "removetextcontext")
+        Other,
+        Single, ///< A message of a single token, nothing merges across it.
+        Input, ///< key, mouse or windowkey.
+        TextInput,
+        RemoveText,
+        Tile,
+        Callback
+    };
+
+    /// A queued message with the fields that deduplication and prioritization
+    /// look at, parsed once on the way in rather than on every put.
+    struct Item
+    {
+        explicit Item(const Payload& payload)
+            : _payload(payload)
+            , _kind(Kind::Other)
+            , _seq(0)
+            , _preview(false)
+            , _prerender(false)
+            , _callbackType(-1)
+            , _x(0)
+            , _y(0)
+            , _width(0)
+            , _height(0)
+            , _part(0)
         {
-            const std::string newMsg = combineRemoveText(tokens);
-            if (!newMsg.empty())
-            {
-                _queue.push_back(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
-                return;
-            }
         }
 
-        _queue.emplace_back(value);
-    }
+        Payload _payload;
+        Kind _kind;
+        /// Order of arrival.
+        uint64_t _seq;
+        /// The first token: the session of child messages.
+        std::string _target;
+        /// What the item is indexed by, for finding its duplicates. Empty for none.
+        std::string _key;
+        /// The tile, of tile messages.
+        std::unique_ptr<TileDesc> _tile;
+        /// Tiles with an id are previews.
+        bool _preview;
+        /// Speculative tiles, dropped as soon as anything else arrives.
+        bool _prerender;
+        /// The callback type, of callback messages.
+        int _callbackType;
+        /// The area of invalidation callbacks.
+        int _x;
+        int _y;
+        int _width;
+        int _height;
+        int _part;
+    };
+
+    typedef std::list<Item> Queue;
+
+    virtual void put_impl(const Payload& value);
 
     virtual Payload get_impl()
     {
-        Payload result = _queue.front();
-        _queue.erase(_queue.begin());
+        Payload result = std::move(_queue.front()._payload);
+        erase(_queue.begin());
         return result;
     }
 
     void clear_impl()
     {
         _queue.clear();
+        _index.clear();
     }
 
-    std::vector<Payload>& getQueue() { return _queue; }
+    Queue& getQueue() { return _queue; }
+
+    /// Append the item, indexed by its key if it has one.
+    void push(Item&& item);
+
+    /// Remove the item from the queue and the index.
+    Queue::iterator erase(Queue::iterator it);
+
+    /// The queued items with the given key, oldest first.
+    std::vector<Queue::iterator> find(const std::string& key);
+
+    /// The most recent queued item with the given key, or end().
+    Queue::iterator findLast(const std::string& key);
 
     /// Search the queue for a previous textinput message and if found, remove it and combine its
     /// input with that in the current textinput message. We check that there aren't any interesting
     /// messages inbetween that would make it wrong to merge the textinput messages.
     ///
+    /// Sets @key to what the message is indexed by, to merge later ones into it.
     /// @return New message to put into the queue. If empty, use what we got.
-    std::string combineTextInput(const StringVector& tokens)
-    {
-        std::string id;
-        std::string text;
-        if (!LOOLProtocol::getTokenString(tokens, "id", id) ||
-            !LOOLProtocol::getTokenString(tokens, "text", text))
-            return std::string();
-
-        int i = getQueue().size() - 1;
-        while (i >= 0)
-        {
-            auto& it = getQueue()[i];
-
-            const std::string queuedMessage(it.data(), it.size());
-            StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-
-            // If any messages of these types are present before the current ("textinput") message,
-            // no combination is possible.
-            if (queuedTokens.size() == 1 ||
-                (queuedTokens[0] == tokens[0] &&
-                 (queuedTokens[1] == "key" ||
-                  queuedTokens[1] == "mouse" ||
-                  queuedTokens[1] == "removetextcontext" ||
-                  queuedTokens[1] == "windowkey")))
-                return std::string();
-
-            std::string queuedId;
-            std::string queuedText;
-            if (queuedTokens[0] == tokens[0] &&
-                queuedTokens[1] == "textinput" &&
-                LOOLProtocol::getTokenString(queuedTokens, "id", queuedId) &&
-                queuedId == id &&
-                LOOLProtocol::getTokenString(queuedTokens, "text", queuedText))
-            {
-                // Remove the queued textinput message and combine it with the current one
-                getQueue().erase(getQueue().begin() + i);
-
-                std::string newMsg = queuedTokens[0] + " textinput id=" + id + " text=" + queuedText + text;
-
-                LOG_TRC("Combined [" << queuedMessage << "] with current message to [" << newMsg << "]");
-
-                return newMsg;
-            }
-
-            --i;
-        }
-
-        return std::string();
-    }
+    std::string combineTextInput(const StringVector& tokens, std::string& key);
 
     /// Search the queue for a previous removetextcontext message (which actually means "remove text
     /// content", the word "context" is becaue of some misunderstanding lost in history) and if
@@ -186,65 +196,31 @@ protected:
     /// We check that there aren't any interesting messages inbetween that would make it wrong to
     /// merge the removetextcontext messages.
     ///
+    /// Sets @key to what the message is indexed by, to merge later ones into it.
     /// @return New message to put into the queue. If empty, use what we got.
-    std::string combineRemoveText(const StringVector& tokens)
+    std::string combineRemoveText(const StringVector& tokens, std::string& key);
+
+private:
+    /// The last messages of each session that textinput or removetextcontext can't merge across.
+    struct Barriers
     {
-        std::string id;
-        int before;
-        int after;
-        if (!LOOLProtocol::getTokenString(tokens, "id", id) ||
-            !LOOLProtocol::getTokenInteger(tokens, "before", before) ||
-            !LOOLProtocol::getTokenInteger(tokens, "after", after))
-            return std::string();
-
-        int i = getQueue().size() - 1;
-        while (i >= 0)
+        Barriers()
+            : _input(0)
+            , _textInput(0)
+            , _removeText(0)
         {
-            auto& it = getQueue()[i];
-
-            const std::string queuedMessage(it.data(), it.size());
-            StringVector queuedTokens = Util::tokenize(it.data(), it.size());
-
-            // If any messages of these types are present before the current (removetextcontext)
-            // message, no combination is possible.
-            if (queuedTokens.size() == 1 ||
-                (queuedTokens[0] == tokens[0] &&
-                 (queuedTokens[1] == "key" ||
-                  queuedTokens[1] == "mouse" ||
-                  queuedTokens[1] == "textinput" ||
-                  queuedTokens[1] == "windowkey")))
-                return std::string();
-
-            std::string queuedId;
-            int queuedBefore;
-            int queuedAfter;
-            if (queuedTokens[0] == tokens[0] &&
-                queuedTokens[1] == "removetextcontext" &&
-                LOOLProtocol::getTokenStringFromMessage(queuedMessage, "id", queuedId) &&
-                queuedId == id &&
-                LOOLProtocol::getTokenIntegerFromMessage(queuedMessage, "before", queuedBefore) &&
-                LOOLProtocol::getTokenIntegerFromMessage(queuedMessage, "after", queuedAfter))
-            {
-                // Remove the queued removetextcontext message and combine it with the current one
-                getQueue().erase(getQueue().begin() + i);
-
-                std::string newMsg = queuedTokens[0] + " removetextcontext id=" + id +
-                    " before=" + std::to_string(queuedBefore + before) +
-                    " after=" + std::to_string(queuedAfter + after);
-
-                LOG_TRC("Combined [" << queuedMessage << "] with current message to [" << newMsg << "]");
-
-                return newMsg;
-            }
-
-            --i;
         }
 
-        return std::string();
-    }
+        uint64_t _input;
+        uint64_t _textInput;
+        uint64_t _removeText;
+    };
 
-private:
-    std::vector<Payload> _queue;
+    Queue _queue;
+    std::unordered_multimap<std::string, Queue::iterator> _index;
+    uint64_t _nextSeq;
+    std::unordered_map<std::string, Barriers> _barriers;
+    uint64_t _lastSingle;
 };
 
 /// MessageQueue specialized for priority handling of tiles.
@@ -317,6 +293,17 @@ public:
         _cursorPositions.erase(viewId);
     }
 
+    /// Accumulate the payload of an invalidation callback, to be queued by
+    /// flushInvalidations() merged with the others of the same part.
+    /// Putting any other message flushes them first, to keep them in order.
+    void invalidate(const std::string& payload);
+
+    /// Queue the invalidations accumulated since the last flush,
+    /// as few callbacks as the regions of each part allow.
+    void flushInvalidations();
+
+    bool hasInvalidations() const { return !_invalidations.empty(); }
+
     void dumpState(std::ostream& oss);
 
 protected:
@@ -325,32 +312,44 @@ protected:
     virtual Payload get_impl() override;
 
 private:
-    /// Search the queue for a duplicate tile and remove it (if present).
-    void removeTileDuplicate(const std::string& tileMsg);
+    /// Queue the tile, replacing its duplicate (if present).
+    /// Prerendered tiles never replace anything, the duplicate is already wanted.
+    void putTile(const Payload& value, const TileDesc& tile, bool preview, bool prerender = false);
+
+    /// Drop the queued prerendered tiles: there is real work to do now.
+    void cancelPrerender();
 
     /// Search the queue for a duplicate callback and remove it (if present).
     ///
     /// This removes also callbacks that are made invalid by the current
     /// message, like the new cursor position invalidates the old one etc.
     ///
+    /// Sets the key of @item to find its own duplicates later.
     /// @return New message to put into the queue.  If empty, use what was in callbackMsg.
-    std::string removeCallbackDuplicate(const std::string& callbackMsg);
+    std::string removeCallbackDuplicate(const std::string& callbackMsg, Item& item);
 
     /// De-prioritize the previews (tiles with 'id') - move them to the end of
     /// the queue.
     void deprioritizePreviews();
 
-    /// Priority of the given tile message.
+    /// Priority of the given tile.
     /// -1 means the lowest prio (the tile does not intersect any of the cursors),
     /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    int priority(const TileDesc& tile);
 
 private:
     std::map<int, CursorPosition> _cursorPositions;
 
+    /// The regions invalidated since the last flush, per part.
+    /// Invalidations are for all the views, so they aren't kept per view.
+    std::map<int, std::vector<Util::Rectangle>> _invalidations;
+
     /// Check the views in the order of how the editing (cursor movement) has
     /// been happening (0 == oldest, size() - 1 == newest).
     std::vector<int> _viewOrder;
+
+    /// Whether there may be prerendered tiles queued.
+    bool _prerendering = false;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
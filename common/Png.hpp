@@ -58,6 +58,7 @@
 #endif
 
 #include "Log.hpp"
+#include "Simd.hpp"
 #include "SpookyV2.h"
 #include "TraceEvent.hpp"
 
@@ -89,36 +90,7 @@ extern "C"
 static void
 unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 {
-    unsigned int i;
-
-    for (i = 0; i < row_info->rowbytes; i += 4)
-    {
-        uint8_t *b = &data[i];
-        uint32_t pix;
-        uint8_t  alpha;
-
-        std::memcpy (&pix, b, sizeof (uint32_t));
-
-        alpha = (pix & 0xff000000) >> 24;
-        if (alpha == 255)
-        {
-            b[0] = ((pix & 0xff0000) >> 16);
-            b[1] = ((pix & 0x00ff00) >>  8);
-            b[2] = ((pix & 0x0000ff) >>  0);
-            b[3] = 255;
-        }
-        else if (alpha == 0)
-        {
-            b[0] = b[1] = b[2] = b[3] = 0;
-        }
-        else
-        {
-            b[0] = (((pix & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pix & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pix & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
-        }
-    }
+    Simd::unpremultiply(data, row_info->rowbytes / 4);
 }
 
 /// This function uses setjmp which may clobbers non-trivial objects.
@@ -253,6 +225,15 @@ uint64_t hashSubBuffer(unsigned char* pixmap, size_t startX, size_t startY,
     if (bufferWidth < width || bufferHeight < height)
         return 0; // magic invalid hash.
 
+    // Blank tiles are by far the most common, and the check bails out
+    // at the first differing pixel; so hash just what describes them.
+    uint32_t color;
+    if (Simd::isUniform(pixmap, startX, startY, width, height, bufferWidth, color))
+    {
+        const uint64_t key[2] = { color, (static_cast<uint64_t>(width) << 32) | height };
+        return SpookyHash::Hash64(key, sizeof(key), 1073741789);
+    }
+
     // assume a consistent mode - RGBA vs. BGRA for process
     SpookyHash hash;
     hash.Init(1073741789, 1073741789); // Seeds can be anything.
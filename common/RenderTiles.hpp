@@ -7,13 +7,19 @@
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <mutex>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <Delta.hpp>
 #include "Png.hpp"
 #include "Rectangle.hpp"
 #include "TileDesc.hpp"
@@ -159,9 +165,9 @@ public:
         }
     }
 
-    /// Lookup an entry in the cache and store the data in output.
-    /// Returns true on success, otherwise false.
-    bool copyFromCache(const TileBinaryHash hash, std::vector<char>& output, size_t &imgSize)
+    /// Lookup an entry in the cache.
+    /// Returns its data, shared rather than copied, or nullptr on a miss.
+    CacheData lookupCache(const TileBinaryHash hash)
     {
         if (hash)
         {
@@ -171,18 +177,13 @@ public:
             {
                 ++_cacheHits;
                 LOG_DBG("PNG cache with hash " << hash << " hit.");
-                output.insert(output.end(),
-                              it->second.getData()->begin(),
-                              it->second.getData()->end());
                 it->second.incrementHitCount();
-                imgSize = it->second.getData()->size();
-
-                return true;
+                return it->second.getData();
             }
         }
 
         LOG_DBG("PNG cache with hash " << hash << " missed.");
-        return false;
+        return nullptr;
     }
 
     void addToCache(const CacheData &data, TileWireId wid, const TileBinaryHash hash)
@@ -240,19 +241,54 @@ public:
     }
 };
 
+/// A small work-stealing pool, used for PNG compression.
+/// Each worker owns a deque: it pops from the front of its own
+/// and, when that is empty, steals from the back of the others.
+/// Work is pushed in groups; waiting on a group makes the calling
+/// thread help out until every item of that group is done, so
+/// the submitter can go on painting while a previous group encodes.
 class ThreadPool {
-    std::mutex _mutex;
-    std::condition_variable _cond;
-    std::condition_variable _complete;
+public:
     typedef std::function<void()> ThreadFn;
-    std::queue<ThreadFn> _work;
+
+    /// Tracks completion of a batch of work items.
+    class Group {
+        friend class ThreadPool;
+        std::mutex _mutex;
+        std::condition_variable _complete;
+        size_t _pending;
+    public:
+        Group() : _pending(0) {}
+        bool isComplete()
+        {
+            std::unique_lock< std::mutex > lock(_mutex);
+            return _pending == 0;
+        }
+    };
+
+private:
+    struct Work {
+        ThreadFn _fn;
+        std::shared_ptr<Group> _group;
+    };
+
+    struct WorkQueue {
+        std::mutex _mutex;
+        std::deque<Work> _work;
+    };
+
+    /// One queue per worker, plus one for the submitting thread when we have no workers.
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
     std::vector<std::thread> _threads;
-    size_t _working;
-    bool   _shutdown;
-public:
-    ThreadPool()
-        : _working(0),
-          _shutdown(false)
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _working;
+    std::atomic<size_t> _stolen;
+    size_t _nextQueue;
+    std::mutex _sleepMutex;
+    std::condition_variable _cond;
+    bool _shutdown;
+
+    static int getMaxConcurrency()
     {
         int maxConcurrency = 2;
 #if MOBILEAPP && !defined(GTKAPP)
@@ -262,14 +298,32 @@ public:
         if (max)
             maxConcurrency = atoi(max);
 #endif
+        return std::max(maxConcurrency, 1);
+    }
+
+public:
+    ThreadPool()
+        : _queued(0),
+          _working(0),
+          _stolen(0),
+          _nextQueue(0),
+          _shutdown(false)
+    {
+        const int maxConcurrency = getMaxConcurrency();
         LOG_TRC("PNG compression thread pool size " << maxConcurrency);
-        for (int i = 1; i < maxConcurrency; ++i)
-            _threads.push_back(std::thread(&ThreadPool::work, this));
+
+        // The submitting thread helps while waiting, so it counts as one.
+        const size_t workers = maxConcurrency - 1;
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i)
+            _queues.emplace_back(new WorkQueue());
+
+        for (size_t i = 0; i < workers; ++i)
+            _threads.push_back(std::thread(&ThreadPool::work, this, i));
     }
     ~ThreadPool()
     {
         {
-            std::unique_lock< std::mutex > lock(_mutex);
+            std::unique_lock< std::mutex > lock(_sleepMutex);
             assert(_working == 0);
             _shutdown = true;
         }
@@ -280,74 +334,130 @@ public:
 
     size_t count() const
     {
-        return _work.size();
+        return _queued;
     }
 
-    void pushWork(const ThreadFn &fn)
+    /// Queue work into the given group, distributing it round-robin
+    /// over the workers' queues. Idle workers are woken up immediately.
+    void pushWork(const std::shared_ptr<Group>& group, const ThreadFn &fn)
     {
-        std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
-        _work.push(fn);
-    }
+        {
+            std::unique_lock< std::mutex > lock(group->_mutex);
+            ++group->_pending;
+        }
 
-    void runOne(std::unique_lock< std::mutex >& lock)
-    {
-        assert(!_work.empty());
+        WorkQueue& queue = *_queues[_nextQueue++ % _queues.size()];
+        {
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            queue._work.push_back(Work{ fn, group });
+            ++_queued;
+        }
 
-        ThreadFn fn = _work.front();
-        _work.pop();
-        _working++;
-        lock.unlock();
+        if (!_threads.empty())
+        {
+            // Pairs with the predicate check in work() so we can't miss a wakeup.
+            { std::unique_lock< std::mutex > lock(_sleepMutex); }
+            _cond.notify_one();
+        }
+    }
 
-        try {
-            fn();
-        } catch(...) {
-            LOG_ERR("Exception in thread pool execution.");
+    /// Help run queued work until everything in @group is complete.
+    void wait(Group& group)
+    {
+        Work work;
+        while (!group.isComplete())
+        {
+            if (!steal(_queues.size(), work))
+                break;
+            runOne(work);
         }
 
-        lock.lock();
-        _working--;
-        if (_work.empty() && _working == 0)
-            _complete.notify_all();
+        // Anything left is already being run by a worker.
+        std::unique_lock< std::mutex > lock(group._mutex);
+        group._complete.wait(lock, [&group]() { return group._pending == 0; });
     }
 
-    void run()
+private:
+    /// Pop from our own queue first, otherwise steal from the back of the others.
+    bool steal(size_t self, Work& work)
     {
-        std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
+        if (self < _queues.size())
+        {
+            WorkQueue& queue = *_queues[self];
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            if (!queue._work.empty())
+            {
+                work = std::move(queue._work.front());
+                queue._work.pop_front();
+                --_queued;
+                return true;
+            }
+        }
 
-        // Avoid notifying threads if we don't need to.
-        bool useThreads = _threads.size() > 1 && _work.size() > 1;
-        if (useThreads)
-            _cond.notify_all();
+        for (size_t i = 0; i < _queues.size(); ++i)
+        {
+            if (i == self)
+                continue;
+
+            WorkQueue& queue = *_queues[i];
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            if (!queue._work.empty())
+            {
+                work = std::move(queue._work.back());
+                queue._work.pop_back();
+                --_queued;
+                ++_stolen;
+                return true;
+            }
+        }
+
+        return false;
+    }
 
-        while(!_work.empty())
-            runOne(lock);
+    void runOne(Work& work)
+    {
+        ++_working;
+        try {
+            work._fn();
+        } catch(...) {
+            LOG_ERR("Exception in thread pool execution.");
+        }
+        --_working;
 
-        if (useThreads && (_working > 0 || !_work.empty()))
-            _complete.wait(lock, [this]() { return _working == 0 && _work.empty(); } );
+        std::shared_ptr<Group> group = std::move(work._group);
+        work._fn = nullptr;
 
-        assert(_working==0);
-        assert(_work.empty());
+        std::unique_lock< std::mutex > lock(group->_mutex);
+        assert(group->_pending > 0);
+        if (--group->_pending == 0)
+            group->_complete.notify_all();
     }
 
-    void work()
+    void work(size_t self)
     {
-        std::unique_lock< std::mutex > lock(_mutex);
-        while (!_shutdown)
+        Work work;
+        while (true)
         {
-            _cond.wait(lock);
-            if (!_shutdown && !_work.empty())
-                runOne(lock);
+            {
+                std::unique_lock< std::mutex > lock(_sleepMutex);
+                _cond.wait(lock, [this]() { return _shutdown || _queued > 0; });
+                if (_shutdown)
+                    return;
+            }
+
+            while (steal(self, work))
+                runOne(work);
         }
     }
 
+public:
     void dumpState(std::ostream& oss)
     {
         oss << "\tthreadPool:"
             << "\n\t\tshutdown: " << _shutdown
             << "\n\t\tworking: " << _working
             << "\n\t\twork count: " << count()
+            << "\n\t\tstolen: " << _stolen
             << "\n\t\tthread count " << _threads.size()
             << "\n";
     }
@@ -387,18 +497,159 @@ namespace RenderTiles
         renderedTiles.back().setImgSize(imgSize);
     }
 
-    bool doRender(std::shared_ptr<lok::Document> document,
-                  TileCombined &tileCombined,
-                  PngCache &pngCache,
-                  ThreadPool &pngPool,
-                  bool combined,
-                  const std::function<void (unsigned char *data,
-                                            int offsetX, int offsetY,
-                                            size_t pixmapWidth, size_t pixmapHeight,
-                                            int pixelWidth, int pixelHeight,
-                                            LibreOfficeKitTileMode mode)>& blendWatermark,
-                  const std::function<void (const char *buffer, size_t length)>& outputMessage,
-                  unsigned mobileAppDocId)
+    /// Sends a message made of the header followed by the image data of each tile,
+    /// which is shared with the PNG cache and must not be modified.
+    typedef std::function<void (const std::string& header,
+                                const std::vector<PngCache::CacheData>& images)> OutputMessageFn;
+
+    /// A tilecombine that was painted and whose tiles are still
+    /// being compressed by the pool; sent by finishRender().
+    struct PendingRender
+    {
+        struct Encode
+        {
+            TileDesc _desc;
+            TileWireId _wireId;
+            TileBinaryHash _hash;
+            PngCache::CacheData _data; //< Set by the worker on success.
+        };
+
+        PendingRender(const TileCombined& tileCombined, bool combined,
+                      DeltaGenerator* deltaGen,
+                      const OutputMessageFn& outputMessage,
+                      std::chrono::steady_clock::time_point start)
+            : _group(std::make_shared<ThreadPool::Group>())
+            , _tileCombined(tileCombined)
+            , _combined(combined)
+            , _deltaGen(deltaGen)
+            , _outputMessage(outputMessage)
+            , _start(start)
+        {
+        }
+
+        std::shared_ptr<ThreadPool::Group> _group;
+        TileCombined _tileCombined;
+        bool _combined;
+        /// Told the size of each PNG we send, if deltas are enabled.
+        DeltaGenerator* _deltaGen;
+        OutputMessageFn _outputMessage;
+        std::chrono::steady_clock::time_point _start;
+
+        /// The tiles to send, with their image data in the matching slot of _images.
+        std::vector<TileDesc> _renderedTiles;
+        std::vector<PngCache::CacheData> _images;
+
+        void pushRendered(const TileDesc &desc, TileWireId wireId, const PngCache::CacheData& image)
+        {
+            RenderTiles::pushRendered(_renderedTiles, desc, wireId, image ? image->size() : 0);
+            _images.push_back(image);
+        }
+        /// One slot per tile to compress; each is only touched by its worker.
+        std::vector<Encode> _encodes;
+        std::vector<TileDesc> _duplicateTiles;
+        std::vector<TileBinaryHash> _duplicateHashes;
+    };
+
+    /// Wait for the compression of a pending render to complete,
+    /// then cache and send the results.
+    inline void finishRender(std::shared_ptr<PendingRender>& pending,
+                             PngCache &pngCache,
+                             ThreadPool &pngPool)
+    {
+        if (!pending)
+            return;
+
+        std::shared_ptr<PendingRender> render = std::move(pending);
+        pending.reset();
+
+        pngPool.wait(*render->_group);
+
+        std::vector<TileDesc>& renderedTiles = render->_renderedTiles;
+        std::vector<PngCache::CacheData>& images = render->_images;
+
+        for (auto& encode : render->_encodes)
+        {
+            if (!encode._data)
+                continue; // Failed to encode; already logged.
+
+            if (encode._data->empty())
+            {
+                LOG_TRC("Encoded 0-sized tile " << encode._desc.debugName());
+                assert(!"0-sized tile enocded!");
+            }
+
+            pngCache.addToCache(encode._data, encode._wireId, encode._hash);
+            render->pushRendered(encode._desc, encode._wireId, encode._data);
+            if (render->_deltaGen)
+                render->_deltaGen->setImageSize(encode._wireId, encode._data->size());
+        }
+
+        // Duplicates share the image we have just cached.
+        {
+            assert(render->_duplicateTiles.size() == render->_duplicateHashes.size());
+            for (size_t i = 0; i < render->_duplicateTiles.size(); ++i)
+            {
+                const TileDesc& duplicate = render->_duplicateTiles[i];
+                PngCache::CacheData image = pngCache.lookupCache(render->_duplicateHashes[i]);
+                if (image)
+                    render->pushRendered(duplicate, duplicate.getWireId(), image);
+                else
+                    LOG_ERR("Horror - tile disappeared while rendering! " << render->_duplicateHashes[i]);
+            }
+        }
+
+        pngCache.balanceCache();
+
+        const auto duration = std::chrono::steady_clock::now() - render->_start;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
+        LOG_DBG("rendering " << renderedTiles.size() << " tiles took " << elapsed
+                             << " (including the paintPartTile).");
+
+        TileCombined& tileCombined = render->_tileCombined;
+        std::string tileMsg;
+        if (render->_combined)
+        {
+            tileMsg = tileCombined.serialize("tilecombine:", ADD_DEBUG_RENDERID, renderedTiles);
+
+            size_t outputSize = 0;
+            for (const auto& i : renderedTiles)
+                outputSize += i.getImgSize();
+
+            LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << outputSize << " bytes) for: " << tileMsg);
+
+            render->_outputMessage(tileMsg, images);
+        }
+        else
+        {
+            assert(renderedTiles.size() == images.size());
+            for (size_t i = 0; i < renderedTiles.size(); ++i)
+            {
+                tileMsg = renderedTiles[i].serialize("tile:", ADD_DEBUG_RENDERID);
+                render->_outputMessage(tileMsg, { images[i] });
+            }
+        }
+    }
+
+    /// Paint the tiles and queue their compression on @pngPool, without waiting for it.
+    /// Any previously @pending render is completed and sent once the new paint is done,
+    /// so compressing one tilecombine overlaps with painting the next. The caller must
+    /// call finishRender() before sending anything else to keep the message order.
+    /// With a @deltaGen, tiles that have an oldWireId it still has the bitmap of are
+    /// sent as a delta instead, when that is smaller than the PNG.
+    inline bool doRender(std::shared_ptr<lok::Document> document,
+                         TileCombined &tileCombined,
+                         PngCache &pngCache,
+                         ThreadPool &pngPool,
+                         DeltaGenerator *deltaGen,
+                         std::shared_ptr<PendingRender> &pending,
+                         bool combined,
+                         const std::function<void (unsigned char *data,
+                                                   int offsetX, int offsetY,
+                                                   size_t pixmapWidth, size_t pixmapHeight,
+                                                   int pixelWidth, int pixelHeight,
+                                                   LibreOfficeKitTileMode mode)>& blendWatermark,
+                         const OutputMessageFn& outputMessage,
+                         unsigned mobileAppDocId)
     {
         auto& tiles = tileCombined.getTiles();
 
@@ -436,13 +687,15 @@ namespace RenderTiles
         if (pixmapWidth > 4096 || pixmapHeight > 4096)
             LOG_WRN("Unusual extremely large tile combine of size " << pixmapWidth << 'x' << pixmapHeight);
 
-        RenderTiles::Buffer pixmap(pixmapWidth, pixmapHeight);
+        // Shared with the workers, which may outlive this call.
+        std::shared_ptr<RenderTiles::Buffer> pixmap =
+            std::make_shared<RenderTiles::Buffer>(pixmapWidth, pixmapHeight);
 
-        // Render the whole area
+        // Render the whole area, while the previous batch is still compressing.
         const double area = pixmapWidth * pixmapHeight;
         const auto start = std::chrono::steady_clock::now();
-        LOG_TRC("Calling paintPartTile(" << (void*)pixmap.data() << ')');
-        document->paintPartTile(pixmap.data(),
+        LOG_TRC("Calling paintPartTile(" << (void*)pixmap->data() << ')');
+        document->paintPartTile(pixmap->data(),
                                 tileCombined.getPart(),
                                 pixmapWidth, pixmapHeight,
                                 renderArea.getLeft(), renderArea.getTop(),
@@ -457,22 +710,23 @@ namespace RenderTiles
 
         (void) mobileAppDocId;
 
+        // The previous batch goes out first, and fills the cache we are about to look up.
+        finishRender(pending, pngCache, pngPool);
+
+        if (tiles.empty())
+            return false;
+
         const auto mode = static_cast<LibreOfficeKitTileMode>(document->getTileMode());
 
-        const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<char> output;
-        output.reserve(pixmapSize);
+        std::shared_ptr<PendingRender> render =
+            std::make_shared<PendingRender>(tileCombined, combined, deltaGen, outputMessage, start);
+        render->_encodes.reserve(tiles.size());
 
         // Compress the area as tiles
-        std::vector<TileDesc> renderedTiles;
-        std::vector<TileDesc> duplicateTiles;
-        std::vector<TileBinaryHash> duplicateHashes;
         std::vector<TileWireId> renderingIds;
 
         size_t tileIndex = 0;
 
-        std::mutex pngMutex;
-
         for (Util::Rectangle& tileRect : tileRecs)
         {
             const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
@@ -480,12 +734,12 @@ namespace RenderTiles
 
             const int offsetX = positionX * pixelWidth;
             const int offsetY = positionY * pixelHeight;
-            blendWatermark(pixmap.data(), offsetX, offsetY,
+            blendWatermark(pixmap->data(), offsetX, offsetY,
                            pixmapWidth, pixmapHeight,
                            pixelWidth, pixelHeight,
                            mode);
 
-            const uint64_t hash = Png::hashSubBuffer(pixmap.data(), offsetX, offsetY,
+            const uint64_t hash = Png::hashSubBuffer(pixmap->data(), offsetX, offsetY,
                                                      pixelWidth, pixelHeight, pixmapWidth, pixmapHeight);
 
             TileWireId wireId = pngCache.hashToWireId(hash);
@@ -497,29 +751,47 @@ namespace RenderTiles
                         positionY << ") oldhash==hash (" << hash << "), wireId: " << wireId << " skipping");
                 // Push a zero byte image to inform WSD we didn't need that.
                 // This allows WSD side TileCache to free up waiting subscribers.
-                pushRendered(renderedTiles, tiles[tileIndex], wireId, 0);
+                render->pushRendered(tiles[tileIndex], wireId, nullptr);
                 tileIndex++;
                 continue;
             }
 
+            if (deltaGen && hash != 0)
+            {
+                // Keeps the bitmap either way, to base the next delta on.
+                PngCache::CacheData delta = std::make_shared<std::vector<char>>();
+                if (deltaGen->createDelta(pixmap->data(), offsetX, offsetY, pixelWidth, pixelHeight,
+                                          pixmapWidth, pixmapHeight, *delta,
+                                          wireId, oldWireId, mode == LOK_TILEMODE_BGRA))
+                {
+                    LOG_TRC("Sending delta for tile #" << tileIndex << " from wireId " << oldWireId <<
+                            " to " << wireId << " in " << delta->size() << " bytes.");
+                    render->pushRendered(tiles[tileIndex], wireId, delta);
+                    tileIndex++;
+                    continue;
+                }
+            }
+
             bool skipCompress = false;
             size_t imgSize = -1;
-            if (pngCache.copyFromCache(hash, output, imgSize))
+            PngCache::CacheData cached = pngCache.lookupCache(hash);
+            if (cached)
             {
-                pushRendered(renderedTiles, tiles[tileIndex], wireId, imgSize);
+                imgSize = cached->size();
+                render->pushRendered(tiles[tileIndex], wireId, cached);
+                if (deltaGen)
+                    deltaGen->setImageSize(wireId, imgSize);
                 skipCompress = true;
             }
             else
             {
-                LOG_DBG("PNG cache with hash " << hash << " missed.");
-
                 // Don't re-compress the same thing multiple times.
                 for (auto id : renderingIds)
                 {
                     if (wireId == id)
                     {
-                        pushRendered(duplicateTiles, tiles[tileIndex], wireId, 0);
-                        duplicateHashes.push_back(hash);
+                        pushRendered(render->_duplicateTiles, tiles[tileIndex], wireId, 0);
+                        render->_duplicateHashes.push_back(hash);
                         skipCompress = true;
                         LOG_TRC("Rendering duplicate tile #" << tileIndex << " at (" << positionX << ',' <<
                                 positionY << ") oldhash==hash (" << hash << "), wireId: " << wireId << " skipping");
@@ -531,15 +803,20 @@ namespace RenderTiles
             if (!skipCompress)
             {
                 renderingIds.push_back(wireId);
+                render->_encodes.push_back(
+                    PendingRender::Encode{ tiles[tileIndex], wireId, hash, nullptr });
+
+                const size_t encodeIndex = render->_encodes.size() - 1;
 
-                // Queue to be executed later in parallel inside 'run'
-                pngPool.pushWork([=,&output,&pixmap,&tiles,&renderedTiles,&pngCache,&pngMutex](){
+                // Queue to be executed in parallel, while we paint the next batch.
+                // The slot is ours alone, and _encodes never reallocates.
+                pngPool.pushWork(render->_group, [=](){
 
                         PngCache::CacheData data(new std::vector< char >() );
                         data->reserve(pixmapWidth * pixmapHeight * 1);
 
                         LOG_DBG("Encode a new png for tile #" << tileIndex);
-                        if (!Png::encodeSubBufferToPNG(pixmap.data(), offsetX, offsetY, pixelWidth, pixelHeight,
+                        if (!Png::encodeSubBufferToPNG(pixmap->data(), offsetX, offsetY, pixelWidth, pixelHeight,
                                                        pixmapWidth, pixmapHeight, *data, mode))
                         {
                             // FIXME: Return error.
@@ -549,10 +826,7 @@ namespace RenderTiles
                         }
 
                         LOG_DBG("Tile " << tileIndex << " is " << data->size() << " bytes.");
-                        std::unique_lock<std::mutex> pngLock(pngMutex);
-                        output.insert(output.end(), data->begin(), data->end());
-                        pngCache.addToCache(data, wireId, hash);
-                        pushRendered(renderedTiles, tiles[tileIndex], wireId, data->size());
+                        render->_encodes[encodeIndex]._data = data;
                     });
             }
 
@@ -561,76 +835,7 @@ namespace RenderTiles
             tileIndex++;
         }
 
-        // empty ones come first
-        size_t zeroCheckStart = renderedTiles.size();
-
-        pngPool.run();
-
-        for (size_t i = zeroCheckStart; i < renderedTiles.size(); ++i)
-        {
-            if (renderedTiles[i].getImgSize() == 0)
-            {
-                LOG_TRC("Encoded 0-sized tile in slot !" << i);
-                assert(!"0-sized tile enocded!");
-            }
-        }
-
-        // FIXME: append duplicates - tragically for now as real duplicates
-        // we should append these as
-        {
-            size_t imgSize = -1;
-            assert(duplicateTiles.size() == duplicateHashes.size());
-            for (size_t i = 0; i < duplicateTiles.size(); ++i)
-            {
-                if (pngCache.copyFromCache(duplicateHashes[i], output, imgSize))
-                    pushRendered(renderedTiles, duplicateTiles[i],
-                                 duplicateTiles[i].getWireId(), imgSize);
-                else
-                    LOG_ERR("Horror - tile disappeared while rendering! " << duplicateHashes[i]);
-            }
-        }
-
-        pngCache.balanceCache();
-
-        duration = std::chrono::steady_clock::now() - start;
-        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-        LOG_DBG("rendering tiles at (" << renderArea.getLeft() << ", " << renderArea.getTop()
-                                       << "), (" << renderArea.getWidth() << ", "
-                                       << renderArea.getHeight() << ") "
-                                       << " took " << elapsed << " (including the paintPartTile).");
-
-        if (tileIndex == 0)
-            return false;
-
-        std::string tileMsg;
-        if (combined)
-        {
-            tileMsg = tileCombined.serialize("tilecombine:", ADD_DEBUG_RENDERID, renderedTiles);
-
-            LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << output.size() << " bytes) for: " << tileMsg);
-
-            std::unique_ptr<char[]> response;
-            const size_t responseSize = tileMsg.size() + output.size();
-            response.reset(new char[responseSize]);
-            std::copy(tileMsg.begin(), tileMsg.end(), response.get());
-            std::copy(output.begin(), output.end(), response.get() + tileMsg.size());
-            outputMessage(response.get(), responseSize);
-        }
-        else
-        {
-            size_t outputOffset = 0;
-            for (auto &i : renderedTiles)
-            {
-                tileMsg = i.serialize("tile:", ADD_DEBUG_RENDERID);
-                const size_t responseSize = tileMsg.size() + i.getImgSize();
-                std::unique_ptr<char[]> response;
-                response.reset(new char[responseSize]);
-                std::copy(tileMsg.begin(), tileMsg.end(), response.get());
-                std::copy(output.begin() + outputOffset, output.begin() + outputOffset + i.getImgSize(), response.get() + tileMsg.size());
-                outputMessage(response.get(), responseSize);
-                outputOffset += i.getImgSize();
-            }
-        }
+        pending = std::move(render);
         return true;
     }
 }
@@ -52,7 +52,8 @@ Session::Session(const std::shared_ptr<ProtocolHandlerInterface> &protocol,
     _isAllowChangeComments(false),
     _haveDocPassword(false),
     _isDocPasswordProtected(false),
-    _watermarkOpacity(0.2)
+    _watermarkOpacity(0.2),
+    _tileDeltas(false)
 {
 }
 
@@ -205,6 +206,11 @@ void Session::parseDocOptions(const StringVector& tokens, int& part, std::string
             _macroSecurityLevel = value;
             ++offset;
         }
+        else if (name == "deltas")
+        {
+            _tileDeltas = value == "true";
+            ++offset;
+        }
     }
 
     Util::mapAnonymized(_userId, _userIdAnonym);
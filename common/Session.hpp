@@ -233,6 +233,11 @@ public:
 
     const std::string& getMacroSecurityLevel() const { return _macroSecurityLevel; }
 
+    /// Whether the client can apply tile deltas.
+    bool getTileDeltas() const { return _tileDeltas; }
+
+    void setTileDeltas(bool tileDeltas) { _tileDeltas = tileDeltas; }
+
 protected:
     Session(const std::shared_ptr<ProtocolHandlerInterface> &handler,
             const std::string& name, const std::string& id, bool readonly);
@@ -340,6 +345,9 @@ private:
 
     /// Level of Macro security.
     std::string _macroSecurityLevel;
+
+    /// The client negotiated tile updates as pixel deltas.
+    bool _tileDeltas;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
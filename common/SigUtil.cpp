@@ -242,6 +242,10 @@ namespace SigUtil
         SigHandlerTrap guard;
         bool bReEntered = !guard.isExclusive();
 
+        // What led to this is likely still queued.
+        if (!bReEntered)
+            Log::signalFlush();
+
         Log::signalLogPrefix();
 
         // Heap corruption can re-enter through backtrace.
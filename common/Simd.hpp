@@ -0,0 +1,331 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Vectorized pixel kernels used for every tile we encode,
+// with a scalar fallback and runtime CPU dispatch.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define SIMD_X86 1
+#  include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  define SIMD_NEON 1
+#  include <arm_neon.h>
+#endif
+
+namespace Simd
+{
+
+enum class Level
+{
+    Scalar,
+    SSE2,
+    AVX2,
+    NEON
+};
+
+inline const char* toString(Level level)
+{
+    switch (level)
+    {
+        case Level::Scalar: return "scalar";
+        case Level::SSE2: return "sse2";
+        case Level::AVX2: return "avx2";
+        case Level::NEON: return "neon";
+    }
+    return "unknown";
+}
+
+/// The best level this CPU supports.
+inline Level detectLevel()
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return Level::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return Level::SSE2;
+#elif SIMD_NEON
+    return Level::NEON;
+#endif
+    return Level::Scalar;
+}
+
+/// Unpremultiply one pixel, converting native endian ARGB => RGBA bytes.
+inline void unpremultiplyPixel(uint8_t* b)
+{
+    uint32_t pix;
+    std::memcpy(&pix, b, sizeof(uint32_t));
+
+    const uint8_t alpha = (pix & 0xff000000) >> 24;
+    if (alpha == 255)
+    {
+        b[0] = ((pix & 0xff0000) >> 16);
+        b[1] = ((pix & 0x00ff00) >>  8);
+        b[2] = ((pix & 0x0000ff) >>  0);
+        b[3] = 255;
+    }
+    else if (alpha == 0)
+    {
+        b[0] = b[1] = b[2] = b[3] = 0;
+    }
+    else
+    {
+        b[0] = (((pix & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+        b[1] = (((pix & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
+        b[2] = (((pix & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
+        b[3] = alpha;
+    }
+}
+
+inline void unpremultiplyScalar(uint8_t* data, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; ++i)
+        unpremultiplyPixel(data + i * 4);
+}
+
+inline bool isUniformRowScalar(const uint8_t* data, size_t pixels, uint32_t color)
+{
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        uint32_t pix;
+        std::memcpy(&pix, data + i * 4, sizeof(uint32_t));
+        if (pix != color)
+            return false;
+    }
+
+    return true;
+}
+
+// The vector versions only speed up the common case: a run of pixels that are all
+// either opaque or fully transparent just needs the R and B bytes swapped (or zeroing).
+// Anything else is handed to unpremultiplyPixel, so the results are bit-identical.
+
+#if SIMD_X86
+
+__attribute__((target("sse2")))
+inline void unpremultiplySSE2(uint8_t* data, size_t pixels)
+{
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+    const __m128i greenAlpha = _mm_set1_epi32(0xff00ff00);
+    const __m128i lowByte = _mm_set1_epi32(0xff);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        uint8_t* b = data + i * 4;
+        const __m128i pix = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        const __m128i alpha = _mm_and_si128(pix, alphaMask);
+        const __m128i opaque = _mm_cmpeq_epi32(alpha, alphaMask);
+        const __m128i transparent = _mm_cmpeq_epi32(alpha, zero);
+        if (_mm_movemask_epi8(_mm_or_si128(opaque, transparent)) != 0xffff)
+        {
+            for (size_t j = 0; j < 4; ++j)
+                unpremultiplyPixel(b + j * 4);
+            continue;
+        }
+
+        const __m128i swapped = _mm_or_si128(
+            _mm_and_si128(pix, greenAlpha),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(pix, 16), lowByte),
+                         _mm_slli_epi32(_mm_and_si128(pix, lowByte), 16)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b), _mm_and_si128(swapped, opaque));
+    }
+
+    unpremultiplyScalar(data + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2")))
+inline void unpremultiplyAVX2(uint8_t* data, size_t pixels)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+    const __m256i zero = _mm256_setzero_si256();
+    // Swap bytes 0 and 2 of each pixel.
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        uint8_t* b = data + i * 4;
+        const __m256i pix = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+        const __m256i alpha = _mm256_and_si256(pix, alphaMask);
+        const __m256i opaque = _mm256_cmpeq_epi32(alpha, alphaMask);
+        const __m256i transparent = _mm256_cmpeq_epi32(alpha, zero);
+        if (_mm256_movemask_epi8(_mm256_or_si256(opaque, transparent)) != -1)
+        {
+            for (size_t j = 0; j < 8; ++j)
+                unpremultiplyPixel(b + j * 4);
+            continue;
+        }
+
+        const __m256i swapped = _mm256_shuffle_epi8(pix, shuffle);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(b), _mm256_and_si256(swapped, opaque));
+    }
+
+    unpremultiplySSE2(data + i * 4, pixels - i);
+}
+
+__attribute__((target("sse2")))
+inline bool isUniformRowSSE2(const uint8_t* data, size_t pixels, uint32_t color)
+{
+    const __m128i expected = _mm_set1_epi32(color);
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        const __m128i pix = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 4));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(pix, expected)) != 0xffff)
+            return false;
+    }
+
+    return isUniformRowScalar(data + i * 4, pixels - i, color);
+}
+
+__attribute__((target("avx2")))
+inline bool isUniformRowAVX2(const uint8_t* data, size_t pixels, uint32_t color)
+{
+    const __m256i expected = _mm256_set1_epi32(color);
+
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        const __m256i pix = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i * 4));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(pix, expected)) != -1)
+            return false;
+    }
+
+    return isUniformRowSSE2(data + i * 4, pixels - i, color);
+}
+
+#endif // SIMD_X86
+
+#if SIMD_NEON
+
+inline void unpremultiplyNEON(uint8_t* data, size_t pixels)
+{
+    const uint32x4_t alphaMask = vdupq_n_u32(0xff000000);
+    const uint32x4_t zero = vdupq_n_u32(0);
+    // Swap bytes 0 and 2 of each pixel.
+    static const uint8_t shuffleBytes[16] = { 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 };
+    const uint8x16_t shuffle = vld1q_u8(shuffleBytes);
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        uint8_t* b = data + i * 4;
+        const uint8x16_t bytes = vld1q_u8(b);
+        const uint32x4_t alpha = vandq_u32(vreinterpretq_u32_u8(bytes), alphaMask);
+        const uint32x4_t opaque = vceqq_u32(alpha, alphaMask);
+        const uint32x4_t transparent = vceqq_u32(alpha, zero);
+        if (vminvq_u32(vorrq_u32(opaque, transparent)) == 0)
+        {
+            for (size_t j = 0; j < 4; ++j)
+                unpremultiplyPixel(b + j * 4);
+            continue;
+        }
+
+        const uint32x4_t swapped = vreinterpretq_u32_u8(vqtbl1q_u8(bytes, shuffle));
+        vst1q_u8(b, vreinterpretq_u8_u32(vandq_u32(swapped, opaque)));
+    }
+
+    unpremultiplyScalar(data + i * 4, pixels - i);
+}
+
+inline bool isUniformRowNEON(const uint8_t* data, size_t pixels, uint32_t color)
+{
+    const uint32x4_t expected = vdupq_n_u32(color);
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        const uint32x4_t pix = vreinterpretq_u32_u8(vld1q_u8(data + i * 4));
+        if (vminvq_u32(vceqq_u32(pix, expected)) == 0)
+            return false;
+    }
+
+    return isUniformRowScalar(data + i * 4, pixels - i, color);
+}
+
+#endif // SIMD_NEON
+
+typedef void (*UnpremultiplyFn)(uint8_t* data, size_t pixels);
+typedef bool (*IsUniformRowFn)(const uint8_t* data, size_t pixels, uint32_t color);
+
+/// The unpremultiply kernel for the given level, or the scalar one if not compiled in.
+inline UnpremultiplyFn getUnpremultiply(Level level)
+{
+    switch (level)
+    {
+#if SIMD_X86
+        case Level::SSE2: return unpremultiplySSE2;
+        case Level::AVX2: return unpremultiplyAVX2;
+#endif
+#if SIMD_NEON
+        case Level::NEON: return unpremultiplyNEON;
+#endif
+        default: return unpremultiplyScalar;
+    }
+}
+
+inline IsUniformRowFn getIsUniformRow(Level level)
+{
+    switch (level)
+    {
+#if SIMD_X86
+        case Level::SSE2: return isUniformRowSSE2;
+        case Level::AVX2: return isUniformRowAVX2;
+#endif
+#if SIMD_NEON
+        case Level::NEON: return isUniformRowNEON;
+#endif
+        default: return isUniformRowScalar;
+    }
+}
+
+/// Unpremultiply @pixels native endian ARGB pixels into RGBA bytes, in place.
+inline void unpremultiply(uint8_t* data, size_t pixels)
+{
+    static const UnpremultiplyFn fn = getUnpremultiply(detectLevel());
+    fn(data, pixels);
+}
+
+/// Checks whether every pixel of the given sub-buffer is the same,
+/// and if so returns that in @color.
+inline bool isUniform(const uint8_t* pixmap, size_t startX, size_t startY,
+                      long width, long height, int bufferWidth, uint32_t& color,
+                      IsUniformRowFn isUniformRow = nullptr)
+{
+    static const IsUniformRowFn best = getIsUniformRow(detectLevel());
+    if (!isUniformRow)
+        isUniformRow = best;
+
+    if (width <= 0 || height <= 0)
+        return false;
+
+    const uint8_t* first = pixmap + (startY * bufferWidth * 4) + (startX * 4);
+    std::memcpy(&color, first, sizeof(uint32_t));
+
+    for (long y = 0; y < height; ++y)
+    {
+        const size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+        if (!isUniformRow(pixmap + position, width, color))
+            return false;
+    }
+
+    return true;
+}
+
+} // namespace Simd
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
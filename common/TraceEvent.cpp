@@ -10,42 +10,157 @@
 
 #include <cassert>
 #include <mutex>
-#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "TraceEvent.hpp"
+#include "TraceEventFormat.hpp"
 
 std::atomic<bool> TraceEvent::recordingOn(false);
 
 thread_local int TraceEvent::threadLocalNesting = 0; // level of overlapped zones
 
-static std::mutex mutex;
+namespace
+{
+/// Hand the events of a thread over when there are that many bytes of them.
+constexpr std::size_t FlushSize = 16 * 1024;
+/// Or when the oldest is this old.
+constexpr uint64_t FlushAgeUs = 1000 * 1000;
+
+/// The names interned in this process, by all the threads.
+std::mutex NamesMutex;
+std::unordered_map<std::string, uint32_t> Names;
+int NamesPid = 0;
+
+struct ThreadRecordings;
+
+/// The recordings of all the threads of this process, to flush them all.
+std::mutex ThreadsMutex;
+std::unordered_set<ThreadRecordings*> Threads;
+int ThreadsPid = 0;
+
+/// The events recorded by a thread, and the names it has interned.
+/// Only that thread adds events; any can take them, to flush.
+struct ThreadRecordings
+{
+    ThreadRecordings()
+        : _pid(0)
+    {
+        std::lock_guard<std::mutex> lock(ThreadsMutex);
+        forgetParentThreads();
+        Threads.insert(this);
+    }
+
+    ~ThreadRecordings()
+    {
+        {
+            std::lock_guard<std::mutex> lock(ThreadsMutex);
+            forgetParentThreads();
+            Threads.erase(this);
+        }
+
+        flush();
+    }
+
+    /// The events recorded since the last time, if any.
+    std::string take()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _buffer.empty() ? std::string() : _buffer.take();
+    }
+
+    void flush()
+    {
+        const std::string block = take();
+        if (!block.empty())
+            TraceEvent::emitRecordings(block.data(), block.size());
+    }
+
+    /// After a fork, the other threads of the parent aren't there.
+    static void forgetParentThreads()
+    {
+        if (ThreadsPid != getpid())
+        {
+            Threads.clear();
+            ThreadsPid = getpid();
+        }
+    }
+
+    std::mutex _mutex; //< Protects _buffer.
+    TraceEventFormat::EventBuffer _buffer;
+    std::unordered_map<std::string, uint32_t> _nameIds;
+    int _pid;
+};
+
+thread_local ThreadRecordings Recordings;
+
+uint64_t toMicroseconds(const std::chrono::system_clock::time_point& time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+}
+
+void TraceEvent::recordEvent(int pid, const std::string& name, bool complete, uint64_t timeUs,
+                             uint64_t durationUs, const std::string& args)
+{
+    ThreadRecordings& recordings = Recordings;
+    std::unique_lock<std::mutex> bufferLock(recordings._mutex);
+    if (recordings._pid != pid)
+    {
+        // Forked: the names and events of the parent aren't ours.
+        recordings._buffer.take();
+        recordings._nameIds.clear();
+        recordings._pid = pid;
+    }
+
+    const uint64_t tid = getThreadId();
+    uint32_t nameId;
+    const auto it = recordings._nameIds.find(name);
+    if (it != recordings._nameIds.end())
+        nameId = it->second;
+    else
+    {
+        bool added;
+        {
+            std::lock_guard<std::mutex> lock(NamesMutex);
+            if (NamesPid != pid)
+            {
+                Names.clear();
+                NamesPid = pid;
+            }
+
+            const auto result = Names.emplace(name, Names.size() + 1);
+            nameId = result.first->second;
+            added = result.second;
+        }
+
+        // Defined once per process, by the thread that first used it.
+        if (added)
+            recordings._buffer.addName(pid, tid, timeUs, nameId, name);
+        recordings._nameIds.emplace(name, nameId);
+    }
+
+    if (complete)
+        recordings._buffer.addComplete(pid, tid, nameId, timeUs, durationUs, args);
+    else
+        recordings._buffer.addInstant(pid, tid, nameId, timeUs, args);
+
+    if (recordings._buffer.size() >= FlushSize
+        || timeUs + durationUs - recordings._buffer.getBaseUs() >= FlushAgeUs)
+    {
+        bufferLock.unlock();
+        recordings.flush();
+    }
+}
 
 void TraceEvent::emitInstantEvent(const std::string& name, const std::string& argsOrEmpty)
 {
     if (!recordingOn)
         return;
 
-    emitOneRecording("{"
-                     "\"name\":\""
-                     + name
-                     + "\","
-                       "\"ph\":\"i\""
-                     + ",\"ts\":"
-                     + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(
-                              std::chrono::system_clock::now().time_since_epoch())
-                              .count())
-                     + ","
-                       "\"pid\":"
-                     + std::to_string(getpid())
-                     + ","
-                       "\"tid\":"
-                     + std::to_string(getThreadId())
-                     + (argsOrEmpty.length() == 0 ? "" : ",\"args\":" + argsOrEmpty)
-                     + "}"
-                     // We add a trailing comma and newline, it is up to the code that handles these "recordings"
-                     // (outputs them into a JSON array) to remove the final comma before adding the terminating
-                     // ']'.
-                       ",\n");
+    recordEvent(getpid(), name, false, toMicroseconds(std::chrono::system_clock::now()), 0,
+                argsOrEmpty);
 }
 
 void TraceEvent::startRecording()
@@ -54,41 +169,40 @@ void TraceEvent::startRecording()
     threadLocalNesting = 0;
 }
 
-void TraceEvent::stopRecording() { recordingOn = false; }
+void TraceEvent::stopRecording()
+{
+    recordingOn = false;
+    flushRecordings();
+}
+
+void TraceEvent::flushRecordings()
+{
+    // Emitted once unlocked, emitRecordings() may record events.
+    std::vector<std::string> blocks;
+    {
+        std::lock_guard<std::mutex> lock(ThreadsMutex);
+        ThreadRecordings::forgetParentThreads();
+        for (ThreadRecordings* recordings : Threads)
+        {
+            std::string block = recordings->take();
+            if (!block.empty())
+                blocks.push_back(std::move(block));
+        }
+    }
+
+    for (const std::string& block : blocks)
+        emitRecordings(block.data(), block.size());
+}
 
 void ProfileZone::emitRecording()
 {
     if (!recordingOn)
         return;
 
-    auto now = std::chrono::system_clock::now();
-
     // Generate a single "Complete Event" (type X)
-    auto duration = now - _createTime;
-
-    std::string recordingData(
-        "{"
-        "\"name\":\""
-        + std::string(_name)
-        + "\","
-          "\"ph\":\"X\","
-          "\"ts\":"
-        + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(
-                             _createTime.time_since_epoch())
-                             .count())
-        + ","
-          "\"dur\":"
-        + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(duration).count())
-        + ","
-          "\"pid\":"
-        + std::to_string(_pid)
-        + ","
-          "\"tid\":"
-        + std::to_string(getThreadId())
-        + (_args.length() == 0 ? "" : ",\"args\":" + _args)
-        + "},");
-    std::lock_guard<std::mutex> guard(mutex);
-    emitOneRecording(recordingData);
+    const uint64_t startUs = toMicroseconds(_createTime);
+    const uint64_t endUs = toMicroseconds(std::chrono::system_clock::now());
+    recordEvent(_pid, _name, true, startUs, endUs - startUs, _args);
 }
 
 #ifdef TEST_TRACEEVENT_EXE
@@ -96,14 +210,20 @@ void ProfileZone::emitRecording()
 #include <iostream>
 #include <thread>
 
-void TraceEvent::emitOneRecording(const std::string &recording)
+static std::string recordings;
+
+void TraceEvent::emitRecordings(const char* data, std::size_t size)
 {
-    std::cout << "  " << recording;
+    // Called from the threads as they exit, while main() waits on them.
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    TraceEventFormat::appendChunkHeader(recordings, TraceEventFormat::ChunkEvents, size);
+    recordings.append(data, size);
 }
 
 int main(int, char**)
 {
-    std::cout << "[\n";
+    recordings = TraceEventFormat::FileMagic;
 
     TraceEvent::startRecording();
 
@@ -170,11 +290,10 @@ int main(int, char**)
     delete p1;
     delete p2;
 
-    // Add a dummy integer last in the array to avoid incorrect JSON syntax
-    std::cout << "  0\n";
-    std::cout << "]\n";
+    TraceEvent::stopRecording();
 
-    return 0;
+    TraceEventFormat::JsonConverter converter;
+    return converter.convert(recordings.data(), recordings.size(), std::cout) ? 0 : 1;
 }
 
 #endif
@@ -9,6 +9,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
@@ -24,10 +25,15 @@
 
 // The base class for objects generating Trace Events when enabled.
 //
-// It depends on the embedding processs what is done to the Trace Events generated. In the WSD
-// process they are written to the Trace Event log file as generated (as buffered by the C++
-// library). In the Kit process they are buffered and then sent to the WSD process for writing to
-// the same log file. In the TraceEvent test program they are written out to stdout.
+// The Trace Events are recorded in a compact binary format (see TraceEventFormat.hpp), in a
+// buffer per thread, behind a lock only contended while flushing. The buffers are handed over to
+// emitRecordings() as blocks when full, after a second, when the thread exits, and when
+// flushRecordings() is called, which takes those of all the threads.
+//
+// It depends on the embedding processs what is done to the blocks. In the WSD process they are
+// written to the Trace Event recording file. In the Kit process they are buffered and then sent
+// to the WSD process for writing to the same file. In the TraceEvent test program they are
+// converted to JSON and written out to stdout.
 
 class TraceEvent
 {
@@ -40,6 +46,10 @@ protected:
     std::string _args;
     thread_local static int threadLocalNesting; // For use only by the ProfileZone derived class
 
+    /// Records the event in the buffer of the current thread.
+    static void recordEvent(int pid, const std::string& name, bool complete, uint64_t timeUs,
+                            uint64_t durationUs, const std::string& args);
+
     static long getThreadId()
     {
 #ifdef TEST_TRACEEVENT_EXE
@@ -110,11 +120,15 @@ public:
 
     // This should do its thing if Trace Event generation is enabled, even if not turned on. Used
     // for metadata that will be needed by a Trace Event viewer if Trace Event generation is turned
-    // on later during the process life-time.
+    // on later during the process life-time. The recording is JSON.
     static void emitOneRecordingIfEnabled(const std::string &recording);
 
-    // Unless Trace Event generation is enabled and turned on, this should do nothing.
-    static void emitOneRecording(const std::string &recording);
+    // Unless Trace Event generation is enabled, this should do nothing. The recordings are
+    // blocks of binary events, which may come after recording is turned off.
+    static void emitRecordings(const char* data, std::size_t size);
+
+    /// Hands the events recorded so far by all the threads over to emitRecordings().
+    static void flushRecordings();
 
     TraceEvent(const TraceEvent&) = delete;
     void operator=(const TraceEvent&) = delete;
@@ -0,0 +1,376 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+
+// The binary recording of Trace Events, and its conversion to the Chrome Trace Event JSON.
+//
+// Recording a ProfileZone used to format a JSON object under a global lock. Instead, each thread
+// now appends compact binary records to a buffer of its own: the event names are interned, and
+// numbers are varints, with the timestamps relative to the previous event of the thread.
+//
+// The recording file is made of chunks, after the FileMagic:
+//   - ChunkJson: Chrome Trace Event JSON objects, each followed by ",\n", as recorded by the
+//     core, the loleaflet client and the metadata;
+//   - ChunkEvents: blocks of binary events.
+// Each chunk is the kind byte, the uint32 size of the payload, and the payload.
+//
+// A block is a BlockHeader, followed by records:
+//   - RecordName: varint id, varint length, the name;
+//   - RecordComplete: varint name id, zigzag varint timestamp delta, varint duration,
+//     varint args length, the args JSON;
+//   - RecordInstant: as RecordComplete, without the duration.
+// The names are interned per process, so they may be defined in a block of another thread.
+//
+// All the numbers are in the byte order of the recording machine; timestamps in microseconds.
+
+namespace TraceEventFormat
+{
+constexpr char FileMagic[] = "LOOLTRC1";
+constexpr std::size_t FileMagicSize = sizeof(FileMagic) - 1;
+
+constexpr char ChunkJson = 'J';
+constexpr char ChunkEvents = 'E';
+
+enum RecordKind : uint8_t
+{
+    RecordName = 1,
+    RecordComplete = 2,
+    RecordInstant = 3
+};
+
+struct BlockHeader
+{
+    uint32_t _size; //< Of the block, including this header.
+    uint32_t _pid;
+    uint64_t _tid;
+    uint64_t _baseUs; //< The timestamp the first delta is relative to.
+};
+
+inline void appendVarint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+
+    out += static_cast<char>(value);
+}
+
+inline bool readVarint(const char*& pos, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7)
+    {
+        const uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+inline uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline void appendChunkHeader(std::string& out, char kind, uint32_t size)
+{
+    out += kind;
+    out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+}
+
+/// The binary events recorded by a thread, as a block.
+class EventBuffer
+{
+public:
+    EventBuffer()
+        : _lastUs(0)
+    {
+    }
+
+    bool empty() const { return _data.empty(); }
+
+    /// The size of the block so far.
+    std::size_t size() const { return _data.size(); }
+
+    /// The timestamp the block starts from, when not empty.
+    uint64_t getBaseUs() const
+    {
+        BlockHeader header;
+        std::memcpy(&header, _data.data(), sizeof(header));
+        return header._baseUs;
+    }
+
+    void addName(uint32_t pid, uint64_t tid, uint64_t nowUs, uint32_t id, const std::string& name)
+    {
+        begin(pid, tid, nowUs);
+        _data += static_cast<char>(RecordName);
+        appendVarint(_data, id);
+        appendVarint(_data, name.size());
+        _data += name;
+    }
+
+    void addComplete(uint32_t pid, uint64_t tid, uint32_t nameId, uint64_t startUs,
+                     uint64_t durationUs, const std::string& args)
+    {
+        begin(pid, tid, startUs);
+        _data += static_cast<char>(RecordComplete);
+        appendVarint(_data, nameId);
+        appendTimestamp(startUs);
+        appendVarint(_data, durationUs);
+        appendVarint(_data, args.size());
+        _data += args;
+    }
+
+    void addInstant(uint32_t pid, uint64_t tid, uint32_t nameId, uint64_t timeUs,
+                    const std::string& args)
+    {
+        begin(pid, tid, timeUs);
+        _data += static_cast<char>(RecordInstant);
+        appendVarint(_data, nameId);
+        appendTimestamp(timeUs);
+        appendVarint(_data, args.size());
+        _data += args;
+    }
+
+    /// Returns the complete block, and starts over.
+    std::string take()
+    {
+        if (!_data.empty())
+        {
+            const uint32_t size = _data.size();
+            std::memcpy(&_data[0], &size, sizeof(size));
+        }
+
+        std::string block;
+        block.swap(_data);
+        return block;
+    }
+
+private:
+    void begin(uint32_t pid, uint64_t tid, uint64_t baseUs)
+    {
+        if (!_data.empty())
+            return;
+
+        const BlockHeader header = { 0, pid, tid, baseUs };
+        _data.reserve(16 * 1024);
+        _data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        _lastUs = baseUs;
+    }
+
+    /// Zones complete in the reverse order they start, so the deltas can be negative.
+    void appendTimestamp(uint64_t timeUs)
+    {
+        appendVarint(_data, zigzag(static_cast<int64_t>(timeUs - _lastUs)));
+        _lastUs = timeUs;
+    }
+
+    std::string _data;
+    uint64_t _lastUs;
+};
+
+/// Converts recordings to the Chrome Trace Event JSON array format.
+class JsonConverter
+{
+public:
+    JsonConverter()
+        : _first(true)
+    {
+    }
+
+    /// Converts the content of a recording file, writing the JSON to @out.
+    /// Returns false if it is malformed; what could be converted is still written.
+    bool convert(const char* data, std::size_t size, std::ostream& out)
+    {
+        if (size < FileMagicSize || std::memcmp(data, FileMagic, FileMagicSize) != 0)
+            return false;
+
+        const char* const end = data + size;
+
+        // The names of a thread may be defined in a block of another one, written later.
+        bool valid = forEachChunk(data + FileMagicSize, end, true, out);
+
+        out << "[\n";
+        valid = forEachChunk(data + FileMagicSize, end, false, out) && valid;
+        out << "\n]\n";
+        return valid;
+    }
+
+private:
+    bool forEachChunk(const char* pos, const char* end, bool namesOnly, std::ostream& out)
+    {
+        while (pos < end)
+        {
+            uint32_t size;
+            if (end - pos < 1 + static_cast<std::ptrdiff_t>(sizeof(size)))
+                return false;
+
+            const char kind = *pos++;
+            std::memcpy(&size, pos, sizeof(size));
+            pos += sizeof(size);
+            if (static_cast<std::size_t>(end - pos) < size)
+                return false;
+
+            if (kind == ChunkEvents)
+            {
+                if (!convertBlocks(pos, pos + size, namesOnly, out))
+                    return false;
+            }
+            else if (kind == ChunkJson)
+            {
+                if (!namesOnly)
+                    writeJson(pos, size, out);
+            }
+            else
+                return false;
+
+            pos += size;
+        }
+
+        return true;
+    }
+
+    bool convertBlocks(const char* pos, const char* end, bool namesOnly, std::ostream& out)
+    {
+        while (pos < end)
+        {
+            BlockHeader header;
+            if (static_cast<std::size_t>(end - pos) < sizeof(header))
+                return false;
+
+            std::memcpy(&header, pos, sizeof(header));
+            if (header._size < sizeof(header) || static_cast<std::size_t>(end - pos) < header._size)
+                return false;
+
+            if (!convertBlock(header, pos + sizeof(header), pos + header._size, namesOnly, out))
+                return false;
+
+            pos += header._size;
+        }
+
+        return true;
+    }
+
+    bool convertBlock(const BlockHeader& header, const char* pos, const char* end,
+                      bool namesOnly, std::ostream& out)
+    {
+        uint64_t timeUs = header._baseUs;
+        while (pos < end)
+        {
+            const uint8_t kind = static_cast<uint8_t>(*pos++);
+            uint64_t id;
+            if (!readVarint(pos, end, id))
+                return false;
+
+            if (kind == RecordName)
+            {
+                std::string name;
+                if (!readString(pos, end, name))
+                    return false;
+
+                if (namesOnly)
+                    _names[std::make_pair(header._pid, id)] = name;
+                continue;
+            }
+
+            if (kind != RecordComplete && kind != RecordInstant)
+                return false;
+
+            uint64_t delta;
+            uint64_t durationUs = 0;
+            std::string args;
+            if (!readVarint(pos, end, delta)
+                || (kind == RecordComplete && !readVarint(pos, end, durationUs))
+                || !readString(pos, end, args))
+                return false;
+
+            timeUs += unzigzag(delta);
+            if (namesOnly)
+                continue;
+
+            const auto it = _names.find(std::make_pair(header._pid, id));
+            separate(out);
+            out << "{\"name\":\"";
+            writeEscaped(it != _names.end() ? it->second : "#" + std::to_string(id), out);
+            out << "\",\"ph\":\"" << (kind == RecordComplete ? 'X' : 'i') << "\",\"ts\":" << timeUs;
+            if (kind == RecordComplete)
+                out << ",\"dur\":" << durationUs;
+            out << ",\"pid\":" << header._pid << ",\"tid\":" << header._tid;
+            if (!args.empty())
+                out << ",\"args\":" << args;
+            out << '}';
+        }
+
+        return true;
+    }
+
+    static bool readString(const char*& pos, const char* end, std::string& value)
+    {
+        uint64_t length;
+        if (!readVarint(pos, end, length) || static_cast<uint64_t>(end - pos) < length)
+            return false;
+
+        value.assign(pos, length);
+        pos += length;
+        return true;
+    }
+
+    /// Writes the JSON objects, without the trailing separator.
+    void writeJson(const char* data, std::size_t size, std::ostream& out)
+    {
+        while (size > 0 && (data[size - 1] == '\n' || data[size - 1] == ','
+                            || data[size - 1] == ' '))
+            --size;
+
+        if (size > 0)
+        {
+            separate(out);
+            out.write(data, size);
+        }
+    }
+
+    static void writeEscaped(const std::string& value, std::ostream& out)
+    {
+        for (const char ch : value)
+        {
+            if (ch == '"' || ch == '\\')
+                out << '\\';
+            out << ch;
+        }
+    }
+
+    void separate(std::ostream& out)
+    {
+        if (!_first)
+            out << ",\n";
+        _first = false;
+    }
+
+    std::map<std::pair<uint32_t, uint64_t>, std::string> _names;
+    bool _first;
+};
+
+} // namespace TraceEventFormat
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -369,10 +369,127 @@ namespace Util
         return totalMemKb;
     }
 
-    std::pair<std::size_t, std::size_t> getPssAndDirtyFromSMaps(FILE* file)
+    /// The CPU limit set on the cgroup at @dir by its quota, 0 for none.
+    static unsigned readCGroupCpuLimit(const std::string& dir, bool v2)
+    {
+        long quota = -1;
+        long period = 0;
+
+        if (v2)
+        {
+            // "<quota|max> <period>"
+            FILE* file = fopen((dir + "/cpu.max").c_str(), "r");
+            if (file != nullptr)
+            {
+                char line[256] = { 0 };
+                if (fgets(line, sizeof(line), file) && !startsWith(line, "max"))
+                {
+                    if (sscanf(line, "%ld %ld", &quota, &period) != 2)
+                        quota = -1;
+                }
+                fclose(file);
+            }
+        }
+        else
+        {
+            // Separate quota (-1 for unlimited) and period files.
+            FILE* file = fopen((dir + "/cpu.cfs_quota_us").c_str(), "r");
+            if (file != nullptr)
+            {
+                if (fscanf(file, "%ld", &quota) != 1)
+                    quota = -1;
+                fclose(file);
+            }
+
+            file = fopen((dir + "/cpu.cfs_period_us").c_str(), "r");
+            if (file != nullptr)
+            {
+                if (fscanf(file, "%ld", &period) != 1)
+                    period = 0;
+                fclose(file);
+            }
+        }
+
+        if (quota <= 0 || period <= 0)
+            return 0;
+
+        return (quota + period - 1) / period;
+    }
+
+    unsigned getCGroupCpuLimit()
+    {
+        // Find our own cgroup: that of the v1 cpu controller, which may
+        // come with a v2 entry without controllers, else the v2 one.
+        std::string path;
+        bool v2 = false;
+        bool found = false;
+        FILE* file = fopen("/proc/self/cgroup", "r");
+        if (file != nullptr)
+        {
+            // "<hierarchy-id>:<controllers>:<path>"
+            char line[4096] = { 0 };
+            while (fgets(line, sizeof(line), file))
+            {
+                char* controllers = strchr(line, ':');
+                char* cgroup = controllers ? strchr(controllers + 1, ':') : nullptr;
+                if (!cgroup)
+                    continue;
+
+                *controllers++ = '\0';
+                *cgroup++ = '\0';
+                cgroup[strcspn(cgroup, "\n")] = '\0';
+
+                if ((',' + std::string(controllers) + ',').find(",cpu,") != std::string::npos)
+                {
+                    path = cgroup;
+                    v2 = false;
+                    found = true;
+                    break;
+                }
+
+                if (strcmp(line, "0") == 0 && !found)
+                {
+                    path = cgroup;
+                    v2 = true;
+                    found = true;
+                }
+            }
+            fclose(file);
+        }
+
+        if (!found)
+        {
+            // Assume we are at the root, as in a container.
+            v2 = (access("/sys/fs/cgroup/cpu.max", F_OK) == 0);
+        }
+
+        // Each level up may be limited too; the tightest applies. Without a
+        // cgroup namespace, our path may not be under the mount, as in a
+        // container; the root, reached last, is then our own.
+        const std::string mount = (v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/cpu");
+        while (!path.empty() && path.back() == '/')
+            path.pop_back();
+
+        unsigned limit = 0;
+        while (true)
+        {
+            const unsigned cpus = readCGroupCpuLimit(mount + path, v2);
+            if (cpus > 0 && (limit == 0 || cpus < limit))
+                limit = cpus;
+
+            if (path.empty())
+                break;
+
+            const std::size_t slash = path.find_last_of('/');
+            path.resize(slash == std::string::npos ? 0 : slash);
+        }
+
+        return limit;
+    }
+
+    SMapsStats getSMapsStats(FILE* file)
     {
-        std::size_t numPSSKb = 0;
-        std::size_t numDirtyKb = 0;
+        SMapsStats stats;
         if (file)
         {
             rewind(file);
@@ -383,16 +500,27 @@ namespace Util
                 // Shared_Dirty is accounted for by forkit's RSS
                 if ((value = startsWith(line, "Private_Dirty:")))
                 {
-                    numDirtyKb += atoi(value);
+                    stats._privateDirtyKb += atoi(value);
                 }
                 else if ((value = startsWith(line, "Pss:")))
                 {
-                    numPSSKb += atoi(value);
+                    stats._pssKb += atoi(value);
+                }
+                else if ((value = startsWith(line, "Shared_Clean:"))
+                         || (value = startsWith(line, "Shared_Dirty:")))
+                {
+                    stats._sharedKb += atoi(value);
                 }
             }
         }
 
-        return std::make_pair(numPSSKb, numDirtyKb);
+        return stats;
+    }
+
+    std::pair<std::size_t, std::size_t> getPssAndDirtyFromSMaps(FILE* file)
+    {
+        const SMapsStats stats = getSMapsStats(file);
+        return std::make_pair(stats._pssKb, stats._privateDirtyKb);
     }
 
     std::string getMemoryStats(FILE* file)
@@ -406,12 +534,21 @@ namespace Util
         return oss.str();
     }
 
+    FILE* openSMaps(const std::string& procPath)
+    {
+        // The kernel sums smaps_rollup up for us (since Linux 4.14), which is much cheaper than
+        // formatting every mapping of a large process only for us to parse and sum it again.
+        FILE* file = fopen((procPath + "/smaps_rollup").c_str(), "r");
+        if (file == nullptr)
+            file = fopen((procPath + "/smaps").c_str(), "r");
+        return file;
+    }
+
     std::size_t getMemoryUsagePSS(const pid_t pid)
     {
         if (pid > 0)
         {
-            const auto cmd = "/proc/" + std::to_string(pid) + "/smaps";
-            FILE* fp = fopen(cmd.c_str(), "r");
+            FILE* fp = openSMaps("/proc/" + std::to_string(pid));
             if (fp != nullptr)
             {
                 const std::size_t pss = getPssAndDirtyFromSMaps(fp).first;
@@ -425,29 +562,14 @@ namespace Util
 
     std::size_t getMemoryUsageRSS(const pid_t pid)
     {
-        static const int pageSizeBytes = getpagesize();
-        std::size_t rss = 0;
-
-        if (pid > 0)
-        {
-            rss = getStatFromPid(pid, 23);
-            rss *= pageSizeBytes;
-            rss /= 1024;
-            return rss;
-        }
-        return 0;
+        ProcessStat stat;
+        return getProcessStat(pid, stat) ? stat._rssKb : 0;
     }
 
     std::size_t getCpuUsage(const pid_t pid)
     {
-        if (pid > 0)
-        {
-            std::size_t totalJiffies = 0;
-            totalJiffies += getStatFromPid(pid, 13);
-            totalJiffies += getStatFromPid(pid, 14);
-            return totalJiffies;
-        }
-        return 0;
+        ProcessStat stat;
+        return getProcessStat(pid, stat) ? stat._cpuJiffies : 0;
     }
 
     std::size_t getStatFromPid(const pid_t pid, int ind)
@@ -475,11 +597,51 @@ namespace Util
                         pos = s.find(' ', pos + 1);
                     }
                 }
+                fclose(fp);
             }
         }
         return 0;
     }
 
+    bool getProcessStat(const pid_t pid, ProcessStat& stat)
+    {
+        if (pid <= 0)
+            return false;
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        char line[1024];
+        const ssize_t size = read(fd, line, sizeof(line) - 1);
+        close(fd);
+        if (size <= 0)
+            return false;
+        line[size] = '\0';
+
+        // The command name may have spaces and parentheses; the fields follow its last ')'.
+        const char* pos = strrchr(line, ')');
+        if (pos == nullptr)
+            return false;
+
+        // Starting with the state, field 3 of proc(5).
+        unsigned long fields[22] = { 0 };
+        std::size_t count = 0;
+        for (pos = strchr(pos, ' '); pos != nullptr && count < 22; pos = strchr(pos + 1, ' '))
+            fields[count++] = strtoul(pos + 1, nullptr, 10);
+        if (count < 22)
+            return false;
+
+        static const long pageSizeKb = getpagesize() / 1024;
+        stat._ppid = fields[1];
+        stat._cpuJiffies = fields[11] + fields[12];
+        stat._threads = fields[17];
+        stat._rssKb = fields[21] * pageSizeKb;
+        return true;
+    }
+
     void setProcessAndThreadPriorities(const pid_t pid, int prio)
     {
         int res = setpriority(PRIO_PROCESS, pid, prio);
@@ -177,6 +177,15 @@ namespace Util
     /// Returns the total physical memory (in kB) available in the system
     size_t getTotalSystemMemoryKb();
 
+    /// Returns the number of CPUs our cgroup CPU quota allows us to use,
+    /// rounded up; 0 when there is no quota or it can't be determined.
+    /// Our cgroup, from /proc/self/cgroup, and its ancestors are checked.
+    unsigned getCGroupCpuLimit();
+
+    /// Opens the smaps_rollup of the process at @procPath (e.g. "/proc/self"), or its smaps
+    /// on kernels without it. Both are read by getPssAndDirtyFromSMaps().
+    FILE* openSMaps(const std::string& procPath);
+
     /// Returns the process PSS in KB (works only when we have perms for /proc/pid/smaps).
     size_t getMemoryUsagePSS(const pid_t pid);
 
@@ -191,10 +200,33 @@ namespace Util
     /// returns them as a pair in the same order
     std::pair<size_t, size_t> getPssAndDirtyFromSMaps(FILE* file);
 
+    /// The sums of the SMaps values used for the stats, in KB.
+    struct SMapsStats
+    {
+        size_t _pssKb = 0;
+        size_t _privateDirtyKb = 0;
+        /// The pages still shared with other processes: for a Kit, mostly with ForKit.
+        size_t _sharedKb = 0;
+    };
+
+    SMapsStats getSMapsStats(FILE* file);
+
     size_t getCpuUsage(const pid_t pid);
 
     size_t getStatFromPid(const pid_t pid, int ind);
 
+    /// The fields of /proc/<pid>/stat used for the stats.
+    struct ProcessStat
+    {
+        pid_t _ppid = 0;
+        size_t _cpuJiffies = 0; ///< User and system time.
+        size_t _threads = 0;
+        size_t _rssKb = 0;
+    };
+
+    /// Reads all of ProcessStat at once. Returns false if the process is gone.
+    bool getProcessStat(const pid_t pid, ProcessStat& stat);
+
     /// Sets priorities for a given pid & the current thread
     void setProcessAndThreadPriorities(const pid_t pid, int prio);
 #endif
@@ -43,6 +43,7 @@
 #include "KitHelper.hpp"
 #include <Log.hpp>
 #include <Png.hpp>
+#include <RenderTiles.hpp>
 #include <Util.hpp>
 #include <Unit.hpp>
 #include <Clipboard.hpp>
@@ -1878,7 +1879,37 @@ bool ChildSession::renderWindow(const char* /*buffer*/, int /*length*/, const St
                                << " and rendered in " << elapsedMs << " (" << area / elapsedMics
                                << " MP/s).");
 
-    uint64_t pixmapHash = Png::hashSubBuffer(pixmap.data(), 0, 0, width, height, bufferWidth, bufferHeight) + getViewId();
+    // Only what changed since the last paint of the same rectangle is encoded and sent,
+    // for the client to composite on what it has.
+    const Util::Rectangle paintRect(startX, startY, width, height);
+    const std::vector<Util::Rectangle> damage
+        = _windowFrames.update(winId, paintRect, dpiScale, pixmap);
+    if (damage.empty())
+    {
+        LOG_TRC("paintWindow for " << winId << " unchanged, not encoding to PNG");
+        sendTextFrame("windowpaint: id=" + std::to_string(winId) + " width=0 height=0 rectangle="
+                      + std::to_string(startX) + ',' + std::to_string(startY) + ",0,0 unchanged");
+        return true;
+    }
+
+    for (const Util::Rectangle& rect : damage)
+    {
+        if (!sendWindowPaint(winId, pixmap, bufferWidth, bufferHeight, startX, startY, rect))
+            return false;
+    }
+
+    return true;
+}
+
+bool ChildSession::sendWindowPaint(unsigned winId, std::vector<unsigned char>& pixmap,
+                                   int bufferWidth, int bufferHeight, int startX, int startY,
+                                   const Util::Rectangle& rect)
+{
+    const int width = rect.getWidth();
+    const int height = rect.getHeight();
+    const uint64_t contentHash = Png::hashSubBuffer(pixmap.data(), rect.getLeft(), rect.getTop(),
+                                                    width, height, bufferWidth, bufferHeight);
+    const uint64_t pixmapHash = contentHash + getViewId();
 
     auto found = std::find(_pixmapCache.begin(), _pixmapCache.end(), pixmapHash);
 
@@ -1920,11 +1951,12 @@ bool ChildSession::renderWindow(const char* /*buffer*/, int /*length*/, const St
 
     assert(_pixmapCache.size() <= LOKitHelper::tunnelledDialogImageCacheSize);
 
-    std::string response = "windowpaint: id=" + std::to_string(winId) + " width=" + std::to_string(width)
-                           + " height=" + std::to_string(height);
-
-    if (!paintRectangle.empty())
-        response += " rectangle=" + paintRectangle;
+    // The rectangle is where the client draws the image, in the window.
+    std::string response = "windowpaint: id=" + std::to_string(winId) + " width="
+                           + std::to_string(width) + " height=" + std::to_string(height)
+                           + " rectangle=" + std::to_string(startX + rect.getLeft()) + ','
+                           + std::to_string(startY + rect.getTop()) + ',' + std::to_string(width)
+                           + ',' + std::to_string(height);
 
     response += " hash=" + std::to_string(pixmapHash);
 
@@ -1938,20 +1970,33 @@ bool ChildSession::renderWindow(const char* /*buffer*/, int /*length*/, const St
 
     response += "\n";
 
-    std::vector<char> output;
-    output.reserve(response.size() + pixmapDataSize);
-    output.resize(response.size());
-    std::memcpy(output.data(), response.data(), response.size());
+    // The same content may have been encoded for another view, or another window.
+    // The size is part of the key, as only that of blank areas is in the content hash.
+    PngCache& pngCache = _docManager->getPngCache();
+    const uint64_t cacheKey[2] = { contentHash, (static_cast<uint64_t>(width) << 32) | height };
+    const TileBinaryHash cacheHash = SpookyHash::Hash64(cacheKey, sizeof(cacheKey), 1073741789);
+    PngCache::CacheData data = pngCache.lookupCache(cacheHash);
+    if (!data)
+    {
+        const auto mode = static_cast<LibreOfficeKitTileMode>(getLOKitDocument()->getTileMode());
 
-    const auto mode = static_cast<LibreOfficeKitTileMode>(getLOKitDocument()->getTileMode());
+        data = std::make_shared<std::vector<char>>();
+        data->reserve(width * height);
+        if (!Png::encodeSubBufferToPNG(pixmap.data(), rect.getLeft(), rect.getTop(), width, height,
+                                       bufferWidth, bufferHeight, *data, mode))
+        {
+            LOG_ERR("Failed to encode into PNG.");
+            return false;
+        }
 
-    // TODO: use png cache for dialogs too
-    if (!Png::encodeSubBufferToPNG(pixmap.data(), 0, 0, width, height, bufferWidth, bufferHeight, output, mode))
-    {
-        LOG_ERR("Failed to encode into PNG.");
-        return false;
+        pngCache.addToCache(data, pngCache.hashToWireId(cacheHash), cacheHash);
     }
 
+    std::vector<char> output;
+    output.reserve(response.size() + data->size());
+    output.insert(output.end(), response.begin(), response.end());
+    output.insert(output.end(), data->begin(), data->end());
+
 #if 0
     {
         static const std::string tempDir = FileUtil::createRandomTmpDir();
@@ -1960,7 +2005,7 @@ bool ChildSession::renderWindow(const char* /*buffer*/, int /*length*/, const St
         ss << tempDir << "/" << "renderwindow-" << pngDumpCounter++ << ".png";
         LOG_INF("Dumping PNG to '"<< ss.str() << "'");
         FILE *f = fopen(ss.str().c_str(), "w");
-        fwrite(output.data() + response.size(), output.size() - response.size(), 1, f);
+        fwrite(data->data(), data->size(), 1, f);
         fclose(f);
     }
 #endif
@@ -1976,6 +2021,9 @@ bool ChildSession::resizeWindow(const char* /*buffer*/, int /*length*/, const St
 
     getLOKitDocument()->setView(_viewId);
 
+    // The client resizes its canvas, dropping what it had painted.
+    _windowFrames.forget(winId);
+
     std::string size;
     if (tokens.size() > 2 && getTokenString(tokens[2], "size", size))
     {
@@ -2935,8 +2983,22 @@ void ChildSession::loKitCallback(const int type, const std::string& payload)
         sendTextFrame("rulerupdate: " + payload);
         break;
     case LOK_CALLBACK_WINDOW:
+    {
+        // The client (re)creates the canvas of the window on these.
+        if (payload.find("\"created\"") != std::string::npos
+            || payload.find("\"size_changed\"") != std::string::npos
+            || payload.find("\"close\"") != std::string::npos)
+        {
+            Poco::JSON::Object::Ptr object;
+            if (JsonUtil::parseJSON(payload, object))
+                _windowFrames.forget(JsonUtil::getJSONValue<unsigned>(object, "id"));
+            else
+                _windowFrames.clear();
+        }
+
         sendTextFrame("window: " + payload);
         break;
+    }
     case LOK_CALLBACK_VALIDITY_LIST_BUTTON:
         sendTextFrame("validitylistbutton: " + payload);
         break;
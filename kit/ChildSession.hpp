@@ -19,8 +19,10 @@
 #include "Kit.hpp"
 #include "Session.hpp"
 #include "Watermark.hpp"
+#include "WindowFrames.hpp"
 
 class ChildSession;
+class PngCache;
 
 enum class LokEventTargetEnum
 {
@@ -65,6 +67,9 @@ public:
 
     virtual std::shared_ptr<TileQueue>& getTileQueue() = 0;
 
+    /// The PNGs encoded for the document, shared by the tiles and the windows of all views.
+    virtual PngCache& getPngCache() = 0;
+
     virtual bool sendFrame(const char* buffer, int length, WSOpCode opCode = WSOpCode::Text) = 0;
 
     virtual void alertAllUsers(const std::string& cmd, const std::string& kind) = 0;
@@ -304,6 +309,8 @@ private:
     bool selectText(const char* buffer, int length, const StringVector& tokens, const LokEventTargetEnum target);
     bool selectGraphic(const char* buffer, int length, const StringVector& tokens);
     bool renderWindow(const char* buffer, int length, const StringVector& tokens);
+    bool sendWindowPaint(unsigned winId, std::vector<unsigned char>& pixmap, int bufferWidth,
+                         int bufferHeight, int startX, int startY, const Util::Rectangle& rect);
     bool resizeWindow(const char* buffer, int length, const StringVector& tokens);
     bool resetSelection(const char* buffer, int length, const StringVector& tokens);
     bool saveAs(const char* buffer, int length, const StringVector& tokens);
@@ -385,6 +392,9 @@ private:
 
     std::vector<uint64_t> _pixmapCache;
 
+    /// The last frames painted of the windows, to send the damage only.
+    WindowFrames _windowFrames;
+
     static UnoCommandsRecorder unoCommandsRecorder;
 };
 
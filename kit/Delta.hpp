@@ -7,9 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <assert.h>
+#include <string.h>
 #include <Log.hpp>
+#include <Simd.hpp>
 
 #ifndef TILE_WIRE_ID
 #  define TILE_WIRE_ID
@@ -32,6 +36,11 @@ class DeltaGenerator {
             return _pixels == other._pixels;
         }
 
+        void setCrc(uint64_t crc)
+        {
+            _crc = crc;
+        }
+
         const std::vector<uint32_t>& getPixels() const
         {
             return _pixels;
@@ -44,6 +53,8 @@ class DeltaGenerator {
     };
 
     struct DeltaData {
+        DeltaData() : _wid(0), _width(0), _height(0), _imageSize(0) {}
+
         void setWid(TileWireId wid)
         {
             _wid = wid;
@@ -74,6 +85,17 @@ class DeltaGenerator {
             return _height;
         }
 
+        /// The size of the image the client got for this frame, if known.
+        void setImageSize(size_t imageSize)
+        {
+            _imageSize = imageSize;
+        }
+
+        size_t getImageSize() const
+        {
+            return _imageSize;
+        }
+
         const std::vector<DeltaBitmapRow>& getRows() const
         {
             return _rows;
@@ -88,9 +110,39 @@ class DeltaGenerator {
         TileWireId _wid;
         int _width;
         int _height;
+        size_t _imageSize;
         std::vector<DeltaBitmapRow> _rows;
     };
+    /// Oldest first.
     std::vector<std::shared_ptr<DeltaData>> _deltaEntries;
+    size_t _maxEntries;
+
+    std::shared_ptr<DeltaData> findEntry(TileWireId wid) const
+    {
+        for (const auto& entry : _deltaEntries)
+        {
+            if (entry->getWid() == wid)
+                return entry;
+        }
+        return nullptr;
+    }
+
+    void storeEntry(const std::shared_ptr<DeltaData>& data)
+    {
+        for (auto it = _deltaEntries.begin(); it != _deltaEntries.end(); ++it)
+        {
+            if ((*it)->getWid() == data->getWid())
+            {
+                _deltaEntries.erase(it);
+                break;
+            }
+        }
+
+        if (_deltaEntries.size() >= _maxEntries)
+            _deltaEntries.erase(_deltaEntries.begin());
+
+        _deltaEntries.push_back(data);
+    }
 
     bool makeDelta(
         const DeltaData &prev,
@@ -170,7 +222,7 @@ class DeltaGenerator {
 
                 int diff;
                 for (diff = 0; diff + x < prev.getWidth() &&
-                         (prevRow.getPixels()[x+diff] == curRow.getPixels()[x+diff] || diff < 2) &&
+                         prevRow.getPixels()[x+diff] != curRow.getPixels()[x+diff] &&
                          diff < 254;)
                     ++diff;
                 if (diff > 0)
@@ -197,7 +249,8 @@ class DeltaGenerator {
         TileWireId wid,
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
-        int bufferWidth, int bufferHeight)
+        int bufferWidth, int bufferHeight,
+        bool unpremultiply)
     {
         auto data = std::make_shared<DeltaData>();
         data->setWid(wid);
@@ -218,52 +271,92 @@ class DeltaGenerator {
         {
             DeltaBitmapRow &row = data->getRows()[y];
             size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-            int32_t *src = reinterpret_cast<int32_t *>(pixmap + position);
+            std::vector<uint32_t> &pixels = row.getPixels();
+            pixels.resize(width);
+            memcpy(pixels.data(), pixmap + position, width * 4);
+
+            // Store what the client will have after decoding the PNG.
+            if (unpremultiply)
+                Simd::unpremultiply(reinterpret_cast<uint8_t *>(pixels.data()), width);
 
-            // We get the hash ~for free as we copy - with a cheap hash.
+            // A cheap hash to reject most rows without comparing them.
             uint64_t crc = 0x7fffffff - 1;
-            row.getPixels().resize(width);
             for (int x = 0; x < width; ++x)
-            {
-                crc = (crc << 7) + crc + src[x];
-                row.getPixels()[x] = src[x];
-            }
+                crc = (crc << 7) + crc + pixels[x];
+            row.setCrc(crc);
         }
 
         return data;
     }
 
   public:
-    DeltaGenerator() {}
+    /// Keeps the bitmaps of the last @maxEntries distinct frames.
+    explicit DeltaGenerator(size_t maxEntries = 7)
+        : _maxEntries(std::max<size_t>(maxEntries, 1))
+    {
+    }
 
     /**
      * Creates a delta between @oldWid and pixmap if possible:
      *   if so - returns @true and appends the delta to @output
      * stores @pixmap, and other data to accelerate delta
      * creation in a limited size cache.
+     * A delta is only produced when it is smaller than the image
+     * last sent for @oldWid, see setImageSize(). With @unpremultiply
+     * the pixels are converted like the PNG encoder does, so the
+     * delta applies on top of the decoded image.
      */
     bool createDelta(
         unsigned char* pixmap, size_t startX, size_t startY,
         int width, int height,
         int bufferWidth, int bufferHeight,
         std::vector<char>& output,
-        TileWireId wid, TileWireId oldWid)
+        TileWireId wid, TileWireId oldWid,
+        bool unpremultiply = false)
     {
-        // First store a copy for later:
-        if (_deltaEntries.size() > 6) // FIXME: hard-coded ...
-            _deltaEntries.erase(_deltaEntries.begin());
+        std::shared_ptr<DeltaData> old = oldWid ? findEntry(oldWid) : nullptr;
 
+        // First store a copy for later:
         std::shared_ptr<DeltaData> update =
             dataToDeltaData(wid, pixmap, startX, startY, width, height,
-                            bufferWidth, bufferHeight);
-        _deltaEntries.push_back(update);
+                            bufferWidth, bufferHeight, unpremultiply);
+        if (wid)
+            storeEntry(update);
+
+        if (!old)
+            return false;
 
-        for (auto &old : _deltaEntries)
+        const size_t start = output.size();
+        if (!makeDelta(*old, *update, output))
+            return false;
+
+        // Without a PNG size to beat, settle for a quarter of the raw pixels.
+        const size_t maxSize = old->getImageSize() ? old->getImageSize()
+                                                   : static_cast<size_t>(width * height);
+        if (output.size() - start >= maxSize)
         {
-            if (oldWid == old->getWid())
-                return makeDelta(*old, *update, output);
+            LOG_TRC("Delta of " << (output.size() - start) << " bytes is not smaller than "
+                    << maxSize << ", dropping it");
+            output.resize(start);
+            return false;
         }
-        return false;
+
+        // Good enough as an estimate of what a PNG of this frame would be.
+        update->setImageSize(old->getImageSize());
+        return true;
+    }
+
+    /// Records the size of the image sent for @wid, if we have its bitmap.
+    void setImageSize(TileWireId wid, size_t imageSize)
+    {
+        std::shared_ptr<DeltaData> entry = findEntry(wid);
+        if (entry)
+            entry->setImageSize(imageSize);
+    }
+
+    size_t getEntryCount() const
+    {
+        return _deltaEntries.size();
     }
 };
 
@@ -34,14 +34,17 @@
 #include <sysexits.h>
 
 #include <atomic>
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <condition_variable>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
 #include <thread>
@@ -609,6 +612,10 @@ public:
         // Wait for the callback worker to finish.
         _stop = true;
 
+        // Let the compression workers finish before the pool goes away.
+        if (_pendingRender)
+            _pngPool.wait(*_pendingRender->_group);
+
         _tileQueue->put("eof");
 
         for (const auto& session : _sessions)
@@ -637,6 +644,21 @@ public:
         return true;
     }
 
+    /// Post the header followed by the blocks, which are sent without being copied.
+    bool postMessage(const std::string& header, const std::vector<Buffer::SharedBlock>& blocks,
+                     const WSOpCode code) const
+    {
+        LOG_TRC("postMessage called with: " << getAbbreviatedMessage(header));
+        if (!_websocketHandler)
+        {
+            LOG_ERR("Child Doc: Bad socket while sending [" << getAbbreviatedMessage(header) << "].");
+            return false;
+        }
+
+        _websocketHandler->sendMessage(header, blocks, code);
+        return true;
+    }
+
     bool createSession(const std::string& sessionId, int canonicalViewId)
     {
         try
@@ -791,11 +813,15 @@ public:
                                                pixelWidth, pixelHeight, mode);
         };
 
-        const auto postMessageFunc = [&](const char* buffer, std::size_t length) {
-            postMessage(buffer, length, WSOpCode::Binary);
+        // Called later, once the tiles are compressed.
+        const auto postMessageFunc = [this](const std::string& header,
+                                            const std::vector<PngCache::CacheData>& images) {
+            postMessage(header, std::vector<Buffer::SharedBlock>(images.begin(), images.end()),
+                        WSOpCode::Binary);
         };
 
-        if (!RenderTiles::doRender(_loKitDocument, tileCombined, _pngCache, _pngPool, combined,
+        if (!RenderTiles::doRender(_loKitDocument, tileCombined, _pngCache, _pngPool,
+                                   _deltaGen.get(), _pendingRender, combined,
                                    blenderFunc, postMessageFunc, _mobileAppDocId))
         {
             LOG_DBG("All tiles skipped, not producing empty tilecombine: message");
@@ -803,6 +829,12 @@ public:
         }
     }
 
+    /// Send the tiles still being compressed, if any.
+    void flushPendingRender()
+    {
+        RenderTiles::finishRender(_pendingRender, _pngCache, _pngPool);
+    }
+
     bool sendTextFrame(const std::string& message)
     {
         return sendFrame(message.data(), message.size());
@@ -978,10 +1010,16 @@ public:
         }
 
         // merge various callback types together if possible
-        if (type == LOK_CALLBACK_INVALIDATE_TILES ||
-            type == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED)
+        if (type == LOK_CALLBACK_INVALIDATE_TILES)
+        {
+            // no point in handling invalidations per-view, all views have to be
+            // in sync; coalesce them until anything else is queued, or the
+            // queue is drained next
+            tileQueue->invalidate(payload);
+        }
+        else if (type == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED)
         {
-            // no point in handling invalidations or page resizes per-view,
+            // no point in handling page resizes per-view,
             // all views have to be in sync
             tileQueue->put("callback all " + std::to_string(type) + ' ' + payload);
         }
@@ -1016,6 +1054,16 @@ private:
         }
 
         std::shared_ptr<ChildSession> session = it->second;
+
+        // WSD only asks for deltas on behalf of sessions that negotiated them.
+        if (session->getTileDeltas() && !_deltaGen)
+        {
+            // Enough for the tiles being edited, at 256KB each.
+            const size_t deltaBitmapCount = 64;
+            LOG_INF("Enabling tile deltas, keeping the last " << deltaBitmapCount << " tile bitmaps.");
+            _deltaGen = Util::make_unique<DeltaGenerator>(deltaBitmapCount);
+        }
+
         try
         {
             if (!load(session, renderOpts))
@@ -1102,6 +1150,11 @@ private:
         return _tileQueue;
     }
 
+    PngCache& getPngCache() override
+    {
+        return _pngCache;
+    }
+
     int getEditorId() const override
     {
         return _editorId;
@@ -1538,7 +1591,7 @@ public:
 
     bool hasQueueItems() const
     {
-        return _tileQueue && !_tileQueue->isEmpty();
+        return _tileQueue && (!_tileQueue->isEmpty() || _tileQueue->hasInvalidations());
     }
 
     // poll is idle, are we ?
@@ -1568,12 +1621,20 @@ public:
                     break;
                 }
 
+                // Whatever the last message invalidated goes out as one, before the next.
+                _tileQueue->flushInvalidations();
+
                 const TileQueue::Payload input = _tileQueue->pop();
 
                 LOG_TRC("Kit handling queue message: " << LOOLProtocol::getAbbreviatedMessage(input));
 
                 const StringVector tokens = Util::tokenize(input.data(), input.size());
 
+                // Only consecutive renders may overlap; anything else must
+                // not overtake tiles painted before it.
+                if (!tokens.equals(0, "tile") && !tokens.equals(0, "tilecombine"))
+                    flushPendingRender();
+
                 if (tokens.equals(0, "eof"))
                 {
                     LOG_INF("Received EOF. Finishing.");
@@ -1679,6 +1740,7 @@ public:
                 }
             }
 
+            flushPendingRender();
         }
         catch (const std::exception& exc)
         {
@@ -1754,6 +1816,8 @@ public:
         // TODO: _websocketHandler - but this is an odd one.
         _tileQueue->dumpState(oss);
         _pngCache.dumpState(oss);
+        if (_deltaGen)
+            oss << "\tdeltaBitmaps: " << _deltaGen->getEntryCount() << '\n';
         oss << "\tviewIdToCallbackDescr:";
         for (const auto &it : _viewIdToCallbackDescr)
         {
@@ -1830,6 +1894,10 @@ private:
     std::atomic<bool> _stop;
 
     ThreadPool _pngPool;
+    /// The last tilecombine, compressing while we paint the next.
+    std::shared_ptr<RenderTiles::PendingRender> _pendingRender;
+    /// Bitmaps of recently sent tiles, once a session wants deltas.
+    std::unique_ptr<DeltaGenerator> _deltaGen;
 
     std::condition_variable _cvLoading;
     int _editorId;
@@ -1852,29 +1920,35 @@ private:
 #if !defined FUZZER && !defined BUILDING_TESTS && !MOBILEAPP
 
 // When building the fuzzer we link LOOLWSD.cpp into the same executable so the
-// Protected::emitOneRecording() there gets used. When building the unit tests the one in
+// TraceEvent::emitRecordings() there gets used. When building the unit tests the one in
 // TraceEvent.cpp gets used.
 
-static constexpr int traceEventRecordingsCapacity = 100;
-static std::vector<std::string> traceEventRecordings;
+/// The blocks of binary events pending to be sent to WSD, from all the threads.
+static constexpr std::size_t traceEventRecordingsCapacity = 64 * 1024;
+static std::mutex traceEventRecordingsMutex;
+static std::string traceEventRecordings;
 
-static void flushTraceEventRecordings()
+static void sendTraceEventRecordings(std::unique_lock<std::mutex>& lock)
 {
-    if (traceEventRecordings.size() == 0)
+    if (traceEventRecordings.empty())
         return;
 
-    std::size_t totalLength = 0;
-    for (const auto& i: traceEventRecordings)
-        totalLength += i.length();
+    std::string recordings("binarytraceevent: \n");
+    recordings.reserve(recordings.size() + traceEventRecordings.size());
+    recordings += traceEventRecordings;
+    traceEventRecordings.clear();
+    lock.unlock();
 
-    std::string recordings;
-    recordings.reserve(totalLength);
+    singletonDocument->sendFrame(recordings.data(), recordings.size(), WSOpCode::Binary);
+}
 
-    for (const auto& i: traceEventRecordings)
-        recordings += i;
+static void flushTraceEventRecordings()
+{
+    // Include the events of the current (main) thread.
+    TraceEvent::flushRecordings();
 
-    singletonDocument->sendTextFrame("traceevent: \n" + recordings);
-    traceEventRecordings.clear();
+    std::unique_lock<std::mutex> lock(traceEventRecordingsMutex);
+    sendTraceEventRecordings(lock);
 }
 
 // The checks for singletonDocument below are to catch if this gets called in the ForKit process.
@@ -1901,23 +1975,22 @@ void TraceEvent::emitOneRecordingIfEnabled(const std::string &recording)
     singletonDocument->sendTextFrame("forcedtraceevent: \n" + recording);
 }
 
-void TraceEvent::emitOneRecording(const std::string &recording)
+void TraceEvent::emitRecordings(const char* data, std::size_t size)
 {
     static const bool traceEventsEnabled = config::getBool("trace_event[@enable]", false);
     if (!traceEventsEnabled)
         return;
 
-    if (!TraceEvent::isRecordingOn())
-        return;
-
     if (singletonDocument == nullptr)
         return;
 
-    if (traceEventRecordings.size() >= traceEventRecordingsCapacity)
-        flushTraceEventRecordings();
-    else if (traceEventRecordings.size() == 0 && traceEventRecordings.capacity() < traceEventRecordingsCapacity)
+    std::unique_lock<std::mutex> lock(traceEventRecordingsMutex);
+    if (traceEventRecordings.capacity() < traceEventRecordingsCapacity)
         traceEventRecordings.reserve(traceEventRecordingsCapacity);
-    traceEventRecordings.emplace_back(recording + "\n");
+    traceEventRecordings.append(data, size);
+
+    if (traceEventRecordings.size() >= traceEventRecordingsCapacity)
+        sendTraceEventRecordings(lock);
 }
 
 #elif !MOBILEAPP
@@ -2260,7 +2333,7 @@ protected:
 #endif
         }
         else if (tokens.equals(0, "tile") || tokens.equals(0, "tilecombine") || tokens.equals(0, "canceltiles") ||
-                tokens.equals(0, "paintwindow") || tokens.equals(0, "resizewindow") ||
+                tokens.equals(0, "prerendertiles") || tokens.equals(0, "paintwindow") || tokens.equals(0, "resizewindow") ||
                 LOOLProtocol::getFirstToken(tokens[0], '-') == "child")
         {
             if (_document)
@@ -2388,6 +2461,76 @@ void wakeCallback(void* pData)
 
 #ifndef BUILDING_TESTS
 
+#if !MOBILEAPP
+
+/// Loads and unloads a blank document of each of the configured types, so that the modules,
+/// filters and caches they need are initialized before the Kit is handed a document.
+static void warmUpKit(const std::shared_ptr<lok::Office>& loKit)
+{
+    if (!config::isInitialized())
+        return;
+
+    // Minimal flat ODF documents, so no template needs to be in the jail.
+    static const char* const header
+        = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+          "<office:document xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\" "
+          "office:version=\"1.2\" office:mimetype=\"application/vnd.oasis.opendocument.";
+    struct WarmUpDocument
+    {
+        const char* _type;
+        const char* _extension;
+        const char* _body;
+    };
+    static const WarmUpDocument documents[] = {
+        { "writer", "fodt", "text\"><office:body><office:text/>" },
+        { "calc", "fods", "spreadsheet\"><office:body><office:spreadsheet/>" },
+        { "impress", "fodp", "presentation\"><office:body><office:presentation/>" },
+    };
+
+    const StringVector types
+        = Util::tokenize(config::getString("warm_up_document_types", ""), ' ');
+    for (const auto& type : types)
+    {
+        const std::string name = types.getParam(type);
+        const auto it = std::find_if(
+            std::begin(documents), std::end(documents),
+            [&name](const WarmUpDocument& document) { return name == document._type; });
+        if (it == std::end(documents))
+        {
+            LOG_WRN("Unknown document type [" << name << "] to warm up with.");
+            continue;
+        }
+
+        const std::string path = JailRoot + "/tmp/warmup." + it->_extension;
+        {
+            std::ofstream file(path);
+            file << header << it->_body << "</office:body></office:document>";
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<lok::Document> document(
+            loKit->documentLoad(("file://" + path).c_str(), "Language=en-US"));
+        if (document)
+        {
+            // Much of the first-use cost is in the view and the layout, not in loading.
+            long width = 0;
+            long height = 0;
+            document->initializeForRendering(nullptr);
+            document->getDocumentSize(&width, &height);
+            document.reset();
+            LOG_INF("Warmed up " << name << " in "
+                                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - start));
+        }
+        else
+            LOG_WRN("Failed to warm up " << name << ": " << loKit->getError());
+
+        FileUtil::removeFile(path);
+    }
+}
+
+#endif // !MOBILEAPP
+
 void lokit_main(
 #if !MOBILEAPP
                 const std::string& childRoot,
@@ -2576,7 +2719,10 @@ void lokit_main(
                 std::chrono::steady_clock::now() - jailSetupStartTime);
             LOG_DBG("Initialized jail files in " << ms);
 
-            ProcSMapsFile = open("/proc/self/smaps", O_RDONLY);
+            // WSD reads our memory stats from this, summed up by the kernel when it can.
+            ProcSMapsFile = open("/proc/self/smaps_rollup", O_RDONLY);
+            if (ProcSMapsFile < 0)
+                ProcSMapsFile = open("/proc/self/smaps", O_RDONLY);
             if (ProcSMapsFile < 0)
                 LOG_SYS("Failed to open /proc/self/smaps. Memory stats will be missing.");
 
@@ -2647,6 +2793,9 @@ void lokit_main(
             }
         }
 
+        // Spare Kits are started in advance; spend the wait on what the first document needs.
+        warmUpKit(loKit);
+
         // Lock down the syscalls that can be used
         if (!Seccomp::lockdown(Seccomp::Type::KIT))
         {
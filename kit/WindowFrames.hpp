@@ -0,0 +1,198 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <Rectangle.hpp>
+
+/// The last frames painted of the windows (dialogs, sidebar) of a view,
+/// as the client has them on its canvas, to send it only what changed.
+///
+/// A frame is kept per window and painted rectangle: the client asks for
+/// the same rectangles again, typically the whole window when it is
+/// invalidated. Painting another rectangle of a window updates the
+/// overlapping part of its other frames, so they stay what the client shows.
+class WindowFrames
+{
+public:
+    /// The damage is tracked in cells of this many pixels square.
+    static constexpr int CellSize = 32;
+
+    /// Above this, the damage is sent as its bounding rectangle.
+    static constexpr std::size_t MaxDamageRects = 8;
+
+    /// The frames kept per window, the most recently painted ones.
+    static constexpr std::size_t MaxFramesPerWindow = 4;
+
+    /// Keeps the @pixmap just painted for the rectangle @rect of the window
+    /// @winId, and returns what changed since the last paint of the same
+    /// rectangle, in rectangles relative to it: all of it, if there is none.
+    std::vector<Util::Rectangle> update(unsigned winId, const Util::Rectangle& rect,
+                                        double dpiScale, const std::vector<unsigned char>& pixmap)
+    {
+        std::list<Frame>& frames = _windows[winId];
+
+        auto previous = frames.end();
+        for (auto it = frames.begin(); it != frames.end();)
+        {
+            if (it->_dpiScale != dpiScale)
+            {
+                // The client has resized its canvas.
+                it = frames.erase(it);
+                continue;
+            }
+
+            if (sameRectangle(it->_rect, rect))
+                previous = it;
+            else
+                copyOverlap(rect, pixmap, *it);
+            ++it;
+        }
+
+        if (previous == frames.end())
+        {
+            frames.push_front(Frame{ rect, dpiScale, pixmap });
+            if (frames.size() > MaxFramesPerWindow)
+                frames.pop_back();
+
+            return { Util::Rectangle(0, 0, rect.getWidth(), rect.getHeight()) };
+        }
+
+        std::vector<Util::Rectangle> damage
+            = findDamage(previous->_pixels.data(), pixmap.data(), rect.getWidth(), rect.getHeight());
+        previous->_pixels = pixmap;
+        frames.splice(frames.begin(), frames, previous);
+        return damage;
+    }
+
+    /// Forgets the frames of the window @winId, when the client recreates its canvas.
+    void forget(unsigned winId) { _windows.erase(winId); }
+
+    void clear() { _windows.clear(); }
+
+    /// Compares two 32-bit pixel buffers of @width by @height pixels, and returns
+    /// the cells that differ, merged in rectangles.
+    static std::vector<Util::Rectangle> findDamage(const unsigned char* previous,
+                                                   const unsigned char* current, int width,
+                                                   int height)
+    {
+        std::vector<Util::Rectangle> damage;
+
+        // The rectangles that may grow down, as they end on the row above.
+        std::vector<std::size_t> open;
+        for (int cellY = 0; cellY < height; cellY += CellSize)
+        {
+            const int cellHeight = cellSize(cellY, height);
+            std::vector<std::size_t> next;
+            for (int cellX = 0; cellX < width;)
+            {
+                if (!cellDiffers(previous, current, width, cellX, cellY, cellHeight))
+                {
+                    cellX += CellSize;
+                    continue;
+                }
+
+                // A run of damaged cells on this row.
+                int runEnd = cellX + cellSize(cellX, width);
+                while (runEnd < width && cellDiffers(previous, current, width, runEnd, cellY, cellHeight))
+                    runEnd += cellSize(runEnd, width);
+
+                const auto it = std::find_if(open.begin(), open.end(), [&](std::size_t index) {
+                    return damage[index].getLeft() == cellX && damage[index].getRight() == runEnd;
+                });
+                if (it != open.end())
+                {
+                    damage[*it].setBottom(cellY + cellHeight);
+                    next.push_back(*it);
+                }
+                else
+                {
+                    damage.emplace_back(cellX, cellY, runEnd - cellX, cellHeight);
+                    next.push_back(damage.size() - 1);
+                }
+
+                cellX = runEnd;
+            }
+
+            open.swap(next);
+        }
+
+        if (damage.size() > MaxDamageRects)
+        {
+            Util::Rectangle bounds;
+            for (Util::Rectangle& rect : damage)
+                bounds.extend(rect);
+            damage.assign(1, bounds);
+        }
+
+        return damage;
+    }
+
+private:
+    struct Frame
+    {
+        Util::Rectangle _rect;
+        double _dpiScale;
+        std::vector<unsigned char> _pixels;
+    };
+
+    static bool sameRectangle(const Util::Rectangle& lhs, const Util::Rectangle& rhs)
+    {
+        return lhs.getLeft() == rhs.getLeft() && lhs.getTop() == rhs.getTop()
+               && lhs.getRight() == rhs.getRight() && lhs.getBottom() == rhs.getBottom();
+    }
+
+    /// The size of the cell at @start, clipped to @end.
+    static int cellSize(int start, int end) { return end - start < CellSize ? end - start : CellSize; }
+
+    static bool cellDiffers(const unsigned char* previous, const unsigned char* current,
+                            int width, int cellX, int cellY, int cellHeight)
+    {
+        const std::size_t rowBytes = cellSize(cellX, width) * 4;
+        for (int y = cellY; y < cellY + cellHeight; ++y)
+        {
+            const std::size_t offset = (static_cast<std::size_t>(y) * width + cellX) * 4;
+            if (std::memcmp(previous + offset, current + offset, rowBytes) != 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    /// Copies the part of the @pixmap painted for @rect that overlaps @frame into it.
+    static void copyOverlap(const Util::Rectangle& rect, const std::vector<unsigned char>& pixmap,
+                            Frame& frame)
+    {
+        const int left = std::max(rect.getLeft(), frame._rect.getLeft());
+        const int top = std::max(rect.getTop(), frame._rect.getTop());
+        const int right = std::min(rect.getRight(), frame._rect.getRight());
+        const int bottom = std::min(rect.getBottom(), frame._rect.getBottom());
+        if (left >= right || top >= bottom)
+            return;
+
+        const std::size_t rowBytes = static_cast<std::size_t>(right - left) * 4;
+        for (int y = top; y < bottom; ++y)
+        {
+            const std::size_t from
+                = (static_cast<std::size_t>(y - rect.getTop()) * rect.getWidth() + left - rect.getLeft()) * 4;
+            const std::size_t to = (static_cast<std::size_t>(y - frame._rect.getTop()) * frame._rect.getWidth()
+                                    + left - frame._rect.getLeft())
+                                   * 4;
+            std::memcpy(frame._pixels.data() + to, pixmap.data() + from, rowBytes);
+        }
+    }
+
+    std::map<unsigned, std::list<Frame>> _windows;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -1333,7 +1333,8 @@ L.Control.LokDialog = L.Control.extend({
 			}
 		}
 
-		ctx.drawImage(img, x, y);
+		if (img)
+			ctx.drawImage(img, x, y);
 
 		// if dialog is hidden, show it
 		if (container)
@@ -1352,7 +1353,7 @@ L.Control.LokDialog = L.Control.extend({
 		var id = parseInt(e.id);
 		var parentId = this._getParentId(id);
 		if (parentId) {
-			this._paintDialogChild(parentId, e.img);
+			this._paintDialogChild(parentId, e.rectangle, e.img);
 		} else {
 			this._paintDialog(id, e.rectangle, e.img);
 		}
@@ -1360,7 +1361,7 @@ L.Control.LokDialog = L.Control.extend({
 
 	// Dialog Child Methods
 
-	_paintDialogChild: function(parentId, img) {
+	_paintDialogChild: function(parentId, rectangle, img) {
 		var strId = this._toStrId(parentId);
 		var canvas = L.DomUtil.get(strId + '-floating');
 		if (!canvas)
@@ -1390,8 +1391,19 @@ L.Control.LokDialog = L.Control.extend({
 		this._setCanvasWidthHeight(canvas, this._dialogs[parentId].childwidth,
 			this._dialogs[parentId].childheight);
 
-		var ctx = canvas.getContext('2d');
-		ctx.drawImage(img, 0, 0);
+		// Only the damaged part may be painted, at its place.
+		if (img) {
+			var x = 0;
+			var y = 0;
+			if (rectangle) {
+				rectangle = rectangle.split(',');
+				x = parseInt(rectangle[0]);
+				y = parseInt(rectangle[1]);
+			}
+
+			var ctx = canvas.getContext('2d');
+			ctx.drawImage(img, x, y);
+		}
 		$(canvas).show();
 	},
 
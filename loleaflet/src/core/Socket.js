@@ -198,6 +198,10 @@ app.definitions.Socket = L.Class.extend({
 		if (window.deviceFormFactor) {
 			msg += ' deviceFormFactor=' + window.deviceFormFactor;
 		}
+		if (!window.ThisIsAMobileApp) {
+			// We can apply tile deltas, see CanvasTileLayer._applyDelta().
+			msg += ' deltas=true';
+		}
 		if (this._map.options.renderingOptions) {
 			var options = {
 				'rendering': this._map.options.renderingOptions
@@ -405,7 +409,6 @@ app.definitions.Socket = L.Class.extend({
 		else
 		{
 			var data = e.imgBytes.subarray(e.imgIndex);
-			console.assert(data.length == 0 || data[0] != 68 /* D */, 'Socket: got a delta image, not supported !');
 			img = 'data:image/png;base64,' + window.btoa(this._strFromUint8(data));
 			if (L.Browser.cypressTest && localStorage.getItem('image_validation_test')) {
 				if (!window.imgDatas)
@@ -434,9 +437,17 @@ app.definitions.Socket = L.Class.extend({
 		    !e.textMsg.startsWith('windowpaint:'))
 			return;
 
-		if (e.textMsg.indexOf(' nopng') !== -1)
+		if (e.textMsg.indexOf(' nopng') !== -1 || e.textMsg.indexOf(' unchanged') !== -1)
 			return;
 
+		if (e.textMsg.startsWith('tile:') && !window.ThisIsTheiOSApp &&
+		    e.imgBytes[e.imgIndex] === 68 /* D */) {
+			// A delta, to be applied to the tile we have; no image to load.
+			e.image = e.imgBytes.subarray(e.imgIndex);
+			e.imageIsComplete = true;
+			return;
+		}
+
 		var that = this;
 		var img = this._extractImage(e);
 		e.image = new Image();
@@ -1513,6 +1524,9 @@ app.definitions.Socket = L.Class.extend({
 			else if (tokens[i].startsWith('wid=')) {
 				command.wireId = this.getParameterValue(tokens[i]);
 			}
+			else if (tokens[i].startsWith('oldwid=')) {
+				command.oldWireId = this.getParameterValue(tokens[i]);
+			}
 			else if (tokens[i].substring(0, 6) === 'title=') {
 				command.title = tokens[i].substring(6);
 			}
@@ -1545,6 +1559,9 @@ app.definitions.Socket = L.Class.extend({
 			else if (tokens[i] === 'nopng') {
 				command.nopng = true;
 			}
+			else if (tokens[i] === 'unchanged') {
+				command.unchanged = true;
+			}
 			else if (tokens[i].startsWith('masterpagecount='))
 				command.masterPageCount = parseInt(tokens[i].substring(16));
 			else if (tokens[i].substring(0, 9) === 'username=') {
@@ -1367,7 +1367,8 @@ L.CanvasTileLayer = L.Layer.extend({
 		return true;
 	},
 
-	_sendTileCombineRequest: function(part, tilePositionsX, tilePositionsY) {
+	// tileWids are the wireIds of the tiles we have, to get deltas from those.
+	_sendTileCombineRequest: function(part, tilePositionsX, tilePositionsY, tileWids) {
 		var msg = 'tilecombine ' +
 			'nviewid=0 ' +
 			'part=' + part + ' ' +
@@ -1377,6 +1378,8 @@ L.CanvasTileLayer = L.Layer.extend({
 			'tileposy=' + tilePositionsY + ' ' +
 			'tilewidth=' + this._tileWidthTwips + ' ' +
 			'tileheight=' + this._tileHeightTwips;
+		if (tileWids)
+			msg += ' oldwid=' + tileWids;
 		app.socket.sendMessage(msg, '');
 	},
 
@@ -3122,6 +3125,18 @@ L.CanvasTileLayer = L.Layer.extend({
 		var command = app.socket.parseServerCmd(textMsg);
 
 		// app.socket.sendMessage('DEBUG _onDialogPaintMsg: hash=' + command.hash + ' img=' + typeof(img) + (typeof(img) == 'string' ? (' (length:' + img.length + ':"' + img.substring(0, 30) + (img.length > 30 ? '...' : '') + '")') : '') + ', cache size ' + this._pngCache.length);
+		if (command.unchanged) {
+			// We have it all already, the server sends only the damaged parts of windows.
+			this._map.fire('windowpaint', {
+				id: command.id,
+				img: null,
+				width: command.width,
+				height: command.height,
+				rectangle: command.rectangle
+			});
+			return;
+		}
+
 		if (command.nopng) {
 			var found = false;
 			for (var i = 0; i < this._pngCache.length; i++) {
@@ -6118,7 +6133,7 @@ L.CanvasTileLayer = L.Layer.extend({
 			}
 
 			twips = this._coordsToTwips(coords);
-			this._sendTileCombineRequest(coords.part, tilePositionsX, tilePositionsY);
+			this._sendTileCombineRequest(coords.part, tilePositionsX, tilePositionsY, tileWids);
 		}
 	},
 
@@ -6276,10 +6291,63 @@ L.CanvasTileLayer = L.Layer.extend({
 		}
 	},
 
+	// Applies a tile delta (see 'tile:' in wsd/protocol.txt) to the image we have
+	// for the tile, and returns the updated image; or null if we don't have the
+	// version the delta is based on.
+	_applyTileDelta: function (tile, oldWireId, delta) {
+		if (!tile.loaded || !tile.el || tile.wireId !== oldWireId)
+			return null;
+
+		var width = tile.el.width;
+		var height = tile.el.height;
+		var canvas = document.createElement('canvas');
+		canvas.width = width;
+		canvas.height = height;
+		var ctx = canvas.getContext('2d');
+		ctx.drawImage(tile.el, 0, 0);
+
+		var old = ctx.getImageData(0, 0, width, height).data;
+		var imgData = ctx.createImageData(width, height);
+		var pixels = imgData.data;
+		pixels.set(old);
+
+		var rowBytes = width * 4;
+		for (var i = 1; i < delta.length;) {
+			if (delta[i] === 99 /* c */) {
+				// Copy rows of the old tile.
+				var count = delta[i + 1];
+				var src = delta[i + 2];
+				var dest = delta[i + 3];
+				for (var row = 0; row < count; ++row) {
+					var srcRow = (src + row) % height;
+					pixels.set(old.subarray(srcRow * rowBytes, (srcRow + 1) * rowBytes), (dest + row) * rowBytes);
+				}
+				i += 4;
+			}
+			else if (delta[i] === 100 /* d */) {
+				// New pixels.
+				var y = delta[i + 1];
+				var x = delta[i + 2];
+				var length = delta[i + 3] * 4;
+				pixels.set(delta.subarray(i + 4, i + 4 + length), y * rowBytes + x * 4);
+				i += 4 + length;
+			}
+			else {
+				console.error('Unknown tile delta operation: ' + delta[i]);
+				return null;
+			}
+		}
+
+		ctx.putImageData(imgData, 0, 0);
+		return canvas;
+	},
+
 	_onTileMsgFileBasedView: function (textMsg, img) {
 		var tileMsgObj = app.socket.parseServerCmd(textMsg);
 		var coords = this._tileMsgToCoords(tileMsgObj);
 		var tile = this._tiles[this._tileCoordsToKey(coords)];
+		if (tile && img instanceof Uint8Array)
+			img = this._applyTileDelta(tile, tileMsgObj.oldWireId, img);
 
 		if (tileMsgObj.id !== undefined) {
 			this._map.fire('tilepreview', {
@@ -6291,6 +6359,10 @@ L.CanvasTileLayer = L.Layer.extend({
 				docType: this._docType
 			});
 		}
+		else if (tile && !img) {
+			// We don't have the tile the delta is based on, ask for all of it.
+			this._sendTileCombineRequest(tileMsgObj.part, tileMsgObj.x, tileMsgObj.y);
+		}
 		else if (tile) {
 			if (tile._invalidCount > 0) {
 				tile._invalidCount -= 1;
@@ -6318,6 +6390,8 @@ L.CanvasTileLayer = L.Layer.extend({
 		var coords = this._tileMsgToCoords(tileMsgObj);
 		var key = this._tileCoordsToKey(coords);
 		var tile = this._tiles[key];
+		if (tile && img instanceof Uint8Array)
+			img = this._applyTileDelta(tile, tileMsgObj.oldWireId, img);
 		if (this._debug && tile) {
 			if (tile._debugLoadCount) {
 				tile._debugLoadCount++;
@@ -6360,6 +6434,10 @@ L.CanvasTileLayer = L.Layer.extend({
 				docType: this._docType
 			});
 		}
+		else if (tile && !img) {
+			// We don't have the tile the delta is based on, ask for all of it.
+			this._sendTileCombineRequest(tileMsgObj.part, tileMsgObj.x, tileMsgObj.y);
+		}
 		else if (tile) {
 			if (this._tiles[key]._invalidCount > 0) {
 				this._tiles[key]._invalidCount -= 1;
@@ -8,22 +8,49 @@
 #pragma once
 
 #include <assert.h>
+#include <sys/uio.h>
+#include <deque>
+#include <memory>
 #include <ostream>
 #include <vector>
 
 #include <Util.hpp>
 
-// Blocks -> we can share from client -> server ... etc.
-// headers / and a 'writeV' etc. =)
-
 /**
  * Encapsulate data we need to write.
+ *
+ * Appended data is copied into a contiguous block of our own,
+ * unless it is shared data, which is only referenced and sent
+ * as-is, avoiding copies of large payloads (eg. tiles).
  */
 class Buffer
 {
+public:
+    /// Data that is shared with its producer, and must not change once appended.
+    typedef std::shared_ptr<const std::vector<char>> SharedBlock;
+
+    /// Keeps data owned elsewhere alive, and unchanged, while it is queued.
+    typedef std::shared_ptr<const void> Owner;
+
+private:
+    /// Either our own copy of the data, or a reference to shared data.
+    struct Block
+    {
+        Block() : _data(nullptr), _size(0) {}
+
+        std::vector<char> _owned;
+        Owner _owner;
+        const char* _data;
+        std::size_t _size;
+
+        const char* data() const { return _owner ? _data : _owned.data(); }
+        std::size_t size() const { return _owner ? _size : _owned.size(); }
+    };
+
     std::size_t _size;
+    /// Offset into the first block.
     std::size_t _offset;
-    std::vector<char> _buffer;
+    std::deque<Block> _blocks;
 
 public:
     Buffer() : _size(0), _offset(0)
@@ -33,16 +60,42 @@ public:
     std::size_t size() const { return _size; }
     bool empty() const { return _size == 0; }
 
+    /// The first contiguous block of data.
     const char *getBlock() const
     {
         if (_size)
-            return &_buffer[_offset];
+            return _blocks.front().data() + _offset;
         return nullptr;
     }
 
     std::size_t getBlockSize() const
     {
-        return _size;
+        if (_size)
+            return _blocks.front().size() - _offset;
+        return 0;
+    }
+
+    /// Fill @iov with up to @maxCount blocks covering at most @maxBytes.
+    /// Returns the number of entries filled.
+    int getIOVec(iovec *iov, const int maxCount, std::size_t maxBytes) const
+    {
+        int count = 0;
+        std::size_t offset = _offset;
+        for (auto it = _blocks.begin(); it != _blocks.end() && count < maxCount && maxBytes > 0; ++it)
+        {
+            const std::size_t len = std::min(it->size() - offset, maxBytes);
+            if (len > 0)
+            {
+                iov[count].iov_base = const_cast<char*>(it->data() + offset);
+                iov[count].iov_len = len;
+                maxBytes -= len;
+                ++count;
+            }
+
+            offset = 0;
+        }
+
+        return count;
     }
 
     void eraseFirst(std::size_t len)
@@ -50,31 +103,53 @@ public:
         if (len <= 0)
             return;
 
-        assert(_offset + len <= _buffer.size());
-        assert(_offset + _size == _buffer.size());
+        assert(len <= _size);
 
         len = std::min(len, _size); // Avoid accidental damage.
 
-        // avoid regular shuffling down larger chunks of data
-        if (_buffer.size() > 16384 && // lots of queued data
-            len < _buffer.size() &&   // not a complete erase
-            _offset < 16384 * 64 &&   // do cleanup a Mb at a time or so:
-            _size > 512)              // early cleanup if what remains is small.
+        while (len > 0)
         {
-            _offset += len;
+            Block& first = _blocks.front();
+            const std::size_t blockSize = first.size();
+            const std::size_t remaining = blockSize - _offset;
+            if (len >= remaining)
+            {
+                _blocks.pop_front();
+                _offset = 0;
+                _size -= remaining;
+                len -= remaining;
+                continue;
+            }
+
+            // avoid regular shuffling down larger chunks of data
+            if (first._owner ||
+                (blockSize > 16384 &&   // lots of queued data
+                 _offset < 16384 * 64 && // do cleanup a Mb at a time or so:
+                 remaining > 512))       // early cleanup if what remains is small.
+            {
+                _offset += len;
+                _size -= len;
+                return;
+            }
+
+            first._owned.erase(first._owned.begin(), first._owned.begin() + _offset + len);
+            _offset = 0;
             _size -= len;
             return;
         }
-
-        _buffer.erase(_buffer.begin(), _buffer.begin() + _offset + len);
-        _offset = 0;
-        _size = _buffer.size();
     }
 
     void append(const char *data, const int len)
     {
-        _buffer.insert(_buffer.end(), data, data + len);
-        _size = _buffer.size() - _offset;
+        if (len <= 0)
+            return;
+
+        if (_blocks.empty() || _blocks.back()._owner)
+            _blocks.emplace_back();
+
+        std::vector<char>& last = _blocks.back()._owned;
+        last.insert(last.end(), data, data + len);
+        _size += len;
     }
 
     void append(const std::string& s) { append(s.c_str(), s.size()); }
@@ -86,12 +161,37 @@ public:
         append(s, N - 1); // Minus null termination.
     }
 
+    /// Append shared data without copying it.
+    void append(const SharedBlock& block)
+    {
+        if (block)
+            append(block->data(), block->size(), block);
+    }
+
+    /// Append @len bytes at @data, kept alive by @owner, without copying them.
+    void append(const char* data, std::size_t len, Owner owner)
+    {
+        assert(owner && "Referenced data needs an owner");
+        if (len == 0)
+            return;
+
+        _blocks.emplace_back();
+        _blocks.back()._owner = std::move(owner);
+        _blocks.back()._data = data;
+        _blocks.back()._size = len;
+        _size += len;
+    }
+
     void dumpHex(std::ostream &os, const char *legend, const char *prefix) const
     {
         if (_size > 0 || _offset > 0)
-            os << prefix << "Buffer size: " << _size << " offset: " << _offset << '\n';
-        if (_buffer.size() > 0)
-            Util::dumpHex(os, _buffer, legend, prefix);
+            os << prefix << "Buffer size: " << _size << " offset: " << _offset
+               << " blocks: " << _blocks.size() << '\n';
+        for (const Block& block : _blocks)
+        {
+            if (block.size() > 0)
+                Util::dumpHex(os, std::string(block.data(), block.size()), legend, prefix);
+        }
     }
 };
 
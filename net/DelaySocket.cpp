@@ -98,6 +98,7 @@ public:
     void pushCloseChunk()
     {
         _chunks.push_back(std::make_shared<WriteChunk>(_delayMs));
+        pollEventsChanged();
     }
 
     void changeState(State newState)
@@ -146,7 +147,10 @@ public:
                           << " to queue: " << _chunks.size() << '\n');
                 chunk->getData().insert(chunk->getData().end(), &buf[0], &buf[len]);
                 if (_dest)
+                {
                     _dest->_chunks.push_back(chunk);
+                    _dest->pollEventsChanged();
+                }
                 else
                     assert("no destination for data" && false);
             }
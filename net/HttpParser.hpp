@@ -0,0 +1,331 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+#include "Util.hpp"
+
+namespace http
+{
+/// A token in a parsed buffer, as its offset and length.
+/// Offsets, rather than pointers, survive the buffer growing.
+struct Span
+{
+    Span()
+        : _offset(0)
+        , _length(0)
+    {
+    }
+
+    Span(std::size_t offset, std::size_t length)
+        : _offset(offset)
+        , _length(length)
+    {
+    }
+
+    bool empty() const { return _length == 0; }
+
+    const char* data(const char* p) const { return p + _offset; }
+
+    std::string toString(const char* p) const { return std::string(p + _offset, _length); }
+
+    /// Case-insensitive comparison with @rhs.
+    template <std::size_t N> bool iequal(const char* p, const char (&rhs)[N]) const
+    {
+        return Util::iequal(p + _offset, _length, rhs, N - 1); // Minus null termination.
+    }
+
+    std::size_t _offset;
+    std::size_t _length;
+};
+
+/// An incremental, allocation-free parser of the request line and the
+/// header of incoming (server-side) HTTP requests.
+///
+/// The parser keeps its state across partial reads: every call resumes at
+/// the first line that wasn't complete the previous time, so a header
+/// arriving in many packets is scanned once. The fields are only recorded
+/// as Spans into the caller's buffer, which must keep the data parsed so
+/// far at the same offsets until reset() is called.
+class RequestParser
+{
+public:
+    static constexpr int MaxNumberFields = 128; // Same limits as http::Header.
+    static constexpr std::size_t MaxNameLen = 512;
+    static constexpr std::size_t MaxValueLen = 9 * 1024;
+    static constexpr std::size_t MaxRequestLineLen = 16 * 1024;
+
+    enum class State
+    {
+        Incomplete, //< Need more data.
+        Complete, //< The header, up to and including the blank line, is parsed.
+        Invalid //< Malformed or over the limits; won't recover with more data.
+    };
+
+    /// A header field.
+    struct Field
+    {
+        Span _name;
+        Span _value;
+    };
+
+    RequestParser() { reset(); }
+
+    /// Forget everything parsed, to parse a new request.
+    void reset()
+    {
+        _state = State::Incomplete;
+        _offset = 0;
+        _verb = _url = _version = Span();
+        _fieldCount = 0;
+        _contentLength = -1;
+        _chunked = false;
+        _expectContinue = false;
+    }
+
+    /// Parses the @len bytes at @p, which start with the same data given in
+    /// the previous calls since reset(), followed by any newly received data.
+    State parse(const char* p, std::size_t len)
+    {
+        if (len < _offset)
+        {
+            // The buffer was consumed under our feet; start over.
+            reset();
+        }
+
+        if (_state != State::Incomplete)
+            return _state;
+
+        while (_offset < len)
+        {
+            const char* lineStart = p + _offset;
+            const char* lf = static_cast<const char*>(std::memchr(lineStart, '\n', len - _offset));
+            if (lf == nullptr)
+            {
+                const std::size_t limit
+                    = _version.empty() ? MaxRequestLineLen : MaxNameLen + MaxValueLen + 2;
+                if (len - _offset > limit)
+                    return (_state = State::Invalid);
+
+                return State::Incomplete;
+            }
+
+            std::size_t lineLen = lf - lineStart;
+            if (lineLen > 0 && lineStart[lineLen - 1] == '\r')
+                --lineLen;
+
+            const std::size_t next = (lf - p) + 1;
+            if (_version.empty())
+            {
+                // Servers ought to ignore empty lines before the request line.
+                if (lineLen > 0 && !parseRequestLine(_offset, lineStart, lineLen))
+                    return (_state = State::Invalid);
+            }
+            else if (lineLen == 0)
+            {
+                _offset = next;
+                return (_state = State::Complete);
+            }
+            else if (!parseField(p, _offset, lineLen))
+            {
+                return (_state = State::Invalid);
+            }
+
+            _offset = next;
+        }
+
+        return State::Incomplete;
+    }
+
+    State state() const { return _state; }
+
+    /// The size of the request line and header, including the blank line, once Complete.
+    std::size_t headerSize() const { return _offset; }
+
+    const Span& verb() const { return _verb; }
+    const Span& url() const { return _url; }
+    const Span& version() const { return _version; }
+
+    int getFieldCount() const { return _fieldCount; }
+    const Field& getField(int index) const
+    {
+        assert(index >= 0 && index < _fieldCount && "Field index out of range");
+        return _fields[index];
+    }
+
+    /// Finds the value of the first field called @name (case insensitive).
+    template <std::size_t N> bool find(const char* p, const char (&name)[N], Span& value) const
+    {
+        for (int i = 0; i < _fieldCount; ++i)
+        {
+            if (_fields[i]._name.iequal(p, name))
+            {
+                value = _fields[i]._value;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// The Content-Length, or -1 when there is none.
+    int64_t getContentLength() const { return _contentLength; }
+
+    /// True iff the Transfer-Encoding is chunked.
+    bool getChunkedTransferEncoding() const { return _chunked; }
+
+    /// True iff the client expects a 100-continue before sending the body.
+    bool getExpectContinue() const { return _expectContinue; }
+
+private:
+    static bool isToken(char ch)
+    {
+        return ch > ' ' && ch < 127;
+    }
+
+    static bool isSpace(char ch) { return ch == ' ' || ch == '\t'; }
+
+    /// Parses "VERB URL HTTP/x.y".
+    bool parseRequestLine(std::size_t offset, const char* line, std::size_t len)
+    {
+        std::size_t pos = 0;
+        while (pos < len && isToken(line[pos]))
+            ++pos;
+        if (pos == 0 || pos == len || line[pos] != ' ')
+            return false;
+        _verb = Span(offset, pos);
+
+        const std::size_t urlStart = ++pos;
+        while (pos < len && isToken(line[pos]))
+            ++pos;
+        if (pos == urlStart || pos == len || line[pos] != ' ')
+            return false;
+        _url = Span(offset + urlStart, pos - urlStart);
+
+        const std::size_t versionStart = ++pos;
+        constexpr std::size_t VersionLen = sizeof("HTTP/1.1") - 1;
+        const char* version = line + versionStart;
+        if (len - versionStart != VersionLen || std::memcmp(version, "HTTP/", 5) != 0
+            || version[5] < '0' || version[5] > '9' || version[6] != '.' || version[7] < '0'
+            || version[7] > '9')
+            return false;
+
+        _version = Span(offset + versionStart, VersionLen);
+        return true;
+    }
+
+    /// Parses "Name: value", with optional whitespace around the value.
+    bool parseField(const char* p, std::size_t offset, std::size_t len)
+    {
+        if (_fieldCount >= MaxNumberFields)
+            return false;
+
+        const char* line = p + offset;
+
+        // Folded (obsolete line-continuation) fields may be rejected (rfc7230 3.2.4).
+        if (isSpace(line[0]))
+            return false;
+
+        const char* colon = static_cast<const char*>(std::memchr(line, ':', len));
+        if (colon == nullptr)
+            return false;
+
+        const std::size_t nameLen = colon - line;
+        if (nameLen == 0 || nameLen > MaxNameLen)
+            return false;
+
+        for (std::size_t i = 0; i < nameLen; ++i)
+        {
+            // No whitespace is allowed between the name and the colon.
+            if (!isToken(line[i]))
+                return false;
+        }
+
+        std::size_t start = nameLen + 1;
+        while (start < len && isSpace(line[start]))
+            ++start;
+        std::size_t end = len;
+        while (end > start && isSpace(line[end - 1]))
+            --end;
+
+        if (end - start > MaxValueLen)
+            return false;
+
+        Field& field = _fields[_fieldCount++];
+        field._name = Span(offset, nameLen);
+        field._value = Span(offset + start, end - start);
+
+        // Keep the fields that frame the message at hand.
+        if (field._name.iequal(p, "Content-Length"))
+        {
+            if (field._value.empty() || field._value._length > 18)
+                return false;
+
+            int64_t contentLength = 0;
+            for (std::size_t i = 0; i < field._value._length; ++i)
+            {
+                const char ch = p[field._value._offset + i];
+                if (ch < '0' || ch > '9')
+                    return false;
+                contentLength = contentLength * 10 + (ch - '0');
+            }
+
+            // Conflicting lengths are a request-smuggling vector (rfc7230 3.3.3).
+            if (_contentLength >= 0 && _contentLength != contentLength)
+                return false;
+
+            _contentLength = contentLength;
+        }
+        else if (field._name.iequal(p, "Transfer-Encoding"))
+        {
+            _chunked = field._value.iequal(p, "chunked");
+        }
+        else if (field._name.iequal(p, "Expect"))
+        {
+            _expectContinue = field._value.iequal(p, "100-continue");
+        }
+
+        return true;
+    }
+
+    State _state;
+    /// Where the next line to parse starts.
+    std::size_t _offset;
+    Span _verb;
+    Span _url;
+    Span _version;
+    Field _fields[MaxNumberFields];
+    int _fieldCount;
+    int64_t _contentLength;
+    bool _chunked;
+    bool _expectContinue;
+};
+
+} // namespace http
+
+inline std::ostream& operator<<(std::ostream& os, const http::RequestParser::State& state)
+{
+    switch (state)
+    {
+        case http::RequestParser::State::Incomplete:
+            return os << "Incomplete";
+        case http::RequestParser::State::Complete:
+            return os << "Complete";
+        case http::RequestParser::State::Invalid:
+            return os << "Invalid";
+    }
+
+    return os;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
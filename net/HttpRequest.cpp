@@ -20,7 +20,9 @@
 #include <stdexcept>
 #include <string>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <unistd.h>
 
 #include "Common.hpp"
 #include <utility>
@@ -405,9 +407,17 @@ int64_t Request::readData(const char* p, const int64_t len)
             // A payload in a GET request "has no defined semantics".
             return len - available;
         }
+        else if (_verb == VERB_POST)
+        {
+            if (read == 0)
+                return 0; // Incomplete header.
+
+            // The body, of the Content-Length, is left to the caller.
+            return len - available;
+        }
         else
         {
-            // TODO: Implement POST and HEAD support.
+            // TODO: Implement HEAD support.
             LOG_ERR("Unsupported HTTP Method [" << _verb << ']');
             return -1;
         }
@@ -643,6 +653,55 @@ int64_t Response::readData(const char* p, int64_t len)
     return len - available;
 }
 
+bool Response::writeBodyFile(const char* p, int64_t len)
+{
+    if (_bodyFd < 0)
+        return false;
+
+    if (len > 0 && _bodyFileBuffer.size() + static_cast<std::size_t>(len) <= BodyFileBufferSize)
+    {
+        if (_bodyFileBuffer.capacity() == 0)
+            _bodyFileBuffer.reserve(BodyFileBufferSize);
+
+        _bodyFileBuffer.insert(_bodyFileBuffer.end(), p, p + len);
+        return true;
+    }
+
+    // Write what is buffered and the new data in one go,
+    // without copying the latter.
+    iovec iov[2];
+    iov[0].iov_base = _bodyFileBuffer.data();
+    iov[0].iov_len = _bodyFileBuffer.size();
+    iov[1].iov_base = const_cast<char*>(p);
+    iov[1].iov_len = len;
+    while (iov[0].iov_len + iov[1].iov_len > 0)
+    {
+        const int first = iov[0].iov_len > 0 ? 0 : 1;
+        const ssize_t wrote = ::writev(_bodyFd, iov + first, 2 - first);
+        if (wrote <= 0)
+        {
+            if (wrote < 0 && errno == EINTR)
+                continue;
+
+            LOG_SYS("Failed to write " << iov[0].iov_len + iov[1].iov_len
+                                       << " bytes of the response body to file");
+            return false;
+        }
+
+        std::size_t left = wrote;
+        for (iovec& vec : iov)
+        {
+            const std::size_t done = std::min(left, vec.iov_len);
+            vec.iov_base = static_cast<char*>(vec.iov_base) + done;
+            vec.iov_len -= done;
+            left -= done;
+        }
+    }
+
+    _bodyFileBuffer.clear();
+    return true;
+}
+
 std::shared_ptr<Session> Session::create(std::string host, Protocol protocol, int port)
 {
     std::string scheme;
@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
 #include <iostream>
@@ -14,9 +16,12 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
+#include <unistd.h>
 
 #include "Common.hpp"
 #include "NetUtil.hpp"
@@ -441,6 +446,8 @@ public:
         , _verb(std::move(verb))
         , _version(std::move(version))
         , _bodyReaderCb([](const char*, int64_t) { return 0; })
+        , _bodyFileOffset(0)
+        , _bodyFileSize(0)
         , _stage(Stage::Header)
     {
     }
@@ -483,78 +490,125 @@ public:
     {
         _header.setContentLength(size);
         _bodyReaderCb = std::move(bodyReaderCb);
+        _bodyFile.reset();
     }
 
     /// Set the file to send as the body of the request.
+    /// Unencrypted sockets, and those encrypted by the kernel, send it with
+    /// sendfile(2), straight from the page cache; otherwise it's read in
+    /// chunks bounded by the socket buffer.
     void setBodyFile(const std::string& path)
     {
-        //FIXME: use generalized lambda capture to move the ifstream, available in C++14.
-        auto ifs = std::make_shared<std::ifstream>(path, std::ios::binary);
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0)
+        {
+            LOG_SYS("Failed to open [" << path << "] to send as the request body");
+            if (fd >= 0)
+                ::close(fd);
 
-        ifs->seekg(0, std::ios_base::end);
-        const int64_t size = ifs->tellg();
-        ifs->seekg(0, std::ios_base::beg);
+            // Fail the request when sending the body.
+            setBodySource([](char*, int64_t) { return -1; }, 0);
+            return;
+        }
 
-        setBodySource(
-            [=](char* buf, int64_t len) -> int64_t
-            {
-                ifs->read(buf, len);
-                return ifs->gcount();
-            },
-            size);
+        if (st.st_size == 0)
+        {
+            ::close(fd);
+            setBodySource([](char*, int64_t) { return 0; }, 0);
+            return;
+        }
+
+        _header.setContentLength(st.st_size);
+        _bodyFile = std::make_shared<BodyFile>(fd);
+        _bodyFileOffset = 0;
+        _bodyFileSize = st.st_size;
     }
 
-    Stage stage() const { return _stage; }
+    /// The descriptor of the file set by setBodyFile, or -1.
+    int getBodyFd() const { return _bodyFile ? _bodyFile->_fd : -1; }
 
-    bool writeData(Buffer& out, std::size_t capacity)
+    /// The offset in the body file of the next bytes to send.
+    int64_t getBodyFileOffset() const { return _bodyFileOffset; }
+
+    /// The number of bytes of the body file left to send.
+    int64_t getBodyFileRemaining() const { return _bodyFileSize - _bodyFileOffset; }
+
+    /// Records that @len bytes of the body file were sent
+    /// by the socket directly, rather than with writeBody.
+    void bodyFileSent(int64_t len)
     {
-        if (_stage == Stage::Header)
+        _bodyFileOffset += len;
+        if (_bodyFileOffset >= _bodyFileSize)
         {
-            LOG_TRC("performWrites (request header).");
+            LOG_TRC("performWrites (request body): finished, total: " << _bodyFileOffset);
+            _stage = Stage::Finished;
+        }
+    }
 
-            out.append(getVerb());
-            out.append(" ");
-            out.append(getUrl());
-            out.append(" ");
-            out.append(getVersion());
-            out.append("\r\n");
+    Stage stage() const { return _stage; }
 
-            _header.writeData(out);
-            out.append("\r\n"); // End the header.
+    /// Serializes the request line and the header.
+    void writeHeader(Buffer& out)
+    {
+        LOG_TRC("performWrites (request header).");
 
-            _stage = Stage::Body;
-        }
+        out.append(getVerb());
+        out.append(" ");
+        out.append(getUrl());
+        out.append(" ");
+        out.append(getVersion());
+        out.append("\r\n");
 
-        if (_stage == Stage::Body)
+        _header.writeData(out);
+        out.append("\r\n"); // End the header.
+
+        _stage = Stage::Body;
+    }
+
+    /// Appends about @capacity bytes of the body, if any is left.
+    /// Returns false when the body can't be read.
+    bool writeBody(Buffer& out, std::size_t capacity)
+    {
+        LOG_TRC("performWrites (request body).");
+
+        // Get the data to write into the socket
+        // from the client's callback. This is
+        // used to upload files, or other data.
+        char buffer[64 * 1024];
+        std::size_t wrote = 0;
+        do
         {
-            LOG_TRC("performWrites (request body).");
-
-            // Get the data to write into the socket
-            // from the client's callback. This is
-            // used to upload files, or other data.
-            char buffer[64 * 1024];
-            std::size_t wrote = 0;
-            do
+            const int64_t read = _bodyFile ? readBodyFile(buffer, sizeof(buffer))
+                                           : _bodyReaderCb(buffer, sizeof(buffer));
+            if (read < 0)
             {
-                const int64_t read = _bodyReaderCb(buffer, sizeof(buffer));
-                if (read < 0)
-                {
-                    LOG_ERR("Error reading the data to send as the HTTP request body: " << read);
-                    return false;
-                }
-
-                if (read == 0)
-                {
-                    LOG_TRC("performWrites (request body): finished, total: " << wrote);
-                    _stage = Stage::Finished;
-                    return true;
-                }
-
-                out.append(buffer, read);
-                wrote += read;
-                LOG_TRC("performWrites (request body): " << read << " bytes, total: " << wrote);
-            } while (wrote < capacity);
-        }
+                LOG_ERR("Error reading the data to send as the HTTP request body: " << read);
+                return false;
+            }
+
+            if (read == 0)
+            {
+                LOG_TRC("performWrites (request body): finished, total: " << wrote);
+                _stage = Stage::Finished;
+                return true;
+            }
+
+            out.append(buffer, read);
+            wrote += read;
+            LOG_TRC("performWrites (request body): " << read << " bytes, total: " << wrote);
+        } while (wrote < capacity);
+
+        return true;
+    }
+
+    bool writeData(Buffer& out, std::size_t capacity)
+    {
+        if (_stage == Stage::Header)
+            writeHeader(out);
+
+        if (_stage == Stage::Body)
+            return writeBody(out, capacity);
 
         return true;
     }
@@ -570,6 +624,47 @@ private:
     std::string _verb; //< Used as-is, but only POST supported.
     std::string _version; //< The protocol version, currently 1.1.
     IoReadFunc _bodyReaderCb;
+
+    /// Closes the body file once the last copy of the request is done with it.
+    struct BodyFile
+    {
+        explicit BodyFile(int fd)
+            : _fd(fd)
+        {
+        }
+
+        ~BodyFile() { ::close(_fd); }
+
+        const int _fd;
+    };
+
+    /// Reads the next bytes of the body file. The offset is ours,
+    /// as the file is shared by the copies of the request.
+    int64_t readBodyFile(char* buf, int64_t len)
+    {
+        len = std::min(len, getBodyFileRemaining());
+        if (len == 0)
+            return 0;
+
+        ssize_t read;
+        while ((read = ::pread(_bodyFile->_fd, buf, len, _bodyFileOffset)) < 0 && errno == EINTR)
+            ;
+
+        if (read == 0)
+        {
+            LOG_ERR("The request body file is shorter than its Content-Length of "
+                    << _bodyFileSize);
+            return -1;
+        }
+
+        if (read > 0)
+            _bodyFileOffset += read;
+        return read;
+    }
+
+    std::shared_ptr<BodyFile> _bodyFile; //< Set by setBodyFile, sent as-is.
+    int64_t _bodyFileOffset;
+    int64_t _bodyFileSize;
     Stage _stage;
 };
 
@@ -670,12 +765,16 @@ class Response final
 public:
     using FinishedCallback = std::function<void()>;
 
+    /// Writes of the body to file smaller than this are gathered.
+    static constexpr std::size_t BodyFileBufferSize = 256 * 1024;
+
     /// A response received from a server.
     /// Used for parsing an incoming response.
     Response(FinishedCallback finishedCallback)
         : _state(State::New)
         , _parserStage(ParserStage::StatusLine)
         , _recvBodySize(0)
+        , _bodyFd(-1)
         , _finishedCallback(std::move(finishedCallback))
     {
         // By default we store the body in memory.
@@ -693,11 +792,24 @@ public:
     /// Used for generating an outgoing response.
     Response(StatusLine statusLineObj)
         : _statusLine(std::move(statusLineObj))
+        , _bodyFd(-1)
     {
         _header.add("Date", Util::getHttpTimeNow());
         _header.add("Server", HTTP_SERVER_STRING);
     }
 
+    ~Response()
+    {
+        if (_bodyFd >= 0)
+            ::close(_bodyFd);
+    }
+
+    /// Owns _bodyFd, which mustn't be closed twice.
+    Response(const Response&) = delete;
+    Response& operator=(const Response&) = delete;
+    Response(Response&&) = delete;
+    Response& operator=(Response&&) = delete;
+
     /// The state of an incoming response, when parsing.
     enum class State
     {
@@ -737,15 +849,22 @@ public:
     /// If the server responds with a non-success status code (i.e. not 2xx)
     /// the body is redirected to memory to be read via getBody().
     /// Check the statusLine().statusCategory() for the status code.
+    /// The body is written from the socket's input buffer straight to the
+    /// file; small reads are gathered in a buffer of BodyFileBufferSize first.
     void saveBodyToFile(const std::string& path)
     {
-        _bodyFile.open(path, std::ios_base::out | std::ios_base::binary);
+        if (_bodyFd >= 0)
+            ::close(_bodyFd);
+
+        _bodyFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (_bodyFd < 0)
+            LOG_SYS("Failed to create [" << path << "] to save the response body");
+
+        _bodyFileBuffer.clear();
         _onBodyWriteCb = [this](const char* p, int64_t len)
         {
             LOG_TRC("Writing " << len << " bytes.");
-            if (_bodyFile.good())
-                _bodyFile.write(p, len);
-            return _bodyFile.good() ? len : -1;
+            return writeBodyFile(p, len) ? len : -1;
         };
     }
 
@@ -831,13 +950,28 @@ private:
         if (!done())
         {
             LOG_TRC("Finishing");
-            _bodyFile.close();
+            if (_bodyFd >= 0)
+            {
+                if (!flushBodyFile() && newState == State::Complete)
+                    newState = State::Error;
+
+                ::close(_bodyFd);
+                _bodyFd = -1;
+            }
+
             _state = newState;
             if (_finishedCallback)
                 _finishedCallback();
         }
     }
 
+    /// Writes @len bytes at @p to the body file, after those buffered.
+    /// Returns false on error.
+    bool writeBodyFile(const char* p, int64_t len);
+
+    /// Writes out the buffered bytes of the body file. Returns false on error.
+    bool flushBodyFile() { return writeBodyFile(nullptr, 0); }
+
     /// The stage we're at in consuming the received data.
     enum class ParserStage
     {
@@ -853,7 +987,8 @@ private:
     ParserStage _parserStage; //< The parser's state.
     int64_t _recvBodySize; //< The amount of data we received (compared to the Content-Length).
     std::string _body; //< Used when _bodyHandling is InMemory.
-    std::ofstream _bodyFile; //< Used when _bodyHandling is OnDisk.
+    int _bodyFd; //< Used when _bodyHandling is OnDisk.
+    std::vector<char> _bodyFileBuffer; //< The small writes gathered for _bodyFd.
     IoWriteFunc _onBodyWriteCb; //< Used to handling body receipt in all cases.
     FinishedCallback _finishedCallback; //< Called when response is finished.
 };
@@ -995,6 +1130,24 @@ public:
     /// regardless of the reason (error, timeout, completion).
     void setFinishedHandler(FinishedCallback onFinished) { _onFinished = std::move(onFinished); }
 
+    /// The onRelease callback handler signature.
+    using ReleaseCallback = std::function<void(const std::shared_ptr<Session>& session,
+                                               const std::shared_ptr<StreamSocket>& socket)>;
+
+    /// Set a callback to keep the connection alive after a request.
+    /// onRelease is triggered, in the poll thread, when a response has
+    /// completed and neither side asked to close the connection. The
+    /// socket is out of its SocketPoll then, to be reused via reuseSocket.
+    void setReleaseHandler(ReleaseCallback onRelease) { _onRelease = std::move(onRelease); }
+
+    /// Reuse the connection released earlier, kept alive on @socket.
+    /// It is inserted into the SocketPoll of the next request.
+    void reuseSocket(std::shared_ptr<StreamSocket> socket)
+    {
+        assert(isConnected() && _socket.lock() == socket && "Reusing a foreign socket.");
+        _idleSocket = std::move(socket);
+    }
+
     /// Make a synchronous request to download a file to the given path.
     /// Note: when the server returns an error, the response body,
     /// if any, will be stored in memory and can be read via getBody().
@@ -1010,8 +1163,10 @@ public:
         if (!saveToFilePath.empty())
             _response->saveBodyToFile(saveToFilePath);
 
+        // Once complete, the session may be released and reused elsewhere.
+        const std::shared_ptr<const Response> response = _response;
         syncRequestImpl(poller);
-        return _response;
+        return response;
     }
 
     /// Make a synchronous request to download a file to the given path.
@@ -1030,8 +1185,11 @@ public:
                                 << req.getUrl());
 
         newRequest(req);
+
+        // Once complete, the session may be released and reused elsewhere.
+        const std::shared_ptr<const Response> response = _response;
         syncRequestImpl(poller);
-        return _response;
+        return response;
     }
 
     /// Make a synchronous request.
@@ -1071,8 +1229,35 @@ public:
                                  << req.getUrl());
 
         newRequest(req);
+        return asyncRequestImpl(poll);
+    }
 
-        if (!isConnected())
+    /// Start an asynchronous request to download a file to the given path.
+    /// As with syncDownload, when the server returns an error, the response
+    /// body, if any, will be stored in memory and can be read via getBody().
+    bool asyncDownload(const Request& req, const std::string& saveToFilePath, SocketPoll& poll)
+    {
+        LOG_TRC("asyncDownload: " << req.getVerb() << ' ' << host() << ':' << port() << ' '
+                                  << req.getUrl());
+
+        newRequest(req);
+
+        if (!saveToFilePath.empty())
+            _response->saveBodyToFile(saveToFilePath);
+
+        return asyncRequestImpl(poll);
+    }
+
+private:
+    /// Dispatch the request set up by newRequest to the given SocketPoll.
+    bool asyncRequestImpl(SocketPoll& poll)
+    {
+        if (_idleSocket)
+        {
+            LOG_TRC('#' << _idleSocket->getFD() << " Reusing the connection.");
+            poll.insertNewSocket(std::move(_idleSocket));
+        }
+        else if (!isConnected())
         {
             std::shared_ptr<StreamSocket> socket = connect();
             if (!socket)
@@ -1090,13 +1275,14 @@ public:
             // Technically, there is a race here. The socket can
             // get disconnected and removed right after isConnected.
             // In that case, we will timeout and no request will be sent.
-            poll.wakeupWorld();
+            const std::shared_ptr<StreamSocket> socket = _socket.lock();
+            if (socket)
+                poll.pollEventsChanged(socket->getFD());
         }
 
         return true;
     }
 
-private:
     /// Make a synchronous request.
     bool syncRequestImpl(SocketPoll& poller)
     {
@@ -1104,8 +1290,14 @@ private:
         const auto deadline = std::chrono::steady_clock::now() + timeout;
 
         assert(!!_response && "Response must be set!");
+        const std::shared_ptr<const Response> response = _response;
 
-        if (!isConnected())
+        if (_idleSocket)
+        {
+            LOG_TRC('#' << _idleSocket->getFD() << " Reusing the connection.");
+            poller.insertNewSocket(std::move(_idleSocket));
+        }
+        else if (!isConnected())
         {
             std::shared_ptr<StreamSocket> socket = connect();
             if (!socket)
@@ -1118,7 +1310,7 @@ private:
         }
 
         poller.poll(timeout);
-        while (!_response->done())
+        while (!response->done())
         {
             const auto now = std::chrono::steady_clock::now();
             const auto remaining =
@@ -1126,7 +1318,7 @@ private:
             poller.poll(remaining);
         }
 
-        return _response->state() == Response::State::Complete;
+        return response->state() == Response::State::Complete;
     }
 
     /// Set up a new request and response.
@@ -1251,6 +1443,39 @@ private:
             disposition.setClosed();
             onDisconnect();
         }
+        else if (isReusable(*socket))
+        {
+            LOG_TRC('#' << socket->getFD() << " Releasing the connection to keep it alive.");
+            ReleaseCallback onRelease = _onRelease;
+            _onFinished = nullptr;
+            std::shared_ptr<Session> self = std::static_pointer_cast<Session>(shared_from_this());
+            disposition.setMove(
+                [self, onRelease](const std::shared_ptr<Socket>& moving)
+                { onRelease(self, std::static_pointer_cast<StreamSocket>(moving)); });
+        }
+    }
+
+    /// True when the response is complete, with nothing pending on the
+    /// connection, and both sides are happy to keep it alive.
+    bool isReusable(StreamSocket& socket) const
+    {
+        return _onRelease && isConnected() && _response->state() == Response::State::Complete
+               && _request.stage() == Request::Stage::Finished && socket.getInBuffer().empty()
+               && socket.getOutBuffer().empty()
+               && !Util::iequal(_request.get("Connection", ""), "close") && isKeptAlive();
+    }
+
+    /// True when the server keeps the connection open after the response:
+    /// by default since HTTP/1.1, and only when it says so with HTTP/1.0.
+    bool isKeptAlive() const
+    {
+        const std::string connection = _response->get("Connection", "");
+        const StatusLine& statusLine = _response->statusLine();
+        if (statusLine.versionMajor() > 1
+            || (statusLine.versionMajor() == 1 && statusLine.versionMinor() >= 1))
+            return !Util::iequal(connection, "close");
+
+        return Util::iequal(connection, "keep-alive");
     }
 
     void performWrites(std::size_t capacity) override
@@ -1283,6 +1508,8 @@ private:
         }
 
         _connected = false;
+        _onRelease = nullptr; // Never to be kept alive.
+        _idleSocket.reset();
         if (_response)
             _response->finish();
     }
@@ -1335,6 +1562,8 @@ private:
     Request _request;
     FinishedCallback _onFinished;
     std::shared_ptr<Response> _response;
+    ReleaseCallback _onRelease;
+    std::shared_ptr<StreamSocket> _idleSocket; //< Kept alive, until in the next poll.
     std::weak_ptr<StreamSocket> _socket; //< Must be the last member.
 };
 
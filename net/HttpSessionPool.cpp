@@ -0,0 +1,261 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "HttpSessionPool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+namespace http
+{
+namespace
+{
+std::string getKey(const std::string& host, Session::Protocol protocol, int port)
+{
+    const char* scheme = (protocol == Session::Protocol::HttpSsl ? "https://" : "http://");
+    return scheme + host + ':' + std::to_string(port);
+}
+
+/// The time the server keeps an idle connection open, from the Keep-Alive
+/// header of its @response, if any, or @def. Less a second, so we don't
+/// reuse a connection the server is closing.
+std::chrono::seconds getKeepAliveTimeout(const Response& response, std::chrono::seconds def)
+{
+    const std::string keepAlive = response.get("Keep-Alive");
+    const std::size_t pos = keepAlive.find("timeout=");
+    if (pos == std::string::npos)
+        return def;
+
+    const auto timeout = Util::i32FromString(keepAlive.substr(pos + sizeof("timeout=") - 1));
+    if (!timeout.second)
+        return def;
+
+    return std::min(def, std::chrono::seconds(timeout.first - 1));
+}
+} // namespace
+
+SessionPool::SessionPool()
+    : _state(std::make_shared<State>())
+{
+}
+
+void SessionPool::configure(std::size_t maxPerHost, std::chrono::seconds idleTimeout)
+{
+    std::vector<Idle> closing;
+    std::lock_guard<std::mutex> lock(_state->_mutex);
+    _state->_maxPerHost = maxPerHost;
+    _state->_idleTimeout = idleTimeout;
+    if (maxPerHost == 0)
+        takeExpired(*_state, std::chrono::steady_clock::now(), true, closing);
+
+    LOG_INF("HTTP connection pool " << (maxPerHost ? "enabled" : "disabled") << ", keeping "
+                                    << maxPerHost << " connections per host, idle for "
+                                    << idleTimeout);
+}
+
+std::shared_ptr<Session> SessionPool::acquire(const std::string& host, Session::Protocol protocol,
+                                              int port)
+{
+    const std::string key = getKey(host, protocol, port);
+
+    // Closed once unlocked, as the sessions release their lease.
+    std::vector<Idle> closing;
+    std::shared_ptr<Lease> lease;
+    {
+        std::lock_guard<std::mutex> lock(_state->_mutex);
+        if (_state->_maxPerHost == 0)
+            return Session::create(host, protocol, port);
+
+        takeExpired(*_state, std::chrono::steady_clock::now(), false, closing);
+
+        Host& entry = _state->_hosts[key];
+        while (!entry._idle.empty())
+        {
+            Idle idle = std::move(entry._idle.back());
+            entry._idle.pop_back();
+            if (!isAlive(*idle._socket))
+            {
+                LOG_DBG('#' << idle._socket->getFD() << ": Idle connection to " << key
+                            << " was closed by the server.");
+                ++_state->_stale;
+                closing.push_back(std::move(idle));
+                continue;
+            }
+
+            LOG_TRC('#' << idle._socket->getFD() << ": Reusing the connection to " << key);
+            ++_state->_reused;
+            idle._session->reuseSocket(std::move(idle._socket));
+            return idle._session;
+        }
+
+        if (entry._open >= _state->_maxPerHost)
+        {
+            LOG_DBG("Already " << entry._open << " connections to " << key
+                               << ", the new one won't be kept alive.");
+            ++_state->_overflow;
+        }
+        else
+        {
+            ++entry._open;
+            ++_state->_created;
+            lease = std::make_shared<Lease>(_state, key);
+        }
+    }
+
+    std::shared_ptr<Session> session = Session::create(host, protocol, port);
+    if (lease)
+    {
+        const std::weak_ptr<State> weakState = _state;
+        session->setReleaseHandler(
+            [weakState, lease](const std::shared_ptr<Session>& releasedSession,
+                               const std::shared_ptr<StreamSocket>& socket)
+            { release(weakState, lease->key(), releasedSession, socket); });
+    }
+
+    return session;
+}
+
+void SessionPool::release(const std::weak_ptr<State>& weakState, const std::string& key,
+                          const std::shared_ptr<Session>& session,
+                          const std::shared_ptr<StreamSocket>& socket)
+{
+    std::vector<Idle> closing;
+    const std::shared_ptr<State> state = weakState.lock();
+    if (!state)
+        return;
+
+    std::lock_guard<std::mutex> lock(state->_mutex);
+    const std::chrono::seconds timeout
+        = getKeepAliveTimeout(*session->response(), state->_idleTimeout);
+    Idle idle = { session, socket, std::chrono::steady_clock::now() + timeout };
+    if (state->_maxPerHost == 0 || timeout <= std::chrono::seconds::zero())
+    {
+        closing.push_back(std::move(idle));
+        return;
+    }
+
+    LOG_TRC('#' << socket->getFD() << ": Keeping the connection to " << key << " alive for "
+                << timeout);
+    ++state->_released;
+    state->_hosts[key]._idle.push_back(std::move(idle));
+}
+
+void SessionPool::expire()
+{
+    std::vector<Idle> closing;
+    std::lock_guard<std::mutex> lock(_state->_mutex);
+    takeExpired(*_state, std::chrono::steady_clock::now(), false, closing);
+    takeStale(*_state, closing);
+}
+
+void SessionPool::clear()
+{
+    std::vector<Idle> closing;
+    std::lock_guard<std::mutex> lock(_state->_mutex);
+    takeExpired(*_state, std::chrono::steady_clock::now(), true, closing);
+}
+
+void SessionPool::takeExpired(State& state, std::chrono::steady_clock::time_point now, bool all,
+                              std::vector<Idle>& closing)
+{
+    for (auto& pair : state._hosts)
+    {
+        std::vector<Idle>& idles = pair.second._idle;
+        for (auto it = idles.begin(); it != idles.end();)
+        {
+            if (all || it->_expiry <= now)
+            {
+                if (!all)
+                    ++state._expired;
+                closing.push_back(std::move(*it));
+                it = idles.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+}
+
+void SessionPool::takeStale(State& state, std::vector<Idle>& closing)
+{
+    for (auto& pair : state._hosts)
+    {
+        std::vector<Idle>& idles = pair.second._idle;
+        for (auto it = idles.begin(); it != idles.end();)
+        {
+            if (!isAlive(*it->_socket))
+            {
+                LOG_DBG('#' << it->_socket->getFD() << ": Idle connection to " << pair.first
+                            << " was closed by the server.");
+                ++state._stale;
+                closing.push_back(std::move(*it));
+                it = idles.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+}
+
+bool SessionPool::isAlive(const StreamSocket& socket)
+{
+#if !MOBILEAPP
+    if (socket.isClosed())
+        return false;
+
+    // Idle, there should be nothing to read: not even the TLS close_notify.
+    char byte;
+    const ssize_t len = ::recv(socket.getFD(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+    (void)socket;
+    return false;
+#endif
+}
+
+void SessionPool::getMetrics(std::ostream& os, const std::string& prefix) const
+{
+    std::size_t open = 0;
+    std::size_t idle = 0;
+
+    std::lock_guard<std::mutex> lock(_state->_mutex);
+    for (const auto& pair : _state->_hosts)
+    {
+        open += pair.second._open;
+        idle += pair.second._idle.size();
+    }
+
+    os << prefix << "_hosts_count " << _state->_hosts.size() << '\n';
+    os << prefix << "_open_count " << open << '\n';
+    os << prefix << "_idle_count " << idle << '\n';
+    os << prefix << "_created_total " << _state->_created << '\n';
+    os << prefix << "_reused_total " << _state->_reused << '\n';
+    os << prefix << "_released_total " << _state->_released << '\n';
+    os << prefix << "_expired_total " << _state->_expired << '\n';
+    os << prefix << "_stale_total " << _state->_stale << '\n';
+    os << prefix << "_overflow_total " << _state->_overflow << '\n';
+}
+
+SessionPool::Lease::~Lease()
+{
+    const std::shared_ptr<State> state = _state.lock();
+    if (state)
+    {
+        std::lock_guard<std::mutex> lock(state->_mutex);
+        --state->_hosts[_key]._open;
+    }
+}
+
+} // namespace http
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,147 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "HttpRequest.hpp"
+
+namespace http
+{
+/// Keeps the connections to HTTP servers alive, to reuse them for the
+/// next requests to the same host, rather than connecting, and doing
+/// the TLS handshake, anew for each.
+///
+/// A session from acquire() goes back to the pool by itself once its
+/// response is complete, if the server keeps the connection alive: its
+/// socket is taken out of its SocketPoll then, and inserted in that of
+/// the next request on it. The sessions can be acquired in any thread.
+class SessionPool
+{
+public:
+    /// The pool is disabled until configured.
+    SessionPool();
+
+    ~SessionPool() { clear(); }
+
+    /// Keeps up to @maxPerHost connections open to each host, idle for at
+    /// most @idleTimeout, or less if the server says so. 0 disables the pool.
+    void configure(std::size_t maxPerHost, std::chrono::seconds idleTimeout);
+
+    /// Returns a session to @host, on a connection kept alive if any.
+    /// Beyond maxPerHost connections to the host, the sessions aren't pooled.
+    std::shared_ptr<Session> acquire(const std::string& host, Session::Protocol protocol,
+                                     int port);
+
+    /// Closes the idle connections that expired, or that the server closed,
+    /// rather than leaving them until the next acquire().
+    /// To call periodically.
+    void expire();
+
+    /// Closes the idle connections.
+    void clear();
+
+    /// Writes the metrics of the pool, named after @prefix.
+    void getMetrics(std::ostream& os, const std::string& prefix) const;
+
+private:
+    /// A connection kept alive, its socket in no SocketPoll.
+    struct Idle
+    {
+        std::shared_ptr<Session> _session;
+        std::shared_ptr<StreamSocket> _socket;
+        std::chrono::steady_clock::time_point _expiry;
+    };
+
+    struct Host
+    {
+        Host()
+            : _open(0)
+        {
+        }
+
+        std::size_t _open; //< The pooled connections, in use or idle.
+        std::vector<Idle> _idle; //< The most recently released last.
+    };
+
+    /// Shared with the sessions, which can outlive the pool.
+    struct State
+    {
+        State()
+            : _maxPerHost(0)
+            , _idleTimeout(0)
+            , _created(0)
+            , _reused(0)
+            , _released(0)
+            , _expired(0)
+            , _stale(0)
+            , _overflow(0)
+        {
+        }
+
+        mutable std::mutex _mutex;
+        std::size_t _maxPerHost;
+        std::chrono::seconds _idleTimeout;
+        std::map<std::string, Host> _hosts;
+
+        uint64_t _created; //< Pooled connections opened.
+        uint64_t _reused; //< Requests made on an idle connection.
+        uint64_t _released; //< Connections kept alive after a response.
+        uint64_t _expired; //< Idle connections closed after the timeout.
+        uint64_t _stale; //< Idle connections found closed by the server.
+        uint64_t _overflow; //< Sessions not pooled, beyond maxPerHost.
+    };
+
+    /// Counts a connection to a host as open while alive.
+    /// The session holds it, in its release handler.
+    class Lease
+    {
+    public:
+        Lease(const std::shared_ptr<State>& state, std::string key)
+            : _state(state)
+            , _key(std::move(key))
+        {
+        }
+
+        ~Lease();
+
+        const std::string& key() const { return _key; }
+
+    private:
+        std::weak_ptr<State> _state;
+        const std::string _key;
+    };
+
+    /// Keeps the connection of @session alive, with its @socket taken out of its poll.
+    static void release(const std::weak_ptr<State>& weakState, const std::string& key,
+                        const std::shared_ptr<Session>& session,
+                        const std::shared_ptr<StreamSocket>& socket);
+
+    /// Moves the idle connections that expired, or all, to @closing.
+    static void takeExpired(State& state, std::chrono::steady_clock::time_point now, bool all,
+                            std::vector<Idle>& closing);
+
+    /// Moves the idle connections that the server closed to @closing.
+    static void takeStale(State& state, std::vector<Idle>& closing);
+
+    /// True if the server hasn't closed the idle connection, nor sent anything on it.
+    static bool isAlive(const StreamSocket& socket);
+
+    std::shared_ptr<State> _state;
+};
+
+} // namespace http
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -30,7 +30,8 @@ public:
         _type(type),
 #endif
         _clientPoller(clientPoller),
-        _sockFactory(std::move(sockFactory))
+        _sockFactory(std::move(sockFactory)),
+        _reusePort(false)
     {
     }
 
@@ -39,11 +40,16 @@ public:
 
     /// Create a new server socket - accepted sockets will be added
     /// to the @clientSockets' poll when created with @factory.
+    /// With @reusePort several server sockets can share the same port,
+    /// and the kernel balances the incoming connections between them.
     static std::shared_ptr<ServerSocket> create(ServerSocket::Type type, int port,
                                                 Socket::Type socketType, SocketPoll& clientSocket,
-                                                std::shared_ptr<SocketFactory> factory)
+                                                std::shared_ptr<SocketFactory> factory,
+                                                bool reusePort = false)
     {
         auto serverSocket = std::make_shared<ServerSocket>(socketType, clientSocket, std::move(factory));
+        if (serverSocket)
+            serverSocket->_reusePort = reusePort;
 
         if (serverSocket && serverSocket->bind(type, port) && serverSocket->listen())
             return serverSocket;
@@ -117,6 +123,8 @@ private:
 #endif
     SocketPoll& _clientPoller;
     std::shared_ptr<SocketFactory> _sockFactory;
+    /// Bind with SO_REUSEPORT, to share the port with our siblings.
+    bool _reusePort;
 };
 
 #if !MOBILEAPP
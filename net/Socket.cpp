@@ -10,6 +10,7 @@
 #include "NetUtil.hpp"
 #include "Socket.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <ctype.h>
 #include <iomanip>
@@ -24,6 +25,9 @@
 #ifdef __FreeBSD__
 #include <sys/ucred.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <Poco/DateTime.h>
 #include <Poco/DateTimeFormat.h>
@@ -198,6 +202,12 @@ SocketPoll::SocketPoll(const std::string& threadName)
 {
     ProfileZone profileZone("SocketPoll::SocketPoll");
 
+#if ENABLE_EPOLL
+    _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (_epollFd == -1)
+        throw std::runtime_error("Failed to create epoll for SocketPoll [" + threadName + "].");
+#endif
+
     // Create the wakeup fd.
     if (
 #if !MOBILEAPP
@@ -210,6 +220,10 @@ SocketPoll::SocketPoll(const std::string& threadName)
         throw std::runtime_error("Failed to allocate pipe for SocketPoll [" + threadName + "] waking.");
     }
 
+#if ENABLE_EPOLL
+    epollUpdate(_wakeup[0], POLLIN);
+#endif
+
     LOG_DBG("New SocketPoll [" << _name << "] owned by " << Log::to_string(_owner));
 
     std::lock_guard<std::mutex> lock(getPollWakeupsMutex());
@@ -241,6 +255,13 @@ SocketPoll::~SocketPoll()
 #endif
     _wakeup[0] = -1;
     _wakeup[1] = -1;
+
+#if ENABLE_EPOLL
+    // Those of a poll without a thread are still ours.
+    epollClear();
+    ::close(_epollFd);
+    _epollFd = -1;
+#endif
 }
 
 bool SocketPoll::startThread()
@@ -319,6 +340,9 @@ void SocketPoll::pollingThreadEntry()
         pollingThread();
 
         // Release sockets.
+#if ENABLE_EPOLL
+        epollClear();
+#endif
         _pollSockets.clear();
         _newSockets.clear();
     }
@@ -347,14 +371,24 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
         std::chrono::steady_clock::now();
 
     // The events to poll on change each spin of the loop.
+#if ENABLE_EPOLL
+    epollSetup(now, timeoutMaxMicroS);
+#else
     setupPollFds(now, timeoutMaxMicroS);
+#endif
     const size_t size = _pollSockets.size();
 
     int rc;
     do
     {
 #if !MOBILEAPP
-#  if HAVE_PPOLL
+#  if ENABLE_EPOLL
+        // Round up, or we would spin until the deadline.
+        const int timeoutMaxMs = (std::max(timeoutMaxMicroS, (int64_t)0) + 999) / 1000;
+        LOG_TRC("epoll_wait start, timeoutMs: " << timeoutMaxMs << " size " << size);
+        _epollReady.resize(size + 1);
+        rc = ::epoll_wait(_epollFd, _epollReady.data(), _epollReady.size(), timeoutMaxMs);
+#  elif HAVE_PPOLL
         LOG_TRC("ppoll start, timeoutMicroS: " << timeoutMaxMicroS << " size " << size);
         timeoutMaxMicroS = std::max(timeoutMaxMicroS, (int64_t)0);
         struct timespec timeout;
@@ -376,8 +410,21 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
     LOG_TRC("Poll completed with " << rc << " live polls max (" <<
             timeoutMaxMicroS << "us)" << ((rc==0) ? "(timedout)" : ""));
 
-    // First process the wakeup pipe (always the last entry).
-    if (_pollFds[size].revents)
+#if ENABLE_EPOLL
+    const int ready = rc;
+    bool wakeupReady = false;
+    for (int i = 0; i < ready; ++i)
+    {
+        if (_epollReady[i].data.fd == _wakeup[0])
+            wakeupReady = true;
+    }
+#else
+    // The wakeup pipe is always the last entry.
+    const bool wakeupReady = _pollFds[size].revents;
+#endif
+
+    // First process the wakeup pipe.
+    if (wakeupReady)
     {
         std::vector<CallbackFn> invoke;
         {
@@ -398,6 +445,15 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
             for (auto &i : _newSockets)
                 i->setThreadOwner(std::this_thread::get_id());
 
+#if ENABLE_EPOLL
+            for (size_t i = _pollSockets.size() - _newSockets.size(); i < _pollSockets.size(); ++i)
+                epollInsert(i);
+
+            for (const int fd : _newChanged)
+                epollMarkChanged(fd);
+            _newChanged.clear();
+#endif
+
             _newSockets.clear();
 
             // Extract list of callbacks to process
@@ -441,6 +497,53 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
     std::chrono::steady_clock::time_point newNow =
         std::chrono::steady_clock::now();
 
+#if ENABLE_EPOLL
+    // Only the sockets that have something to do are handled: those ready, those
+    // left with buffered data, and those whose timeout is due.
+    _epollDispatch.clear();
+    for (const int fd : _epollBuffered)
+    {
+        // Unless it left meanwhile.
+        if (_epollEntries[fd]._isSocket)
+            _epollDispatch.emplace_back(_epollEntries[fd]._index, 0);
+    }
+
+    _epollBuffered.clear();
+
+    while (!_epollDeadlines.empty() && _epollDeadlines.top().first <= newNow)
+    {
+        const EpollDeadline deadline = _epollDeadlines.top();
+        _epollDeadlines.pop();
+
+        const EpollEntry& entry = _epollEntries[deadline.second];
+        if (entry._isSocket && entry._deadline == deadline.first)
+            _epollDispatch.emplace_back(entry._index, 0);
+    }
+
+    // The events are the same bits as poll's.
+    for (int i = 0; i < ready; ++i)
+    {
+        const int fd = _epollReady[i].data.fd;
+        if (fd != _wakeup[0] && _epollEntries[fd]._isSocket)
+            _epollDispatch.emplace_back(_epollEntries[fd]._index,
+                                        static_cast<int>(_epollReady[i].events));
+    }
+
+    // Each socket is handled once, with all its events, in order.
+    std::sort(_epollDispatch.begin(), _epollDispatch.end());
+    size_t last = 0;
+    for (size_t i = 1; i < _epollDispatch.size(); ++i)
+    {
+        if (_epollDispatch[i].first == _epollDispatch[last].first)
+            _epollDispatch[last].second |= _epollDispatch[i].second;
+        else
+            _epollDispatch[++last] = _epollDispatch[i];
+    }
+
+    if (!_epollDispatch.empty())
+        _epollDispatch.resize(last + 1);
+#endif
+
     if (size > 0)
     {
         // We use the _pollStartIndex to start the polling at a different index each time. Do some
@@ -452,44 +555,36 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
 
         LOG_DBG("Starting handling poll results of " << _name << " at index " << _pollStartIndex << " (of " << size << ")");
 
+#if ENABLE_EPOLL
+        for (const auto& entry : _epollDispatch)
+        {
+            if (!handlePoll(entry.first, newNow, entry.second, rc))
+                toErase.push_back(entry.first);
+        }
+#else
+        // Go round all of them once, downwards from _pollStartIndex.
         size_t i = _pollStartIndex;
-        size_t previ = size;
-        while (previ != _pollStartIndex)
+        for (size_t count = 0; count < size; ++count, i = (i == 0 ? size - 1 : i - 1))
         {
-            SocketDisposition disposition(_pollSockets[i]);
-            try
-            {
-                _pollSockets[i]->handlePoll(disposition, newNow,
-                                            _pollFds[i].revents);
-            }
-            catch (const std::exception& exc)
-            {
-                LOG_ERR("Error while handling poll for socket #" <<
-                        _pollFds[i].fd << " at " << i << " in " << _name << ": " << exc.what());
-                disposition.setClosed();
-                rc = -1;
-            }
-
-            if (!disposition.isContinue())
+            if (!handlePoll(i, newNow, _pollFds[i].revents, rc))
                 toErase.push_back(i);
-
-            disposition.execute();
-
-            previ = i;
-            if (i == 0)
-                i = size - 1;
-            else
-                i--;
         }
+#endif
         if (!toErase.empty())
         {
             std::sort(toErase.begin(), toErase.end(), [](int a, int b) { return a > b; });
             for (int eraseIndex : toErase)
             {
-                LOG_DBG("Removing socket #" << _pollFds[eraseIndex].fd << " (at " << eraseIndex << " of " <<
+                LOG_DBG("Removing socket #" << _pollSockets[eraseIndex]->getFD() << " (at " << eraseIndex << " of " <<
                         _pollSockets.size() << ") from " << _name);
                 _pollSockets.erase(_pollSockets.begin() + eraseIndex);
             }
+
+#if ENABLE_EPOLL
+            // Those after the first removed moved down.
+            for (size_t i = toErase.back(); i < _pollSockets.size(); ++i)
+                _epollEntries[_pollSockets[i]->getFD()]._index = i;
+#endif
         }
 
         // In case we remved sockets the new _pollStartIndex might be out of bounds, but we check it
@@ -500,6 +595,201 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
     return rc;
 }
 
+bool SocketPoll::handlePoll(size_t index, std::chrono::steady_clock::time_point now, int events,
+                            int& rc)
+{
+    const std::shared_ptr<Socket>& socket = _pollSockets[index];
+    SocketDisposition disposition(socket);
+    try
+    {
+        socket->handlePoll(disposition, now, events);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERR("Error while handling poll for socket #" <<
+                socket->getFD() << " at " << index << " in " << _name << ": " << exc.what());
+        disposition.setClosed();
+        rc = -1;
+    }
+
+    const bool keep = disposition.isContinue();
+#if ENABLE_EPOLL
+    if (keep)
+    {
+        // Handling its events is what changes them mostly.
+        epollMarkChanged(socket->getFD());
+        if (socket->hasBuffered())
+            _epollBuffered.push_back(socket->getFD());
+    }
+    else
+    {
+        // Before it may be taken in by another poll.
+        epollRemove(*socket);
+    }
+#endif
+
+    disposition.execute();
+    return keep;
+}
+
+void SocketPoll::pollEventsChanged(int fd)
+{
+#if ENABLE_EPOLL
+    if (std::this_thread::get_id() == _owner)
+        epollMarkChanged(fd);
+    else
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _newChanged.push_back(fd);
+        wakeup();
+    }
+#else
+    (void)fd; // Each wait asks all the sockets.
+#endif
+}
+
+void Socket::pollEventsChanged()
+{
+#if ENABLE_EPOLL
+    if (_poll)
+        _poll->pollEventsChanged(_fd);
+#endif
+}
+
+#if ENABLE_EPOLL
+
+static_assert(EPOLLIN == POLLIN && EPOLLPRI == POLLPRI && EPOLLOUT == POLLOUT &&
+              EPOLLERR == POLLERR && EPOLLHUP == POLLHUP,
+              "We hand epoll events to the sockets as poll ones.");
+
+void SocketPoll::epollSetup(std::chrono::steady_clock::time_point now, int64_t& timeoutMaxMicroS)
+{
+    for (const int fd : _epollChanged)
+    {
+        EpollEntry& entry = _epollEntries[fd];
+        entry._changed = false;
+
+        // Unless it left meanwhile.
+        if (entry._isSocket)
+            epollSetup(entry._index, now);
+    }
+
+    _epollChanged.clear();
+
+    // Drop the deadlines that moved or left.
+    while (!_epollDeadlines.empty())
+    {
+        const EpollDeadline& deadline = _epollDeadlines.top();
+        const EpollEntry& entry = _epollEntries[deadline.second];
+        if (entry._isSocket && entry._deadline == deadline.first)
+            break;
+
+        _epollDeadlines.pop();
+    }
+
+    if (!_epollDeadlines.empty())
+        timeoutMaxMicroS = std::min<int64_t>(
+            timeoutMaxMicroS, std::chrono::duration_cast<std::chrono::microseconds>(
+                                  _epollDeadlines.top().first - now).count());
+}
+
+void SocketPoll::epollSetup(size_t index, std::chrono::steady_clock::time_point now)
+{
+    const std::shared_ptr<Socket>& socket = _pollSockets[index];
+
+    // The earliest it wants to be handled, even without events; at least now and
+    // then, for those that check a timeout without asking to be woken up for it.
+    int64_t timeoutMicroS = DefaultPollTimeoutMicroS.count();
+    int events = socket->getPollEvents(now, timeoutMicroS);
+    assert(events >= 0 && "The events bitmask must be non-negative, where 0 means skip all events.");
+
+    if (socket->ignoringInput())
+        events &= ~POLLIN; // mask out input.
+
+    epollUpdate(socket->getFD(), events);
+
+    const auto deadline = now + std::chrono::microseconds(timeoutMicroS);
+    _epollEntries[socket->getFD()]._deadline = deadline;
+    _epollDeadlines.emplace(deadline, socket->getFD());
+}
+
+void SocketPoll::epollUpdate(int fd, int events)
+{
+    EpollEntry& entry = epollEntry(fd);
+    if (entry._events == events)
+        return;
+
+    epoll_event event;
+    event.events = events;
+    event.data.u64 = 0;
+    event.data.fd = fd;
+
+    int rc = ::epoll_ctl(_epollFd, entry._events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    if (rc == -1 && errno == ENOENT)
+    {
+        // Closed and reused without leaving us, the kernel forgot it.
+        rc = ::epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    if (rc == -1)
+    {
+        LOG_SYS("Failed to update epoll of " << _name << " for #" << fd);
+        entry._events = -1;
+        return;
+    }
+
+    entry._events = events;
+}
+
+void SocketPoll::epollInsert(size_t index)
+{
+    Socket& socket = *_pollSockets[index];
+    socket._poll = this;
+
+    EpollEntry& entry = epollEntry(socket.getFD());
+    entry._index = index;
+    entry._isSocket = true;
+    epollMarkChanged(socket.getFD());
+}
+
+void SocketPoll::epollRemove(Socket& socket)
+{
+    socket._poll = nullptr;
+
+    const int fd = socket.getFD();
+    if (fd < 0 || fd >= static_cast<int>(_epollEntries.size()))
+        return;
+
+    EpollEntry& entry = _epollEntries[fd];
+    entry._isSocket = false;
+    if (entry._events < 0)
+        return;
+
+    // It may be moving to another poll, so we can't wait for it to be closed.
+    if (::epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr) == -1 && errno != ENOENT && errno != EBADF)
+        LOG_SYS("Failed to remove #" << fd << " from epoll of " << _name);
+
+    entry._events = -1;
+}
+
+void SocketPoll::epollClear()
+{
+    for (const std::shared_ptr<Socket>& socket : _pollSockets)
+        epollRemove(*socket);
+}
+
+void SocketPoll::epollMarkChanged(int fd)
+{
+    EpollEntry& entry = epollEntry(fd);
+    if (!entry._changed)
+    {
+        entry._changed = true;
+        _epollChanged.push_back(fd);
+    }
+}
+
+#endif // ENABLE_EPOLL
+
 void SocketPoll::wakeupWorld()
 {
     for (const auto& fd : getWakeupsArray())
@@ -728,7 +1018,24 @@ bool StreamSocket::send(const http::Response& response)
 
 bool StreamSocket::send(http::Request& request)
 {
-    if (request.writeData(_outBuffer, getSendBufferCapacity()))
+    if (request.stage() == http::Request::Stage::Header)
+        request.writeHeader(_outBuffer);
+
+    bool success = true;
+    if (request.stage() == http::Request::Stage::Body)
+    {
+        if (request.getBodyFd() >= 0 && canSendFile())
+        {
+            // The body file follows the header once that is out.
+            flush();
+            if (_outBuffer.empty())
+                success = sendBodyFile(request);
+        }
+        else
+            success = request.writeBody(_outBuffer, getSendBufferCapacity());
+    }
+
+    if (success)
     {
         flush();
         return true;
@@ -740,6 +1047,71 @@ bool StreamSocket::send(http::Request& request)
     }
 }
 
+bool StreamSocket::canSendFile() const
+{
+#if !MOBILEAPP && defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool StreamSocket::sendBodyFile(http::Request& request)
+{
+#if !MOBILEAPP && defined(__linux__)
+    ASSERT_CORRECT_SOCKET_THREAD(this);
+
+    // Like writeOutgoingData, send until the socket buffer is full.
+    while (request.stage() == http::Request::Stage::Body)
+    {
+        const std::size_t count
+            = std::min<int64_t>(request.getBodyFileRemaining(), getSendBufferSize());
+        off_t offset = request.getBodyFileOffset();
+        ssize_t len;
+        do
+        {
+#if ENABLE_DEBUG
+            if (simulateSocketError(false))
+            {
+                len = -1;
+                break;
+            }
+#endif
+            len = ::sendfile(getFD(), request.getBodyFd(), &offset, count);
+        } while (len < 0 && errno == EINTR);
+
+        if (len < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true; // Poll will tell us when to continue.
+
+            LOG_SYS('#' << getFD() << ": Failed to send the request body file");
+            return false;
+        }
+
+        if (len == 0)
+        {
+            LOG_ERR('#' << getFD() << ": The request body file is shorter than its "
+                                      "Content-Length, with "
+                        << request.getBodyFileRemaining() << " bytes left to send");
+            return false;
+        }
+
+        LOG_TRC('#' << getFD() << ": Sent " << len << " bytes of the request body file, "
+                    << request.getBodyFileRemaining() - len << " left");
+        _bytesSent += len;
+        request.bodyFileSent(len);
+        if (static_cast<std::size_t>(len) < count)
+            break;
+    }
+
+    return true;
+#else
+    (void)request;
+    return false;
+#endif
+}
+
 bool StreamSocket::sendAndShutdown(http::Response& response)
 {
     response.set("Connection", "close");
@@ -775,6 +1147,18 @@ bool ServerSocket::bind(Type type, int port)
     constexpr unsigned int len = sizeof(reuseAddress);
     ::setsockopt(getFD(), SOL_SOCKET, SO_REUSEADDR, &reuseAddress, len);
 
+    if (_reusePort)
+    {
+#ifdef SO_REUSEPORT
+        // Let the kernel balance the connections between
+        // all the sockets listening on this port.
+        if (::setsockopt(getFD(), SOL_SOCKET, SO_REUSEPORT, &reuseAddress, len) == -1)
+            LOG_SYS('#' << getFD() << " Failed to set SO_REUSEPORT");
+#else
+        LOG_WRN('#' << getFD() << " SO_REUSEPORT is not supported on this platform");
+#endif
+    }
+
     int rc;
 
     assert (_type != Socket::Type::Unix);
@@ -1030,23 +1414,31 @@ LocalServerSocket::~LocalServerSocket()
 
 bool StreamSocket::parseHeader(const char *clientName,
                                Poco::MemoryInputStream &message,
-                               Poco::Net::HTTPRequest &request,
                                MessageMap *map)
 {
     assert(!map || (map->_headerSize == 0 && map->_messageSize == 0));
 
-    // Find the end of the header, if any.
-    static const std::string marker("\r\n\r\n");
-    auto itBody = std::search(_inBuffer.begin(), _inBuffer.end(),
-                              marker.begin(), marker.end());
-    if (itBody == _inBuffer.end())
+    // Resume parsing the header where the previous read left off.
+    if (!_requestParser)
+        _requestParser = Util::make_unique<http::RequestParser>();
+
+    const char* data = _inBuffer.data();
+    const http::RequestParser::State state = _requestParser->parse(data, _inBuffer.size());
+    if (state == http::RequestParser::State::Incomplete)
     {
         LOG_TRC('#' << getFD() << " doesn't have enough data for the header yet.");
         return false;
     }
 
-    // Skip the marker.
-    itBody += marker.size();
+    if (state == http::RequestParser::State::Invalid)
+    {
+        LOG_ERR('#' << getFD() << ": " << clientName << " sent an invalid HTTP request header of "
+                    << _inBuffer.size() << " bytes, closing.");
+        shutdown();
+        return false;
+    }
+
+    auto itBody = _inBuffer.begin() + _requestParser->headerSize();
     if (map) // a reasonable guess so far
     {
         map->_headerSize = static_cast<size_t>(itBody - _inBuffer.begin());
@@ -1055,40 +1447,42 @@ bool StreamSocket::parseHeader(const char *clientName,
 
     try
     {
-        request.read(message);
+        // Leave the stream past the header, as reading the request would.
+        message.seekg(_requestParser->headerSize(), std::ios::beg);
+
+        LOG_INF('#' << getFD() << ": " << clientName << " HTTP Request: "
+                    << _requestParser->verb().toString(data) << ' '
+                    << _requestParser->url().toString(data) << ' '
+                    << _requestParser->version().toString(data));
 
-        Log::StreamLogger logger = Log::info();
+        Log::StreamLogger logger = Log::trace();
         if (logger.enabled())
         {
-            logger << '#' << getFD() << ": " << clientName << " HTTP Request: "
-                   << request.getMethod() << ' '
-                   << request.getURI() << ' '
-                   << request.getVersion();
-
-            for (const auto& it : request)
+            logger << '#' << getFD() << ": " << clientName << " HTTP Request header";
+            for (int i = 0; i < _requestParser->getFieldCount(); ++i)
             {
-                logger << " / " << it.first << ": " << it.second;
+                const http::RequestParser::Field& field = _requestParser->getField(i);
+                logger << " / " << field._name.toString(data) << ": "
+                       << field._value.toString(data);
             }
 
             LOG_END(logger, true);
         }
 
-        const std::streamsize contentLength = request.getContentLength();
+        const int64_t contentLength = _requestParser->getContentLength();
         const auto offset = itBody - _inBuffer.begin();
-        const std::streamsize available = _inBuffer.size() - offset;
+        const int64_t available = _inBuffer.size() - offset;
 
-        if (contentLength != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH && available < contentLength)
+        if (contentLength >= 0 && available < contentLength)
         {
             LOG_DBG('#' << getFD() << ": Not enough content yet: ContentLength: " << contentLength
                         << ", available: " << available);
             return false;
         }
-        if (map)
+        if (map && contentLength > 0)
             map->_messageSize += contentLength;
 
-        const std::string expect = request.get("Expect", "");
-        const bool getExpectContinue = Util::iequal(expect, "100-continue");
-        if (getExpectContinue && !_sentHTTPContinue)
+        if (_requestParser->getExpectContinue() && !_sentHTTPContinue)
         {
             LOG_TRC('#' << getFD() << " got Expect: 100-continue, sending Continue");
             // FIXME: should validate authentication headers early too.
@@ -1097,7 +1491,7 @@ bool StreamSocket::parseHeader(const char *clientName,
             _sentHTTPContinue = true;
         }
 
-        if (request.getChunkedTransferEncoding())
+        if (_requestParser->getChunkedTransferEncoding())
         {
             // keep the header
             if (map)
@@ -1187,9 +1581,26 @@ bool StreamSocket::parseHeader(const char *clientName,
         return false;
     }
 
+    // The header is kept until the caller erases the request.
     return true;
 }
 
+void StreamSocket::getRequest(Poco::Net::HTTPRequest &request) const
+{
+    const http::RequestParser& header = getRequestHeader();
+    const char* data = _inBuffer.data();
+
+    request.clear();
+    request.setMethod(header.verb().toString(data));
+    request.setURI(header.url().toString(data));
+    request.setVersion(header.version().toString(data));
+    for (int i = 0; i < header.getFieldCount(); ++i)
+    {
+        const http::RequestParser::Field& field = header.getField(i);
+        request.add(field._name.toString(data), field._value.toString(data));
+    }
+}
+
 bool StreamSocket::compactChunks(MessageMap *map)
 {
     assert (map);
@@ -9,11 +9,15 @@
 
 #include <poll.h>
 #include <unistd.h>
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cerrno>
@@ -26,6 +30,7 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <queue>
 #include <sstream>
 #include <thread>
 
@@ -35,6 +40,7 @@
 #include "Util.hpp"
 #include "Protocol.hpp"
 #include "Buffer.hpp"
+#include "HttpParser.hpp"
 #include "SigUtil.hpp"
 
 // Enable to dump socket traffic as hex in logs.
@@ -190,6 +196,10 @@ public:
     /// Do we have internally queued incoming / outgoing data ?
     virtual bool hasBuffered() const { return false; }
 
+    /// Have our poll ask for our events again before it waits next,
+    /// when they change other than by handling our events.
+    void pollEventsChanged();
+
     /// manage latency issues around packet aggregation
     void setNoDelay()
     {
@@ -353,6 +363,7 @@ public:
     {
         LOG_TRC('#' << _fd << ": ignore further input on socket.");
         _ignoreInput = true;
+        pollEventsChanged();
     }
 protected:
     /// Construct based on an existing socket fd.
@@ -368,6 +379,9 @@ protected:
         _ignoreInput = false;
         _sendBufferSize = DefaultSendBufferSize;
         _owner = std::this_thread::get_id();
+#if ENABLE_EPOLL
+        _poll = nullptr;
+#endif
         LOG_DBG('#' << _fd << " Created socket. Thread affinity set to " << Log::to_string(_owner));
 
 #if !MOBILEAPP
@@ -394,6 +408,12 @@ private:
 
     /// We check the owner even in the release builds, needs to be always correct.
     std::thread::id _owner;
+
+#if ENABLE_EPOLL
+    friend class SocketPoll;
+    /// The poll we are in, only touched in its thread.
+    SocketPoll* _poll;
+#endif
 };
 
 class StreamSocket;
@@ -436,6 +456,10 @@ public:
     /// Do some of the queued writing.
     virtual void performWrites(std::size_t capacity) = 0;
 
+    /// Called when what getPollEvents returns changed other than by handling
+    /// the events of the socket, e.g. when the message handler queued messages.
+    virtual void pollEventsChanged() {}
+
     /// Called when the socket is disconnected and will be destroyed.
     /// Will be called exactly once.
     virtual void onDisconnect() {}
@@ -565,13 +589,13 @@ private:
 /// Handles non-blocking socket event polling.
 /// Only polls on N-Sockets and invokes callback and
 /// doesn't manage buffers or client data.
-/// Note: uses poll(2) since it has very good performance
-/// compared to epoll up to a few hundred sockets and
-/// doesn't suffer select(2)'s poor API. Since this will
-/// be used per-document we don't expect to have several
-/// hundred users on same document to suffer poll(2)'s
-/// scalability limit. Meanwhile, epoll(2)'s high
-/// overhead to adding/removing sockets is not helpful.
+/// Note: uses epoll(7) when built with ENABLE_EPOLL, poll(2) otherwise.
+/// The sockets stay in the epoll interest list while they are ours. Only
+/// those handled, and those whose events changed otherwise (see
+/// pollEventsChanged), are asked for their events again; and only those
+/// epoll reports ready, or whose timeout is due, are handled. So a wakeup
+/// costs what is ready, not every idle websocket of the server poll.
+/// Both are level-triggered: handlers don't have to drain their socket.
 class SocketPoll
 {
 public:
@@ -616,6 +640,9 @@ public:
             LOG_DBG("Removing socket #" << socket->getFD() << " from " << _name);
             ASSERT_CORRECT_SOCKET_THREAD(socket);
             socket->resetThreadOwner();
+#if ENABLE_EPOLL
+            epollRemove(*socket);
+#endif
 
             _pollSockets.pop_back();
         }
@@ -768,6 +795,10 @@ public:
         wakeup();
     }
 
+    /// Have the socket of @fd asked for its events again before the next wait,
+    /// when they change other than by handling its events. Any thread.
+    void pollEventsChanged(int fd);
+
     virtual void dumpState(std::ostream& os);
 
     size_t getSocketCount() const
@@ -824,6 +855,12 @@ private:
     /// Actual poll implementation
     int poll(int64_t timeoutMaxMicroS);
 
+    /// Hand the events to the socket at @index of _pollSockets.
+    /// Returns false when it is to be removed.
+    bool handlePoll(size_t index, std::chrono::steady_clock::time_point now, int events,
+                    int& rc);
+
+#if !ENABLE_EPOLL
     /// Initialize the poll fds array with the right events
     void setupPollFds(std::chrono::steady_clock::time_point now,
                       int64_t &timeoutMaxMicroS)
@@ -850,6 +887,61 @@ private:
         _pollFds[size].events = POLLIN;
         _pollFds[size].revents = 0;
     }
+#else
+    /// Ask the sockets whose events may have changed for them, update the
+    /// epoll interest list to match, and wait until the earliest timeout at most.
+    void epollSetup(std::chrono::steady_clock::time_point now, int64_t& timeoutMaxMicroS);
+
+    /// Ask the socket at @index of _pollSockets for its events and timeout.
+    void epollSetup(size_t index, std::chrono::steady_clock::time_point now);
+
+    /// Add the fd to the epoll interest list, or change the events it
+    /// is there for, unless it is already there for these.
+    void epollUpdate(int fd, int events);
+
+    /// Take in the socket at @index of _pollSockets, which is new.
+    void epollInsert(size_t index);
+
+    /// Remove the socket from the epoll interest list, when it leaves this poll.
+    void epollRemove(Socket& socket);
+
+    /// Remove all the sockets from the epoll interest list.
+    void epollClear();
+
+    /// Have the socket of @fd asked for its events before the next wait.
+    void epollMarkChanged(int fd);
+
+    /// What we keep of each fd we have.
+    struct EpollEntry
+    {
+        EpollEntry()
+            : _events(-1)
+            , _index(0)
+            , _isSocket(false)
+            , _changed(false)
+        {
+        }
+
+        /// When it wants to be handled, even without events.
+        std::chrono::steady_clock::time_point _deadline;
+        /// The events it is in the interest list for, -1 if not there.
+        int _events;
+        /// Its index in _pollSockets, when _isSocket.
+        size_t _index;
+        /// Whether it is one of our sockets.
+        bool _isSocket;
+        /// Whether it is in _epollChanged.
+        bool _changed;
+    };
+
+    /// The entry of @fd, added if needed.
+    EpollEntry& epollEntry(int fd)
+    {
+        if (fd >= static_cast<int>(_epollEntries.size()))
+            _epollEntries.resize(fd + 1);
+        return _epollEntries[fd];
+    }
+#endif
 
     /// The polling thread entry.
     /// Used to set the thread name and mark the thread as stopped when done.
@@ -869,8 +961,29 @@ private:
     std::mutex _mutex;
     std::vector<std::shared_ptr<Socket>> _newSockets;
     std::vector<CallbackFn> _newCallbacks;
+#if !ENABLE_EPOLL
     /// The fds to poll.
     std::vector<pollfd> _pollFds;
+#else
+    int _epollFd;
+    /// Indexed by fd.
+    std::vector<EpollEntry> _epollEntries;
+    /// The fds of the sockets to ask for their events before the next wait.
+    std::vector<int> _epollChanged;
+    /// Those of other threads, protected by _mutex.
+    std::vector<int> _newChanged;
+    /// The fds of the sockets left with buffered data, to handle again.
+    std::vector<int> _epollBuffered;
+    typedef std::pair<std::chrono::steady_clock::time_point, int> EpollDeadline;
+    /// The deadlines of the sockets by fd, earliest first. Those no longer
+    /// the _deadline of the fd are left to be dropped when they come up.
+    std::priority_queue<EpollDeadline, std::vector<EpollDeadline>, std::greater<EpollDeadline>>
+        _epollDeadlines;
+    /// What epoll_wait reports.
+    std::vector<epoll_event> _epollReady;
+    /// The sockets to handle, by index in _pollSockets, and their events.
+    std::vector<std::pair<size_t, int>> _epollDispatch;
+#endif
 
     /// Flag the thread to stop.
     std::atomic<bool> _stop;
@@ -907,6 +1020,9 @@ public:
         UseRecvmsgExpectFD
     };
 
+    /// The most blocks of the output buffer we hand to a single write.
+    static constexpr int MaxWriteBlocks = 64;
+
     /// Create a StreamSocket from native FD.
     StreamSocket(const std::string hostname, const int fd, bool /* isClient */,
                  std::shared_ptr<ProtocolHandlerInterface> socketHandler,
@@ -962,6 +1078,7 @@ public:
     {
         _shutdownSignalled = true;
         LOG_TRC('#' << getFD() << ": Async shutdown requested.");
+        pollEventsChanged();
     }
 
     virtual void ignoreInput() override
@@ -1001,6 +1118,7 @@ public:
             _outBuffer.append(data, len);
             if (doFlush)
                 writeOutgoingData();
+            pollEventsChanged();
         }
     }
 
@@ -1010,12 +1128,28 @@ public:
         send(str.data(), str.size(), doFlush);
     }
 
+    /// Send @len bytes at @data without copying them; @owner keeps
+    /// them alive, and they must not change, until they are written out.
+    void sendShared(const char* data, const std::size_t len, Buffer::Owner owner,
+                    const bool doFlush = true)
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+        if (data != nullptr && len > 0)
+        {
+            _outBuffer.append(data, len, std::move(owner));
+            if (doFlush)
+                writeOutgoingData();
+            pollEventsChanged();
+        }
+    }
+
     /// Sends HTTP response.
     /// Adds Date and User-Agent.
     void send(Poco::Net::HTTPResponse& response);
 
     /// Send an http::Request and flush.
     /// Does not add any fields to the header.
+    /// A body file is sent with sendBodyFile, when canSendFile.
     /// Will shutdown the socket upon error and return false.
     bool send(http::Request& request);
 
@@ -1162,6 +1296,7 @@ public:
     {
         _socketHandler = std::move(handler);
         _socketHandler->onConnect(shared_from_this());
+        pollEventsChanged();
     }
 
     /// Create a socket of type TSocket given an FD and a handler.
@@ -1194,6 +1329,8 @@ public:
     void clearInput()
     {
         _inBuffer.clear();
+        if (_requestParser)
+            _requestParser->reset();
     }
 
     /// Remove the first @count bytes from input buffer
@@ -1209,20 +1346,34 @@ public:
         if (toErase < count)
             LOG_ERR('#' << getFD() << ": attempted to remove: " << count << " which is > size: " << _inBuffer.size() << " clamped to " << toErase);
         if (toErase > 0)
+        {
             _inBuffer.erase(_inBuffer.begin(), _inBuffer.begin() + count);
+            if (_requestParser)
+                _requestParser->reset();
+        }
     }
 
     /// Compacts chunk headers away leaving just the data we want
     /// returns true if we did any re-sizing/movement of _inBuffer.
     bool compactChunks(MessageMap *map);
 
-    /// Detects if we have an HTTP header in the provided message and
-    /// populates a request for that.
+    /// Detects if we have an HTTP header in the provided message.
+    /// Once it does, the header is in getRequestHeader() until the
+    /// request is erased from the input buffer.
     bool parseHeader(const char *clientLoggingName,
                      Poco::MemoryInputStream &message,
-                     Poco::Net::HTTPRequest &request,
                      MessageMap *map = nullptr);
 
+    /// The header found by parseHeader(), as spans into getInBuffer().
+    const http::RequestParser& getRequestHeader() const
+    {
+        assert(_requestParser && _requestParser->state() == http::RequestParser::State::Complete);
+        return *_requestParser;
+    }
+
+    /// Populates a Poco request from that header, for those needing one.
+    void getRequest(Poco::Net::HTTPRequest &request) const;
+
     /// Get input/output statistics on this stream
     void getIOStats(uint64_t &sent, uint64_t &recv)
     {
@@ -1362,11 +1513,12 @@ public:
             do
             {
                 // Writing much more than we can absorb in the kernel causes wastage.
-                const auto size = std::min((int)_outBuffer.getBlockSize(), getSendBufferSize());
-                if (size == 0)
+                iovec iov[MaxWriteBlocks];
+                const int count = _outBuffer.getIOVec(iov, MaxWriteBlocks, getSendBufferSize());
+                if (count == 0)
                     break;
 
-                len = writeData(_outBuffer.getBlock(), size);
+                len = writeData(iov, count);
                 last_errno = errno; // Save right after the syscall.
 
                 LOG_TRC('#' << getFD() << ": Wrote outgoing data " << len << " bytes of "
@@ -1377,7 +1529,8 @@ public:
 #ifdef LOG_SOCKET_DATA
                 if (len > 0 && !_outBuffer.empty())
                     LOG_TRC('#' << getFD() << " outBuffer (" << _outBuffer.size() << " bytes):\n"
-                                << Util::dumpHex(std::string(_outBuffer.getBlock(), len)));
+                                << Util::dumpHex(std::string(_outBuffer.getBlock(),
+                                                             std::min<std::size_t>(len, _outBuffer.getBlockSize()))));
 #endif
 
                 if (len <= 0 && last_errno != EAGAIN && last_errno != EWOULDBLOCK)
@@ -1485,6 +1638,35 @@ protected:
 #endif
     }
 
+    /// Override to handle gathered writes of several blocks differently.
+    /// Like writev(2), a short write can end in the middle of any block.
+    virtual int writeData(const iovec* iov, const int count)
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+        assert(count > 0);
+#if !MOBILEAPP
+        if (count > 1)
+        {
+#if ENABLE_DEBUG
+            if (simulateSocketError(false))
+                return -1;
+#endif
+            return ::writev(getFD(), iov, count);
+        }
+#endif
+        // FakeSocket has no gathered write, one block at a time is good enough there.
+        return writeData(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
+    }
+
+    /// True if the body file of a request can be sent with sendBodyFile,
+    /// i.e. when the data isn't transformed on its way to the socket.
+    virtual bool canSendFile() const;
+
+    /// Sends the body file of @request with sendfile(2), without copying it
+    /// through our buffers, until the socket buffer is full.
+    /// Returns false on error.
+    bool sendBodyFile(http::Request& request);
+
     void setShutdownSignalled()
     {
         _shutdownSignalled = true;
@@ -1516,6 +1698,9 @@ private:
     std::vector<char> _inBuffer;
     Buffer _outBuffer;
 
+    /// Parses the HTTP request in _inBuffer across reads, created on first use.
+    std::unique_ptr<http::RequestParser> _requestParser;
+
     uint64_t _bytesSent;
     uint64_t _bytesRecvd;
 
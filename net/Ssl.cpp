@@ -16,8 +16,30 @@
 #endif
 
 #include <sys/syscall.h>
+#include <algorithm>
+#include <cstring>
+#include <Log.hpp>
 #include <Util.hpp>
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && defined(__linux__)
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 extern "C"
 {
     // Multithreading support for OpenSSL.
@@ -85,6 +107,10 @@ SslContext::SslContext(const std::string& certFilePath, const std::string& keyFi
                        ssl::CertificateVerification verification)
     : _ctx(nullptr)
     , _verification(verification)
+    , _fullHandshakes(0)
+    , _resumedHandshakes(0)
+    , _kernelTlsConnections(0)
+    , _ticketKeyLifetime(0)
 {
     const std::vector<char> rand = Util::rng::getBytes(512);
     RAND_seed(&rand[0], rand.size());
@@ -117,6 +143,9 @@ SslContext::SslContext(const std::string& certFilePath, const std::string& keyFi
     SSL_CTX_set_options(_ctx, SSL_OP_NO_SSLv3);
 #endif
 
+    // For the callbacks to find us.
+    SSL_CTX_set_app_data(_ctx, this);
+
     // SSL_CTX_set_default_passwd_cb(_ctx, &privateKeyPassphraseCallback);
     ERR_clear_error();
     SSL_CTX_set_options(_ctx, SSL_OP_ALL);
@@ -176,6 +205,9 @@ SslContext::SslContext(const std::string& certFilePath, const std::string& keyFi
 
 SslContext::~SslContext()
 {
+    for (const auto& pair : _clientSessions)
+        SSL_SESSION_free(pair.second);
+
     SSL_CTX_free(_ctx);
     EVP_cleanup();
     ERR_free_strings();
@@ -344,6 +376,325 @@ void SslContext::initECDH()
 #endif
 }
 
+void SslContext::enableServerSessionResumption(std::size_t cacheSize,
+                                               std::chrono::seconds timeout,
+                                               std::chrono::seconds ticketKeyLifetime)
+{
+    // Sessions are only resumed in the context they were created in.
+    static const unsigned char sessionIdContext[] = "loolwsd";
+    SSL_CTX_set_session_id_context(_ctx, sessionIdContext, sizeof(sessionIdContext) - 1);
+
+    SSL_CTX_set_session_cache_mode(_ctx, cacheSize ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+    SSL_CTX_sess_set_cache_size(_ctx, cacheSize);
+    SSL_CTX_set_timeout(_ctx, timeout.count());
+
+    if (ticketKeyLifetime > std::chrono::seconds::zero())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_ticketKeysMutex);
+            _ticketKeyLifetime = ticketKeyLifetime;
+            _ticketKeys.clear();
+        }
+
+        SSL_CTX_clear_options(_ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(_ctx, &SslContext::ticketKeyCallback);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(_ctx, &SslContext::ticketKeyCallback);
+#endif
+    }
+    else
+        SSL_CTX_set_options(_ctx, SSL_OP_NO_TICKET);
+
+    LOG_INF("TLS session resumption enabled, caching " << cacheSize << " sessions for "
+                                                       << timeout << ", session tickets "
+                                                       << (ticketKeyLifetime.count() ? "enabled"
+                                                                                     : "disabled"));
+}
+
+void SslContext::enableClientSessionResumption()
+{
+    // OpenSSL only looks sessions up by id in the cache of servers: we
+    // keep them ourselves, by hostname, to set them on new connections.
+    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(_ctx, &SslContext::newClientSession);
+}
+
+void SslContext::resumeClientSession(SSL* ssl, const std::string& hostname)
+{
+    std::lock_guard<std::mutex> lock(_clientSessionsMutex);
+    const auto it = _clientSessions.find(hostname);
+    if (it != _clientSessions.end() && SSL_set_session(ssl, it->second) != 1)
+        LOG_WRN("Failed to resume the TLS session with [" << hostname << ']');
+}
+
+int SslContext::newClientSession(SSL* ssl, SSL_SESSION* session)
+{
+    SslContext* context = static_cast<SslContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    return context && context->keepClientSession(ssl, session);
+}
+
+bool SslContext::keepClientSession(SSL* ssl, SSL_SESSION* session)
+{
+    const char* hostname = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!hostname)
+        return false;
+
+    // A handful of hosts, typically, but don't grow unbounded.
+    constexpr std::size_t MaxClientSessions = 1024;
+
+    std::lock_guard<std::mutex> lock(_clientSessionsMutex);
+    const auto it = _clientSessions.find(hostname);
+    if (it != _clientSessions.end())
+    {
+        if (it->second == session)
+            return false;
+
+        SSL_SESSION_free(it->second);
+        it->second = session;
+    }
+    else if (_clientSessions.size() < MaxClientSessions)
+        _clientSessions.emplace(hostname, session);
+    else
+        return false;
+
+    // We own the reference to the session now.
+    return true;
+}
+
+bool SslContext::setKernelTls(bool enable)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    // OpenSSL falls back to encrypting itself when the kernel, which
+    // needs the tls module, or the negotiated cipher don't support it.
+    if (enable)
+    {
+        SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+        LOG_INF("Kernel TLS enabled, where supported.");
+    }
+    else
+    {
+        SSL_CTX_clear_options(_ctx, SSL_OP_ENABLE_KTLS);
+        LOG_INF("Kernel TLS disabled.");
+    }
+
+    return true;
+#else
+    if (enable)
+        LOG_WRN("Kernel TLS is not supported by this build of OpenSSL.");
+    return false;
+#endif
+}
+
+bool SslContext::isKernelTlsSupported()
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && defined(__linux__)
+    // The tls module only attaches to established TCP connections.
+    const int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const int client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int server = -1;
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+
+    bool supported = false;
+    if (listener >= 0 && client >= 0
+        && ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+        && ::listen(listener, 1) == 0
+        && ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addrLen) == 0
+        && ::connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+        && (server = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) >= 0
+        && ::setsockopt(client, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0)
+    {
+        // Dummy keys: the connection is closed without sending anything.
+        tls12_crypto_info_aes_gcm_128 info;
+        std::memset(&info, 0, sizeof(info));
+        info.info.version = TLS_1_2_VERSION;
+        info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        supported = (::setsockopt(client, SOL_TLS, TLS_TX, &info, sizeof(info)) == 0);
+    }
+
+    if (!supported)
+    {
+        const int lastErrno = errno;
+        LOG_DBG("Kernel TLS is unavailable: " << Util::symbolicErrno(lastErrno) << ": "
+                                              << std::strerror(lastErrno));
+    }
+
+    for (const int fd : { server, client, listener })
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    return supported;
+#else
+    return false;
+#endif
+}
+
+bool SslContext::hasKernelTlsSend(SSL* ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    (void)ssl;
+    return false;
+#endif
+}
+
+bool SslContext::setCipherSuites(const std::string& cipherSuites)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (SSL_CTX_set_ciphersuites(_ctx, cipherSuites.c_str()) != 1)
+    {
+        LOG_ERR("Failed to set the TLS 1.3 cipher suites [" << cipherSuites
+                                                           << "]: " << getLastErrorMsg());
+        return false;
+    }
+
+    return true;
+#else
+    (void)cipherSuites;
+    return false;
+#endif
+}
+
+void SslContext::onHandshake(SSL* ssl)
+{
+    SslContext* context = static_cast<SslContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    if (!context)
+        return;
+
+    if (hasKernelTlsSend(ssl))
+        ++context->_kernelTlsConnections;
+
+    if (!SSL_session_reused(ssl))
+    {
+        ++context->_fullHandshakes;
+        return;
+    }
+
+    ++context->_resumedHandshakes;
+
+    // A TLS 1.2 server may renew the ticket as we resume, without OpenSSL
+    // telling us about the new session: keep it, the old one is spent.
+    if (SSL_CTX_get_session_cache_mode(SSL_get_SSL_CTX(ssl)) & SSL_SESS_CACHE_CLIENT)
+    {
+        SSL_SESSION* session = SSL_get1_session(ssl);
+        if (session && !context->keepClientSession(ssl, session))
+            SSL_SESSION_free(session);
+    }
+}
+
+void SslContext::getMetrics(std::ostream& os, const std::string& prefix) const
+{
+    os << prefix << "_handshakes_full_total " << _fullHandshakes.load() << '\n';
+    os << prefix << "_handshakes_resumed_total " << _resumedHandshakes.load() << '\n';
+    os << prefix << "_ktls_total " << _kernelTlsConnections.load() << '\n';
+
+    const long cacheMode = SSL_CTX_get_session_cache_mode(_ctx);
+    if (cacheMode & SSL_SESS_CACHE_SERVER)
+        os << prefix << "_session_cache_count " << SSL_CTX_sess_number(_ctx) << '\n';
+
+    if (cacheMode & SSL_SESS_CACHE_CLIENT)
+    {
+        std::lock_guard<std::mutex> lock(_clientSessionsMutex);
+        os << prefix << "_sessions_count " << _clientSessions.size() << '\n';
+    }
+}
+
+bool SslContext::getTicketKey(const unsigned char* name, TicketKey& key, bool& current)
+{
+    std::lock_guard<std::mutex> lock(_ticketKeysMutex);
+
+    const auto now = std::chrono::steady_clock::now();
+    if (_ticketKeys.empty() || now - _ticketKeys.front()._created >= _ticketKeyLifetime)
+    {
+        TicketKey newKey;
+        if (RAND_bytes(newKey._name, sizeof(newKey._name)) != 1
+            || RAND_bytes(newKey._hmacKey, sizeof(newKey._hmacKey)) != 1
+            || RAND_bytes(newKey._aesKey, sizeof(newKey._aesKey)) != 1)
+        {
+            LOG_ERR("Failed to generate a TLS session ticket key: " << getLastErrorMsg());
+            return false;
+        }
+
+        LOG_DBG("Renewed the TLS session ticket key.");
+        newKey._created = now;
+        _ticketKeys.insert(_ticketKeys.begin(), newKey);
+        _ticketKeys.resize(std::min<std::size_t>(_ticketKeys.size(), 2));
+    }
+
+    for (std::size_t i = 0; i < _ticketKeys.size(); ++i)
+    {
+        if (!name || std::memcmp(name, _ticketKeys[i]._name, sizeof(_ticketKeys[i]._name)) == 0)
+        {
+            key = _ticketKeys[i];
+            current = (i == 0);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int SslContext::ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                  EVP_CIPHER_CTX* cipherCtx, EVP_MAC_CTX* macCtx, int enc)
+#else
+int SslContext::ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                  EVP_CIPHER_CTX* cipherCtx, HMAC_CTX* macCtx, int enc)
+#endif
+{
+    SslContext* context = static_cast<SslContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    if (!context)
+        return -1;
+
+    TicketKey key;
+    bool current = false;
+    if (!context->getTicketKey(enc ? nullptr : keyName, key, current))
+        return enc ? -1 : 0; // Unknown key: fall back to a full handshake.
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key._hmacKey,
+                                                  sizeof(key._hmacKey));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 const_cast<char*>("SHA256"), 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(macCtx, params) != 1)
+        return -1;
+#else
+    if (HMAC_Init_ex(macCtx, key._hmacKey, sizeof(key._hmacKey), EVP_sha256(), nullptr) != 1)
+        return -1;
+#endif
+
+    if (enc)
+    {
+        std::memcpy(keyName, key._name, sizeof(key._name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1
+            || EVP_EncryptInit_ex(cipherCtx, EVP_aes_256_cbc(), nullptr, key._aesKey, iv) != 1)
+            return -1;
+
+        return 1;
+    }
+
+    if (EVP_DecryptInit_ex(cipherCtx, EVP_aes_256_cbc(), nullptr, key._aesKey, iv) != 1)
+        return -1;
+
+    // Tickets of the previous key are still good, but are renewed. So are
+    // those of TLS 1.3, as clients use each once: they'd get none otherwise.
+#ifdef TLS1_3_VERSION
+    if (SSL_version(ssl) >= TLS1_3_VERSION)
+        return 2;
+#endif
+    return current ? 1 : 2;
+}
+
 std::string SslContext::getLastErrorMsg()
 {
     const unsigned long errCode = ERR_get_error();
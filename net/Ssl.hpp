@@ -11,8 +11,11 @@
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -20,6 +23,8 @@
 #include <openssl/rand.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #if OPENSSL_VERSION_NUMBER >= 0x0907000L
 #include <openssl/conf.h>
 #endif
@@ -49,11 +54,77 @@ public:
 
     ssl::CertificateVerification verification() const { return _verification; }
 
+    /// Lets clients resume their sessions, cached for up to @cacheSize
+    /// clients, for @timeout. With a @ticketKeyLifetime, clients can also
+    /// resume with stateless session tickets, encrypted with keys renewed
+    /// that often; a ticket stays valid for one more lifetime after that.
+    void enableServerSessionResumption(std::size_t cacheSize, std::chrono::seconds timeout,
+                                       std::chrono::seconds ticketKeyLifetime);
+
+    /// Keeps the last session with each server, to resume it on reconnection.
+    void enableClientSessionResumption();
+
+    /// Resumes on @ssl the session kept with @hostname, if any.
+    void resumeClientSession(SSL* ssl, const std::string& hostname);
+
+    /// Lets OpenSSL hand the keys to the kernel after the handshake, when
+    /// it supports the cipher, for the data to be written as-is to sockets.
+    /// Applies to the connections created after. Returns false if OpenSSL
+    /// wasn't built with kernel TLS support.
+    bool setKernelTls(bool enable);
+
+    /// True if OpenSSL supports kernel TLS, and the kernel takes the keys
+    /// of an AES-GCM cipher, loading its tls module if needed. Probes a
+    /// loopback connection of its own, without changing any context.
+    static bool isKernelTlsSupported();
+
+    /// True if the kernel encrypts what is written to the socket of @ssl.
+    static bool hasKernelTlsSend(SSL* ssl);
+
+    /// Restricts the TLS 1.3 cipher suites to the colon-separated @cipherSuites.
+    /// Returns false if none is supported, or OpenSSL predates TLS 1.3.
+    bool setCipherSuites(const std::string& cipherSuites);
+
+    /// Counts the handshake @ssl has just completed, as resumed or full,
+    /// and keeps the session of clients, if renewed.
+    static void onHandshake(SSL* ssl);
+
+    /// Writes the handshake and session metrics, named after @prefix.
+    void getMetrics(std::ostream& os, const std::string& prefix) const;
+
 private:
+    /// A key to encrypt and authenticate the session tickets with.
+    struct TicketKey
+    {
+        unsigned char _name[16];
+        unsigned char _hmacKey[32];
+        unsigned char _aesKey[32];
+        std::chrono::steady_clock::time_point _created;
+    };
+
     void initDH();
     void initECDH();
     void shutdown();
 
+    /// Copies to @key the current ticket key, when @name is null, or that named @name.
+    /// @current is false for the previous key: its tickets need to be renewed.
+    bool getTicketKey(const unsigned char* name, TicketKey& key, bool& current);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                 EVP_CIPHER_CTX* cipherCtx, EVP_MAC_CTX* macCtx, int enc);
+#else
+    static int ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                                 EVP_CIPHER_CTX* cipherCtx, HMAC_CTX* macCtx, int enc);
+#endif
+
+    /// Keeps the new @session of the client @ssl.
+    static int newClientSession(SSL* ssl, SSL_SESSION* session);
+
+    /// Keeps @session as the one to resume with the server of @ssl, taking
+    /// over its reference. False if we don't, or already have it.
+    bool keepClientSession(SSL* ssl, SSL_SESSION* session);
+
     std::string getLastErrorMsg();
 
     // Multithreading support for OpenSSL.
@@ -66,6 +137,17 @@ private:
 private:
     SSL_CTX* _ctx;
     const ssl::CertificateVerification _verification;
+
+    std::atomic<uint64_t> _fullHandshakes;
+    std::atomic<uint64_t> _resumedHandshakes;
+    std::atomic<uint64_t> _kernelTlsConnections;
+
+    std::mutex _ticketKeysMutex;
+    std::chrono::seconds _ticketKeyLifetime;
+    std::vector<TicketKey> _ticketKeys; //< The current one first, then the previous.
+
+    mutable std::mutex _clientSessionsMutex;
+    std::map<std::string, SSL_SESSION*> _clientSessions; //< By server hostname.
 };
 
 namespace ssl
@@ -121,6 +203,58 @@ public:
         return ClientInstance->newSsl();
     }
 
+    /// See SslContext::enableServerSessionResumption.
+    static void enableServerSessionResumption(std::size_t cacheSize, std::chrono::seconds timeout,
+                                              std::chrono::seconds ticketKeyLifetime)
+    {
+        assert(isServerContextInitialized() && "Server SslContext is not initialized");
+        ServerInstance->enableServerSessionResumption(cacheSize, timeout, ticketKeyLifetime);
+    }
+
+    /// See SslContext::enableClientSessionResumption.
+    static void enableClientSessionResumption()
+    {
+        assert(isClientContextInitialized() && "Client SslContext is not initialized");
+        ClientInstance->enableClientSessionResumption();
+    }
+
+    /// Resumes on the client @ssl the session kept with @hostname, if any.
+    static void resumeClientSession(SSL* ssl, const std::string& hostname)
+    {
+        assert(isClientContextInitialized() && "Client SslContext is not initialized");
+        ClientInstance->resumeClientSession(ssl, hostname);
+    }
+
+    /// See SslContext::setKernelTls.
+    static bool setServerKernelTls(bool enable)
+    {
+        assert(isServerContextInitialized() && "Server SslContext is not initialized");
+        return ServerInstance->setKernelTls(enable);
+    }
+
+    /// See SslContext::setKernelTls.
+    static bool setClientKernelTls(bool enable)
+    {
+        assert(isClientContextInitialized() && "Client SslContext is not initialized");
+        return ClientInstance->setKernelTls(enable);
+    }
+
+    /// See SslContext::setCipherSuites.
+    static bool setClientCipherSuites(const std::string& cipherSuites)
+    {
+        assert(isClientContextInitialized() && "Client SslContext is not initialized");
+        return ClientInstance->setCipherSuites(cipherSuites);
+    }
+
+    /// Writes the handshake and session metrics of the contexts.
+    static void getMetrics(std::ostream& os)
+    {
+        if (ServerInstance)
+            ServerInstance->getMetrics(os, "tls_server");
+        if (ClientInstance)
+            ClientInstance->getMetrics(os, "tls_client");
+    }
+
 private:
     static std::unique_ptr<SslContext> ServerInstance;
     static std::unique_ptr<SslContext> ClientInstance;
@@ -24,6 +24,7 @@ public:
         , _ssl(nullptr)
         , _sslWantsTo(SslWantsTo::Neither)
         , _doHandshake(true)
+        , _kernelTls(false)
     {
         LOG_DBG("SslStreamSocket ctor #" << fd);
 
@@ -47,6 +48,10 @@ public:
         if (!hostname.empty() && !SSL_set_tlsext_host_name(_ssl, hostname.c_str()))
             LOG_WRN("Failed to set hostname for Server Name Indication [" << hostname << ']');
 
+        // Skip the full handshake with servers we have talked to before.
+        if (isClient && !hostname.empty())
+            ssl::Manager::resumeClientSession(_ssl, hostname);
+
         SSL_set_bio(_ssl, _bio, _bio);
 
         if (isClient)
@@ -134,6 +139,10 @@ public:
 
         assert (len > 0); // Never write 0 bytes.
 
+        // StreamSocket simulates the errors of the writes the kernel encrypts.
+        if (_kernelTls)
+            return sendKeyUpdate() ? StreamSocket::writeData(buf, len) : -1;
+
 #if ENABLE_DEBUG
         if (simulateSocketError(false))
             return -1;
@@ -141,6 +150,24 @@ public:
         return handleSslState(SSL_write(_ssl, buf, len));
     }
 
+    /// SSL_write has no gathered variant, so write one block at a time,
+    /// unless the kernel encrypts the data.
+    virtual int writeData(const iovec* iov, const int count) override
+    {
+        assert(count > 0);
+        if (_kernelTls && count > 1)
+        {
+            ASSERT_CORRECT_SOCKET_THREAD(this);
+            return sendKeyUpdate() ? StreamSocket::writeData(iov, count) : -1;
+        }
+
+        return writeData(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
+    }
+
+    /// The data is encrypted on its way, so body files are read in chunks
+    /// bounded by the socket buffer instead, unless the kernel encrypts it.
+    bool canSendFile() const override { return _kernelTls && StreamSocket::canSendFile(); }
+
     int getPollEvents(std::chrono::steady_clock::time_point now,
                       int64_t & timeoutMaxMicroS) override
     {
@@ -197,6 +224,17 @@ private:
                     closeConnection();
                     return 0;
                 }
+
+                LOG_TRC("Socket #" << getFD() << " TLS handshake complete, session "
+                                   << (SSL_session_reused(_ssl) ? "resumed." : "new."));
+                SslContext::onHandshake(_ssl);
+
+                // OpenSSL has given the keys to the kernel: from now on, the
+                // data is written as-is, never through SSL_write, to keep the
+                // record sequence of the kernel.
+                _kernelTls = SslContext::hasKernelTlsSend(_ssl);
+                if (_kernelTls)
+                    LOG_DBG("Socket #" << getFD() << " TLS encryption offloaded to the kernel.");
             }
         }
 
@@ -204,6 +242,34 @@ private:
         return 1;
     }
 
+    /// Sends the TLS 1.3 KeyUpdate the peer asked for, if any, before
+    /// writing to the socket directly. False if not sent yet, with errno
+    /// EAGAIN to retry once OpenSSL can progress, or the error.
+    bool sendKeyUpdate()
+    {
+#ifdef SSL_KEY_UPDATE_NONE
+        if (SSL_get_key_update_type(_ssl) != SSL_KEY_UPDATE_NONE)
+        {
+            errno = 0;
+            const int rc = SSL_do_handshake(_ssl);
+            if (rc <= 0)
+            {
+                // handleSslState restores errno, which SSL failures don't set.
+                const int sslError = SSL_get_error(_ssl, rc);
+                if (handleSslState(rc) == 0)
+                    errno = ECONNRESET;
+                else if (sslError == SSL_ERROR_WANT_READ || sslError == SSL_ERROR_WANT_WRITE)
+                    errno = EAGAIN;
+                else if (errno == 0)
+                    errno = EIO;
+
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+
     /// Verify the peer's certificate.
     /// Return true iff the certificate matches the hostname.
     bool verifyCertificate();
@@ -368,6 +434,8 @@ private:
     /// We must do the handshake during the first
     /// read or write in non-blocking.
     bool _doHandshake;
+    /// The kernel encrypts what we write to the socket.
+    bool _kernelTls;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -508,6 +508,13 @@ protected:
         return events;
     }
 
+    void pollEventsChanged() override
+    {
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        if (socket)
+            socket->pollEventsChanged();
+    }
+
 #if !MOBILEAPP
 private:
     /// Send a ping message
@@ -612,12 +619,63 @@ public:
         return sendFrame(socket, data, len, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
     }
 
+    /// Sends a WebSocket message made of @header followed by @blocks.
+    /// The blocks are queued by reference and written out without being copied,
+    /// so they must not be modified afterwards. Only the header is seen by the
+    /// unit-test send filter.
+    /// Returns the same as the sendMessage above.
+    int sendMessage(const std::string& header, const std::vector<Buffer::SharedBlock>& blocks,
+                    const WSOpCode code, const bool flush = true) const
+    {
+        int unitReturn = -1;
+        if (!Util::isFuzzing() && UnitBase::get().filterSendMessage(header.data(), header.size(), code, flush, unitReturn))
+            return unitReturn;
+
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        return sendFrame(socket, header, blocks, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
+    }
+
 protected:
 
 #if !MOBILEAPP
     /// Builds a websocket frame based on data and flags received as parameters.
     /// The frame is output in 'out' parameter
     void buildFrame(const char* data, const uint64_t len, unsigned char flags, Buffer &out) const
+    {
+        buildFrameHeader(len, flags, out);
+
+        if (_isMasking)
+        { // flip some top bits - perhaps it helps.
+            char mask[4];
+
+            mask[0] = static_cast<char>(0x81);
+            mask[1] = static_cast<char>(0x76);
+            mask[2] = static_cast<char>(0x81);
+            mask[3] = static_cast<char>(0x76);
+            out.append(mask, 4);
+
+            // copy and mask the data
+            char copy[16384];
+            ssize_t i = 0, toSend;
+            while (true)
+            {
+                toSend = std::min(sizeof(copy), len - i);
+                if (toSend == 0)
+                    break;
+                for (ssize_t j = 0; j < toSend; ++j, ++i)
+                    copy[j] = data[i] ^ mask[i%4];
+                out.append(copy, toSend);
+            }
+        }
+        else
+        {
+            // Copy the data.
+            out.append(data, len);
+        }
+    }
+
+    /// Appends the frame header for a payload of @len bytes to @out.
+    void buildFrameHeader(const uint64_t len, unsigned char flags, Buffer &out) const
     {
         int slen = 0;
         char scratch[16];
@@ -651,35 +709,6 @@ protected:
 
         assert(slen <= static_cast<int>(sizeof(scratch)));
         out.append(scratch, slen);
-
-        if (_isMasking)
-        { // flip some top bits - perhaps it helps.
-            char mask[4];
-
-            mask[0] = static_cast<char>(0x81);
-            mask[1] = static_cast<char>(0x76);
-            mask[2] = static_cast<char>(0x81);
-            mask[3] = static_cast<char>(0x76);
-            out.append(mask, 4);
-
-            // copy and mask the data
-            char copy[16384];
-            ssize_t i = 0, toSend;
-            while (true)
-            {
-                toSend = std::min(sizeof(copy), len - i);
-                if (toSend == 0)
-                    break;
-                for (ssize_t j = 0; j < toSend; ++j, ++i)
-                    copy[j] = data[i] ^ mask[i%4];
-                out.append(copy, toSend);
-            }
-        }
-        else
-        {
-            // Copy the data.
-            out.append(data, len);
-        }
     }
 #endif
 
@@ -728,49 +757,116 @@ protected:
 #endif
 
         if (flush || _shuttingDown)
+            flushFrame(socket);
+
+        return size;
+    }
+
+    /// Sends a WebSocket frame of @header followed by @blocks, referencing the blocks
+    /// from the socket's output buffer rather than copying them, when we can.
+    /// Returns the same as the sendFrame above.
+    int sendFrame(const std::shared_ptr<StreamSocket>& socket,
+                  const std::string& header, const std::vector<Buffer::SharedBlock>& blocks,
+                  unsigned char flags, bool flush = true) const
+    {
+        uint64_t len = header.size();
+        for (const Buffer::SharedBlock& block : blocks)
+            len += block ? block->size() : 0;
+
+#if !MOBILEAPP
+        if (!_isMasking)
         {
-            socket->writeOutgoingData();
+            if (!socket || len == 0)
+                return -1;
 
-            // Retry if we are shutting down and failed.
-            // This is particularly relevant when we simulate socket error
-            // during unit-tests. Dropping WS frames results in random test failures.
-            // But more important is to flush the data we have before closing the socket.
-            // There is a FIXME item in Session::shutdown specifically to address this case.
-            // When we terminte a client's connection in DocumentBroker::finalRemoveSession,
-            // we send the close frame and close the socket via Socket::closeConnection(),
-            // which is called immediately after *this* function (see shutdown() above).
-            // So, a common scenario is when we want to shutdown all clients. The stack
-            // trace looks like this:
-            //
-            // WebSocketHandler::sendFrame at ./net/WebSocketHandler.hpp:678 (this function)
-            // WebSocketHandler::sendCloseFrame at ./net/WebSocketHandler.hpp:149
-            // WebSocketHandler::shutdown at ./net/WebSocketHandler.hpp:175
-            // WebSocketHandler::shutdown at ./net/WebSocketHandler.hpp:155
-            // Session::shutdown at common/Session.cpp:235
-            // Session::shutdownGoingAway at ./common/Session.hpp:152 (this will close the socket)
-            // DocumentBroker::shutdownClients at wsd/DocumentBroker.cpp:2386
-            // DocumentBroker::terminateChild at wsd/DocumentBroker.cpp:2421
-            //
-            // The proper fix is to flag the socket(s) for shutdown, but continue
-            // polling until we completly flush the buffered data, then we close
-            // the socket in question. This isn't possible in the above scenario,
-            // and a proper fix is to modify DocumentBroker's poll to take this
-            // flushing into account (note that currently terminateChild is called
-            // *after* the poll loop exists). This will be done in a follow up later.
-            // For now, we just do a second write, and hope for the best.
-            if (_shuttingDown && !out.empty())
+            if (socket->isClosed())
             {
-                socket->writeOutgoingData();
-                if (!out.empty())
-                {
-                    LOG_WRN("Socket #"
-                            << socket->getFD() << " is shutting down but " << out.size()
-                            << " bytes couldn't be flushed and still remain in the output buffer.");
-                }
+                LOG_DBG("Socket #" << socket->getFD() << " is closed. Cannot send WS frame.");
+                return 0;
             }
+
+            ASSERT_CORRECT_SOCKET_THREAD(socket);
+            Buffer& out = socket->getOutBuffer();
+
+            LOG_TRC("WebSocketHandler::sendFrame: Writing to #"
+                    << socket->getFD() << ' ' << len << " bytes in " << blocks.size()
+                    << " shared blocks in addition to " << out.size() << " bytes buffered.");
+
+            const size_t oldSize = out.size();
+
+            buildFrameHeader(len, flags, out);
+            out.append(header);
+            for (const Buffer::SharedBlock& block : blocks)
+                out.append(block);
+
+            // Return the number of bytes we wrote to the *buffer*.
+            const size_t size = out.size() - oldSize;
+
+            if (flush || _shuttingDown)
+                flushFrame(socket);
+
+            return size;
+        }
+#endif
+
+        // Masking modifies the data, and the FakeSocket needs a message in a
+        // single write, so copy it all in one piece.
+        std::vector<char> data;
+        data.reserve(len);
+        data.insert(data.end(), header.begin(), header.end());
+        for (const Buffer::SharedBlock& block : blocks)
+        {
+            if (block)
+                data.insert(data.end(), block->begin(), block->end());
         }
 
-        return size;
+        return sendFrame(socket, data.data(), data.size(), flags, flush);
+    }
+
+    /// Writes out the buffered frames, trying harder when we are shutting down.
+    void flushFrame(const std::shared_ptr<StreamSocket>& socket) const
+    {
+        Buffer& out = socket->getOutBuffer();
+        socket->writeOutgoingData();
+
+        // Retry if we are shutting down and failed.
+        // This is particularly relevant when we simulate socket error
+        // during unit-tests. Dropping WS frames results in random test failures.
+        // But more important is to flush the data we have before closing the socket.
+        // There is a FIXME item in Session::shutdown specifically to address this case.
+        // When we terminte a client's connection in DocumentBroker::finalRemoveSession,
+        // we send the close frame and close the socket via Socket::closeConnection(),
+        // which is called immediately after *this* function (see shutdown() above).
+        // So, a common scenario is when we want to shutdown all clients. The stack
+        // trace looks like this:
+        //
+        // WebSocketHandler::flushFrame (this function)
+        // WebSocketHandler::sendFrame at ./net/WebSocketHandler.hpp:678
+        // WebSocketHandler::sendCloseFrame at ./net/WebSocketHandler.hpp:149
+        // WebSocketHandler::shutdown at ./net/WebSocketHandler.hpp:175
+        // WebSocketHandler::shutdown at ./net/WebSocketHandler.hpp:155
+        // Session::shutdown at common/Session.cpp:235
+        // Session::shutdownGoingAway at ./common/Session.hpp:152 (this will close the socket)
+        // DocumentBroker::shutdownClients at wsd/DocumentBroker.cpp:2386
+        // DocumentBroker::terminateChild at wsd/DocumentBroker.cpp:2421
+        //
+        // The proper fix is to flag the socket(s) for shutdown, but continue
+        // polling until we completly flush the buffered data, then we close
+        // the socket in question. This isn't possible in the above scenario,
+        // and a proper fix is to modify DocumentBroker's poll to take this
+        // flushing into account (note that currently terminateChild is called
+        // *after* the poll loop exists). This will be done in a follow up later.
+        // For now, we just do a second write, and hope for the best.
+        if (_shuttingDown && !out.empty())
+        {
+            socket->writeOutgoingData();
+            if (!out.empty())
+            {
+                LOG_WRN("Socket #"
+                        << socket->getFD() << " is shutting down but " << out.size()
+                        << " bytes couldn't be flushed and still remain in the output buffer.");
+            }
+        }
     }
 
     bool isControlFrame(WSOpCode code) const { return code >= WSOpCode::Close; }
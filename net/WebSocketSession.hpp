@@ -215,7 +215,13 @@ public:
 
         const auto pollPtr = _socketPoll.lock();
         if (pollPtr)
-            pollPtr->wakeup();
+        {
+            const std::shared_ptr<StreamSocket> socket = getSocket().lock();
+            if (socket)
+                pollPtr->pollEventsChanged(socket->getFD());
+            else
+                pollPtr->wakeup();
+        }
     }
 
     /// Shutdown the WebSocket, either asynchronously or synchronously,
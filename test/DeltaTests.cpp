@@ -20,11 +20,13 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDeltaSequence);
     CPPUNIT_TEST(testRandomDeltas);
+    CPPUNIT_TEST(testDeltaSizeLimit);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testDeltaSequence();
     void testRandomDeltas();
+    void testDeltaSizeLimit();
 
     std::vector<char> loadPng(const char *relpath,
                               png_uint_32& height,
@@ -199,6 +201,30 @@ void DeltaTests::testRandomDeltas()
 {
 }
 
+void DeltaTests::testDeltaSizeLimit()
+{
+    DeltaGenerator gen;
+
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text = loadPng(TDOC "/delta-text.png", height, width, rowBytes);
+    std::vector<char> text2 = loadPng(TDOC "/delta-text2.png", height, width, rowBytes);
+
+    std::vector<char> delta;
+    LOK_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(&text[0]), 0, 0, width, height,
+                                width, height, delta, 1, 0));
+
+    // The delta is no use when it is bigger than the PNG of the old tile.
+    gen.setImageSize(1, 100);
+    LOK_ASSERT(!gen.createDelta(reinterpret_cast<unsigned char*>(&text2[0]), 0, 0, width, height,
+                                width, height, delta, 2, 1));
+    LOK_ASSERT(delta.empty());
+
+    // But the new tile is still there to base the next delta on.
+    LOK_ASSERT(gen.createDelta(reinterpret_cast<unsigned char*>(&text[0]), 0, 0, width, height,
+                               width, height, delta, 3, 2));
+    assertEqual(applyDelta(text2, width, height, delta), text, width, height);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(DeltaTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
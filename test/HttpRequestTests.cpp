@@ -18,10 +18,14 @@
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/StreamCopier.h>
 
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
+#include <fstream>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <test/lokassert.hpp>
 
 #if ENABLE_SSL
@@ -31,6 +35,7 @@
 #include <net/ServerSocket.hpp>
 #include <net/DelaySocket.hpp>
 #include <net/HttpRequest.hpp>
+#include <net/HttpSessionPool.hpp>
 #include <FileUtil.hpp>
 #include <Util.hpp>
 #include <helpers.hpp>
@@ -59,6 +64,11 @@ class HttpRequestTests final : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTimeout);
     CPPUNIT_TEST(testOnFinished_Complete);
     CPPUNIT_TEST(testOnFinished_Timeout);
+    CPPUNIT_TEST(testLargeUploadDownload);
+    CPPUNIT_TEST(testSessionPool);
+    CPPUNIT_TEST(testSessionPoolExpiry);
+    CPPUNIT_TEST(testTlsSessionResumption);
+    CPPUNIT_TEST(testKernelTls);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -74,6 +84,11 @@ class HttpRequestTests final : public CPPUNIT_NS::TestFixture
     void testTimeout();
     void testOnFinished_Complete();
     void testOnFinished_Timeout();
+    void testLargeUploadDownload();
+    void testSessionPool();
+    void testSessionPoolExpiry();
+    void testTlsSessionResumption();
+    void testKernelTls();
 
     static constexpr std::chrono::seconds DefTimeoutSeconds{ 5 };
 
@@ -651,6 +666,322 @@ void HttpRequestTests::testOnFinished_Timeout()
     LOK_ASSERT(httpResponse->state() == http::Response::State::Timeout);
 }
 
+/// Removes a temporary file when going out of scope, also when an assertion fails.
+class TempFile final
+{
+public:
+    TempFile(std::string path)
+        : _path(std::move(path))
+    {
+    }
+
+    ~TempFile() { FileUtil::removeFile(_path); }
+
+    const std::string& path() const { return _path; }
+
+private:
+    const std::string _path;
+};
+
+/// Writes a file of @size bytes of the pattern that HttpTestServer checks and sends.
+static void writePatternFile(const std::string& path, std::size_t size)
+{
+    std::vector<char> block(1024 * 1024);
+    std::ofstream ofs(path, std::ios::binary);
+    for (std::size_t offset = 0; offset < size; offset += block.size())
+    {
+        const std::size_t len = std::min(block.size(), size - offset);
+        for (std::size_t i = 0; i < len; ++i)
+            block[i] = ServerRequestHandler::getPatternByte(offset + i);
+        ofs.write(block.data(), len);
+    }
+}
+
+void HttpRequestTests::testLargeUploadDownload()
+{
+    constexpr auto testname = "largeUploadDownload";
+
+    constexpr std::size_t Size = 100 * 1024 * 1024;
+    const TempFile file(FileUtil::getSysTempDirectoryPath() + "/test_http_large");
+    writePatternFile(file.path(), Size);
+
+    auto httpSession = http::Session::create(_localUri);
+    httpSession->setTimeout(std::chrono::seconds(60));
+
+    // The upload is sent with sendfile over plain connections, and kTLS ones.
+    // The server checks the body against the pattern, and replies with its size.
+    http::Request uploadRequest("/upload", http::Request::VERB_POST);
+    uploadRequest.setBodyFile(file.path());
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const http::Response> httpResponse = httpSession->syncRequest(uploadRequest);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL_MESSAGE(httpResponse->getBody(), 200U,
+                             httpResponse->statusLine().statusCode());
+    LOK_ASSERT_EQUAL(std::to_string(Size), httpResponse->getBody());
+    TST_LOG("Uploaded " << Size / (1024 * 1024) << " MB in " << elapsed << ": "
+                        << Size * 1000 / (1024 * 1024) / std::max<int64_t>(elapsed.count(), 1)
+                        << " MB/s.");
+
+    // The download is written to the file as it's received.
+    const TempFile download(file.path() + "_download");
+    start = std::chrono::steady_clock::now();
+    httpResponse = httpSession->syncDownload(http::Request("/large/" + std::to_string(Size)),
+                                             download.path());
+    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+    LOK_ASSERT(httpResponse->getBody().empty());
+    LOK_ASSERT_EQUAL(Size, FileUtil::Stat(download.path()).size());
+    TST_LOG("Downloaded " << Size / (1024 * 1024) << " MB in " << elapsed << ": "
+                          << Size * 1000 / (1024 * 1024) / std::max<int64_t>(elapsed.count(), 1)
+                          << " MB/s.");
+
+    // The server sends the same pattern: the download must match the uploaded file.
+    std::ifstream source(file.path(), std::ios::binary);
+    std::ifstream downloaded(download.path(), std::ios::binary);
+    std::vector<char> expected(1024 * 1024);
+    std::vector<char> actual(expected.size());
+    for (std::size_t offset = 0; offset < Size; offset += expected.size())
+    {
+        source.read(expected.data(), expected.size());
+        downloaded.read(actual.data(), actual.size());
+        LOK_ASSERT_EQUAL(source.gcount(), downloaded.gcount());
+        LOK_ASSERT_MESSAGE("Downloaded file differs in the block at offset "
+                               + std::to_string(offset),
+                           std::equal(expected.begin(), expected.begin() + source.gcount(),
+                                      actual.begin()));
+    }
+}
+
+void HttpRequestTests::testSessionPool()
+{
+    constexpr auto testname = "sessionPool";
+
+    const auto server = http::Session::create(_localUri);
+    const std::string& host = server->host();
+    const http::Session::Protocol protocol = server->protocol();
+    const int port = Util::i32FromString(server->port()).first;
+
+    http::SessionPool pool;
+    pool.configure(2, std::chrono::seconds(30));
+
+    std::shared_ptr<http::Session> lastSession;
+    for (int i = 0; i < 5; ++i)
+    {
+        TST_LOG("Request #" << i);
+        const std::string body = "pooled" + std::to_string(i);
+        const std::shared_ptr<http::Session> httpSession = pool.acquire(host, protocol, port);
+        httpSession->setTimeout(DefTimeoutSeconds);
+
+        // All but the first request go over the connection kept alive.
+        if (lastSession)
+            LOK_ASSERT(lastSession == httpSession);
+        lastSession = httpSession;
+
+        const std::shared_ptr<const http::Response> httpResponse
+            = httpSession->syncRequest(http::Request("/echo/" + body));
+        LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+        LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+        LOK_ASSERT_EQUAL(body, httpResponse->getBody());
+    }
+
+    // Connections in use aren't shared, and only 2 are kept alive.
+    const std::shared_ptr<http::Session> first = pool.acquire(host, protocol, port);
+    const std::shared_ptr<http::Session> second = pool.acquire(host, protocol, port);
+    const std::shared_ptr<http::Session> third = pool.acquire(host, protocol, port);
+    LOK_ASSERT(first == lastSession);
+    LOK_ASSERT(second != first && third != first && third != second);
+
+    std::ostringstream metrics;
+    pool.getMetrics(metrics, "test");
+    TST_LOG("Metrics:\n" << metrics.str());
+    LOK_ASSERT(metrics.str().find("test_open_count 2\n") != std::string::npos);
+    LOK_ASSERT(metrics.str().find("test_reused_total 5\n") != std::string::npos);
+    LOK_ASSERT(metrics.str().find("test_overflow_total 1\n") != std::string::npos);
+
+    pool.clear();
+}
+
+void HttpRequestTests::testSessionPoolExpiry()
+{
+    constexpr auto testname = "sessionPoolExpiry";
+
+    const auto server = http::Session::create(_localUri);
+    const std::string& host = server->host();
+    const http::Session::Protocol protocol = server->protocol();
+    const int port = Util::i32FromString(server->port()).first;
+
+    http::SessionPool pool;
+    pool.configure(2, std::chrono::seconds(1));
+
+    // HTTP/1.0 closes the connection after the response, unless asked to keep it alive.
+    const std::string response10 = "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok";
+    const std::shared_ptr<http::Session> session10 = pool.acquire(host, protocol, port);
+    session10->setTimeout(DefTimeoutSeconds);
+    std::shared_ptr<const http::Response> httpResponse = session10->syncRequest(
+        http::Request("/inject/" + Util::bytesToHexString(response10.data(), response10.size())));
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(std::string("ok"), httpResponse->getBody());
+    LOK_ASSERT(pool.acquire(host, protocol, port) != session10);
+
+    // The idle connections are closed once expired, without waiting for the next acquire().
+    const std::shared_ptr<http::Session> httpSession = pool.acquire(host, protocol, port);
+    httpSession->setTimeout(DefTimeoutSeconds);
+    httpResponse = httpSession->syncRequest(http::Request("/echo/expire"));
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(std::string("expire"), httpResponse->getBody());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    pool.expire();
+
+    std::ostringstream metrics;
+    pool.getMetrics(metrics, "test");
+    TST_LOG("Metrics:\n" << metrics.str());
+    LOK_ASSERT(metrics.str().find("test_released_total 1\n") != std::string::npos);
+    LOK_ASSERT(metrics.str().find("test_idle_count 0\n") != std::string::npos);
+    LOK_ASSERT(metrics.str().find("test_expired_total 1\n") != std::string::npos);
+
+    pool.clear();
+}
+
+/// Returns the value of the metric @name, or 0.
+static uint64_t getTlsMetric(const std::string& name)
+{
+    std::ostringstream oss;
+#if ENABLE_SSL
+    ssl::Manager::getMetrics(oss);
+#endif
+    const std::string metrics = oss.str();
+    const std::size_t pos = metrics.find(name + ' ');
+    if (pos == std::string::npos)
+        return 0;
+
+    return std::stoull(metrics.substr(pos + name.size() + 1));
+}
+
+void HttpRequestTests::testTlsSessionResumption()
+{
+    constexpr auto testname = "tlsSessionResumption";
+
+    if (!helpers::haveSsl())
+    {
+        TST_LOG("SSL is not enabled, skipping.");
+        return;
+    }
+
+    const uint64_t resumed = getTlsMetric("tls_client_handshakes_resumed_total");
+    const uint64_t serverResumed = getTlsMetric("tls_server_handshakes_resumed_total");
+
+    // Each session connects anew: all but the first resume the TLS session.
+    for (int i = 0; i < 3; ++i)
+    {
+        auto httpSession = http::Session::create(_localUri);
+        httpSession->setTimeout(DefTimeoutSeconds);
+
+        const std::shared_ptr<const http::Response> httpResponse
+            = httpSession->syncRequest(http::Request("/echo/resume"));
+        LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+        LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+        LOK_ASSERT_EQUAL(std::string("resume"), httpResponse->getBody());
+    }
+
+    TST_LOG("Resumed " << getTlsMetric("tls_client_handshakes_resumed_total") - resumed
+                       << " TLS sessions.");
+    LOK_ASSERT(getTlsMetric("tls_client_handshakes_resumed_total") >= resumed + 2);
+    LOK_ASSERT(getTlsMetric("tls_server_handshakes_resumed_total") >= serverResumed + 2);
+}
+
+#if ENABLE_SSL
+/// Offloads TLS to the kernel while in scope, with a cipher it supports.
+class KernelTlsScope final
+{
+public:
+    KernelTlsScope()
+        : _enabled(ssl::Manager::setServerKernelTls(true)
+                   && ssl::Manager::setClientKernelTls(true)
+                   && ssl::Manager::setClientCipherSuites("TLS_AES_128_GCM_SHA256"))
+    {
+    }
+
+    ~KernelTlsScope()
+    {
+        ssl::Manager::setServerKernelTls(false);
+        ssl::Manager::setClientKernelTls(false);
+#ifdef TLS_DEFAULT_CIPHERSUITES
+        ssl::Manager::setClientCipherSuites(TLS_DEFAULT_CIPHERSUITES);
+#endif
+    }
+
+    bool enabled() const { return _enabled; }
+
+private:
+    const bool _enabled;
+};
+#endif
+
+void HttpRequestTests::testKernelTls()
+{
+    constexpr auto testname = "kernelTls";
+
+#if ENABLE_SSL
+    if (!helpers::haveSsl())
+    {
+        TST_LOG("SSL is not enabled, skipping.");
+        return;
+    }
+
+    if (!SslContext::isKernelTlsSupported())
+    {
+        TST_LOG("Kernel TLS is unavailable, skipping.");
+        return;
+    }
+
+    // Only the connections of this test are offloaded.
+    const KernelTlsScope kernelTls;
+    LOK_ASSERT(kernelTls.enabled());
+
+    const uint64_t offloaded = getTlsMetric("tls_client_ktls_total");
+    const uint64_t serverOffloaded = getTlsMetric("tls_server_ktls_total");
+
+    constexpr std::size_t Size = 4 * 1024 * 1024;
+    const TempFile file(FileUtil::getSysTempDirectoryPath() + "/test_http_ktls");
+    writePatternFile(file.path(), Size);
+
+    auto httpSession = http::Session::create(_localUri);
+    httpSession->setTimeout(DefTimeoutSeconds);
+
+    // The upload is sent with sendfile, encrypted by the kernel.
+    http::Request uploadRequest("/upload", http::Request::VERB_POST);
+    uploadRequest.setBodyFile(file.path());
+    std::shared_ptr<const http::Response> httpResponse = httpSession->syncRequest(uploadRequest);
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL_MESSAGE(httpResponse->getBody(), 200U,
+                             httpResponse->statusLine().statusCode());
+    LOK_ASSERT_EQUAL(std::to_string(Size), httpResponse->getBody());
+
+    httpResponse = httpSession->syncRequest(http::Request("/large/" + std::to_string(Size)));
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+    LOK_ASSERT_EQUAL(Size, httpResponse->getBody().size());
+    for (std::size_t i = 0; i < Size; ++i)
+    {
+        if (httpResponse->getBody()[i] != ServerRequestHandler::getPatternByte(i))
+            LOK_ASSERT_FAIL("Downloaded body differs at offset " + std::to_string(i));
+    }
+
+    LOK_ASSERT(getTlsMetric("tls_client_ktls_total") > offloaded);
+    LOK_ASSERT(getTlsMetric("tls_server_ktls_total") > serverOffloaded);
+#else
+    TST_LOG("SSL is unsupported in this build, skipping.");
+#endif
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(HttpRequestTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
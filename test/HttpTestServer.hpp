@@ -12,8 +12,11 @@
 #include <common/Log.hpp>
 #include <common/Util.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <memory>
 #include <string>
+#include <vector>
 
 #ifndef LOOLWSD_VERSION
 static_assert(false, "config.h must be included in the .cpp being compiled");
@@ -23,7 +26,15 @@ static_assert(false, "config.h must be included in the .cpp being compiled");
 class ServerRequestHandler final : public SimpleSocketHandler
 {
 public:
-    ServerRequestHandler() {}
+    ServerRequestHandler()
+        : _postBodyRemaining(0)
+        , _postBodySize(0)
+        , _postBodyMismatch(-1)
+    {
+    }
+
+    /// The byte at the given offset of the bodies of /large/ and /upload.
+    static char getPatternByte(uint64_t offset) { return static_cast<char>(offset * 7); }
 
 private:
     /// Set the socket associated with this ResponseClient.
@@ -46,6 +57,12 @@ private:
         LOG_TRC('#' << socket->getFD() << " handleIncomingMessage.");
 
         std::vector<char>& data = socket->getInBuffer();
+        if (_postBodyRemaining > 0)
+        {
+            receivePostBody(socket, data);
+            return;
+        }
+
         LOG_TRC('#' << socket->getFD() << " handleIncomingMessage: buffer has ["
                     << std::string(data.data(), data.size()));
 
@@ -111,6 +128,21 @@ private:
             {
                 // Don't send anything back.
             }
+            else if (Util::startsWith(request.getUrl(), "/large/"))
+            {
+                // /large/<size> sends back a patterned body of that many bytes.
+                const uint64_t size
+                    = Util::u64FromString(request.getUrl().substr(sizeof("/large")), 0).first;
+                http::Response response(http::StatusLine(200));
+                response.set("Content-Length", std::to_string(size));
+                response.set("Content-Type", "application/octet-stream");
+                socket->send(response);
+
+                auto body = std::make_shared<std::vector<char>>(size);
+                for (uint64_t i = 0; i < size; ++i)
+                    (*body)[i] = getPatternByte(i);
+                socket->sendShared(body->data(), body->size(), body);
+            }
             else if (Util::startsWith(request.getUrl(), "/inject"))
             {
                 // /inject/<hex data> sends back the data (in binary form)
@@ -155,6 +187,14 @@ private:
                 socket->send(response);
             }
         }
+        else if (request.getVerb() == http::Request::VERB_POST && request.getUrl() == "/upload")
+        {
+            // Reply with the size of the body, once received and checked against the pattern.
+            _postBodyRemaining = std::max<int64_t>(request.header().getContentLength(), 0);
+            _postBodySize = 0;
+            _postBodyMismatch = -1;
+            receivePostBody(socket, data);
+        }
         else
         {
             http::Response response(http::StatusLine(501));
@@ -163,6 +203,39 @@ private:
         }
     }
 
+    /// Consumes the body of an upload, and replies once it's complete.
+    void receivePostBody(const std::shared_ptr<StreamSocket>& socket, std::vector<char>& data)
+    {
+        const std::size_t len = std::min<int64_t>(_postBodyRemaining, data.size());
+        for (std::size_t i = 0; i < len && _postBodyMismatch < 0; ++i)
+        {
+            if (data[i] != getPatternByte(_postBodySize + i))
+                _postBodyMismatch = _postBodySize + i;
+        }
+
+        data.erase(data.begin(), data.begin() + len);
+        _postBodyRemaining -= len;
+        _postBodySize += len;
+
+        if (_postBodyRemaining == 0)
+        {
+            if (_postBodyMismatch >= 0)
+            {
+                LOG_ERR('#' << socket->getFD() << " Upload differs from the pattern at offset "
+                            << _postBodyMismatch);
+                http::Response response(http::StatusLine(400));
+                response.setBody("Mismatch at " + std::to_string(_postBodyMismatch),
+                                 "text/plain");
+                socket->send(response);
+                return;
+            }
+
+            http::Response response(http::StatusLine(200));
+            response.setBody(std::to_string(_postBodySize), "text/plain");
+            socket->send(response);
+        }
+    }
+
     int getPollEvents(std::chrono::steady_clock::time_point /* now */,
                       int64_t& /* timeoutMaxMs */) override
     {
@@ -186,6 +259,10 @@ private:
 private:
     // The socket that owns us (we can't own it).
     std::weak_ptr<StreamSocket> _socket;
+
+    int64_t _postBodyRemaining; //< Of the upload being received.
+    int64_t _postBodySize; //< Of the upload received so far.
+    int64_t _postBodyMismatch; //< The first offset differing from the pattern, or -1.
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
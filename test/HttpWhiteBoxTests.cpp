@@ -8,7 +8,9 @@
 #include <config.h>
 
 #include <string>
+#include <vector>
 
+#include <net/HttpParser.hpp>
 #include <net/HttpRequest.hpp>
 
 #include <test/lokassert.hpp>
@@ -33,6 +35,10 @@ class HttpWhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testRequestParserValidComplete);
     CPPUNIT_TEST(testRequestParserValidIncomplete);
 
+    CPPUNIT_TEST(testServerRequestParserIncremental);
+    CPPUNIT_TEST(testServerRequestParserFraming);
+    CPPUNIT_TEST(testServerRequestParserInvalid);
+
     CPPUNIT_TEST_SUITE_END();
 
     void testStatusLineParserValidComplete();
@@ -42,6 +48,9 @@ class HttpWhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testHeader();
     void testRequestParserValidComplete();
     void testRequestParserValidIncomplete();
+    void testServerRequestParserIncremental();
+    void testServerRequestParserFraming();
+    void testServerRequestParserInvalid();
 };
 
 void HttpWhiteBoxTests::testStatusLineParserValidComplete()
@@ -199,6 +208,135 @@ void HttpWhiteBoxTests::testRequestParserValidIncomplete()
     LOK_ASSERT_EQUAL(expHost, req.header().get("Host"));
 }
 
+void HttpWhiteBoxTests::testServerRequestParserIncremental()
+{
+    const std::string data = "GET /loleaflet/dist/loleaflet.html?WOPISrc=x HTTP/1.1\r\n"
+                             "Host: localhost:9980\r\n"
+                             "Accept-Encoding:  gzip, deflate \r\n"
+                             "EmptyKey:\r\n"
+                             "\r\n"
+                             "Body";
+    const std::size_t headerSize = data.size() - 4;
+
+    http::RequestParser parser;
+
+    // Feed the data a byte at a time, as if over many reads.
+    for (std::size_t i = 0; i < headerSize; ++i)
+    {
+        LOK_ASSERT_EQUAL_MESSAGE("i = " << i, http::RequestParser::State::Incomplete,
+                                 parser.parse(data.c_str(), i));
+    }
+
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(data.c_str(), headerSize));
+    LOK_ASSERT_EQUAL(headerSize, parser.headerSize());
+
+    // More data doesn't change the outcome.
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(data.c_str(), data.size()));
+    LOK_ASSERT_EQUAL(headerSize, parser.headerSize());
+
+    const char* p = data.c_str();
+    LOK_ASSERT_EQUAL(std::string("GET"), parser.verb().toString(p));
+    LOK_ASSERT_EQUAL(std::string("/loleaflet/dist/loleaflet.html?WOPISrc=x"),
+                     parser.url().toString(p));
+    LOK_ASSERT_EQUAL(std::string("HTTP/1.1"), parser.version().toString(p));
+    LOK_ASSERT_EQUAL(3, parser.getFieldCount());
+    LOK_ASSERT_EQUAL(std::string("Accept-Encoding"), parser.getField(1)._name.toString(p));
+
+    http::Span value;
+    LOK_ASSERT(parser.find(p, "host", value));
+    LOK_ASSERT_EQUAL(std::string("localhost:9980"), value.toString(p));
+    LOK_ASSERT(parser.find(p, "Accept-Encoding", value));
+    LOK_ASSERT_EQUAL(std::string("gzip, deflate"), value.toString(p));
+    LOK_ASSERT(parser.find(p, "EmptyKey", value));
+    LOK_ASSERT(value.empty());
+    LOK_ASSERT(!parser.find(p, "Cookie", value));
+
+    LOK_ASSERT_EQUAL(static_cast<int64_t>(-1), parser.getContentLength());
+    LOK_ASSERT(!parser.getChunkedTransferEncoding());
+    LOK_ASSERT(!parser.getExpectContinue());
+
+    // Reset for the next request on the same connection.
+    parser.reset();
+    const std::string next = "\r\nPOST /lool/convert-to HTTP/1.0\nContent-Length: 4\n\n";
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(next.c_str(), next.size()));
+    LOK_ASSERT_EQUAL(next.size(), parser.headerSize());
+    LOK_ASSERT_EQUAL(std::string("POST"), parser.verb().toString(next.c_str()));
+    LOK_ASSERT_EQUAL(std::string("HTTP/1.0"), parser.version().toString(next.c_str()));
+}
+
+void HttpWhiteBoxTests::testServerRequestParserFraming()
+{
+    http::RequestParser parser;
+
+    const std::string post = "POST /lool/convert-to/pdf HTTP/1.1\r\n"
+                             "content-length: 1234\r\n"
+                             "Expect: 100-Continue\r\n\r\n";
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(post.c_str(), post.size()));
+    LOK_ASSERT_EQUAL(static_cast<int64_t>(1234), parser.getContentLength());
+    LOK_ASSERT(parser.getExpectContinue());
+    LOK_ASSERT(!parser.getChunkedTransferEncoding());
+
+    parser.reset();
+    const std::string chunked = "POST /upload HTTP/1.1\r\n"
+                                "Transfer-Encoding: Chunked\r\n\r\n"
+                                "4\r\nWiki\r\n0\r\n\r\n";
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(chunked.c_str(), chunked.size()));
+    LOK_ASSERT_EQUAL(chunked.find("4\r\n"), parser.headerSize());
+    LOK_ASSERT(parser.getChunkedTransferEncoding());
+    LOK_ASSERT_EQUAL(static_cast<int64_t>(-1), parser.getContentLength());
+
+    // A shrunk buffer means it was consumed; parse from the start.
+    const std::string get = "GET / HTTP/1.1\r\n\r\n";
+    parser.reset();
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Incomplete,
+                     parser.parse(chunked.c_str(), chunked.find("Transfer")));
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(get.c_str(), get.size()));
+    LOK_ASSERT_EQUAL(std::string("/"), parser.url().toString(get.c_str()));
+}
+
+void HttpWhiteBoxTests::testServerRequestParserInvalid()
+{
+    const std::vector<std::string> invalid = {
+        "GET /\r\n\r\n",
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1\r\n\r\n",
+        "GET / FTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost : localhost\r\n\r\n",
+        "GET / HTTP/1.1\r\n: value\r\n\r\n",
+        "GET / HTTP/1.1\r\nA: b\r\n folded\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 12a\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+    };
+
+    for (const std::string& data : invalid)
+    {
+        http::RequestParser parser;
+        LOK_ASSERT_EQUAL_MESSAGE(data, http::RequestParser::State::Invalid,
+                                 parser.parse(data.c_str(), data.size()));
+    }
+
+    // Too many fields.
+    std::string data = "GET / HTTP/1.1\r\n";
+    for (int i = 0; i <= http::RequestParser::MaxNumberFields; ++i)
+        data += "X-Field-" + std::to_string(i) + ": value\r\n";
+    data += "\r\n";
+
+    http::RequestParser parser;
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Invalid, parser.parse(data.c_str(), data.size()));
+
+    // Endless header line.
+    parser.reset();
+    data = "GET / HTTP/1.1\r\nX-Long: " + std::string(16 * 1024, 'x');
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Invalid, parser.parse(data.c_str(), data.size()));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(HttpWhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -62,6 +62,11 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testSimple);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testSize);
+    CPPUNIT_TEST(testDeltaChain);
+    CPPUNIT_TEST(testDeltaFromOldWid);
+    CPPUNIT_TEST(testInvalidateArea);
+    CPPUNIT_TEST(testEvictUnused);
+    CPPUNIT_TEST(testSharedStore);
     CPPUNIT_TEST(testCancelTiles);
     // unstable
     // CPPUNIT_TEST(testCancelTilesMultiView);
@@ -99,6 +104,11 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     void testSimple();
     void testSimpleCombine();
     void testSize();
+    void testDeltaChain();
+    void testDeltaFromOldWid();
+    void testInvalidateArea();
+    void testEvictUnused();
+    void testSharedStore();
     void testCancelTiles();
     void testCancelTilesMultiView();
     void testDisconnectMultiView();
@@ -311,6 +321,207 @@ void TileCacheTests::testSize()
     LOK_ASSERT_MESSAGE("tile cache too big", tc.getMemorySize() < maxSize);
 }
 
+void TileCacheTests::testDeltaChain()
+{
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+    tc.setTileDeltas(true);
+
+    const int nviewid = 0;
+    TileDesc tile(nviewid, 0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    tile.setWireId(1);
+
+    std::vector<char> png = genRandomData(4096);
+    png[0] = '\x89';
+    tc.saveTileAndNotify(tile, png.data(), png.size());
+
+    // Invalidated tiles stay around as the base for deltas, but can't be served.
+    tc.invalidateTiles("invalidatetiles: EMPTY", nviewid);
+    std::vector<TileCache::TileUpdate> updates;
+    LOK_ASSERT(!tc.lookupTile(tile));
+    LOK_ASSERT(!tc.lookupTileUpdates(tile, 0, updates));
+
+    std::vector<char> delta = genRandomData(256);
+    delta[0] = 'D';
+    tile.setOldWireId(1);
+    tile.setWireId(2);
+    tc.saveTileAndNotify(tile, delta.data(), delta.size());
+
+    // Only those that take deltas can be served now.
+    LOK_ASSERT(!tc.lookupTile(tile));
+    LOK_ASSERT(tc.lookupTileUpdates(tile, 1, updates));
+    LOK_ASSERT_EQUAL(size_t(1), updates.size());
+    LOK_ASSERT_EQUAL(TileWireId(1), updates[0]._oldWireId);
+    LOK_ASSERT_EQUAL(TileWireId(2), updates[0]._wireId);
+    LOK_ASSERT(delta == *updates[0]._data);
+
+    // Without the base, the client gets the full tile and the delta.
+    updates.clear();
+    LOK_ASSERT(tc.lookupTileUpdates(tile, 0, updates));
+    LOK_ASSERT_EQUAL(size_t(2), updates.size());
+    LOK_ASSERT_EQUAL(TileWireId(0), updates[0]._oldWireId);
+    LOK_ASSERT(png == *updates[0]._data);
+    LOK_ASSERT_EQUAL(TileWireId(2), updates[1]._wireId);
+    LOK_ASSERT(!tc.wantsKeyframe(tile));
+
+    // A delta from something else than what we have drops the tile.
+    tile.setOldWireId(7);
+    tile.setWireId(8);
+    tc.saveTileAndNotify(tile, delta.data(), delta.size());
+    updates.clear();
+    LOK_ASSERT(!tc.lookupTileUpdates(tile, 0, updates));
+    LOK_ASSERT_EQUAL(size_t(0), tc.getMemorySize());
+}
+
+void TileCacheTests::testDeltaFromOldWid()
+{
+    const std::string testname = "deltaFromOldWid ";
+    std::string documentPath, documentURL;
+    getDocumentPathAndURL("hello.odt", documentPath, documentURL, testname);
+
+    std::shared_ptr<http::WebSocketSession> socket = http::WebSocketSession::create(_uri.toString());
+    http::Request request(documentURL);
+    socket->asyncRequest(request, _socketPoll);
+    sendTextFrame(socket, "load url=" + documentURL + " deltas=true", testname);
+    LOK_ASSERT_MESSAGE("Failed to load the document " + documentURL,
+                       isDocumentLoaded(socket, testname));
+
+    const std::string tileRequest = "tilecombine nviewid=0 part=0 width=256 height=256 "
+                                    "tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840";
+    sendTextFrame(socket, tileRequest, testname);
+    std::vector<char> tile = getResponseMessage(socket, "tile:", testname);
+    LOK_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+    TileDesc desc = TileDesc::parse(LOOLProtocol::getFirstLine(tile));
+    const TileWireId wireId = desc.getWireId();
+    LOK_ASSERT(wireId != 0);
+    LOK_ASSERT_EQUAL(TileWireId(0), desc.getOldWireId());
+
+    // Change the tile, then ask for it again, saying which version we have.
+    sendText(socket, "x", testname);
+    LOK_ASSERT_MESSAGE("did not receive an invalidatetiles: message as expected",
+                       !getResponseMessage(socket, "invalidatetiles:", testname).empty());
+
+    sendTextFrame(socket, tileRequest + " oldwid=" + std::to_string(wireId), testname);
+    tile = getResponseMessage(socket, "tile:", testname);
+    LOK_ASSERT_MESSAGE("did not receive a tile: message as expected", !tile.empty());
+    const std::string firstLine = LOOLProtocol::getFirstLine(tile);
+    desc = TileDesc::parse(firstLine);
+    TST_LOG("Got " << firstLine);
+
+    // A delta from what we have, not a whole new image.
+    LOK_ASSERT_EQUAL(wireId, desc.getOldWireId());
+    LOK_ASSERT(desc.getWireId() > wireId);
+    LOK_ASSERT(tile.size() > firstLine.size() + 1);
+    LOK_ASSERT_EQUAL('D', tile[firstLine.size() + 1]);
+
+    socket->asyncShutdown();
+    LOK_ASSERT_MESSAGE("Expected successful disconnection of the WebSocket",
+                       socket->waitForDisconnection(std::chrono::seconds(5)));
+}
+
+void TileCacheTests::testInvalidateArea()
+{
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+
+    const int nviewid = 0;
+    const int tileSize = 3840;
+    const std::vector<char> data = genRandomData(256);
+    for (int part = 0; part < 3; ++part)
+    {
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+            {
+                TileDesc tile(nviewid, part, 256, 256, x * tileSize, y * tileSize, tileSize,
+                              tileSize, -1, 0, -1, false);
+                tc.saveTileAndNotify(tile, data.data(), data.size());
+            }
+        }
+    }
+
+    const auto isCached = [&](int part, int x, int y) {
+        TileDesc tile(nviewid, part, 256, 256, x * tileSize, y * tileSize, tileSize, tileSize, -1,
+                      0, -1, false);
+        return !!tc.lookupTile(tile);
+    };
+
+    // Inside a single tile of one part.
+    tc.invalidateTiles("invalidatetiles: part=1 x=4000 y=4000 width=100 height=100", nviewid);
+    LOK_ASSERT(!isCached(1, 1, 1));
+    LOK_ASSERT(isCached(1, 0, 0));
+    LOK_ASSERT(isCached(1, 2, 1));
+    LOK_ASSERT(isCached(0, 1, 1));
+    LOK_ASSERT(isCached(2, 1, 1));
+
+    // A point on the corner touches all four tiles around it.
+    tc.invalidateTiles("invalidatetiles: part=2 x=3840 y=7680 width=0 height=0", nviewid);
+    LOK_ASSERT(!isCached(2, 0, 1));
+    LOK_ASSERT(!isCached(2, 1, 1));
+    LOK_ASSERT(!isCached(2, 0, 2));
+    LOK_ASSERT(!isCached(2, 1, 2));
+    LOK_ASSERT(isCached(2, 2, 2));
+    LOK_ASSERT(isCached(2, 0, 3));
+
+    // Other views are left alone.
+    tc.invalidateTiles("invalidatetiles: EMPTY", nviewid + 1);
+    LOK_ASSERT(isCached(0, 3, 3));
+
+    tc.invalidateTiles("invalidatetiles: EMPTY, 0", nviewid);
+    LOK_ASSERT(!isCached(0, 3, 3));
+    LOK_ASSERT(isCached(1, 3, 3));
+
+    tc.invalidateTiles("invalidatetiles: EMPTY", nviewid);
+    LOK_ASSERT(!isCached(1, 3, 3));
+    LOK_ASSERT_EQUAL(size_t(0), tc.getMemorySize());
+}
+
+void TileCacheTests::testEvictUnused()
+{
+    TileCache tc("doc.ods", std::chrono::system_clock::time_point());
+
+    const std::vector<char> data = genRandomData(4096);
+    const size_t maxSize = (data.size() + sizeof (TileDesc)) * 10;
+    tc.setMaxCacheSize(maxSize);
+
+    // A tile in use survives many more new ones than fit in the cache.
+    TileDesc used(0, 0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    for (int tilePosY = 0; tilePosY < 100; ++tilePosY)
+    {
+        TileDesc tile(0, 0, 256, 256, 0, tilePosY * 3840, 3840, 3840, -1, 0, -1, false);
+        tile.setWireId(tilePosY + 1);
+        tc.saveTileAndNotify(tile, data.data(), data.size());
+        LOK_ASSERT_MESSAGE("used tile evicted", tc.lookupTile(used));
+    }
+
+    LOK_ASSERT(tc.getMemorySize() <= maxSize);
+}
+
+void TileCacheTests::testSharedStore()
+{
+    TileCache tc1("doc1.odt", std::chrono::system_clock::time_point());
+    TileCache tc2("doc2.odt", std::chrono::system_clock::time_point());
+
+    TileDesc tile(0, 0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+    const std::vector<char> data = genRandomData(2048);
+    tc1.saveTileAndNotify(tile, data.data(), data.size());
+    tc2.saveTileAndNotify(tile, data.data(), data.size());
+
+    // Both documents have the very same image.
+    TileCache::Tile tile1 = tc1.lookupTile(tile);
+    TileCache::Tile tile2 = tc2.lookupTile(tile);
+    LOK_ASSERT(tile1);
+    LOK_ASSERT_EQUAL(tile1.get(), tile2.get());
+    LOK_ASSERT(data == *tile1);
+
+    // Different content is stored apart, even for the same tile.
+    std::vector<char> other = data;
+    other.back() ^= 1;
+    tc2.saveTileAndNotify(tile, other.data(), other.size());
+    tile2 = tc2.lookupTile(tile);
+    LOK_ASSERT(tile1.get() != tile2.get());
+    LOK_ASSERT(other == *tile2);
+    LOK_ASSERT(data == *tc1.lookupTile(tile));
+}
+
 void TileCacheTests::testCancelTiles()
 {
     const char* testname = "cancelTiles ";
@@ -7,6 +7,8 @@
 
 #include <config.h>
 
+#include <thread>
+
 #include <test/lokassert.hpp>
 
 #include <Common.hpp>
@@ -47,10 +49,16 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
+    CPPUNIT_TEST(testSenderQueueDeltaDeduplication);
+    CPPUNIT_TEST(testSenderQueueThreaded);
     CPPUNIT_TEST(testCallbackModifiedStatusIsSkipped);
     CPPUNIT_TEST(testCallbackInvalidation);
     CPPUNIT_TEST(testCallbackIndicatorValue);
     CPPUNIT_TEST(testCallbackPageSize);
+    CPPUNIT_TEST(testTextInputCombining);
+    CPPUNIT_TEST(testInvalidationCoalescing);
+    CPPUNIT_TEST(testInvalidationOrdering);
+    CPPUNIT_TEST(testPrerenderCancelling);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -62,10 +70,16 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
     void testInvalidateViewCursorDeduplication();
+    void testSenderQueueDeltaDeduplication();
+    void testSenderQueueThreaded();
     void testCallbackModifiedStatusIsSkipped();
     void testCallbackInvalidation();
     void testCallbackIndicatorValue();
     void testCallbackPageSize();
+    void testTextInputCombining();
+    void testInvalidationCoalescing();
+    void testInvalidationOrdering();
+    void testPrerenderCancelling();
 };
 
 void TileQueueTests::testTileQueuePriority()
@@ -471,6 +485,203 @@ void TileQueueTests::testCallbackPageSize()
     LOK_ASSERT_EQUAL(std::string("callback all 13 12474, 205748"), payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testSenderQueueDeltaDeduplication()
+{
+    SenderQueue<std::shared_ptr<Message>> queue;
+
+    std::shared_ptr<Message> item;
+
+    const std::string tile = "tile: nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                             "tilewidth=3840 tileheight=3840";
+    const std::string other = "tile: nviewid=0 part=0 width=256 height=256 tileposx=3840 "
+                              "tileposy=0 tilewidth=3840 tileheight=3840";
+
+    // A delta needs the tile queued before it.
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=0 wid=1\n\x89PNG", Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(other + " oldwid=0 wid=2\n\x89PNG", Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>(tile + " oldwid=1 wid=3\nDc", Message::Dir::Out));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(3), queue.size());
+
+    // A full tile supersedes both.
+    const std::string full = tile + " oldwid=0 wid=4\n\x89PNG";
+    queue.enqueue(std::make_shared<Message>(full, Message::Dir::Out));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(2), queue.size());
+
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    LOK_ASSERT(item->firstLine().find("wid=2") != std::string::npos);
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    LOK_ASSERT_EQUAL(full, std::string(item->data().data(), item->data().size()));
+    LOK_ASSERT_EQUAL(false, queue.dequeue(item));
+
+    // Once sent, nothing is left to supersede.
+    queue.enqueue(std::make_shared<Message>(full, Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>("setpart: part=1", Message::Dir::Out));
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    queue.enqueue(std::make_shared<Message>(full, Message::Dir::Out));
+    queue.enqueue(std::make_shared<Message>("setpart: part=2", Message::Dir::Out));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(2), queue.size());
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    LOK_ASSERT_EQUAL(full, std::string(item->data().data(), item->data().size()));
+    LOK_ASSERT_EQUAL(true, queue.dequeue(item));
+    LOK_ASSERT_EQUAL(std::string("setpart: part=2"), std::string(item->data().data(), item->data().size()));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), queue.size());
+}
+
+void TileQueueTests::testSenderQueueThreaded()
+{
+    SenderQueue<std::shared_ptr<Message>> queue;
+
+    // Enough to wrap around many ring segments, with one drop every few messages.
+    constexpr int Count = 20000;
+    std::thread producer([&queue]()
+        {
+            for (int i = 0; i < Count; ++i)
+            {
+                queue.enqueue(std::make_shared<Message>("message " + std::to_string(i),
+                                                        Message::Dir::Out));
+                if (i % 7 == 0)
+                    queue.enqueue(std::make_shared<Message>("setpart: part=" + std::to_string(i),
+                                                            Message::Dir::Out));
+            }
+        });
+
+    int last = -1;
+    int lastPart = -1;
+    std::shared_ptr<Message> item;
+    while (last < Count - 1)
+    {
+        if (!queue.dequeue(item))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        const std::string msg(item->data().data(), item->data().size());
+        if (item->firstTokenMatches("setpart:"))
+        {
+            const int part = std::stoi(msg.substr(sizeof("setpart: part=") - 1));
+            LOK_ASSERT(part > lastPart);
+            LOK_ASSERT(part <= last);
+            lastPart = part;
+        }
+        else
+        {
+            // Never lost nor reordered.
+            LOK_ASSERT_EQUAL("message " + std::to_string(last + 1), msg);
+            ++last;
+        }
+    }
+
+    producer.join();
+
+    while (queue.dequeue(item))
+        LOK_ASSERT(item->firstTokenMatches("setpart:"));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), queue.size());
+}
+
+void TileQueueTests::testTextInputCombining()
+{
+    TileQueue queue;
+
+    // Other ids and sessions don't prevent combining.
+    queue.put("child-1 textinput id=0 text=a");
+    queue.put("child-1 textinput id=1 text=b");
+    queue.put("child-2 key type=input char=97 key=0");
+    queue.put("child-1 textinput id=0 text=c");
+    queue.put("child-1 removetextcontext id=0 before=1 after=0");
+
+    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+
+    // Nor combine across input, even with the message combined into the queue already.
+    queue.put("child-1 textinput id=0 text=d");
+    queue.put("child-1 removetextcontext id=0 before=2 after=1");
+
+    LOK_ASSERT_EQUAL(6, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(std::string("child-1 textinput id=1 text=b"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("child-2 key type=input char=97 key=0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("child-1 textinput id=0 text=ac"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("child-1 removetextcontext id=0 before=1 after=0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("child-1 textinput id=0 text=d"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("child-1 removetextcontext id=0 before=2 after=1"), payloadAsString(queue.get()));
+
+    queue.put("child-1 removetextcontext id=0 before=1 after=0");
+    queue.put("child-1 removetextcontext id=0 before=1 after=2");
+    LOK_ASSERT_EQUAL(std::string("child-1 removetextcontext id=0 before=2 after=2"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(true, queue.isEmpty());
+}
+
+void TileQueueTests::testInvalidationCoalescing()
+{
+    TileQueue queue;
+
+    // Typing: overlapping and adjacent invalidations of the same line.
+    queue.invalidate("1000, 1000, 500, 300, 0");
+    queue.invalidate("1200, 1000, 500, 300, 0");
+    queue.invalidate("4000, 1100, 800, 200, 0");
+    // Far away, and on another part.
+    queue.invalidate("40000, 40000, 100, 100, 0");
+    queue.invalidate("1000, 1000, 500, 300, 1");
+
+    LOK_ASSERT_EQUAL(true, queue.hasInvalidations());
+    LOK_ASSERT_EQUAL(true, queue.isEmpty());
+
+    queue.flushInvalidations();
+    LOK_ASSERT_EQUAL(false, queue.hasInvalidations());
+    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(std::string("callback all 0 1000, 1000, 3800, 300, 0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("callback all 0 40000, 40000, 100, 100, 0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(std::string("callback all 0 1000, 1000, 500, 300, 1"), payloadAsString(queue.get()));
+
+    // The whole part absorbs everything in it.
+    queue.invalidate("1000, 1000, 500, 300, 0");
+    queue.invalidate("EMPTY, 0");
+    queue.invalidate("40000, 40000, 100, 100, 0");
+    queue.flushInvalidations();
+    LOK_ASSERT_EQUAL(std::string("callback all 0 EMPTY, 0"), payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(true, queue.isEmpty());
+
+    // As does invalidating all the parts, which is queued as is.
+    queue.invalidate("1000, 1000, 500, 300, 1");
+    queue.invalidate("EMPTY");
+    LOK_ASSERT_EQUAL(false, queue.hasInvalidations());
+    LOK_ASSERT_EQUAL(std::string("callback all 0 EMPTY"), payloadAsString(queue.get()));
+
+    // Scattered ones are merged to stay few.
+    for (int i = 0; i < 20; ++i)
+        queue.invalidate(std::to_string(i * 20000) + ", 0, 100, 100, 0");
+    queue.flushInvalidations();
+    LOK_ASSERT_EQUAL(8, static_cast<int>(queue.getQueue().size()));
+}
+
+void TileQueueTests::testInvalidationOrdering()
+{
+    TileQueue queue;
+
+    const std::string invalidate = "callback all " + std::to_string(LOK_CALLBACK_INVALIDATE_TILES) + ' ';
+    const std::string sizeChanged = "callback all " + std::to_string(LOK_CALLBACK_DOCUMENT_SIZE_CHANGED) + " 12240, 15840";
+    const std::string stateChanged = "callback 0 " + std::to_string(LOK_CALLBACK_STATE_CHANGED) + " .uno:Bold=true";
+
+    // The invalidations go out before the callbacks following them...
+    queue.invalidate("1000, 1000, 500, 300, 0");
+    queue.put(sizeChanged);
+    LOK_ASSERT_EQUAL(false, queue.hasInvalidations());
+
+    // ...and are merged only with the ones right before or after them.
+    queue.invalidate("1000, 1000, 500, 300, 0");
+    queue.invalidate("1200, 1000, 500, 300, 0");
+    queue.put(stateChanged);
+    queue.invalidate("1000, 1000, 500, 300, 0");
+    queue.flushInvalidations();
+
+    LOK_ASSERT_EQUAL(5, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(invalidate + "1000, 1000, 500, 300, 0", payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(sizeChanged, payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(invalidate + "1000, 1000, 700, 300, 0", payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(stateChanged, payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(invalidate + "1000, 1000, 500, 300, 0", payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(true, queue.isEmpty());
+}
+
 void TileQueueTests::testCallbackModifiedStatusIsSkipped()
 {
     TileQueue queue;
@@ -498,6 +709,41 @@ void TileQueueTests::testCallbackModifiedStatusIsSkipped()
     LOK_ASSERT_EQUAL(messages[3], payloadAsString(queue.get()));
 }
 
+void TileQueueTests::testPrerenderCancelling()
+{
+    const std::string prerender = "prerendertiles nviewid=0 part=0 width=256 height=256 tileposx=0,3840 tileposy=7680,7680 imgsize=0,0 tilewidth=3840 tileheight=3840 ver=5,6 oldwid=0,0 wid=0,0";
+    const std::string tile = "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=7680 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=7";
+    const std::string callback = "callback all 0 0, 0, 100, 100, 0";
+
+    TileQueue queue;
+
+    // Rendered when there is nothing else to do, combined as usual.
+    queue.put(prerender);
+    queue.put(callback);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(3), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(std::string("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=0,3840 tileposy=7680,7680 imgsize=0,0 tilewidth=3840 tileheight=3840 ver=5,6 oldwid=0,0 wid=0,0"),
+                     payloadAsString(queue.get()));
+    LOK_ASSERT_EQUAL(callback, payloadAsString(queue.get()));
+
+    // A real request drops them, even the one it asks for again.
+    queue.put(prerender);
+    queue.put(tile);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(tile, payloadAsString(queue.get()));
+
+    // So does input.
+    queue.put(prerender);
+    queue.put("child-1 key type=input char=97 key=0");
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(std::string("child-1 key type=input char=97 key=0"), payloadAsString(queue.get()));
+
+    // And they don't replace what was asked for already.
+    queue.put(tile);
+    queue.put(prerender);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(2), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(tile, payloadAsString(queue.getQueue().front()._payload));
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(TileQueueTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "WopiTestServer.hpp"
+#include "Log.hpp"
+#include "Unit.hpp"
+#include "UnitHTTP.hpp"
+#include "helpers.hpp"
+#include "lokassert.hpp"
+
+#include <Poco/Net/HTTPRequest.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+/**
+ * This test asserts that sessions are added to a document asynchronously
+ * without losing track of the sessions still loading.
+ *
+ * The way this works is as follows:
+ * 1. Load a document with a first session.
+ * 2. Join a second session; while its CheckFileInfo is pending at the
+ *    storage, disconnect the first (and last loaded) session.
+ * 3. The document must survive, and the second session must load.
+ * 4. Join a third session whose CheckFileInfo fails.
+ * 5. The third session must fail to load, and the second one stay usable.
+ */
+class UnitWOPIAsyncLoad : public WopiTestServer
+{
+    enum class Phase
+    {
+        Load,
+        WaitLoadStatus,
+        Join,
+        WaitJoinStatus,
+        FailedJoin,
+        WaitStatus,
+        Polling
+    } _phase;
+
+    /// The number of CheckFileInfo requests served so far.
+    int _checkFileInfoCount;
+
+    /// The session joining while the first one leaves.
+    std::unique_ptr<UnitWebSocket> _ws2;
+
+    static constexpr auto testname = "UnitWOPIAsyncLoad";
+
+public:
+    UnitWOPIAsyncLoad()
+        : WopiTestServer(testname)
+        , _phase(Phase::Load)
+        , _checkFileInfoCount(0)
+    {
+    }
+
+    bool handleHttpRequest(const Poco::Net::HTTPRequest& request, Poco::MemoryInputStream& message,
+                           std::shared_ptr<StreamSocket>& socket) override
+    {
+        Poco::URI uriReq(request.getURI());
+        static const Poco::RegularExpression regInfo("/wopi/files/[0-9]");
+
+        if (request.getMethod() == "GET" && regInfo.match(uriReq.getPath()))
+        {
+            ++_checkFileInfoCount;
+            LOG_TST("Fake wopi host request, CheckFileInfo #" << _checkFileInfoCount);
+
+            if (_checkFileInfoCount == 2)
+            {
+                // The second session is loading; have the first leave meanwhile.
+                // There is no hook for the DocBroker handling the disconnection,
+                // so give it a moment before answering.
+                LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitJoinStatus",
+                                   _phase == Phase::WaitJoinStatus);
+                LOG_TST("Disconnecting the first session while the second is loading.");
+                getWs()->getLOOLWebSocket()->shutdown(testname);
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            else if (_checkFileInfoCount == 3)
+            {
+                LOK_ASSERT_MESSAGE("Expected to be in Phase::FailedJoin",
+                                   _phase == Phase::FailedJoin);
+                LOG_TST("Failing CheckFileInfo of the third session.");
+                http::Response httpResponse(http::StatusLine(404));
+                socket->sendAndShutdown(httpResponse);
+                return true;
+            }
+        }
+
+        return WopiTestServer::handleHttpRequest(request, message, socket);
+    }
+
+    void assertGetFileRequest(const Poco::Net::HTTPRequest& /*request*/) override
+    {
+        // The document is downloaded once, by the first session; the others join it.
+        LOK_ASSERT_EQUAL_MESSAGE("Expected a single GetFile", 1, _checkFileInfoCount);
+    }
+
+    bool onDocumentLoaded(const std::string& message) override
+    {
+        LOG_TST("onDocumentLoaded: [" << message << ']');
+        switch (_phase)
+        {
+            case Phase::WaitLoadStatus:
+                _phase = Phase::Join;
+                break;
+            case Phase::WaitJoinStatus:
+                LOK_ASSERT_EQUAL_MESSAGE("Expected the second session to load", 2,
+                                         _checkFileInfoCount);
+                _phase = Phase::FailedJoin;
+                break;
+            case Phase::WaitStatus:
+                passTest("The document survived the sessions leaving and failing while loading.");
+                _phase = Phase::Polling;
+                break;
+            default:
+                failTest("Unexpected status in phase " + std::to_string(static_cast<int>(_phase)));
+                break;
+        }
+
+        SocketPoll::wakeupWorld();
+        return true;
+    }
+
+    void invokeWSDTest() override
+    {
+        switch (_phase)
+        {
+            case Phase::Load:
+            {
+                LOG_TST("Phase::Load");
+                _phase = Phase::WaitLoadStatus;
+
+                initWebsocket("/wopi/files/0?access_token=anything");
+
+                WSD_CMD("load url=" + getWopiSrc());
+            }
+            break;
+            case Phase::Join:
+            {
+                LOG_TST("Phase::Join");
+                _phase = Phase::WaitJoinStatus;
+
+                _ws2.reset(new UnitWebSocket("/lool/" + getWopiSrc() + "/ws"));
+                helpers::sendTextFrame(*_ws2->getLOOLWebSocket(), "load url=" + getWopiSrc(),
+                                       testname);
+            }
+            break;
+            case Phase::FailedJoin:
+            {
+                LOG_TST("Phase::FailedJoin");
+
+                UnitWebSocket ws3("/lool/" + getWopiSrc() + "/ws");
+                helpers::sendTextFrame(*ws3.getLOOLWebSocket(), "load url=" + getWopiSrc(),
+                                       testname);
+
+                std::string message;
+                const int statusCode =
+                    helpers::getErrorCode(*ws3.getLOOLWebSocket(), message, testname);
+                LOK_ASSERT_EQUAL(static_cast<int>(Poco::Net::WebSocket::WS_POLICY_VIOLATION),
+                                 statusCode);
+                LOK_ASSERT_EQUAL(std::string("error: cmd=storage kind=loadfailed"), message);
+
+                // The failed join must not have taken the document down.
+                _phase = Phase::WaitStatus;
+                helpers::sendTextFrame(*_ws2->getLOOLWebSocket(), "status", testname);
+            }
+            break;
+            case Phase::WaitLoadStatus:
+            case Phase::WaitJoinStatus:
+            case Phase::WaitStatus:
+            case Phase::Polling:
+            {
+                // Nothing to do.
+            }
+            break;
+        }
+    }
+};
+
+UnitBase* unit_create_wsd(void) { return new UnitWOPIAsyncLoad(); }
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
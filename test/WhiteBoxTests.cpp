@@ -14,10 +14,13 @@
 #include <Auth.hpp>
 #include <ChildSession.hpp>
 #include <Common.hpp>
+#include <Exceptions.hpp>
 #include <FileUtil.hpp>
 #include <Kit.hpp>
 #include <MessageQueue.hpp>
+#include <RenderTiles.hpp>
 #include <Protocol.hpp>
+#include <Simd.hpp>
 #include <TileDesc.hpp>
 #include <Util.hpp>
 #include <JsonUtil.hpp>
@@ -25,12 +28,17 @@
 
 #include <common/Message.hpp>
 #include <common/Authorization.hpp>
+#include <common/LogRing.hpp>
+#include <common/TraceEventFormat.hpp>
 #include <wsd/FileServer.hpp>
 #include <net/Buffer.hpp>
 #include <net/NetUtil.hpp>
+#include <net/ServerSocket.hpp>
+#include <net/Socket.hpp>
 
 #include <chrono>
 #include <fstream>
+#include <sstream>
 
 #include <cppunit/extensions/HelperMacros.h>
 
@@ -51,11 +59,15 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testEmptyCellCursor);
     CPPUNIT_TEST(testTileDesc);
     CPPUNIT_TEST(testRectanglesIntersect);
+    CPPUNIT_TEST(testTilesOnFly);
+    CPPUNIT_TEST(testWindowFrames);
     CPPUNIT_TEST(testAuthorization);
     CPPUNIT_TEST(testJson);
     CPPUNIT_TEST(testAnonymization);
     CPPUNIT_TEST(testTime);
     CPPUNIT_TEST(testBufferClass);
+    CPPUNIT_TEST(testLogRing);
+    CPPUNIT_TEST(testTraceEventFormat);
     CPPUNIT_TEST(testStringVector);
     CPPUNIT_TEST(testHexify);
     CPPUNIT_TEST(testRequestDetails_DownloadURI);
@@ -63,15 +75,25 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testRequestDetails_local);
     CPPUNIT_TEST(testRequestDetails_local_hexified);
     CPPUNIT_TEST(testRequestDetails);
+    CPPUNIT_TEST(testRequestDetails_parsed);
     CPPUNIT_TEST(testUIDefaults);
     CPPUNIT_TEST(testCSSVars);
+    CPPUNIT_TEST(testStaticFiles);
+    CPPUNIT_TEST(testStaticFileContent);
     CPPUNIT_TEST(testStat);
+    CPPUNIT_TEST(testProcessStat);
     CPPUNIT_TEST(testStringCompare);
     CPPUNIT_TEST(testParseUri);
     CPPUNIT_TEST(testParseUriUrl);
     CPPUNIT_TEST(testParseUrl);
     CPPUNIT_TEST(testSafeAtoi);
     CPPUNIT_TEST(testBytesToHex);
+    CPPUNIT_TEST(testSimdKernels);
+    CPPUNIT_TEST(testSocketPollDispatch);
+    CPPUNIT_TEST(testServerSocketReusePort);
+    CPPUNIT_TEST(testThreadPool);
+    CPPUNIT_TEST(testThreadPoolStealing);
+    CPPUNIT_TEST(testFinishRenderOrder);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -87,11 +109,15 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testEmptyCellCursor();
     void testTileDesc();
     void testRectanglesIntersect();
+    void testTilesOnFly();
+    void testWindowFrames();
     void testAuthorization();
     void testJson();
     void testAnonymization();
     void testTime();
     void testBufferClass();
+    void testLogRing();
+    void testTraceEventFormat();
     void testStringVector();
     void testHexify();
     void testRequestDetails_DownloadURI();
@@ -99,15 +125,25 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testRequestDetails_local();
     void testRequestDetails_local_hexified();
     void testRequestDetails();
+    void testRequestDetails_parsed();
     void testUIDefaults();
     void testCSSVars();
+    void testStaticFiles();
+    void testStaticFileContent();
     void testStat();
+    void testProcessStat();
     void testStringCompare();
     void testParseUri();
     void testParseUriUrl();
     void testParseUrl();
     void testSafeAtoi();
     void testBytesToHex();
+    void testSimdKernels();
+    void testSocketPollDispatch();
+    void testServerSocketReusePort();
+    void testThreadPool();
+    void testThreadPoolStealing();
+    void testFinishRenderOrder();
 };
 
 void WhiteBoxTests::testLOOLProtocolFunctions()
@@ -640,6 +676,7 @@ void WhiteBoxTests::testRegexListMatcher_Init()
 class DummyDocument : public DocumentManagerInterface
 {
     std::shared_ptr<TileQueue> _tileQueue;
+    PngCache _pngCache;
     std::mutex _mutex;
     std::mutex _documentMutex;
 public:
@@ -702,6 +739,11 @@ public:
         return _tileQueue;
     }
 
+    PngCache& getPngCache() override
+    {
+        return _pngCache;
+    }
+
     bool sendFrame(const char* /*buffer*/, int /*length*/, WSOpCode /*opCode*/) override
     {
         return true;
@@ -762,6 +804,104 @@ void WhiteBoxTests::testRectanglesIntersect()
                                                   1000, 1000, 2000, 1000));
 }
 
+void WhiteBoxTests::testTilesOnFly()
+{
+    const TileDesc desc(1, 2, 256, 256, 7680, 3840, 3840, 3840, -1, 0, -1, false);
+    const TileKey key = desc.generateKey();
+    LOK_ASSERT_EQUAL(std::string("2:7680:3840:3840:3840:1"), desc.generateID());
+
+    TileKey parsed;
+    LOK_ASSERT(TileKey::parse(desc.generateID(), parsed));
+    LOK_ASSERT(parsed == key);
+    LOK_ASSERT_EQUAL(key.hash(), parsed.hash());
+    LOK_ASSERT(!TileKey::parse("2:7680:3840:3840:3840", parsed));
+    LOK_ASSERT(!TileKey::parse("2:7680:3840:3840:3840:1:", parsed));
+    LOK_ASSERT(!TileKey::parse("2:7680:x:3840:3840:1", parsed));
+
+    const TileKey other(2, 7680, 3840, 3840, 3840, 0);
+    LOK_ASSERT(other != key);
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::chrono::milliseconds timeout(100);
+    TilesOnFly tilesOnFly;
+    tilesOnFly.add(key, start);
+    tilesOnFly.add(other, start + std::chrono::milliseconds(10));
+    tilesOnFly.add(key, start + std::chrono::milliseconds(20));
+    LOK_ASSERT_EQUAL(std::size_t(3), tilesOnFly.size());
+    LOK_ASSERT_EQUAL(std::size_t(2), tilesOnFly.count(key));
+    LOK_ASSERT_EQUAL(std::size_t(1), tilesOnFly.count(other));
+
+    // The oldest send of key is acknowledged, so it doesn't time out.
+    LOK_ASSERT(tilesOnFly.remove(key));
+    LOK_ASSERT_EQUAL(std::size_t(1), tilesOnFly.count(key));
+
+    std::vector<TileKey> expired;
+    const auto collect = [&expired](const TileKey& k, std::chrono::steady_clock::duration) {
+        expired.push_back(k);
+    };
+    tilesOnFly.expire(start + std::chrono::milliseconds(115), timeout, collect);
+    LOK_ASSERT_EQUAL(std::size_t(1), expired.size());
+    LOK_ASSERT(expired[0] == other);
+    LOK_ASSERT_EQUAL(std::size_t(1), tilesOnFly.size());
+    LOK_ASSERT(!tilesOnFly.remove(other));
+
+    tilesOnFly.expire(start + std::chrono::milliseconds(200), timeout, collect);
+    LOK_ASSERT_EQUAL(std::size_t(2), expired.size());
+    LOK_ASSERT(expired[1] == key);
+    LOK_ASSERT_EQUAL(std::size_t(0), tilesOnFly.size());
+    LOK_ASSERT_EQUAL(std::size_t(0), tilesOnFly.count(key));
+
+    tilesOnFly.add(key, start);
+    tilesOnFly.clear();
+    LOK_ASSERT_EQUAL(std::size_t(0), tilesOnFly.size());
+    LOK_ASSERT(!tilesOnFly.remove(key));
+}
+
+void WhiteBoxTests::testWindowFrames()
+{
+    constexpr int width = 100;
+    constexpr int height = 70;
+    const int cellSize = WindowFrames::CellSize;
+    const Util::Rectangle window(0, 0, width, height);
+    std::vector<unsigned char> pixmap(width * height * 4, 0xff);
+
+    // Everything is new at first, and nothing has changed when painted again.
+    WindowFrames frames;
+    std::vector<Util::Rectangle> damage = frames.update(1, window, 1.0, pixmap);
+    LOK_ASSERT_EQUAL(std::size_t(1), damage.size());
+    LOK_ASSERT_EQUAL(width, damage[0].getWidth());
+    LOK_ASSERT_EQUAL(height, damage[0].getHeight());
+    LOK_ASSERT(frames.update(1, window, 1.0, pixmap).empty());
+
+    // Cells damaged on consecutive rows merge, the last ones are clipped.
+    pixmap[(5 * width + 40) * 4] = 0;
+    pixmap[(40 * width + 45) * 4] = 0;
+    pixmap[(69 * width + 99) * 4 + 3] = 0;
+    damage = frames.update(1, window, 1.0, pixmap);
+    LOK_ASSERT_EQUAL(std::size_t(2), damage.size());
+    LOK_ASSERT_EQUAL(cellSize, damage[0].getLeft());
+    LOK_ASSERT_EQUAL(0, damage[0].getTop());
+    LOK_ASSERT_EQUAL(cellSize, damage[0].getWidth());
+    LOK_ASSERT_EQUAL(2 * cellSize, damage[0].getHeight());
+    LOK_ASSERT_EQUAL(3 * cellSize, damage[1].getLeft());
+    LOK_ASSERT_EQUAL(2 * cellSize, damage[1].getTop());
+    LOK_ASSERT_EQUAL(width, damage[1].getRight());
+    LOK_ASSERT_EQUAL(height, damage[1].getBottom());
+
+    // Painting a part of the window updates the frame of the whole.
+    const Util::Rectangle part(32, 32, 10, 10);
+    LOK_ASSERT_EQUAL(std::size_t(1),
+                     frames.update(1, part, 1.0, std::vector<unsigned char>(10 * 10 * 4, 0)).size());
+    for (int y = part.getTop(); y < part.getBottom(); ++y)
+        std::fill_n(pixmap.begin() + (y * width + part.getLeft()) * 4, part.getWidth() * 4, 0);
+    LOK_ASSERT(frames.update(1, window, 1.0, pixmap).empty());
+
+    // All is sent again after a change of scale, or when forgotten.
+    LOK_ASSERT_EQUAL(std::size_t(1), frames.update(1, window, 2.0, pixmap).size());
+    frames.forget(1);
+    LOK_ASSERT_EQUAL(std::size_t(1), frames.update(1, window, 2.0, pixmap).size());
+}
+
 void WhiteBoxTests::testAuthorization()
 {
     Authorization auth1(Authorization::Type::Token, "abc");
@@ -1119,6 +1259,176 @@ void WhiteBoxTests::testBufferClass()
     buf.eraseFirst(buf.size()); // Remove all.
     CPPUNIT_ASSERT_EQUAL(0UL, buf.size());
     CPPUNIT_ASSERT_EQUAL(true, buf.empty());
+
+    // Shared data is referenced, not copied.
+    const auto shared = std::make_shared<const std::vector<char>>(BlockSize, 's');
+    buf.append(data, sizeof(data));
+    buf.append(shared);
+    buf.append(data, sizeof(data));
+    CPPUNIT_ASSERT_EQUAL(2 * sizeof(data) + BlockSize, buf.size());
+    CPPUNIT_ASSERT_EQUAL(sizeof(data), buf.getBlockSize());
+
+    iovec iov[4];
+    CPPUNIT_ASSERT_EQUAL(3, buf.getIOVec(iov, 4, buf.size()));
+    CPPUNIT_ASSERT_EQUAL(static_cast<const void*>(shared->data()),
+                         static_cast<const void*>(iov[1].iov_base));
+    CPPUNIT_ASSERT_EQUAL(BlockSize, iov[1].iov_len);
+    CPPUNIT_ASSERT_EQUAL(2, buf.getIOVec(iov, 4, sizeof(data) + 1));
+    CPPUNIT_ASSERT_EQUAL(1UL, iov[1].iov_len);
+
+    // Erase across blocks, into the middle of the shared one.
+    buf.eraseFirst(sizeof(data) + 1);
+    CPPUNIT_ASSERT_EQUAL(sizeof(data) + BlockSize - 1, buf.size());
+    CPPUNIT_ASSERT_EQUAL(BlockSize - 1, buf.getBlockSize());
+    CPPUNIT_ASSERT(buf.getBlock() == shared->data() + 1);
+
+    buf.eraseFirst(BlockSize - 1);
+    CPPUNIT_ASSERT_EQUAL(sizeof(data), buf.size());
+    CPPUNIT_ASSERT_EQUAL(0, memcmp(buf.getBlock(), data, buf.size()));
+
+    buf.eraseFirst(buf.size()); // Remove all.
+    CPPUNIT_ASSERT_EQUAL(true, buf.empty());
+    CPPUNIT_ASSERT(std::vector<char>(BlockSize, 's') == *shared);
+
+    // Data kept alive by its owner is referenced until written out.
+    auto owner = std::make_shared<const std::string>("owned elsewhere");
+    std::weak_ptr<const std::string> weakOwner = owner;
+    buf.append(owner->data() + 6, owner->size() - 6, owner);
+    buf.append(data, sizeof(data));
+    owner.reset();
+    CPPUNIT_ASSERT(!weakOwner.expired());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(9), buf.getBlockSize());
+    CPPUNIT_ASSERT_EQUAL(0, memcmp(buf.getBlock(), "elsewhere", 9));
+
+    buf.eraseFirst(9);
+    CPPUNIT_ASSERT(weakOwner.expired());
+    CPPUNIT_ASSERT_EQUAL(0, memcmp(buf.getBlock(), data, buf.size()));
+}
+
+void WhiteBoxTests::testLogRing()
+{
+    Log::Ring ring(256);
+    CPPUNIT_ASSERT(ring.empty());
+
+    std::vector<std::string> records;
+    const auto collect = [&records](int priority, const char* text, std::size_t size) {
+        records.push_back(std::to_string(priority) + ':' + std::string(text, size));
+    };
+
+    // Records come out newline-terminated, in order.
+    CPPUNIT_ASSERT(ring.push(7, "first", 5));
+    CPPUNIT_ASSERT(ring.push(3, "second", 6));
+    std::size_t position = ring.peek(collect, 1);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), records.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("7:first\n"), records[0]);
+
+    // Nothing is freed until released.
+    records.clear();
+    CPPUNIT_ASSERT_EQUAL(position, ring.peek(collect, 1));
+    ring.release(position);
+    ring.release(ring.peek(collect, 10));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), records.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("3:second\n"), records[1]);
+    CPPUNIT_ASSERT(ring.empty());
+
+    // Wrap around many times, records staying contiguous.
+    for (int i = 0; i < 100; ++i)
+    {
+        const std::string text = "record #" + std::to_string(i) + std::string(i % 40, 'x');
+        CPPUNIT_ASSERT(ring.push(i, text.data(), text.size()));
+        records.clear();
+        ring.release(ring.peek(collect, 10));
+        CPPUNIT_ASSERT_EQUAL(std::size_t(1), records.size());
+        CPPUNIT_ASSERT_EQUAL(std::to_string(i) + ':' + text + '\n', records[0]);
+    }
+
+    // When full, records are dropped and counted, not overwritten.
+    const std::string text(40, 'y');
+    std::size_t pushed = 0;
+    while (ring.push(6, text.data(), text.size()))
+        ++pushed;
+    CPPUNIT_ASSERT(pushed > 0);
+    CPPUNIT_ASSERT(!ring.push(6, text.data(), text.size()));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), ring.takeDropped());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), ring.takeDropped());
+
+    records.clear();
+    ring.release(ring.peek(collect, ring.capacity()));
+    CPPUNIT_ASSERT_EQUAL(pushed, records.size());
+    CPPUNIT_ASSERT(ring.empty());
+
+    // Oversized records are truncated.
+    const std::string large(ring.capacity(), 'z');
+    CPPUNIT_ASSERT(ring.push(6, large.data(), large.size()));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), ring.takeTruncated());
+    records.clear();
+    ring.release(ring.peek(collect, 10));
+    CPPUNIT_ASSERT_EQUAL("6:" + large.substr(0, ring.maxTextSize()) + '\n', records[0]);
+}
+
+void WhiteBoxTests::testTraceEventFormat()
+{
+    using namespace TraceEventFormat;
+
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), zigzag(0));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), zigzag(-1));
+    CPPUNIT_ASSERT_EQUAL(int64_t(-123456789), unzigzag(zigzag(-123456789)));
+
+    std::string varint;
+    appendVarint(varint, 300);
+    CPPUNIT_ASSERT_EQUAL(std::string("\xac\x02"), varint);
+    const char* pos = varint.data();
+    uint64_t value;
+    CPPUNIT_ASSERT(readVarint(pos, varint.data() + varint.size(), value));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(300), value);
+    pos = varint.data();
+    CPPUNIT_ASSERT(!readVarint(pos, varint.data() + 1, value));
+
+    // A nested zone completes before the outer one, so it is recorded first. The name of the
+    // instant event is defined by the block of another thread, written later.
+    EventBuffer main;
+    main.addName(42, 1, 1000, 1, "outer \"zone\"");
+    main.addName(42, 1, 1000, 2, "inner");
+    main.addComplete(42, 1, 2, 1100, 50, "");
+    main.addComplete(42, 1, 1, 1000, 300, "{\"id\":\"7\"}");
+    main.addInstant(42, 1, 3, 1400, "");
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1000), main.getBaseUs());
+
+    EventBuffer other;
+    other.addName(42, 2, 900, 3, "instant");
+
+    std::string recording(FileMagic);
+    const std::string json = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":42},\n";
+    appendChunkHeader(recording, ChunkJson, json.size());
+    recording += json;
+    std::string blocks = main.take();
+    blocks += other.take();
+    CPPUNIT_ASSERT(main.empty());
+    appendChunkHeader(recording, ChunkEvents, blocks.size());
+    recording += blocks;
+
+    std::ostringstream out;
+    JsonConverter converter;
+    CPPUNIT_ASSERT(converter.convert(recording.data(), recording.size(), out));
+    CPPUNIT_ASSERT_EQUAL(
+        std::string("[\n"
+                    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":42},\n"
+                    "{\"name\":\"inner\",\"ph\":\"X\",\"ts\":1100,\"dur\":50,\"pid\":42,\"tid\":1},\n"
+                    "{\"name\":\"outer \\\"zone\\\"\",\"ph\":\"X\",\"ts\":1000,\"dur\":300,"
+                    "\"pid\":42,\"tid\":1,\"args\":{\"id\":\"7\"}},\n"
+                    "{\"name\":\"instant\",\"ph\":\"i\",\"ts\":1400,\"pid\":42,\"tid\":1}"
+                    "\n]\n"),
+        out.str());
+
+    // Truncated recordings are still converted as far as they go.
+    std::ostringstream truncated;
+    JsonConverter converter2;
+    CPPUNIT_ASSERT(!converter2.convert(recording.data(), recording.size() - 3, truncated));
+    CPPUNIT_ASSERT(truncated.str().find("process_name") != std::string::npos);
+
+    std::ostringstream invalid;
+    JsonConverter converter3;
+    CPPUNIT_ASSERT(!converter3.convert("[\n{}", 4, invalid));
 }
 
 void WhiteBoxTests::testStringVector()
@@ -1934,6 +2244,58 @@ void WhiteBoxTests::testRequestDetails()
     }
 }
 
+void WhiteBoxTests::testRequestDetails_parsed()
+{
+    static const std::string Root = "localhost:9980";
+    static const std::string ServiceRoot = "/root";
+    static const std::string URI = "/lool/0x68747470733a2f2f6578616d706c652e636f6d2f77"
+                                   "6f70692f66696c65732f3132/ws?WOPISrc=https://example.com/"
+                                   "wopi/files/12&compat=/ws";
+
+    const std::string header = "GET " + ServiceRoot + URI
+                               + " HTTP/1.1\r\n"
+                                 "host: "
+                               + Root
+                               + "\r\n"
+                                 "Upgrade: WebSocket\r\n"
+                                 "ProxyPrefix: http://proxy/\r\n"
+                                 "\r\n";
+
+    http::RequestParser parser;
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(header.data(), header.size()));
+
+    // The same details as from the Poco request, which we no longer build for each.
+    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, ServiceRoot + URI,
+                                   Poco::Net::HTTPMessage::HTTP_1_1);
+    request.setHost(Root);
+    request.set("Upgrade", "WebSocket");
+    request.set("ProxyPrefix", "http://proxy/");
+
+    const RequestDetails expected(request, ServiceRoot);
+    const RequestDetails details(parser, header.data(), ServiceRoot);
+
+    LOK_ASSERT_EQUAL(expected.getURI(), details.getURI());
+    LOK_ASSERT_EQUAL(expected.getDocumentURI(), details.getDocumentURI());
+    LOK_ASSERT_EQUAL(Root, details.getHostUntrusted());
+    LOK_ASSERT_EQUAL(true, details.isGet());
+    LOK_ASSERT_EQUAL(true, details.isWebSocket());
+    LOK_ASSERT_EQUAL(true, details.isProxy());
+    LOK_ASSERT_EQUAL(std::string("http://proxy/"), details.getProxyPrefix());
+    LOK_ASSERT_EQUAL(expected.size(), details.size());
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        LOK_ASSERT_EQUAL(expected[i], details[i]);
+
+    // The ServiceRoot and the Host are required.
+    CPPUNIT_ASSERT_THROW(RequestDetails(parser, header.data(), "/other"), BadRequestException);
+
+    const std::string noHost = "GET " + ServiceRoot + "/ HTTP/1.1\r\n\r\n";
+    parser.reset();
+    LOK_ASSERT_EQUAL(http::RequestParser::State::Complete,
+                     parser.parse(noHost.data(), noHost.size()));
+    CPPUNIT_ASSERT_THROW(RequestDetails(parser, noHost.data(), ServiceRoot), BadRequestException);
+}
+
 void WhiteBoxTests::testUIDefaults()
 {
     std::string uiMode;
@@ -1966,6 +2328,117 @@ void WhiteBoxTests::testCSSVars()
                      FileServerRequestHandler::cssVarsToStyle("--co-somestyle-text=#123456;;--some-val=3453--some-other-val=4536;;"));
 }
 
+void WhiteBoxTests::testStaticFiles()
+{
+    StaticFile file;
+    file._etag = "\"0123456789abcdef\"";
+    file._content[0] = std::make_shared<const FileContent>(std::string("plain"));
+
+    // Only what we have can be served.
+    LOK_ASSERT(StaticFile::Encoding::Identity
+               == FileServerRequestHandler::selectEncoding(file, "gzip, deflate, br"));
+
+    file._content[1] = std::make_shared<const FileContent>(std::string("gz"));
+    LOK_ASSERT(StaticFile::Encoding::Gzip
+               == FileServerRequestHandler::selectEncoding(file, "gzip, deflate, br"));
+
+    file._content[2] = std::make_shared<const FileContent>(std::string("br"));
+    LOK_ASSERT(StaticFile::Encoding::Brotli
+               == FileServerRequestHandler::selectEncoding(file, "gzip, deflate, br"));
+    LOK_ASSERT(StaticFile::Encoding::Gzip
+               == FileServerRequestHandler::selectEncoding(file, "br;q=0.5, GZIP"));
+    LOK_ASSERT(StaticFile::Encoding::Gzip
+               == FileServerRequestHandler::selectEncoding(file, "gzip;q=1.0, br;q=0"));
+    LOK_ASSERT(StaticFile::Encoding::Brotli
+               == FileServerRequestHandler::selectEncoding(file, "*"));
+    LOK_ASSERT(StaticFile::Encoding::Identity
+               == FileServerRequestHandler::selectEncoding(file, "identity"));
+    LOK_ASSERT(StaticFile::Encoding::Identity
+               == FileServerRequestHandler::selectEncoding(file, ""));
+
+    // Each representation has its own entity-tag.
+    const std::string gzipETag = file.getETag(StaticFile::Encoding::Gzip);
+    LOK_ASSERT_EQUAL(std::string("\"0123456789abcdef-gz\""), gzipETag);
+    LOK_ASSERT_EQUAL(std::string("\"0123456789abcdef-br\""),
+                     file.getETag(StaticFile::Encoding::Brotli));
+
+    LOK_ASSERT(FileServerRequestHandler::matchETag(gzipETag, gzipETag));
+    LOK_ASSERT(FileServerRequestHandler::matchETag("\"other\", W/" + gzipETag, gzipETag));
+    LOK_ASSERT(FileServerRequestHandler::matchETag("*", gzipETag));
+    LOK_ASSERT(!FileServerRequestHandler::matchETag(file._etag, gzipETag));
+    LOK_ASSERT(!FileServerRequestHandler::matchETag("", gzipETag));
+
+    // Placeholders are filled in a single pass, adjacent or repeated.
+    const PreprocessedFile preprocessed("<a>%TOKEN%%TTL%</a>%TOKEN%%MISSING%",
+                                        { "%TOKEN%", "%TTL%", "%NOWHERE%" });
+    LOK_ASSERT_EQUAL(std::string("<a>secret0</a>secret%MISSING%"),
+                     preprocessed.substitute({ "secret", "0", "x" }));
+    LOK_ASSERT_EQUAL(std::string("<a>%TTL%%TOKEN%</a>%TTL%%MISSING%"),
+                     preprocessed.substitute({ "%TTL%", "%TOKEN%", "" }));
+}
+
+void WhiteBoxTests::testStaticFileContent()
+{
+    const std::string tmpFile = FileUtil::getSysTempDirectoryPath() + "/test_static_file";
+    const std::size_t maxReadSize = FileContent::MaxReadSize;
+
+    // Small files are read, and never change under us.
+    {
+        std::ofstream ofs(tmpFile, std::ios::trunc);
+        ofs << "small";
+    }
+
+    std::shared_ptr<const FileContent> small = FileContent::map(tmpFile);
+    LOK_ASSERT(small);
+    LOK_ASSERT_EQUAL(std::string("small"), small->toString());
+    LOK_ASSERT_EQUAL(tmpFile, small->getPath());
+    LOK_ASSERT_EQUAL(0, ::truncate(tmpFile.c_str(), 0));
+    LOK_ASSERT(!small->changed());
+    LOK_ASSERT_EQUAL(std::string("small"), small->toString());
+
+    // Nor do empty ones.
+    std::shared_ptr<const FileContent> empty = FileContent::map(tmpFile);
+    LOK_ASSERT(empty);
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), empty->size());
+
+    // Large ones are mapped, and must not be served once truncated.
+    const std::string data(maxReadSize + 1, 'x');
+    {
+        std::ofstream ofs(tmpFile, std::ios::trunc);
+        ofs << data;
+    }
+
+    std::shared_ptr<const FileContent> large = FileContent::map(tmpFile);
+    LOK_ASSERT(large);
+    LOK_ASSERT_EQUAL(data.size(), large->size());
+    LOK_ASSERT(!large->changed());
+    LOK_ASSERT_EQUAL(data, large->toString());
+
+    // Replaced under its name, ours is intact.
+    const std::string newFile = tmpFile + ".new";
+    {
+        std::ofstream ofs(newFile, std::ios::trunc);
+        ofs << "new";
+    }
+
+    LOK_ASSERT_EQUAL(0, ::rename(newFile.c_str(), tmpFile.c_str()));
+    LOK_ASSERT(!large->changed());
+    LOK_ASSERT_EQUAL(data, large->toString());
+
+    // Truncated in place, it isn't.
+    {
+        std::ofstream ofs(tmpFile, std::ios::trunc);
+        ofs << data;
+    }
+
+    large = FileContent::map(tmpFile);
+    LOK_ASSERT(large);
+    LOK_ASSERT_EQUAL(0, ::truncate(tmpFile.c_str(), maxReadSize / 2));
+    LOK_ASSERT(large->changed());
+
+    FileUtil::removeFile(tmpFile);
+}
+
 void WhiteBoxTests::testStat()
 {
     FileUtil::Stat invalid("/missing/file/path");
@@ -2014,6 +2487,29 @@ void WhiteBoxTests::testStat()
     FileUtil::removeFile(tmpFile);
 }
 
+void WhiteBoxTests::testProcessStat()
+{
+    Util::ProcessStat stat;
+    LOK_ASSERT(!Util::getProcessStat(0, stat));
+
+    LOK_ASSERT(Util::getProcessStat(getpid(), stat));
+    LOK_ASSERT_EQUAL(getppid(), stat._ppid);
+    LOK_ASSERT(stat._threads >= 1);
+    LOK_ASSERT(stat._rssKb > 0);
+    LOK_ASSERT_EQUAL(Util::getStatFromPid(getpid(), 19), stat._threads);
+
+    // Read from smaps_rollup, or smaps on older kernels.
+    LOK_ASSERT(Util::getMemoryUsagePSS(getpid()) > 0);
+
+    FILE* file = Util::openSMaps("/proc/self");
+    LOK_ASSERT(file != nullptr);
+    const Util::SMapsStats stats = Util::getSMapsStats(file);
+    LOK_ASSERT(stats._pssKb > 0);
+    LOK_ASSERT(stats._privateDirtyKb > 0);
+    LOK_ASSERT_EQUAL(stats._privateDirtyKb, Util::getPssAndDirtyFromSMaps(file).second);
+    fclose(file);
+}
+
 void WhiteBoxTests::testStringCompare()
 {
     LOK_ASSERT(Util::iequal("abcd", "abcd"));
@@ -2230,6 +2726,424 @@ void WhiteBoxTests::testBytesToHex()
     }
 }
 
+void WhiteBoxTests::testSimdKernels()
+{
+    constexpr size_t width = 256;
+    constexpr size_t height = 256;
+
+    // Mostly opaque and transparent runs, with some translucent pixels in between.
+    std::vector<uint8_t> pixels(width * height * 4);
+    for (size_t i = 0; i < width * height; ++i)
+    {
+        const uint8_t alpha = (i % 97 == 0) ? (i % 251) : ((i / 64) % 3 == 0 ? 0 : 255);
+        pixels[i * 4 + 0] = std::min<uint8_t>(i % 256, alpha);
+        pixels[i * 4 + 1] = std::min<uint8_t>((i / 3) % 256, alpha);
+        pixels[i * 4 + 2] = std::min<uint8_t>((i * 7) % 256, alpha);
+        pixels[i * 4 + 3] = alpha;
+    }
+
+    std::vector<uint8_t> expected = pixels;
+    Simd::unpremultiplyScalar(expected.data(), width * height);
+
+    const Simd::Level best = Simd::detectLevel();
+    for (const Simd::Level level : { Simd::Level::SSE2, Simd::Level::AVX2, Simd::Level::NEON })
+    {
+        if (best != level && !(best == Simd::Level::AVX2 && level == Simd::Level::SSE2))
+            continue; // Not supported here.
+
+        // Odd lengths exercise the tails.
+        std::vector<uint8_t> actual = pixels;
+        Simd::getUnpremultiply(level)(actual.data(), width * height - 3);
+        Simd::unpremultiplyScalar(actual.data() + (width * height - 3) * 4, 3);
+        LOK_ASSERT_MESSAGE(Simd::toString(level), expected == actual);
+
+        uint32_t color = 0;
+        std::vector<uint8_t> uniform(width * height * 4, 0xff);
+        LOK_ASSERT(Simd::isUniform(uniform.data(), 0, 0, width, height, width, color,
+                                   Simd::getIsUniformRow(level)));
+        LOK_ASSERT_EQUAL(0xffffffffU, color);
+
+        uniform[(width * (height - 1) + width - 1) * 4] = 0;
+        LOK_ASSERT(!Simd::isUniform(uniform.data(), 0, 0, width, height, width, color,
+                                    Simd::getIsUniformRow(level)));
+        LOK_ASSERT(Simd::isUniform(uniform.data(), 0, 0, width - 1, height, width, color,
+                                   Simd::getIsUniformRow(level)));
+    }
+}
+
+/// A socket that counts what it is handled with.
+class PollTestSocket : public Socket
+{
+public:
+    PollTestSocket(int fd)
+        : Socket(fd)
+        , _wantWrite(false)
+        , _closeOnRead(false)
+        , _timeoutMicroS(0)
+        , _handled(0)
+        , _reads(0)
+        , _writes(0)
+    {
+    }
+
+    int getPollEvents(std::chrono::steady_clock::time_point /* now */,
+                      int64_t& timeoutMaxMicroS) override
+    {
+        if (_timeoutMicroS > 0)
+            timeoutMaxMicroS = std::min(timeoutMaxMicroS, _timeoutMicroS);
+        return POLLIN | (_wantWrite ? POLLOUT : 0);
+    }
+
+    void handlePoll(SocketDisposition& disposition, std::chrono::steady_clock::time_point /* now */,
+                    int events) override
+    {
+        ++_handled;
+        if (events & POLLIN)
+        {
+            char buf[64];
+            const ssize_t len = ::read(getFD(), buf, sizeof(buf));
+            ++_reads;
+            if (len <= 0 || _closeOnRead)
+                disposition.setClosed();
+        }
+
+        if (events & POLLOUT)
+        {
+            ++_writes;
+            _wantWrite = false;
+        }
+    }
+
+    bool _wantWrite;
+    bool _closeOnRead;
+    int64_t _timeoutMicroS;
+    int _handled;
+    int _reads;
+    int _writes;
+};
+
+void WhiteBoxTests::testSocketPollDispatch()
+{
+    SocketPoll poll("TestPoll");
+    poll.runOnClientThread();
+
+    std::vector<std::shared_ptr<PollTestSocket>> sockets;
+    std::vector<int> peers;
+    for (int i = 0; i < 4; ++i)
+    {
+        int fds[2];
+        LOK_ASSERT_EQUAL(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+        sockets.push_back(std::make_shared<PollTestSocket>(fds[0]));
+        peers.push_back(fds[1]);
+        poll.insertNewSocket(sockets.back());
+    }
+
+    // Take them in.
+    poll.poll(std::chrono::milliseconds(0));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(4), poll.getSocketCount());
+
+    // Several ready in one wakeup are all handled, once, and only them.
+    for (const int i : { 0, 2, 3 })
+        LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[i], "x", 1));
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(1, sockets[0]->_reads);
+    LOK_ASSERT_EQUAL(0, sockets[1]->_reads);
+    LOK_ASSERT_EQUAL(1, sockets[2]->_reads);
+    LOK_ASSERT_EQUAL(1, sockets[3]->_reads);
+
+    // Events changing without handling the socket.
+    sockets[1]->_wantWrite = true;
+    sockets[1]->pollEventsChanged();
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(1, sockets[1]->_writes);
+    LOK_ASSERT_EQUAL(0, sockets[1]->_reads);
+
+    // Removed by its handler while another one's events are pending.
+    sockets[0]->_closeOnRead = true;
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[0], "x", 1));
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[2], "x", 1));
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(2, sockets[0]->_reads);
+    LOK_ASSERT_EQUAL(2, sockets[2]->_reads);
+    LOK_ASSERT_EQUAL(static_cast<size_t>(3), poll.getSocketCount());
+
+    // No longer ours, though still open and readable.
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[0], "x", 1));
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[3], "x", 1));
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(2, sockets[0]->_reads);
+    LOK_ASSERT_EQUAL(2, sockets[3]->_reads);
+
+    // Removed while its events are pending.
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[3], "x", 1));
+    poll.addCallback([&poll]() { poll.removeSockets(); });
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(static_cast<size_t>(0), poll.getSocketCount());
+    LOK_ASSERT_EQUAL(2, sockets[3]->_reads);
+
+    // And handled once back.
+    poll.insertNewSocket(sockets[3]);
+    poll.poll(std::chrono::milliseconds(0));
+    poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT_EQUAL(3, sockets[3]->_reads);
+
+    // Handled when its timeout is due, without events.
+    sockets[3]->_timeoutMicroS = 10 * 1000;
+    sockets[3]->pollEventsChanged();
+    const int handled = sockets[3]->_handled;
+    const auto start = std::chrono::steady_clock::now();
+    while (sockets[3]->_handled == handled
+           && std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+        poll.poll(std::chrono::seconds(5));
+    LOK_ASSERT(sockets[3]->_handled > handled);
+    LOK_ASSERT(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+    poll.removeSockets();
+    for (const int fd : peers)
+        ::close(fd);
+}
+
+namespace
+{
+/// Counts the connections accepted with it.
+class CountingSocketFactory : public SocketFactory
+{
+public:
+    CountingSocketFactory()
+        : _accepted(0)
+    {
+    }
+
+    std::shared_ptr<Socket> create(const int fd) override
+    {
+        ++_accepted;
+        return std::make_shared<PollTestSocket>(fd);
+    }
+
+    int _accepted;
+};
+}
+
+void WhiteBoxTests::testServerSocketReusePort()
+{
+    SocketPoll clientPoll("TestClientPoll");
+    clientPoll.runOnClientThread();
+
+    SocketPoll acceptPoll("TestAcceptPoll");
+    acceptPoll.runOnClientThread();
+    auto factory = std::make_shared<CountingSocketFactory>();
+    std::shared_ptr<ServerSocket> server = ServerSocket::create(
+        ServerSocket::Type::Local, 0, Socket::Type::IPv4, clientPoll, factory, true);
+    LOK_ASSERT(server);
+
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    LOK_ASSERT_EQUAL(0, ::getsockname(server->getFD(), (struct sockaddr*)&addr, &addrLen));
+    const int port = ntohs(addr.sin_port);
+
+    // The port is only shared by those asking for it, as with a single acceptor.
+    LOK_ASSERT(!ServerSocket::create(ServerSocket::Type::Local, port, Socket::Type::IPv4,
+                                     clientPoll, std::make_shared<CountingSocketFactory>()));
+
+    SocketPoll acceptPoll2("TestAcceptPoll2");
+    acceptPoll2.runOnClientThread();
+    auto factory2 = std::make_shared<CountingSocketFactory>();
+    std::shared_ptr<ServerSocket> server2 = ServerSocket::create(
+        ServerSocket::Type::Local, port, Socket::Type::IPv4, clientPoll, factory2, true);
+    LOK_ASSERT(server2);
+
+    acceptPoll.insertNewSocket(server);
+    acceptPoll2.insertNewSocket(server2);
+    acceptPoll.poll(std::chrono::milliseconds(0));
+    acceptPoll2.poll(std::chrono::milliseconds(0));
+
+    // The kernel spreads the connections over both, by their source port.
+    // Within the backlog of either, so that connect() doesn't block.
+    constexpr int Count = 32;
+    std::vector<int> clients;
+    for (int i = 0; i < Count; ++i)
+    {
+        const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        LOK_ASSERT(fd >= 0);
+        LOK_ASSERT_EQUAL(0, ::connect(fd, (struct sockaddr*)&addr, sizeof(addr)));
+        clients.push_back(fd);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    while (factory->_accepted + factory2->_accepted < Count
+           && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+    {
+        acceptPoll.poll(std::chrono::milliseconds(10));
+        acceptPoll2.poll(std::chrono::milliseconds(10));
+    }
+
+    LOK_ASSERT_EQUAL(Count, factory->_accepted + factory2->_accepted);
+    LOK_ASSERT(factory->_accepted > 0);
+    LOK_ASSERT(factory2->_accepted > 0);
+
+    acceptPoll.removeSockets();
+    acceptPoll2.removeSockets();
+    clientPoll.poll(std::chrono::milliseconds(0));
+    clientPoll.removeSockets();
+    for (const int fd : clients)
+        ::close(fd);
+}
+
+namespace
+{
+/// Sizes the ThreadPools created meanwhile, including the calling thread.
+class ScopedMaxConcurrency
+{
+    std::string _old;
+    bool _hadOld;
+
+public:
+    ScopedMaxConcurrency(int concurrency)
+    {
+        const char* old = getenv("MAX_CONCURRENCY");
+        _hadOld = (old != nullptr);
+        if (_hadOld)
+            _old = old;
+        setenv("MAX_CONCURRENCY", std::to_string(concurrency).c_str(), 1);
+    }
+
+    ~ScopedMaxConcurrency()
+    {
+        if (_hadOld)
+            setenv("MAX_CONCURRENCY", _old.c_str(), 1);
+        else
+            unsetenv("MAX_CONCURRENCY");
+    }
+};
+}
+
+void WhiteBoxTests::testThreadPool()
+{
+    // Without workers, the waiting thread does it all; then with some.
+    for (const int concurrency : { 1, 4 })
+    {
+        ScopedMaxConcurrency maxConcurrency(concurrency);
+        ThreadPool pool;
+
+        constexpr int Count = 1000;
+        std::atomic<int> done(0);
+        std::vector<int> results(Count, 0);
+        auto group = std::make_shared<ThreadPool::Group>();
+        for (int i = 0; i < Count; ++i)
+        {
+            pool.pushWork(group, [&done, &results, i]() {
+                results[i] = i;
+                ++done;
+            });
+        }
+
+        pool.wait(*group);
+        LOK_ASSERT(group->isComplete());
+        LOK_ASSERT_EQUAL(Count, done.load());
+        LOK_ASSERT_EQUAL(static_cast<size_t>(0), pool.count());
+        for (int i = 0; i < Count; ++i)
+            LOK_ASSERT_EQUAL(i, results[i]);
+
+        // Nothing left to wait for.
+        pool.wait(*group);
+        LOK_ASSERT(group->isComplete());
+    }
+}
+
+void WhiteBoxTests::testThreadPoolStealing()
+{
+    ScopedMaxConcurrency maxConcurrency(4);
+    ThreadPool pool;
+
+    // The first item holds up whichever worker runs it until all the others
+    // are done: those queued behind it complete only if others steal them.
+    constexpr int Count = 64;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int done = 0;
+    bool others = false;
+    auto group = std::make_shared<ThreadPool::Group>();
+    pool.pushWork(group, [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        others = cond.wait_for(lock, std::chrono::seconds(10),
+                               [&done]() { return done == Count - 1; });
+    });
+
+    for (int i = 1; i < Count; ++i)
+    {
+        pool.pushWork(group, [&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::unique_lock<std::mutex> lock(mutex);
+            if (++done == Count - 1)
+                cond.notify_all();
+        });
+    }
+
+    pool.wait(*group);
+    LOK_ASSERT_MESSAGE("Work queued behind a busy worker was not stolen", others);
+    LOK_ASSERT_EQUAL(Count - 1, done);
+}
+
+void WhiteBoxTests::testFinishRenderOrder()
+{
+    ScopedMaxConcurrency maxConcurrency(4);
+    ThreadPool pool;
+    PngCache pngCache;
+
+    TileCombined tileCombined = TileCombined::parse(
+        "tilecombine nviewid=0 part=0 width=256 height=256 tileposx=0,3840,7680,11520 "
+        "tileposy=0,0,0,0 tilewidth=3840 tileheight=3840");
+    const std::vector<TileDesc>& tiles = tileCombined.getTiles();
+
+    std::vector<std::string> headers;
+    std::vector<PngCache::CacheData> sent;
+    std::shared_ptr<RenderTiles::PendingRender> pending =
+        std::make_shared<RenderTiles::PendingRender>(
+            tileCombined, true, nullptr,
+            [&headers, &sent](const std::string& header,
+                              const std::vector<PngCache::CacheData>& images) {
+                headers.push_back(header);
+                sent.insert(sent.end(), images.begin(), images.end());
+            },
+            std::chrono::steady_clock::now());
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const TileBinaryHash hash = 1000 + i;
+        pending->_encodes.push_back(RenderTiles::PendingRender::Encode{
+            tiles[i], pngCache.hashToWireId(hash), hash, nullptr });
+    }
+
+    // The first tiles take the longest, so they are encoded last.
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const std::shared_ptr<RenderTiles::PendingRender> render = pending;
+        const size_t count = tiles.size();
+        pool.pushWork(pending->_group, [render, i, count]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20 * (count - i)));
+            render->_encodes[i]._data =
+                std::make_shared<std::vector<char>>(i + 1, static_cast<char>('a' + i));
+        });
+    }
+
+    RenderTiles::finishRender(pending, pngCache, pool);
+    LOK_ASSERT(!pending);
+
+    // Sent once, in the order requested.
+    LOK_ASSERT_EQUAL(static_cast<size_t>(1), headers.size());
+    LOK_ASSERT(headers[0].find("tileposx=0,3840,7680,11520 ") != std::string::npos);
+    LOK_ASSERT(headers[0].find("imgsize=1,2,3,4 ") != std::string::npos);
+    LOK_ASSERT_EQUAL(tiles.size(), sent.size());
+    for (size_t i = 0; i < sent.size(); ++i)
+    {
+        LOK_ASSERT_EQUAL(i + 1, sent[i]->size());
+        LOK_ASSERT_EQUAL(static_cast<char>('a' + i), sent[i]->front());
+    }
+
+    // And cached.
+    LOK_ASSERT(pngCache.lookupCache(1000) == sent[0]);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(WhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -127,12 +127,19 @@ int main(int argc, char** argv)
         LOG_ERR("Failed to initialize Server SSL. Set the path to the certificates via "
                 "--cert-path. HTTPS tests will be disabled in unit-tests.");
     else
+    {
         LOG_INF("Initialized Server SSL.");
+        ssl::Manager::enableServerSessionResumption(1024, std::chrono::seconds(300),
+                                                    std::chrono::seconds(300));
+    }
 
     if (!ssl::Manager::isClientContextInitialized())
         LOG_ERR("Failed to initialize Client SSL.");
     else
+    {
         LOG_INF("Initialized Client SSL.");
+        ssl::Manager::enableClientSessionResumption();
+    }
 #else
     LOG_INF("SSL is unsupported in this build.");
 #endif
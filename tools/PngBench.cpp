@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Microbenchmark of the per-tile pixel kernels: unpremultiply and hashing,
+ * scalar vs. the vectorized versions, on 256x256 RGBA tiles.
+ */
+
+#include <config.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <Png.hpp>
+#include <Simd.hpp>
+#include <SpookyV2.h>
+
+namespace
+{
+constexpr int TileSize = 256;
+
+/// What hashSubBuffer did before the uniform tile detection.
+uint64_t hashSpookyOnly(unsigned char* pixmap, long width, long height)
+{
+    SpookyHash hash;
+    hash.Init(1073741789, 1073741789);
+    for (long y = 0; y < height; ++y)
+        hash.Update(pixmap + y * width * 4, width * 4);
+
+    uint64_t hash1;
+    uint64_t hash2;
+    hash.Final(&hash1, &hash2);
+    return hash1;
+}
+
+/// A blank (opaque white) tile.
+std::vector<unsigned char> makeBlank()
+{
+    return std::vector<unsigned char>(TileSize * TileSize * 4, 0xff);
+}
+
+/// Mostly white with dark, antialiased 'glyph' strokes, like a text tile.
+std::vector<unsigned char> makeText()
+{
+    std::vector<unsigned char> pixels = makeBlank();
+    for (int y = 0; y < TileSize; ++y)
+    {
+        if ((y / 12) % 2)
+            continue;
+
+        for (int x = 0; x < TileSize; ++x)
+        {
+            if ((x * 7 + y * 3) % 11 < 3)
+            {
+                unsigned char* pix = &pixels[(y * TileSize + x) * 4];
+                pix[0] = pix[1] = pix[2] = (x * y) % 128;
+            }
+        }
+    }
+
+    return pixels;
+}
+
+/// Premultiplied with varying alpha, the worst case.
+std::vector<unsigned char> makeTranslucent()
+{
+    std::vector<unsigned char> pixels(TileSize * TileSize * 4);
+    for (int i = 0; i < TileSize * TileSize; ++i)
+    {
+        const unsigned char alpha = i % 256;
+        pixels[i * 4 + 0] = (i % 251) * alpha / 255;
+        pixels[i * 4 + 1] = (i % 241) * alpha / 255;
+        pixels[i * 4 + 2] = (i % 239) * alpha / 255;
+        pixels[i * 4 + 3] = alpha;
+    }
+
+    return pixels;
+}
+
+void bench(const std::string& name, int iterations, const std::function<void()>& fn)
+{
+    fn(); // Warm up.
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        fn();
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    const double perTile = ns / iterations;
+    std::cout << "  " << std::left << std::setw(32) << name << std::right << std::setw(10)
+              << std::fixed << std::setprecision(0) << perTile << " ns/tile "
+              << std::setw(8) << std::setprecision(1)
+              << (TileSize * TileSize) / (perTile / 1000.) << " MP/s" << std::endl;
+}
+}
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 2000;
+
+    std::cout << "Best SIMD level: " << Simd::toString(Simd::detectLevel()) << ", " << iterations
+              << " iterations of " << TileSize << 'x' << TileSize << " RGBA tiles." << std::endl;
+
+    const std::vector<std::pair<std::string, std::vector<unsigned char>>> tiles = {
+        { "blank", makeBlank() }, { "text", makeText() }, { "translucent", makeTranslucent() }
+    };
+
+    std::vector<Simd::Level> levels = { Simd::Level::Scalar };
+    switch (Simd::detectLevel())
+    {
+        case Simd::Level::AVX2: levels.push_back(Simd::Level::SSE2);
+                                levels.push_back(Simd::Level::AVX2); break;
+        case Simd::Level::SSE2: levels.push_back(Simd::Level::SSE2); break;
+        case Simd::Level::NEON: levels.push_back(Simd::Level::NEON); break;
+        case Simd::Level::Scalar: break;
+    }
+
+    volatile uint64_t sink = 0;
+    for (const auto& tile : tiles)
+    {
+        std::cout << tile.first << ':' << std::endl;
+
+        std::vector<unsigned char> work(tile.second.size());
+        for (const Simd::Level level : levels)
+        {
+            const Simd::UnpremultiplyFn unpremultiply = Simd::getUnpremultiply(level);
+            bench(std::string("unpremultiply ") + Simd::toString(level), iterations, [&]() {
+                work = tile.second;
+                // libpng hands us one row at a time.
+                for (int y = 0; y < TileSize; ++y)
+                    unpremultiply(work.data() + y * TileSize * 4, TileSize);
+            });
+        }
+
+        work = tile.second;
+        bench("hash spooky (old)", iterations, [&]() {
+            sink = sink + hashSpookyOnly(work.data(), TileSize, TileSize);
+        });
+
+        for (const Simd::Level level : levels)
+        {
+            const Simd::IsUniformRowFn isUniformRow = Simd::getIsUniformRow(level);
+            bench(std::string("hash + uniform ") + Simd::toString(level), iterations, [&]() {
+                uint32_t color;
+                if (Simd::isUniform(work.data(), 0, 0, TileSize, TileSize, TileSize, color,
+                                    isUniformRow))
+                    sink = sink + color;
+                else
+                    sink = sink + hashSpookyOnly(work.data(), TileSize, TileSize);
+            });
+        }
+
+        std::vector<char> output;
+        bench("encodeSubBufferToPNG", iterations / 10 + 1, [&]() {
+            output.clear();
+            Png::encodeBufferToPNG(work.data(), TileSize, TileSize, output, LOK_TILEMODE_BGRA);
+        });
+    }
+
+    return sink == 42 ? 1 : 0;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
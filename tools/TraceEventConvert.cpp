@@ -0,0 +1,76 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Converts a binary Trace Event recording, as written by loolwsd, to the
+ * Chrome Trace Event JSON format that chrome://tracing and Perfetto load.
+ */
+
+#include <config.h>
+
+#include <sysexits.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include <TraceEventFormat.hpp>
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3 || argv[1] == std::string("--help"))
+    {
+        std::cerr << "Usage: " << argv[0] << " <recording> [<output.json>]\n"
+                  << "Converts a Trace Event recording of loolwsd to JSON, written to stdout "
+                     "when no output file is given."
+                  << std::endl;
+        return EX_USAGE;
+    }
+
+    std::ifstream input(argv[1], std::ios::binary);
+    if (!input)
+    {
+        std::cerr << "Failed to open " << argv[1] << '.' << std::endl;
+        return EX_NOINPUT;
+    }
+
+    const std::string data((std::istreambuf_iterator<char>(input)),
+                           std::istreambuf_iterator<char>());
+    if (!data.empty() && data[0] == '[')
+    {
+        std::cerr << argv[1] << " is already JSON, as recorded by older versions." << std::endl;
+        return EX_DATAERR;
+    }
+
+    std::ofstream file;
+    if (argc == 3)
+    {
+        file.open(argv[2]);
+        if (!file)
+        {
+            std::cerr << "Failed to create " << argv[2] << '.' << std::endl;
+            return EX_CANTCREAT;
+        }
+    }
+
+    std::ostream& output = argc == 3 ? file : std::cout;
+
+    TraceEventFormat::JsonConverter converter;
+    if (!converter.convert(data.data(), data.size(), output))
+    {
+        // Most likely loolwsd was still running, or didn't exit cleanly.
+        std::cerr << argv[1] << " is truncated or not a Trace Event recording; converted what "
+                                "could be."
+                  << std::endl;
+        return EX_DATAERR;
+    }
+
+    return output ? EX_OK : EX_IOERR;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -407,6 +407,7 @@ Admin::Admin() :
 
     LOG_TRC("Total available memory: " << _totalAvailMemKb << " KB (memproportion: " << memLimit << "%).");
 
+    _model.updateProcStats();
     const size_t totalMem = getTotalMemoryUsage();
     LOG_TRC("Total memory used: " << totalMem << " KB.");
     _model.addMemStats(totalMem);
@@ -447,6 +448,7 @@ void Admin::pollingThread()
         if (memWait <= MinStatsIntervalMs / 2) // Close enough
         {
             _model.UpdateMemoryDirty();
+            _model.updateProcStats();
 
             const size_t totalMem = getTotalMemoryUsage();
             _model.addMemStats(totalMem);
@@ -565,8 +567,8 @@ size_t Admin::getTotalMemoryUsage()
     // inside the forkit - we should account all of our fixed cost of
     // memory to the forkit; and then count only dirty pages in the clients
     // since we know that they share everything else with the forkit.
-    const size_t forkitRssKb = Util::getMemoryUsageRSS(_forKitPid);
-    const size_t wsdPssKb = Util::getMemoryUsagePSS(getpid());
+    const size_t forkitRssKb = _model.getForKitMemoryUsage();
+    const size_t wsdPssKb = _model.getWsdMemoryUsage();
     const size_t kitsDirtyKb = _model.getKitsMemoryUsage();
     const size_t totalMem = wsdPssKb + forkitRssKb + kitsDirtyKb;
 
@@ -917,6 +919,14 @@ void Admin::getMetrics(std::ostringstream &metrics)
     metrics << "global_memory_free_bytes " << (memAvail - memUsed) * 1024 << std::endl;
     metrics << std::endl;
 
+    StorageBase::getMetrics(metrics);
+    metrics << std::endl;
+
+#if ENABLE_SSL
+    ssl::Manager::getMetrics(metrics);
+    metrics << std::endl;
+#endif
+
     _model.getMetrics(metrics);
 }
 
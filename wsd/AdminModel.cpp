@@ -139,7 +139,10 @@ void Document::updateMemoryDirty()
     if (now - _lastTimeSMapsRead >= 5)
     {
         size_t lastMemDirty = _memoryDirty;
-        _memoryDirty = _procSMaps  ? Util::getPssAndDirtyFromSMaps(_procSMaps).second : 0;
+        const Util::SMapsStats stats
+            = _procSMaps ? Util::getSMapsStats(_procSMaps) : Util::SMapsStats();
+        _memoryDirty = stats._privateDirtyKb;
+        _memoryShared = stats._sharedKb;
         _lastTimeSMapsRead = now;
         if (lastMemDirty != _memoryDirty)
             _hasMemDirtyChanged = true;
@@ -997,6 +1000,7 @@ struct DocumentAggregateStats
     void Update(const Document &d, bool active)
     {
         _kitUsedMemory.Update(d.getMemoryDirty() * 1024, active);
+        _kitSharedMemory.Update(d.getMemoryShared() * 1024, active);
         _viewsCount.Update(d.getViews().size(), active);
         _activeViewsCount.Update(d.getActiveViews(), active);
         _expiredViewsCount.Update(d.getViews().size() - d.getActiveViews(), active);
@@ -1012,6 +1016,7 @@ struct DocumentAggregateStats
     }
 
     ActiveExpiredStats _kitUsedMemory;
+    ActiveExpiredStats _kitSharedMemory;
     ActiveExpiredStats _viewsCount;
     ActiveExpiredStats _activeViewsCount;
     ActiveExpiredStats _expiredViewsCount;
@@ -1025,10 +1030,10 @@ struct DocumentAggregateStats
 
 struct KitProcStats
 {
-    void UpdateAggregateStats(int pid)
+    void UpdateAggregateStats(const Util::ProcessStat& stat)
     {
-        _threadCount.Update(Util::getStatFromPid(pid, 19));
-        _cpuTime.Update(Util::getCpuUsage(pid) / sysconf (_SC_CLK_TCK));
+        _threadCount.Update(stat._threads);
+        _cpuTime.Update(stat._cpuJiffies / sysconf (_SC_CLK_TCK));
     }
 
     int unassignedCount;
@@ -1046,17 +1051,6 @@ void AdminModel::CalcDocAggregateStats(DocumentAggregateStats& stats)
         stats.Update(*d.second, false);
 }
 
-void CalcKitStats(KitProcStats& stats)
-{
-    std::vector<int> childProcs;
-    stats.unassignedCount = AdminModel::getUnassignedKitPids(&childProcs);
-    stats.assignedCount = AdminModel::getAssignedKitPids(&childProcs);
-    for (int& pid : childProcs)
-    {
-        stats.UpdateAggregateStats(pid);
-    }
-}
-
 void PrintDocActExpMetrics(std::ostringstream &oss, const char* name, const char* unit, const ActiveExpiredStats &values)
 {
     values.Print(oss, "document", name, unit);
@@ -1068,25 +1062,59 @@ void PrintKitAggregateMetrics(std::ostringstream &oss, const char* name, const c
     values.Print(oss, prefix.c_str(), unit);
 }
 
+void AdminModel::updateProcStats()
+{
+    ProcStats stats;
+
+    stats._wsdCount = getPidsFromProcName(std::regex("loolwsd"), nullptr);
+    Util::getProcessStat(getpid(), stats._wsd);
+    stats._wsdPssKb = Util::getMemoryUsagePSS(getpid());
+
+    stats._forKitCount = getPidsFromProcName(std::regex("forkit"), nullptr);
+    Util::getProcessStat(_forKitPid, stats._forKit);
+
+    std::vector<int> kitPids;
+    stats._unassignedKitCount = getUnassignedKitPids(&kitPids);
+    stats._assignedKitCount = getAssignedKitPids(&kitPids);
+    stats._kits.reserve(kitPids.size());
+    for (const int pid : kitPids)
+    {
+        Util::ProcessStat stat;
+        if (Util::getProcessStat(pid, stat))
+            stats._kits.push_back(stat);
+    }
+
+    _procStats = std::move(stats);
+    _hasProcStats = true;
+}
+
 void AdminModel::getMetrics(std::ostringstream &oss)
 {
-    oss << "loolwsd_count " << getPidsFromProcName(std::regex("loolwsd"), nullptr) << std::endl;
-    oss << "loolwsd_thread_count " << Util::getStatFromPid(getpid(), 19) << std::endl;
-    oss << "loolwsd_cpu_time_seconds " << Util::getCpuUsage(getpid()) / sysconf (_SC_CLK_TCK) << std::endl;
-    oss << "loolwsd_memory_used_bytes " << Util::getMemoryUsagePSS(getpid()) * 1024 << std::endl;
+    if (!_hasProcStats)
+        updateProcStats();
+
+    const long ticksPerSecond = sysconf (_SC_CLK_TCK);
+
+    oss << "loolwsd_count " << _procStats._wsdCount << std::endl;
+    oss << "loolwsd_thread_count " << _procStats._wsd._threads << std::endl;
+    oss << "loolwsd_cpu_time_seconds " << _procStats._wsd._cpuJiffies / ticksPerSecond << std::endl;
+    oss << "loolwsd_memory_used_bytes " << _procStats._wsdPssKb * 1024 << std::endl;
     oss << std::endl;
 
-    oss << "forkit_count " << getPidsFromProcName(std::regex("forkit"), nullptr) << std::endl;
-    oss << "forkit_thread_count " << Util::getStatFromPid(_forKitPid, 19) << std::endl;
-    oss << "forkit_cpu_time_seconds " << Util::getCpuUsage(_forKitPid) / sysconf (_SC_CLK_TCK) << std::endl;
-    oss << "forkit_memory_used_bytes " << Util::getMemoryUsageRSS(_forKitPid) * 1024 << std::endl;
+    oss << "forkit_count " << _procStats._forKitCount << std::endl;
+    oss << "forkit_thread_count " << _procStats._forKit._threads << std::endl;
+    oss << "forkit_cpu_time_seconds " << _procStats._forKit._cpuJiffies / ticksPerSecond << std::endl;
+    oss << "forkit_memory_used_bytes " << _procStats._forKit._rssKb * 1024 << std::endl;
     oss << std::endl;
 
     DocumentAggregateStats docStats;
     KitProcStats kitStats;
 
     CalcDocAggregateStats(docStats);
-    CalcKitStats(kitStats);
+    kitStats.unassignedCount = _procStats._unassignedKitCount;
+    kitStats.assignedCount = _procStats._assignedKitCount;
+    for (const Util::ProcessStat& stat : _procStats._kits)
+        kitStats.UpdateAggregateStats(stat);
 
     oss << "kit_count " << kitStats.unassignedCount + kitStats.assignedCount << std::endl;
     oss << "kit_unassigned_count " << kitStats.unassignedCount << std::endl;
@@ -1095,6 +1123,7 @@ void AdminModel::getMetrics(std::ostringstream &oss)
     oss << "kit_lost_terminated_count " << _lostKitsTerminatedCount << std::endl;
     PrintKitAggregateMetrics(oss, "thread_count", "", kitStats._threadCount);
     PrintKitAggregateMetrics(oss, "memory_used", "bytes", docStats._kitUsedMemory._active);
+    PrintKitAggregateMetrics(oss, "memory_shared", "bytes", docStats._kitSharedMemory._active);
     PrintKitAggregateMetrics(oss, "cpu_time", "seconds", kitStats._cpuTime);
     oss << std::endl;
 
@@ -14,6 +14,7 @@
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <common/Log.hpp>
 #include "Util.hpp"
@@ -141,6 +142,7 @@ public:
         , _filename(std::move(filename))
         , _wopiHost(std::move(wopiHost))
         , _memoryDirty(0)
+        , _memoryShared(0)
         , _lastJiffy(0)
         , _lastCpuPercentage(0)
         , _start(std::time(nullptr))
@@ -194,6 +196,7 @@ public:
     void updateLastActivityTime() { _lastActivity = std::time(nullptr); }
     void updateMemoryDirty();
     size_t getMemoryDirty() const { return _memoryDirty; }
+    size_t getMemoryShared() const { return _memoryShared; }
 
     std::pair<std::time_t, std::string> getSnapshot() const;
     const std::string getHistory() const;
@@ -239,6 +242,8 @@ private:
     std::string _wopiHost;
     /// The dirty (ie. un-shared) memory of the document's Kit process.
     size_t _memoryDirty;
+    /// The memory the document's Kit process still shares, copy-on-write, with ForKit.
+    size_t _memoryShared;
     /// Last noted Jiffy count
     unsigned _lastJiffy;
     std::chrono::steady_clock::time_point _lastJiffyTime;
@@ -383,6 +388,13 @@ public:
     void setForKitPid(pid_t pid) { _forKitPid = pid; }
     void addLostKitsTerminated(unsigned lostKitsTerminated);
 
+    /// Reads the stats of the WSD, ForKit and Kit processes, for getMetrics() to serve.
+    void updateProcStats();
+
+    /// The PSS of WSD and the RSS of ForKit, in KB, as of the last updateProcStats().
+    size_t getWsdMemoryUsage() const { return _procStats._wsdPssKb; }
+    size_t getForKitMemoryUsage() const { return _procStats._forKit._rssKb; }
+
     void getMetrics(std::ostringstream &oss);
 
     std::set<pid_t> getDocumentPids() const;
@@ -440,6 +452,22 @@ private:
 
     pid_t _forKitPid = 0;
 
+    /// The stats of the processes, as of the last updateProcStats(), so that scrapes don't
+    /// have to walk /proc.
+    struct ProcStats
+    {
+        int _wsdCount = 0;
+        Util::ProcessStat _wsd;
+        size_t _wsdPssKb = 0;
+        int _forKitCount = 0;
+        Util::ProcessStat _forKit;
+        int _unassignedKitCount = 0;
+        int _assignedKitCount = 0;
+        std::vector<Util::ProcessStat> _kits;
+    };
+    ProcStats _procStats;
+    bool _hasProcStats = false;
+
     /// We check the owner even in the release builds, needs to be always correct.
     std::thread::id _owner;
 
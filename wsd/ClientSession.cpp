@@ -64,6 +64,8 @@ ClientSession::ClientSession(
     _clientVisibleArea(0, 0, 0, 0),
     _splitX(0),
     _splitY(0),
+    _scrollDirectionX(0),
+    _scrollDirectionY(0),
     _clientSelectedPart(-1),
     _tileWidthPixel(0),
     _tileHeightPixel(0),
@@ -173,6 +175,28 @@ void ClientSession::setState(SessionState newState)
     _lastStateTime = std::chrono::steady_clock::now();
 }
 
+void ClientSession::handleMessage(const std::vector<char>& data)
+{
+    if (_state == SessionState::DETACHED)
+    {
+        // The DocBroker is still downloading the document for us: the Kit has no view yet.
+        LOG_TRC(getName() << ": queuing incoming [" << getAbbreviatedMessage(data)
+                          << "] until loaded.");
+        _inputQueuedOnLoad.push_back(data);
+        return;
+    }
+
+    Session::handleMessage(data);
+}
+
+void ClientSession::handleInputQueuedOnLoad()
+{
+    std::vector<std::vector<char>> input;
+    input.swap(_inputQueuedOnLoad);
+    for (const std::vector<char>& data : input)
+        Session::handleMessage(data);
+}
+
 bool ClientSession::disconnectFromKit()
 {
     assert(_state != SessionState::WAIT_DISCONNECT);
@@ -721,6 +745,15 @@ bool ClientSession::_handleInput(const char *buffer, int length)
                 _splitY = splitY;
             }
 
+            // Remember which way the user scrolls, that is what we prerender next.
+            // A different size is zooming or resizing, which doesn't tell.
+            if (width == _clientVisibleArea.getWidth() && height == _clientVisibleArea.getHeight()
+                && (x != _clientVisibleArea.getLeft() || y != _clientVisibleArea.getTop()))
+            {
+                _scrollDirectionX = (x > _clientVisibleArea.getLeft()) - (x < _clientVisibleArea.getLeft());
+                _scrollDirectionY = (y > _clientVisibleArea.getTop()) - (y < _clientVisibleArea.getTop());
+            }
+
             _clientVisibleArea = Util::Rectangle(x, y, width, height);
             resetWireIdMap();
             return forwardToChild(std::string(buffer, length), docBroker);
@@ -817,15 +850,14 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             return true;
         }
 
-        auto iter = std::find_if(_tilesOnFly.begin(), _tilesOnFly.end(),
-        [&tileID](const std::pair<std::string, std::chrono::steady_clock::time_point>& curTile)
+        TileKey tileKey;
+        if (!TileKey::parse(tileID, tileKey))
         {
-            return curTile.first == tileID;
-        });
+            LOG_WRN("Invalid tile ID in '" << tokens[0] << "' message: [" << firstLine << "].");
+            return true;
+        }
 
-        if(iter != _tilesOnFly.end())
-            _tilesOnFly.erase(iter);
-        else
+        if (!_tilesOnFly.remove(tileKey))
             LOG_INF("Tileprocessed message with an unknown tile ID '" << tileID << "' from session " << getId());
 
         docBroker->sendRequestedTiles(client_from_this());
@@ -1048,6 +1080,14 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/,
         std::string timestamp, doctemplate;
         int loadPart = -1;
         parseDocOptions(tokens, loadPart, timestamp, doctemplate);
+        if (getTileDeltas() && !LOOLWSD::getConfigValue<bool>("per_document.tile_deltas", true))
+        {
+            LOG_INF("Tile deltas are disabled by config, sending full tiles to " << getName());
+            setTileDeltas(false);
+        }
+
+        if (getTileDeltas())
+            docBroker->setTileDeltas();
 
         std::ostringstream oss;
         oss << "load url=" << docBroker->getPublicUri().toString();
@@ -1122,6 +1162,11 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/,
             oss << " macroSecurityLevel=" << LOOLWSD::getConfigValue<int>("security.macro_security_level", 1);
         }
 
+        if (getTileDeltas())
+        {
+            oss << " deltas=true";
+        }
+
         if (!getDocOptions().empty())
         {
             oss << " options=" << getDocOptions();
@@ -1209,6 +1254,13 @@ bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, co
     {
         TileCombined tileCombined = TileCombined::parse(tokens);
         tileCombined.setNormalizedViewId(getCanonicalViewId());
+        if (getTileDeltas())
+        {
+            // The client may have dropped what we sent it, so base deltas on what it has.
+            for (const TileDesc& tile : tileCombined.getTiles())
+                setClientWireId(tile);
+        }
+
         docBroker->handleTileCombinedRequest(tileCombined, client_from_this());
     }
     catch (const std::exception& exc)
@@ -1919,7 +1971,7 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
     {
         // Avoid sending tile if it has the same wireID as the previously sent tile
         tile = Util::make_unique<TileDesc>(TileDesc::parse(data->firstLine()));
-        auto iter = _oldWireIds.find(tile->generateID());
+        auto iter = _oldWireIds.find(tile->generateKey());
         if(iter != _oldWireIds.end() && tile->getWireId() != 0 && tile->getWireId() == iter->second)
         {
             LOG_INF("WSD filters out a tile with the same wireID: " <<  tile->serialize("tile:"));
@@ -1929,7 +1981,11 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
 
     LOG_TRC(getName() << " enqueueing client message " << data->id());
     std::size_t sizeBefore = _senderQueue.size();
-    std::size_t newSize = _senderQueue.enqueue(data);
+    std::size_t newSize = _senderQueue.enqueue(data, tile.get());
+
+    // Have the socket polled for writing.
+    if (sizeBefore == 0 && _protocol)
+        _protocol->pollEventsChanged();
 
     // Track sent tile
     if (tile)
@@ -1940,7 +1996,7 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
 
 void ClientSession::addTileOnFly(const TileDesc& tile)
 {
-    _tilesOnFly.emplace_back(tile.generateID(), std::chrono::steady_clock::now());
+    _tilesOnFly.add(tile.generateKey(), std::chrono::steady_clock::now());
 }
 
 void ClientSession::clearTilesOnFly()
@@ -1950,35 +2006,22 @@ void ClientSession::clearTilesOnFly()
 
 void ClientSession::removeOutdatedTilesOnFly()
 {
-    // Check only the beginning of the list, tiles are ordered by timestamp
-    bool continueLoop = true;
-    while(!_tilesOnFly.empty() && continueLoop)
-    {
-        auto tileIter = _tilesOnFly.begin();
-        const auto elapsedTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - tileIter->second);
-        if (elapsedTimeMs > std::chrono::milliseconds(TILE_ROUNDTRIP_TIMEOUT_MS))
-        {
-            LOG_WRN("Tracker tileID " << tileIter->first << " was dropped because of time out ("
-                                      << elapsedTimeMs
-                                      << "). Tileprocessed message did not arrive in time.");
-            _tilesOnFly.erase(tileIter);
-        }
-        else
-            continueLoop = false;
-    }
+    // Only the beginning of the queue is checked, tiles are ordered by timestamp
+    _tilesOnFly.expire(std::chrono::steady_clock::now(),
+                       std::chrono::milliseconds(TILE_ROUNDTRIP_TIMEOUT_MS),
+                       [](const TileKey& key, std::chrono::steady_clock::duration elapsed) {
+                           const auto elapsedTimeMs
+                               = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+                           LOG_WRN("Tracker tileID " << key.toString()
+                                                     << " was dropped because of time out ("
+                                                     << elapsedTimeMs
+                                                     << "). Tileprocessed message did not arrive in time.");
+                       });
 }
 
-std::size_t ClientSession::countIdenticalTilesOnFly(const TileDesc& tile) const
+std::size_t ClientSession::countIdenticalTilesOnFly(const TileKey& key) const
 {
-    std::size_t count = 0;
-    const std::string tileID = tile.generateID();
-    for (const auto& tileItem : _tilesOnFly)
-    {
-        if (tileItem.first == tileID)
-            ++count;
-    }
-    return count;
+    return _tilesOnFly.count(key);
 }
 
 Util::Rectangle ClientSession::getNormalizedVisibleArea() const
@@ -1991,6 +2034,41 @@ Util::Rectangle ClientSession::getNormalizedVisibleArea() const
     return normalizedVisArea;
 }
 
+void ClientSession::getPrerenderTiles(std::vector<TileDesc>& tiles)
+{
+    if (!_clientVisibleArea.hasSurface() ||
+        _tileWidthPixel == 0 || _tileHeightPixel == 0 ||
+        _tileWidthTwips == 0 || _tileHeightTwips == 0 ||
+        (_clientSelectedPart == -1 && !_isTextDocument))
+    {
+        return;
+    }
+
+    const Util::Rectangle visibleArea = getNormalizedVisibleArea();
+    if (!visibleArea.hasSurface())
+        return;
+
+    // Until the user scrolls, the next screenful is the one below.
+    const int directionX = _scrollDirectionX;
+    const int directionY = (_scrollDirectionX == 0 && _scrollDirectionY == 0) ? 1 : _scrollDirectionY;
+
+    const int left = std::max(visibleArea.getLeft() + directionX * visibleArea.getWidth(), 0);
+    const int top = std::max(visibleArea.getTop() + directionY * visibleArea.getHeight(), 0);
+    const int right = visibleArea.getRight() + directionX * visibleArea.getWidth();
+    const int bottom = visibleArea.getBottom() + directionY * visibleArea.getHeight();
+
+    const int part = _isTextDocument ? 0 : _clientSelectedPart;
+    for (int y = top / _tileHeightTwips; y * _tileHeightTwips < bottom; ++y)
+    {
+        for (int x = left / _tileWidthTwips; x * _tileWidthTwips < right; ++x)
+        {
+            tiles.emplace_back(getCanonicalViewId(), part, _tileWidthPixel, _tileHeightPixel,
+                               x * _tileWidthTwips, y * _tileHeightTwips, _tileWidthTwips,
+                               _tileHeightTwips, -1, 0, -1, false);
+        }
+    }
+}
+
 void ClientSession::onDisconnect()
 {
     LOG_INF(getName() << " Disconnected, current number of connections: " << LOOLWSD::NumConnections);
@@ -2164,7 +2242,7 @@ void ClientSession::handleTileInvalidation(const std::string& message,
                         invalidTiles.emplace_back(normalizedViewId, part, _tileWidthPixel, _tileHeightPixel, j * _tileWidthTwips, i * _tileHeightTwips, _tileWidthTwips, _tileHeightTwips, -1, 0, -1, false);
 
                         TileWireId oldWireId = 0;
-                        auto iter = _oldWireIds.find(invalidTiles.back().generateID());
+                        auto iter = _oldWireIds.find(invalidTiles.back().generateKey());
                         if(iter != _oldWireIds.end())
                             oldWireId = iter->second;
 
@@ -2263,12 +2341,44 @@ void ClientSession::resetWireIdMap()
     _oldWireIds.clear();
 }
 
+TileWireId ClientSession::getSentWireId(const TileDesc& tile) const
+{
+    const auto iter = _oldWireIds.find(tile.generateKey());
+    return iter != _oldWireIds.end() ? iter->second : 0;
+}
+
+void ClientSession::setClientWireId(const TileDesc& tile)
+{
+    if (tile.getOldWireId() != 0)
+        _oldWireIds[tile.generateKey()] = tile.getOldWireId();
+    else
+        _oldWireIds.erase(tile.generateKey());
+}
+
+void ClientSession::sendTileUpdates(const TileDesc& tile,
+                                    const std::vector<TileCache::TileUpdate>& updates)
+{
+    TileDesc desc = tile;
+    for (const TileCache::TileUpdate& update : updates)
+    {
+        desc.setOldWireId(update._oldWireId);
+        desc.setWireId(update._wireId);
+        const std::string response = desc.serialize("tile:");
+
+        auto payload = std::make_shared<Message>(response, Message::Dir::Out,
+                                                 response.size() + 1 + update._data->size());
+        payload->append("\n", 1);
+        payload->append(update._data->data(), update._data->size());
+        enqueueSendMessage(payload);
+    }
+}
+
 void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
 {
-    const std::string tileID = tile.generateID();
+    const TileKey tileKey = tile.generateKey();
 
     // Store wireId first
-    auto iter = _oldWireIds.find(tileID);
+    auto iter = _oldWireIds.find(tileKey);
     if(iter != _oldWireIds.end())
     {
         iter->second = tile.getWireId();
@@ -2278,7 +2388,7 @@ void ClientSession::traceTileBySend(const TileDesc& tile, bool deduplicated)
         // Track only tile inside the visible area
         if(_clientVisibleArea.hasSurface() && isTileInsideVisibleArea(tile))
         {
-            _oldWireIds.insert(std::pair<std::string, TileWireId>(tileID, tile.getWireId()));
+            _oldWireIds.emplace(tileKey, tile.getWireId());
         }
     }
 
@@ -18,6 +18,7 @@
 #include <deque>
 #include <map>
 #include <list>
+#include <unordered_map>
 #include <utility>
 #include "Util.hpp"
 
@@ -58,6 +59,13 @@ public:
     /// transition to a new state
     void setState(SessionState newState);
 
+    /// Handles the client input, or queues it while we are still DETACHED,
+    /// the document being downloaded for this session.
+    void handleMessage(const std::vector<char>& data) override;
+
+    /// Handles the input queued while we were DETACHED, once added to the DocBroker.
+    void handleInputQueuedOnLoad();
+
     void setDocumentOwner(const bool documentOwner) { _isDocumentOwner = documentOwner; }
     bool isDocumentOwner() const { return _isDocumentOwner; }
 
@@ -92,6 +100,9 @@ public:
         return sendBinaryFrame(output.data(), output.size());
     }
 
+    /// Send the full tile and/or deltas to bring the client's @tile up to date.
+    void sendTileUpdates(const TileDesc& tile, const std::vector<TileCache::TileUpdate>& updates);
+
     bool sendTextFrame(const char* buffer, const int length) override
     {
         auto payload = std::make_shared<Message>(buffer, length, Message::Dir::Out);
@@ -134,7 +145,7 @@ public:
     void clearTilesOnFly();
     size_t getTilesOnFlyCount() const { return _tilesOnFly.size(); }
     void removeOutdatedTilesOnFly();
-    size_t countIdenticalTilesOnFly(const TileDesc& tile) const;
+    size_t countIdenticalTilesOnFly(const TileKey& key) const;
 
     Util::Rectangle getVisibleArea() const { return _clientVisibleArea; }
     /// Visible area can have negative value as position, but we have tiles only in the positive range
@@ -154,6 +165,9 @@ public:
     /// Returns the normalized visible area of a given split-pane.
     Util::Rectangle getNormalizedVisiblePaneArea(const SplitPaneName) const;
 
+    /// The tiles of the screenful the client is likely to scroll to next.
+    void getPrerenderTiles(std::vector<TileDesc>& tiles);
+
     int getTileWidthInTwips() const { return _tileWidthTwips; }
     int getTileHeightInTwips() const { return _tileHeightTwips; }
 
@@ -164,6 +178,13 @@ public:
     /// Clear wireId map anytime when client visible area changes (visible area, zoom, part number)
     void resetWireIdMap();
 
+    /// The wireId of the last version of this tile we sent, or 0.
+    TileWireId getSentWireId(const TileDesc& tile) const;
+
+    /// The client asked for the tile, with the version it has as its oldWireId, or 0 if none:
+    /// what we send it next is based on that, rather than on what we sent, which it may have dropped.
+    void setClientWireId(const TileDesc& tile);
+
     bool isTextDocument() const { return _isTextDocument; }
 
     /// Do we recognize this clipboard ?
@@ -269,6 +290,9 @@ private:
     /// Time of last state transition
     std::chrono::steady_clock::time_point _lastStateTime;
 
+    /// The client input received while DETACHED.
+    std::vector<std::vector<char>> _inputQueuedOnLoad;
+
     /// Wopi FileInfo object
     std::unique_ptr<WopiStorage::WOPIFileInfo> _wopiFileInfo;
 
@@ -284,6 +308,10 @@ private:
     int _splitX;
     int _splitY;
 
+    /// Which way the client scrolled last, -1, 0 or 1 on each axis.
+    int _scrollDirectionX;
+    int _scrollDirectionY;
+
     /// Selected part of the document viewed by the client (no parts in Writer)
     int _clientSelectedPart;
 
@@ -305,14 +333,14 @@ private:
     /// Rotating clipboard remote access identifiers - protected by GlobalSessionMapMutex
     std::string _clipboardKeys[2];
 
-    /// TileID's of the sent tiles. Push by sending and pop by tileprocessed message from the client.
-    std::vector<std::pair<std::string, std::chrono::steady_clock::time_point>> _tilesOnFly;
+    /// The sent tiles. Added by sending and removed by tileprocessed message from the client.
+    TilesOnFly _tilesOnFly;
 
     /// Requested tiles are stored in this list, before we can send them to the client
     std::deque<TileDesc> _requestedTiles;
 
     /// Store wireID's of the sent tiles inside the actual visible area
-    std::map<std::string, TileWireId> _oldWireIds;
+    std::unordered_map<TileKey, TileWireId, TileKeyHasher> _oldWireIds;
 
     /// Sockets to send binary selection content to
     std::vector<std::weak_ptr<StreamSocket>> _clipSockets;
@@ -49,6 +49,8 @@
 #include <sys/wait.h>
 
 #define TILES_ON_FLY_MIN_UPPER_LIMIT 10.0f
+/// How long the user has to pause before we prerender what they may scroll to.
+#define TILE_PRERENDER_DELAY_MS 250
 
 using namespace LOOLProtocol;
 
@@ -135,6 +137,8 @@ DocumentBroker::DocumentBroker(ChildType type,
     _docKey(docKey),
     _docId(Util::encodeId(DocBrokerId++, 3)),
     _documentChangedInStorage(false),
+    _downloadingAsync(false),
+    _haveFileInfo(false),
     _isModified(false),
     _cursorPosX(0),
     _cursorPosY(0),
@@ -147,6 +151,8 @@ DocumentBroker::DocumentBroker(ChildType type,
     _lastEditingSessionId(),
     _tileVersion(0),
     _debugRenderedTileCount(0),
+    _tileDeltas(false),
+    _tilePrerender(LOOLWSD::getConfigValue<bool>("per_document.tile_prerender", false)),
     _wopiDownloadDuration(0),
     _mobileAppDocId(mobileAppDocId)
 {
@@ -269,7 +275,10 @@ void DocumentBroker::pollThread()
     // Main polling loop goodness.
     while (!_stop && _poll->continuePolling() && !SigUtil::getTerminationFlag())
     {
-        _poll->poll(SocketPoll::DefaultPollTimeoutMicroS);
+        // Wake up in time to prerender when the user pauses.
+        const bool prerenderDue = _tilePrerender && _lastPrerenderTime < _lastActivityTime;
+        _poll->poll(prerenderDue ? std::chrono::milliseconds(TILE_PRERENDER_DELAY_MS)
+                                 : SocketPoll::DefaultPollTimeoutMicroS);
 
 #if !MOBILEAPP
         const auto now = std::chrono::steady_clock::now();
@@ -278,6 +287,9 @@ void DocumentBroker::pollThread()
         if (_tileCache)
             _tileCache->setMaxCacheSize(8 * 1024 * 128 * _sessions.size());
 
+        if (prerenderDue)
+            prerenderTiles(now);
+
         if (isInteractive())
         {
             // Extend the deadline while we are interactiving with the user.
@@ -447,7 +459,7 @@ void DocumentBroker::pollThread()
         }
         else
 #endif
-        if (_sessions.empty() && (isLoaded() || _docState.isMarkedToDestroy()))
+        if (!hasSessions() && (isLoaded() || _docState.isMarkedToDestroy()))
         {
             if (_saveManager.isSaving() || isAsyncSaveInProgress())
             {
@@ -576,6 +588,15 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
             return result;
     }
 
+    if (!prepareDownload(session, jailId))
+        return false;
+
+    return downloadSync(session);
+}
+
+bool DocumentBroker::prepareDownload(const std::shared_ptr<ClientSession>& session,
+                                     const std::string& jailId)
+{
     if (_docState.isMarkedToDestroy())
     {
         // Tearing down.
@@ -594,7 +615,6 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
 
     LOG_INF("jailPath: " << jailPath.toString() << ", jailRoot: " << jailRoot);
 
-    bool firstInstance = false;
     if (_storage == nullptr)
     {
         _docState.setStatus(DocumentState::Status::Downloading);
@@ -621,19 +641,19 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
             LOG_ERR("Failed to create Storage instance for [" << _docKey << "] in " << jailPath.toString());
             return false;
         }
-        firstInstance = true;
     }
 
     assert(_storage != nullptr);
+    return true;
+}
 
+bool DocumentBroker::downloadSync(const std::shared_ptr<ClientSession>& session)
+{
     // Call the storage specific fileinfo functions
-    std::string userId, username;
-    std::string userExtraInfo;
-    std::string watermarkText;
     std::string templateSource;
+    std::chrono::milliseconds wopiCallDurationMs = std::chrono::milliseconds::zero();
 
 #if !MOBILEAPP
-    std::chrono::milliseconds checkFileInfoCallDurationMs = std::chrono::milliseconds::zero();
     WopiStorage* wopiStorage = dynamic_cast<WopiStorage*>(_storage.get());
     if (wopiStorage != nullptr)
     {
@@ -641,129 +661,170 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
         std::unique_ptr<WopiStorage::WOPIFileInfo> wopifileinfo = wopiStorage->getWOPIFileInfo(
             session->getAuthorization(), session->getCookies(), *_lockCtx);
 
-        checkFileInfoCallDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        wopiCallDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::steady_clock::now() - start);
 
-        userId = wopifileinfo->getUserId();
-        username = wopifileinfo->getUsername();
-        userExtraInfo = wopifileinfo->getUserExtraInfo();
-        watermarkText = wopifileinfo->getWatermarkText();
         templateSource = wopifileinfo->getTemplateSource();
+        processWOPIFileInfo(session, wopifileinfo);
+    }
+    else
+#endif
+    {
+        processLocalFileInfo(session);
+    }
 
-        if (!wopifileinfo->getUserCanWrite() ||
-            LOOLWSD::IsViewFileExtension(wopiStorage->getFileExtension()))
-        {
-            LOG_DBG("Setting the session as readonly");
-            session->setReadOnly();
-            if (LOOLWSD::IsViewWithCommentsFileExtension(wopiStorage->getFileExtension()))
-            {
-                LOG_DBG("Allow session to change comments");
-                session->setAllowChangeComments();
-            }
-        }
-        else if (wopifileinfo->getUserCanWrite())
+    if (!processFileInfo(session))
+        return false;
+
+    // Let's download the document now, if not downloaded.
+    if (!_storage->isDownloaded())
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string localPath = _storage->downloadStorageFileToLocal(
+            session->getAuthorization(), session->getCookies(), *_lockCtx, templateSource);
+
+        wopiCallDurationMs += std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+
+        if (!processDownloadedFile(session, localPath, templateSource))
+            return false;
+    }
+
+#if !MOBILEAPP
+    finishDownload(session, wopiCallDurationMs);
+#endif
+    return true;
+}
+
+#if !MOBILEAPP
+void DocumentBroker::processWOPIFileInfo(const std::shared_ptr<ClientSession>& session,
+                                         std::unique_ptr<WopiStorage::WOPIFileInfo>& wopifileinfo)
+{
+    WopiStorage* wopiStorage = static_cast<WopiStorage*>(_storage.get());
+
+    session->setUserId(wopifileinfo->getUserId());
+    session->setUserName(wopifileinfo->getUsername());
+    session->setUserExtraInfo(wopifileinfo->getUserExtraInfo());
+    session->setWatermarkText(wopifileinfo->getWatermarkText());
+    const std::string templateSource = wopifileinfo->getTemplateSource();
+
+    if (!wopifileinfo->getUserCanWrite() ||
+        LOOLWSD::IsViewFileExtension(wopiStorage->getFileExtension()))
+    {
+        LOG_DBG("Setting the session as readonly");
+        session->setReadOnly();
+        if (LOOLWSD::IsViewWithCommentsFileExtension(wopiStorage->getFileExtension()))
         {
-            session->setReadOnly(false);
-            session->setAllowChangeComments(true);
+            LOG_DBG("Allow session to change comments");
+            session->setAllowChangeComments();
         }
+    }
+    else if (wopifileinfo->getUserCanWrite())
+    {
+        session->setReadOnly(false);
+        session->setAllowChangeComments(true);
+    }
 
-        // We will send the client about information of the usage type of the file.
-        // Some file types may be treated differently than others.
-        session->sendFileMode(session->isReadOnly(), session->isAllowChangeComments());
+    // We will send the client about information of the usage type of the file.
+    // Some file types may be treated differently than others.
+    session->sendFileMode(session->isReadOnly(), session->isAllowChangeComments());
 
-        // Construct a JSON containing relevant WOPI host properties
-        Object::Ptr wopiInfo = new Object();
-        if (!wopifileinfo->getPostMessageOrigin().empty())
+    // Construct a JSON containing relevant WOPI host properties
+    Object::Ptr wopiInfo = new Object();
+    if (!wopifileinfo->getPostMessageOrigin().empty())
+    {
+        // Update the scheme to https if ssl or ssl termination is on
+        if (wopifileinfo->getPostMessageOrigin().substr(0, 7) == "http://" &&
+            (LOOLWSD::isSSLEnabled() || LOOLWSD::isSSLTermination()))
         {
-            // Update the scheme to https if ssl or ssl termination is on
-            if (wopifileinfo->getPostMessageOrigin().substr(0, 7) == "http://" &&
-                (LOOLWSD::isSSLEnabled() || LOOLWSD::isSSLTermination()))
-            {
-                wopifileinfo->getPostMessageOrigin().replace(0, 4, "https");
-                LOG_DBG("Updating PostMessageOrigin scheme to HTTPS. Updated origin is [" << wopifileinfo->getPostMessageOrigin() << "].");
-            }
-
-            wopiInfo->set("PostMessageOrigin", wopifileinfo->getPostMessageOrigin());
+            wopifileinfo->getPostMessageOrigin().replace(0, 4, "https");
+            LOG_DBG("Updating PostMessageOrigin scheme to HTTPS. Updated origin is [" << wopifileinfo->getPostMessageOrigin() << "].");
         }
 
-        // If print, export are disabled, order client to hide these options in the UI
-        if (wopifileinfo->getDisablePrint())
-            wopifileinfo->setHidePrintOption(true);
-        if (wopifileinfo->getDisableExport())
-            wopifileinfo->setHideExportOption(true);
+        wopiInfo->set("PostMessageOrigin", wopifileinfo->getPostMessageOrigin());
+    }
 
-        wopiInfo->set("BaseFileName", wopiStorage->getFileInfo().getFilename());
-        if (wopifileinfo->getBreadcrumbDocName().size())
-            wopiInfo->set("BreadcrumbDocName", wopifileinfo->getBreadcrumbDocName());
+    // If print, export are disabled, order client to hide these options in the UI
+    if (wopifileinfo->getDisablePrint())
+        wopifileinfo->setHidePrintOption(true);
+    if (wopifileinfo->getDisableExport())
+        wopifileinfo->setHideExportOption(true);
 
-        if (!wopifileinfo->getTemplateSaveAs().empty())
-            wopiInfo->set("TemplateSaveAs", wopifileinfo->getTemplateSaveAs());
+    wopiInfo->set("BaseFileName", wopiStorage->getFileInfo().getFilename());
+    if (wopifileinfo->getBreadcrumbDocName().size())
+        wopiInfo->set("BreadcrumbDocName", wopifileinfo->getBreadcrumbDocName());
 
-        if (!templateSource.empty())
-                wopiInfo->set("TemplateSource", templateSource);
+    if (!wopifileinfo->getTemplateSaveAs().empty())
+        wopiInfo->set("TemplateSaveAs", wopifileinfo->getTemplateSaveAs());
 
-        wopiInfo->set("HidePrintOption", wopifileinfo->getHidePrintOption());
-        wopiInfo->set("HideSaveOption", wopifileinfo->getHideSaveOption());
-        wopiInfo->set("HideExportOption", wopifileinfo->getHideExportOption());
-        wopiInfo->set("DisablePrint", wopifileinfo->getDisablePrint());
-        wopiInfo->set("DisableExport", wopifileinfo->getDisableExport());
-        wopiInfo->set("DisableCopy", wopifileinfo->getDisableCopy());
-        wopiInfo->set("DisableInactiveMessages", wopifileinfo->getDisableInactiveMessages());
-        wopiInfo->set("DownloadAsPostMessage", wopifileinfo->getDownloadAsPostMessage());
-        wopiInfo->set("UserCanNotWriteRelative", wopifileinfo->getUserCanNotWriteRelative());
-        wopiInfo->set("EnableInsertRemoteImage", wopifileinfo->getEnableInsertRemoteImage());
-        wopiInfo->set("EnableShare", wopifileinfo->getEnableShare());
-        wopiInfo->set("HideUserList", wopifileinfo->getHideUserList());
-        wopiInfo->set("SupportsRename", wopifileinfo->getSupportsRename());
-        wopiInfo->set("UserCanRename", wopifileinfo->getUserCanRename());
-        wopiInfo->set("FileUrl", wopifileinfo->getFileUrl());
-        if (wopifileinfo->getHideChangeTrackingControls() != WopiStorage::WOPIFileInfo::TriState::Unset)
-            wopiInfo->set("HideChangeTrackingControls", wopifileinfo->getHideChangeTrackingControls() == WopiStorage::WOPIFileInfo::TriState::True);
+    if (!templateSource.empty())
+        wopiInfo->set("TemplateSource", templateSource);
 
-        std::ostringstream ossWopiInfo;
-        wopiInfo->stringify(ossWopiInfo);
-        const std::string wopiInfoString = ossWopiInfo.str();
-        LOG_TRC("Sending wopi info to client: " << wopiInfoString);
+    wopiInfo->set("HidePrintOption", wopifileinfo->getHidePrintOption());
+    wopiInfo->set("HideSaveOption", wopifileinfo->getHideSaveOption());
+    wopiInfo->set("HideExportOption", wopifileinfo->getHideExportOption());
+    wopiInfo->set("DisablePrint", wopifileinfo->getDisablePrint());
+    wopiInfo->set("DisableExport", wopifileinfo->getDisableExport());
+    wopiInfo->set("DisableCopy", wopifileinfo->getDisableCopy());
+    wopiInfo->set("DisableInactiveMessages", wopifileinfo->getDisableInactiveMessages());
+    wopiInfo->set("DownloadAsPostMessage", wopifileinfo->getDownloadAsPostMessage());
+    wopiInfo->set("UserCanNotWriteRelative", wopifileinfo->getUserCanNotWriteRelative());
+    wopiInfo->set("EnableInsertRemoteImage", wopifileinfo->getEnableInsertRemoteImage());
+    wopiInfo->set("EnableShare", wopifileinfo->getEnableShare());
+    wopiInfo->set("HideUserList", wopifileinfo->getHideUserList());
+    wopiInfo->set("SupportsRename", wopifileinfo->getSupportsRename());
+    wopiInfo->set("UserCanRename", wopifileinfo->getUserCanRename());
+    wopiInfo->set("FileUrl", wopifileinfo->getFileUrl());
+    if (wopifileinfo->getHideChangeTrackingControls() != WopiStorage::WOPIFileInfo::TriState::Unset)
+        wopiInfo->set("HideChangeTrackingControls", wopifileinfo->getHideChangeTrackingControls() == WopiStorage::WOPIFileInfo::TriState::True);
 
-        // Contains PostMessageOrigin property which is necessary to post messages to parent
-        // frame. Important to send this message immediately and not enqueue it so that in case
-        // document load fails, loleaflet is able to tell its parent frame via PostMessage API.
-        session->sendMessage("wopi: " + wopiInfoString);
+    std::ostringstream ossWopiInfo;
+    wopiInfo->stringify(ossWopiInfo);
+    const std::string wopiInfoString = ossWopiInfo.str();
+    LOG_TRC("Sending wopi info to client: " << wopiInfoString);
 
-        // Mark the session as 'Document owner' if WOPI hosts supports it
-        if (userId == _storage->getFileInfo().getOwnerId())
-        {
-            LOG_DBG("Session [" << sessionId << "] is the document owner");
-            session->setDocumentOwner(true);
-        }
+    // Contains PostMessageOrigin property which is necessary to post messages to parent
+    // frame. Important to send this message immediately and not enqueue it so that in case
+    // document load fails, loleaflet is able to tell its parent frame via PostMessage API.
+    session->sendMessage("wopi: " + wopiInfoString);
 
-        // Pass the ownership to client session
-        session->setWopiFileInfo(wopifileinfo);
+    // Mark the session as 'Document owner' if WOPI hosts supports it
+    if (session->getUserId() == _storage->getFileInfo().getOwnerId())
+    {
+        LOG_DBG("Session [" << session->getId() << "] is the document owner");
+        session->setDocumentOwner(true);
     }
-    else
+
+    // Pass the ownership to client session
+    session->setWopiFileInfo(wopifileinfo);
+}
 #endif
+
+void DocumentBroker::processLocalFileInfo(const std::shared_ptr<ClientSession>& session)
+{
+    LocalStorage* localStorage = dynamic_cast<LocalStorage*>(_storage.get());
+    if (localStorage != nullptr)
     {
-        LocalStorage* localStorage = dynamic_cast<LocalStorage*>(_storage.get());
-        if (localStorage != nullptr)
-        {
-            std::unique_ptr<LocalStorage::LocalFileInfo> localfileinfo = localStorage->getLocalFileInfo();
-            userId = localfileinfo->getUserId();
-            username = localfileinfo->getUsername();
+        std::unique_ptr<LocalStorage::LocalFileInfo> localfileinfo = localStorage->getLocalFileInfo();
+        session->setUserId(localfileinfo->getUserId());
+        session->setUserName(localfileinfo->getUsername());
 
-            if (LOOLWSD::IsViewFileExtension(localStorage->getFileExtension()))
+        if (LOOLWSD::IsViewFileExtension(localStorage->getFileExtension()))
+        {
+            LOG_DBG("Setting the session as readonly");
+            session->setReadOnly();
+            if (LOOLWSD::IsViewWithCommentsFileExtension(localStorage->getFileExtension()))
             {
-                LOG_DBG("Setting the session as readonly");
-                session->setReadOnly();
-                if (LOOLWSD::IsViewWithCommentsFileExtension(localStorage->getFileExtension()))
-                {
-                    LOG_DBG("Allow session to change comments");
-                    session->setAllowChangeComments();
-                }
+                LOG_DBG("Allow session to change comments");
+                session->setAllowChangeComments();
             }
-            session->sendFileMode(session->isReadOnly(), session->isAllowChangeComments());
         }
+        session->sendFileMode(session->isReadOnly(), session->isAllowChangeComments());
     }
+}
 
+bool DocumentBroker::processFileInfo(const std::shared_ptr<ClientSession>& session)
+{
 #ifdef ENABLE_FREEMIUM
     Object::Ptr freemiumInfo = new Object();
     freemiumInfo->set("IsFreemiumUser", Freemium::FreemiumManager::isFreemiumUser());
@@ -785,19 +846,9 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
 
 #if ENABLE_SUPPORT_KEY
     if (!LOOLWSD::OverrideWatermark.empty())
-        watermarkText = LOOLWSD::OverrideWatermark;
+        session->setWatermarkText(LOOLWSD::OverrideWatermark);
 #endif
 
-    session->setUserId(userId);
-    session->setUserName(username);
-    session->setUserExtraInfo(userExtraInfo);
-    session->setWatermarkText(watermarkText);
-    session->createCanonicalViewId(_sessions);
-
-    LOG_DBG("Setting username [" << LOOLWSD::anonymizeUsername(username) << "] and userId [" <<
-            LOOLWSD::anonymizeUsername(userId) << "] for session [" << sessionId <<
-            "] is canonical id " << session->getCanonicalViewId());
-
     // Basic file information was stored by the above getWOPIFileInfo() or getLocalFileInfo() calls
     const StorageBase::FileInfo fileInfo = _storage->getFileInfo();
     if (!fileInfo.isValid())
@@ -806,8 +857,11 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
         return false;
     }
 
-    if (firstInstance)
+    // Not necessarily that of the first session to load: its CheckFileInfo can
+    // fail, or complete after that of a later one.
+    if (!_haveFileInfo)
     {
+        _haveFileInfo = true;
         _storageManager.setLastModifiedTime(fileInfo.getModifiedTime());
         LOG_DBG("Document timestamp: " << _storageManager.getLastModifiedTime());
     }
@@ -835,159 +889,160 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
 
     broadcastLastModificationTime(session);
 
-    // Let's download the document now, if not downloaded.
-    std::chrono::milliseconds getFileCallDurationMs = std::chrono::milliseconds::zero();
-    if (!_storage->isDownloaded())
-    {
-        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-        std::string localPath = _storage->downloadStorageFileToLocal(
-            session->getAuthorization(), session->getCookies(), *_lockCtx, templateSource);
-
-        getFileCallDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - start);
+    return true;
+}
 
-        _docState.setStatus(DocumentState::Status::Loading); // Done downloading.
+bool DocumentBroker::processDownloadedFile(const std::shared_ptr<ClientSession>& session,
+                                           std::string localPath,
+                                           const std::string& templateSource)
+{
+    _docState.setStatus(DocumentState::Status::Loading); // Done downloading.
 
-        // Only lock the document on storage for editing sessions
-        // FIXME: why not lock before downloadStorageFileToLocal? Would also prevent race conditions
-        if (!session->isReadOnly() &&
-            !_storage->updateLockState(session->getAuthorization(), session->getCookies(), *_lockCtx, true))
-        {
-            LOG_ERR("Failed to lock!");
-            session->setLockFailed(_lockCtx->_lockFailureReason);
-            // TODO: make this "read-only" a special one with a notification (infobar? balloon tip?)
-            //       and a button to unlock
-        }
+    // Only lock the document on storage for editing sessions
+    // FIXME: why not lock before downloadStorageFileToLocal? Would also prevent race conditions
+    if (!session->isReadOnly() &&
+        !_storage->updateLockState(session->getAuthorization(), session->getCookies(), *_lockCtx, true))
+    {
+        LOG_ERR("Failed to lock!");
+        session->setLockFailed(_lockCtx->_lockFailureReason);
+        // TODO: make this "read-only" a special one with a notification (infobar? balloon tip?)
+        //       and a button to unlock
+    }
 
 #if !MOBILEAPP
-        // Check if we have a prefilter "plugin" for this document format
-        for (const auto& plugin : LOOLWSD::PluginConfigurations)
+    // Check if we have a prefilter "plugin" for this document format
+    for (const auto& plugin : LOOLWSD::PluginConfigurations)
+    {
+        try
         {
-            try
-            {
-                const std::string extension(plugin->getString("prefilter.extension"));
-                const std::string newExtension(plugin->getString("prefilter.newextension"));
-                std::string commandLine(plugin->getString("prefilter.commandline"));
+            const std::string extension(plugin->getString("prefilter.extension"));
+            const std::string newExtension(plugin->getString("prefilter.newextension"));
+            std::string commandLine(plugin->getString("prefilter.commandline"));
 
-                if (localPath.length() > extension.length()+1 &&
-                    strcasecmp(localPath.substr(localPath.length() - extension.length() -1).data(), (std::string(".") + extension).data()) == 0)
-                {
-                    // Extension matches, try the conversion. We convert the file to another one in
-                    // the same (jail) directory, with just the new extension tacked on.
-
-                    const std::string newRootPath = _storage->getRootFilePath() + '.' + newExtension;
+            if (localPath.length() > extension.length()+1 &&
+                strcasecmp(localPath.substr(localPath.length() - extension.length() -1).data(), (std::string(".") + extension).data()) == 0)
+            {
+                // Extension matches, try the conversion. We convert the file to another one in
+                // the same (jail) directory, with just the new extension tacked on.
 
-                    // The commandline must contain the space-separated substring @INPUT@ that is
-                    // replaced with the input file name, and @OUTPUT@ for the output file name.
-                    int inputs(0), outputs(0);
+                const std::string newRootPath = _storage->getRootFilePath() + '.' + newExtension;
 
-                    std::string input("@INPUT");
-                    std::size_t pos = commandLine.find(input);
-                    if (pos != std::string::npos)
-                    {
-                        commandLine.replace(pos, input.length(), _storage->getRootFilePath());
-                        ++inputs;
-                    }
+                // The commandline must contain the space-separated substring @INPUT@ that is
+                // replaced with the input file name, and @OUTPUT@ for the output file name.
+                int inputs(0), outputs(0);
 
-                    std::string output("@OUTPUT@");
-                    pos = commandLine.find(output);
-                    if (pos != std::string::npos)
-                    {
-                        commandLine.replace(pos, output.length(), newRootPath);
-                        ++outputs;
-                    }
+                std::string input("@INPUT");
+                std::size_t pos = commandLine.find(input);
+                if (pos != std::string::npos)
+                {
+                    commandLine.replace(pos, input.length(), _storage->getRootFilePath());
+                    ++inputs;
+                }
 
-                    StringVector args(Util::tokenize(commandLine, ' '));
-                    std::string command(args[0]);
-                    args.erase(args.begin()); // strip the command
+                std::string output("@OUTPUT@");
+                pos = commandLine.find(output);
+                if (pos != std::string::npos)
+                {
+                    commandLine.replace(pos, output.length(), newRootPath);
+                    ++outputs;
+                }
 
-                    if (inputs != 1 || outputs != 1)
-                        throw std::exception();
+                StringVector args(Util::tokenize(commandLine, ' '));
+                std::string command(args[0]);
+                args.erase(args.begin()); // strip the command
 
-                    int process = Util::spawnProcess(command, args);
-                    int status = -1;
-                    const int rc = ::waitpid(process, &status, 0);
-                    if (rc != 0)
-                    {
-                        LOG_ERR("Conversion from " << extension << " to " << newExtension << " failed (" << rc << ").");
-                        return false;
-                    }
+                if (inputs != 1 || outputs != 1)
+                    throw std::exception();
 
-                    _storage->setRootFilePath(newRootPath);
-                    localPath += '.' + newExtension;
+                int process = Util::spawnProcess(command, args);
+                int status = -1;
+                const int rc = ::waitpid(process, &status, 0);
+                if (rc != 0)
+                {
+                    LOG_ERR("Conversion from " << extension << " to " << newExtension << " failed (" << rc << ").");
+                    return false;
                 }
 
-                // We successfully converted the file to something LO can use; break out of the for
-                // loop.
-                break;
-            }
-            catch (const std::exception&)
-            {
-                // This plugin is not a proper prefilter one
+                _storage->setRootFilePath(newRootPath);
+                localPath += '.' + newExtension;
             }
+
+            // We successfully converted the file to something LO can use; break out of the for
+            // loop.
+            break;
+        }
+        catch (const std::exception&)
+        {
+            // This plugin is not a proper prefilter one
         }
+    }
 #endif
 
-        const std::string localFilePath = Poco::Path(getJailRoot(), localPath).toString();
-        std::ifstream istr(localFilePath, std::ios::binary);
-        Poco::SHA1Engine sha1;
-        Poco::DigestOutputStream dos(sha1);
-        Poco::StreamCopier::copyStream(istr, dos);
-        dos.close();
-        LOG_INF("SHA1 for DocKey [" << _docKey << "] of [" << LOOLWSD::anonymizeUrl(localPath) << "]: " <<
-                Poco::DigestEngine::digestToHex(sha1.digest()));
+    const std::string localFilePath = Poco::Path(getJailRoot(), localPath).toString();
+    std::ifstream istr(localFilePath, std::ios::binary);
+    Poco::SHA1Engine sha1;
+    Poco::DigestOutputStream dos(sha1);
+    Poco::StreamCopier::copyStream(istr, dos);
+    dos.close();
+    LOG_INF("SHA1 for DocKey [" << _docKey << "] of [" << LOOLWSD::anonymizeUrl(localPath) << "]: " <<
+            Poco::DigestEngine::digestToHex(sha1.digest()));
 
-        std::string localPathEncoded;
-        Poco::URI::encode(localPath, "#?", localPathEncoded);
-        _uriJailed = Poco::URI(Poco::URI("file://"), localPathEncoded).toString();
-        _uriJailedAnonym = Poco::URI(Poco::URI("file://"), LOOLWSD::anonymizeUrl(localPathEncoded)).toString();
+    std::string localPathEncoded;
+    Poco::URI::encode(localPath, "#?", localPathEncoded);
+    _uriJailed = Poco::URI(Poco::URI("file://"), localPathEncoded).toString();
+    _uriJailedAnonym = Poco::URI(Poco::URI("file://"), LOOLWSD::anonymizeUrl(localPathEncoded)).toString();
 
-        _filename = fileInfo.getFilename();
+    _filename = _storage->getFileInfo().getFilename();
 
-        if (!templateSource.empty())
-        {
-            // Invalid timestamp for templates, to force uploading once we save-after-loading.
-            _saveManager.setLastModifiedTime(std::chrono::system_clock::time_point());
-            _storageManager.setLastUploadedFileModifiedTime(
-                std::chrono::system_clock::time_point());
-        }
-        else
-        {
-            // Use the local temp file's timestamp.
-            const auto timepoint = FileUtil::Stat(localFilePath).modifiedTimepoint();
-            _saveManager.setLastModifiedTime(timepoint);
-            _storageManager.setLastUploadedFileModifiedTime(timepoint); // Used to detect modifications.
-        }
+    if (!templateSource.empty())
+    {
+        // Invalid timestamp for templates, to force uploading once we save-after-loading.
+        _saveManager.setLastModifiedTime(std::chrono::system_clock::time_point());
+        _storageManager.setLastUploadedFileModifiedTime(
+            std::chrono::system_clock::time_point());
+    }
+    else
+    {
+        // Use the local temp file's timestamp.
+        const auto timepoint = FileUtil::Stat(localFilePath).modifiedTimepoint();
+        _saveManager.setLastModifiedTime(timepoint);
+        _storageManager.setLastUploadedFileModifiedTime(timepoint); // Used to detect modifications.
+    }
 
-        bool dontUseCache = false;
+    bool dontUseCache = false;
 #if MOBILEAPP
-        // avoid memory consumption for single-user local bits.
-        // FIXME: arguably should/could do this for single user documents too.
-        dontUseCache = true;
+    // avoid memory consumption for single-user local bits.
+    // FIXME: arguably should/could do this for single user documents too.
+    dontUseCache = true;
 #endif
 
-        _tileCache = Util::make_unique<TileCache>(_storage->getUri().toString(),
-                                                  _saveManager.getLastModifiedTime(), dontUseCache);
-        _tileCache->setThreadOwner(std::this_thread::get_id());
-    }
+    _tileCache = Util::make_unique<TileCache>(_storage->getUri().toString(),
+                                              _saveManager.getLastModifiedTime(), dontUseCache);
+    _tileCache->setThreadOwner(std::this_thread::get_id());
+    _tileCache->setTileDeltas(_tileDeltas);
+    return true;
+}
 
 #if !MOBILEAPP
-    LOOLWSD::dumpNewSessionTrace(getJailId(), sessionId, _uriOrig, _storage->getRootFilePath());
+void DocumentBroker::finishDownload(const std::shared_ptr<ClientSession>& session,
+                                    std::chrono::milliseconds wopiCallDurationMs)
+{
+    LOOLWSD::dumpNewSessionTrace(getJailId(), session->getId(), _uriOrig,
+                                 _storage->getRootFilePath());
 
     // Since document has been loaded, send the stats if its WOPI
-    if (wopiStorage != nullptr)
+    if (dynamic_cast<WopiStorage*>(_storage.get()) != nullptr)
     {
         // Add the time taken to load the file from storage and to check file info.
-        _wopiDownloadDuration += getFileCallDurationMs + checkFileInfoCallDurationMs;
+        _wopiDownloadDuration += wopiCallDurationMs;
         const auto downloadSecs = _wopiDownloadDuration.count() / 1000.;
         const std::string msg
             = "stats: wopiloadduration " + std::to_string(downloadSecs); // In seconds.
         LOG_TRC("Sending to Client [" << msg << "].");
         session->sendTextFrame(msg);
     }
-#endif
-    return true;
 }
+#endif
 
 std::string DocumentBroker::handleRenameFileCommand(std::string sessionId,
                                                     std::string newFilename)
@@ -1181,7 +1236,7 @@ void DocumentBroker::handleSaveResponse(const std::string& sessionId, bool succe
             disconnectSessionInternal(sessionId);
 
         // If marked to destroy, then this was the last session.
-        if (_docState.isMarkedToDestroy() || _sessions.empty())
+        if (_docState.isMarkedToDestroy() || !hasSessions())
         {
             // Stop so we get cleaned up and removed.
             LOG_DBG("Stopping after saving because "
@@ -1539,7 +1594,7 @@ void DocumentBroker::handleUploadToStorageResponse(const StorageBase::UploadResu
         }
 
         // If marked to destroy, then this was the last session.
-        if (_docState.isMarkedToDestroy() || _sessions.empty())
+        if (_docState.isMarkedToDestroy() || !hasSessions())
         {
             // Stop so we get cleaned up and removed.
             LOG_DBG("Stopping after uploading because "
@@ -1863,7 +1918,7 @@ std::size_t DocumentBroker::addSession(const std::shared_ptr<ClientSession>& ses
     catch (const std::exception& exc)
     {
         LOG_ERR("Failed to add session to [" << _docKey << "] with URI [" << LOOLWSD::anonymizeUrl(session->getPublicUri().toString()) << "]: " << exc.what());
-        if (_sessions.empty())
+        if (!hasSessions())
         {
             LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
             _docState.markToDestroy();
@@ -1873,6 +1928,265 @@ std::size_t DocumentBroker::addSession(const std::shared_ptr<ClientSession>& ses
     }
 }
 
+void DocumentBroker::addSessionAsync(const std::shared_ptr<ClientSession>& session,
+                                     const AsyncAddSessionCallback& asyncAddSessionCallback)
+{
+    assertCorrectThread();
+
+    const std::string id = session->getId();
+    _sessionsLoading.insert(id);
+
+    try
+    {
+        const std::string jailId = _childProcess->getJailId();
+        LOG_INF("Loading [" << _docKey << "] asynchronously for session [" << id << "] in jail ["
+                            << jailId << ']');
+
+        bool result;
+        if (UnitWSD::get().filterLoad(id, jailId, result))
+        {
+            if (!result)
+                throw std::runtime_error("Failed to load document with URI [" +
+                                         session->getPublicUri().toString() + "].");
+
+            finishAddSessionAsync(session, nullptr, asyncAddSessionCallback);
+            return;
+        }
+
+        if (!prepareDownload(session, jailId))
+            throw std::runtime_error("Failed to load document with URI [" +
+                                     session->getPublicUri().toString() + "].");
+
+#if !MOBILEAPP
+        WopiStorage* wopiStorage = dynamic_cast<WopiStorage*>(_storage.get());
+        if (wopiStorage != nullptr)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            wopiStorage->getWOPIFileInfoAsync(
+                session->getAuthorization(), session->getCookies(), *_lockCtx, *_poll,
+                [=](std::unique_ptr<WopiStorage::WOPIFileInfo> wopifileinfo,
+                    const std::exception_ptr& error)
+                {
+                    const std::chrono::milliseconds callDurationMs
+                        = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start);
+                    onWOPIFileInfoAsync(session, wopifileinfo, error, callDurationMs,
+                                        asyncAddSessionCallback);
+                });
+            return;
+        }
+#endif
+
+        // Only WOPI makes network requests, load anything else right away.
+        if (!downloadSync(session))
+            throw std::runtime_error("Failed to load document with URI [" +
+                                     session->getPublicUri().toString() + "].");
+    }
+    catch (const std::exception&)
+    {
+        finishAddSessionAsync(session, std::current_exception(), asyncAddSessionCallback);
+        return;
+    }
+
+    finishAddSessionAsync(session, nullptr, asyncAddSessionCallback);
+}
+
+#if !MOBILEAPP
+void DocumentBroker::onWOPIFileInfoAsync(const std::shared_ptr<ClientSession>& session,
+                                         std::unique_ptr<WopiStorage::WOPIFileInfo>& wopifileinfo,
+                                         const std::exception_ptr& error,
+                                         std::chrono::milliseconds callDurationMs,
+                                         const AsyncAddSessionCallback& asyncAddSessionCallback)
+{
+    assertCorrectThread();
+
+    if (!isLoadingAsync(session))
+        return;
+
+    if (error)
+    {
+        finishAddSessionAsync(session, error, asyncAddSessionCallback);
+        return;
+    }
+
+    std::string templateSource;
+    try
+    {
+        templateSource = wopifileinfo->getTemplateSource();
+        processWOPIFileInfo(session, wopifileinfo);
+
+        if (!processFileInfo(session))
+            throw std::runtime_error("Failed to load document with URI [" +
+                                     session->getPublicUri().toString() + "].");
+    }
+    catch (const std::exception&)
+    {
+        finishAddSessionAsync(session, std::current_exception(), asyncAddSessionCallback);
+        return;
+    }
+
+    downloadAsync(session, templateSource, callDurationMs, asyncAddSessionCallback);
+}
+
+void DocumentBroker::downloadAsync(const std::shared_ptr<ClientSession>& session,
+                                   const std::string& templateSource,
+                                   std::chrono::milliseconds wopiCallDurationMs,
+                                   const AsyncAddSessionCallback& asyncAddSessionCallback)
+{
+    if (!isLoadingAsync(session))
+        return;
+
+    if (_storage->isDownloaded())
+    {
+        finishDownload(session, wopiCallDurationMs);
+        finishAddSessionAsync(session, nullptr, asyncAddSessionCallback);
+        return;
+    }
+
+    if (_downloadingAsync)
+    {
+        // Another session is downloading the document, continue once it is done.
+        LOG_DBG("Session [" << session->getId() << "] waits for the download of [" << _docKey
+                            << "] in progress.");
+        _awaitingDownload.emplace_back(
+            [=]()
+            {
+                downloadAsync(session, templateSource, wopiCallDurationMs,
+                              asyncAddSessionCallback);
+            });
+        return;
+    }
+
+    _downloadingAsync = true;
+
+    const auto start = std::chrono::steady_clock::now();
+    WopiStorage* wopiStorage = static_cast<WopiStorage*>(_storage.get());
+    wopiStorage->downloadStorageFileToLocalAsync(
+        session->getAuthorization(), session->getCookies(), templateSource, *_poll,
+        [=](const std::string& localPath, const std::exception_ptr& error)
+        {
+            const std::chrono::milliseconds callDurationMs
+                = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start);
+            onDownloadAsync(session, templateSource, localPath, error,
+                            wopiCallDurationMs + callDurationMs, asyncAddSessionCallback);
+        });
+}
+
+void DocumentBroker::onDownloadAsync(const std::shared_ptr<ClientSession>& session,
+                                     const std::string& templateSource,
+                                     const std::string& localPath, std::exception_ptr error,
+                                     std::chrono::milliseconds wopiCallDurationMs,
+                                     const AsyncAddSessionCallback& asyncAddSessionCallback)
+{
+    assertCorrectThread();
+
+    _downloadingAsync = false;
+
+    // The document is for all the sessions, even if this one disconnected meanwhile.
+    if (!error)
+    {
+        try
+        {
+            if (!processDownloadedFile(session, localPath, templateSource))
+                throw std::runtime_error("Failed to load document with URI [" +
+                                         session->getPublicUri().toString() + "].");
+        }
+        catch (const std::exception&)
+        {
+            error = std::current_exception();
+        }
+    }
+
+    if (isLoadingAsync(session))
+    {
+        if (!error)
+            finishDownload(session, wopiCallDurationMs);
+        finishAddSessionAsync(session, error, asyncAddSessionCallback);
+    }
+
+    // Should the download have failed, the next session waiting tries again.
+    std::vector<std::function<void()>> awaitingDownload;
+    awaitingDownload.swap(_awaitingDownload);
+    for (const auto& resume : awaitingDownload)
+        resume();
+}
+#endif
+
+bool DocumentBroker::isLoadingAsync(const std::shared_ptr<ClientSession>& session)
+{
+    if (_sessionsLoading.count(session->getId()))
+        return true;
+
+    LOG_DBG("Abandoning the load of [" << _docKey << "] for the disconnected session ["
+                                       << session->getId() << "].");
+    releaseSessionsToDisconnect(false);
+    if (!hasSessions())
+    {
+        LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
+        _docState.markToDestroy();
+    }
+
+    return false;
+}
+
+void DocumentBroker::finishAddSessionAsync(const std::shared_ptr<ClientSession>& session,
+                                           std::exception_ptr error,
+                                           const AsyncAddSessionCallback& asyncAddSessionCallback)
+{
+    _sessionsLoading.erase(session->getId());
+
+    if (!error)
+    {
+        try
+        {
+            attachSession(session);
+        }
+        catch (const std::exception&)
+        {
+            error = std::current_exception();
+        }
+    }
+
+    if (error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const StorageSpaceLowException&)
+        {
+            LOG_ERR("Out of storage while loading document with URI ["
+                    << session->getPublicUri().toString() << "].");
+            alertAllUsers("internal", "diskfull");
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Failed to add session to [" << _docKey << "] with URI ["
+                                                 << LOOLWSD::anonymizeUrl(
+                                                        session->getPublicUri().toString())
+                                                 << "]: " << exc.what());
+        }
+
+        releaseSessionsToDisconnect(false);
+        if (!hasSessions())
+        {
+            LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
+            _docState.markToDestroy();
+        }
+
+        asyncAddSessionCallback(error);
+        return;
+    }
+
+    // The Kit has the new session, it can let go of the last ones.
+    releaseSessionsToDisconnect(true);
+    asyncAddSessionCallback(nullptr);
+
+    // Now that the Kit has the session, handle what the client sent while we loaded.
+    session->handleInputQueuedOnLoad();
+}
+
 std::size_t DocumentBroker::addSessionInternal(const std::shared_ptr<ClientSession>& session)
 {
     assertCorrectThread();
@@ -1904,6 +2218,17 @@ std::size_t DocumentBroker::addSessionInternal(const std::shared_ptr<ClientSessi
         throw;
     }
 
+    return attachSession(session);
+}
+
+std::size_t DocumentBroker::attachSession(const std::shared_ptr<ClientSession>& session)
+{
+    session->createCanonicalViewId(_sessions);
+
+    LOG_DBG("Setting username [" << LOOLWSD::anonymizeUsername(session->getUserName()) << "] and userId [" <<
+            LOOLWSD::anonymizeUsername(session->getUserId()) << "] for session [" << session->getId() <<
+            "] is canonical id " << session->getCanonicalViewId());
+
     const std::string id = session->getId();
 
     // Request a new session from the child kit.
@@ -1943,12 +2268,19 @@ std::size_t DocumentBroker::removeSession(const std::string& id)
         const auto it = _sessions.find(id);
         if (it == _sessions.end())
         {
-            LOG_ERR("Invalid or unknown session [" << id << "] to remove.");
+            if (_sessionsLoading.erase(id))
+            {
+                LOG_INF("Session [" << id << "] disconnected while loading [" << _docKey << "].");
+                releaseSessionsToDisconnect(false);
+            }
+            else
+                LOG_ERR("Invalid or unknown session [" << id << "] to remove.");
             return _sessions.size();
         }
         std::shared_ptr<ClientSession> session = it->second;
 
-        const bool isLastSession = (_sessions.size() == 1);
+        // Not the last if another is still loading, which would join a stopped broker.
+        const bool isLastSession = (_sessions.size() == 1 && !hasSessionsLoading());
 
         const bool lastEditableSession = (!session->isReadOnly() || session->isAllowChangeComments()) && !haveAnotherEditableSession(id);
         static const bool dontSaveIfUnmodified = !LOOLWSD::getConfigValue<bool>("per_document.always_save_on_exit", false);
@@ -2019,6 +2351,15 @@ std::size_t DocumentBroker::removeSession(const std::string& id)
 void DocumentBroker::disconnectSessionInternal(const std::string& id)
 {
     assertCorrectThread();
+
+    if (_sessions.size() == 1 && _sessions.count(id) && hasSessionsLoading())
+    {
+        LOG_DBG("Session [" << id << "] is the last of [" << _docKey
+                            << "], it will disconnect once a session loading joins.");
+        _sessionsToDisconnect.insert(id);
+        return;
+    }
+
     try
     {
 #if !MOBILEAPP
@@ -2062,7 +2403,7 @@ void DocumentBroker::disconnectSessionInternal(const std::string& id)
             {
                 hardDisconnect = it->second->disconnectFromKit();
 
-                if (isLoaded() || _sessions.size() > 1)
+                if (isLoaded() || _sessions.size() > 1 || hasSessionsLoading())
                 {
                     // Let the child know the client has disconnected.
                     const std::string msg("child-" + id + " disconnect");
@@ -2100,6 +2441,23 @@ void DocumentBroker::disconnectSessionInternal(const std::string& id)
     }
 }
 
+void DocumentBroker::releaseSessionsToDisconnect(bool joined)
+{
+    if (_sessionsToDisconnect.empty() || (!joined && hasSessionsLoading()))
+        return;
+
+    std::set<std::string> ids;
+    ids.swap(_sessionsToDisconnect);
+    for (const std::string& id : ids)
+    {
+        // Without a session joining, these are the last after all.
+        if (joined)
+            disconnectSessionInternal(id);
+        else
+            removeSession(id);
+    }
+}
+
 void DocumentBroker::finalRemoveSession(const std::string& id)
 {
     assertCorrectThread();
@@ -2283,6 +2641,16 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
                     LOOLWSD::writeTraceEventRecording(newLine + 1, payload.size() - (newLine + 1 - payload.data()));
             }
         }
+        else if (message->firstTokenMatches("binarytraceevent:"))
+        {
+            // Blocks of events recorded in Kit, possibly just before recording was turned off.
+            if (LOOLWSD::TraceEventFile != NULL)
+            {
+                const auto newLine = static_cast<const char*>(memchr(payload.data(), '\n', payload.size()));
+                if (newLine)
+                    LOOLWSD::writeTraceEventBlocks(newLine + 1, payload.size() - (newLine + 1 - payload.data()));
+            }
+        }
         else if (message->firstTokenMatches("forcedtraceevent:"))
         {
             LOG_CHECK_RET(message->tokens().size() == 1, false);
@@ -2319,10 +2687,10 @@ void DocumentBroker::handleTileRequest(const StringVector &tokens,
 
     TileDesc tile = TileDesc::parse(tokens);
     tile.setNormalizedViewId(session->getCanonicalViewId());
+    if (session->getTileDeltas())
+        session->setClientWireId(tile);
 
     tile.setVersion(++_tileVersion);
-    const std::string tileMsg = tile.serialize();
-    LOG_TRC("Tile request for " << tileMsg);
 
     if (!hasTileCache())
     {
@@ -2330,13 +2698,12 @@ void DocumentBroker::handleTileRequest(const StringVector &tokens,
         return;
     }
 
-    TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
-    if (cachedTile)
-    {
-        const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
-        session->sendTile(response, cachedTile);
+    if (sendCachedTile(tile, session))
         return;
-    }
+
+    setRenderBase(tile, session);
+    const std::string tileMsg = tile.serialize();
+    LOG_TRC("Tile request for " << tileMsg);
 
     auto now = std::chrono::steady_clock::now();
     if (tile.getBroadcast())
@@ -2381,11 +2748,11 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
     {
         tile.setVersion(++_tileVersion);
 
-        TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
-        if(!cachedTile)
+        if (!isTileCached(tile, session))
         {
             // Not cached, needs rendering.
             tilesNeedsRendering.push_back(tile);
+            setRenderBase(tilesNeedsRendering.back(), session);
             _debugRenderedTileCount++;
             tileCache().registerTileBeingRendered(tile);
         }
@@ -2550,7 +2917,7 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
 
             // We already sent out two versions of the same tile, let's not send the third one
             // until we get a tileprocessed message for this specific tile.
-            if (session->countIdenticalTilesOnFly(tile) >= 2)
+            if (session->countIdenticalTilesOnFly(tile.generateKey()) >= 2)
             {
                 LOG_DBG("Requested tile " << tile.getWireId() << " was delayed (already sent a version)!");
                 requestedTiles.push_back(requestedTiles.front());
@@ -2560,14 +2927,8 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
             }
 
             // Satisfy as many tiles from the cache.
-            TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
-            if (cachedTile)
-            {
-                //TODO: Combine the response to reduce latency.
-                const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
-                session->sendTile(response, cachedTile);
-            }
-            else
+            //TODO: Combine the response to reduce latency.
+            if (!sendCachedTile(tile, session))
             {
                 // Not cached, needs rendering.
                 if (!tileCache().hasTileBeingRendered(tile, &now) || // There is no in progress rendering of the given tile
@@ -2575,6 +2936,7 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
                 {
                     tile.setVersion(++_tileVersion);
                     tilesNeedsRendering.push_back(tile);
+                    setRenderBase(tilesNeedsRendering.back(), session);
                     _debugRenderedTileCount++;
                 }
                 tileCache().subscribeToTileRendering(tile, session, now);
@@ -2596,6 +2958,131 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
     }
 }
 
+void DocumentBroker::prerenderTiles(const std::chrono::steady_clock::time_point now)
+{
+    if (!isLoaded() || !hasTileCache() || !_childProcess
+        || now - _lastActivityTime < std::chrono::milliseconds(TILE_PRERENDER_DELAY_MS))
+    {
+        return;
+    }
+
+    // Only when the Kit is done with what the clients asked for.
+    for (const auto& it : _sessions)
+    {
+        const std::shared_ptr<ClientSession>& session = it.second;
+        if (!session->getRequestedTiles().empty() || session->getTilesOnFlyCount() > 0
+            || _tileCache->countTilesBeingRenderedForSession(session, now) > 0)
+        {
+            return;
+        }
+    }
+
+    _lastPrerenderTime = now;
+
+    for (const auto& it : _sessions)
+    {
+        std::vector<TileDesc> tiles;
+        it.second->getPrerenderTiles(tiles);
+
+        std::vector<TileDesc> tilesNeedsRendering;
+        for (TileDesc& tile : tiles)
+        {
+            // Another session of the same view may have asked for it already.
+            if (_tileCache->lookupTile(tile) || _tileCache->hasTileBeingRendered(tile, &now))
+                continue;
+
+            tile.setVersion(++_tileVersion);
+            tilesNeedsRendering.push_back(tile);
+        }
+
+        if (tilesNeedsRendering.empty())
+            continue;
+
+        // Not registered as being rendered: the Kit drops these on the next
+        // request, which has to reach it then.
+        const std::string req = TileCombined::create(tilesNeedsRendering).serialize("prerendertiles");
+        LOG_TRC("Prerendering " << tilesNeedsRendering.size() << " tiles for " << it.second->getName()
+                                << ": " << req);
+        _childProcess->sendTextFrame(req);
+        _debugRenderedTileCount += tilesNeedsRendering.size();
+    }
+}
+
+bool DocumentBroker::isTileCached(const TileDesc& tile,
+                                  const std::shared_ptr<ClientSession>& session)
+{
+    if (session->getTileDeltas())
+    {
+        std::vector<TileCache::TileUpdate> updates;
+        return _tileCache->lookupTileUpdates(tile, session->getSentWireId(tile), updates);
+    }
+
+    return _tileCache->lookupTile(tile) != nullptr;
+}
+
+bool DocumentBroker::sendCachedTile(const TileDesc& tile,
+                                    const std::shared_ptr<ClientSession>& session)
+{
+    if (session->getTileDeltas())
+    {
+        std::vector<TileCache::TileUpdate> updates;
+        if (!_tileCache->lookupTileUpdates(tile, session->getSentWireId(tile), updates))
+            return false;
+
+        session->sendTileUpdates(tile, updates);
+        return true;
+    }
+
+    TileCache::Tile cachedTile = _tileCache->lookupTile(tile);
+    if (!cachedTile)
+        return false;
+
+    const std::string response = tile.serialize("tile:", ADD_DEBUG_RENDERID);
+    session->sendTile(response, cachedTile);
+    return true;
+}
+
+void DocumentBroker::setRenderBase(TileDesc& tile, const std::shared_ptr<ClientSession>& session)
+{
+    // The Kit renders a delta from the oldWireId when it still has that, which only
+    // sessions that take deltas understand. And the cache wants a full image now and then.
+    if (_tileDeltas && tile.getOldWireId() != 0
+        && (!session->getTileDeltas() || _tileCache->wantsKeyframe(tile)))
+    {
+        tile.setOldWireId(0);
+    }
+}
+
+void DocumentBroker::rerenderUnservedTiles(
+    const TileDesc& tile, const std::vector<std::shared_ptr<ClientSession>>& sessions)
+{
+    if (sessions.empty())
+        return;
+
+    // They don't have what the delta was based on; have the whole tile rendered again.
+    TileDesc desc = tile;
+    desc.setOldWireId(0);
+    desc.setWireId(0);
+    desc.setImgSize(0);
+    desc.setVersion(++_tileVersion);
+
+    const auto now = std::chrono::steady_clock::now();
+    for (const auto& session : sessions)
+        tileCache().subscribeToTileRendering(desc, session, now);
+
+    LOG_DBG("Re-rendering tile " << desc.debugName() << " for " << sessions.size()
+                                 << " sessions that can't use its delta.");
+    _childProcess->sendTextFrame("tile " + desc.serialize());
+    _debugRenderedTileCount++;
+}
+
+void DocumentBroker::setTileDeltas()
+{
+    _tileDeltas = true;
+    if (hasTileCache())
+        _tileCache->setTileDeltas(true);
+}
+
 void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& session)
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -2634,7 +3121,8 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 
             std::unique_lock<std::mutex> lock(_mutex);
 
-            tileCache().saveTileAndNotify(tile, buffer + offset, length - offset);
+            rerenderUnservedTiles(tile,
+                                  tileCache().saveTileAndNotify(tile, buffer + offset, length - offset));
         }
         else
         {
@@ -2666,7 +3154,8 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
 
             for (const auto& tile : tileCombined.getTiles())
             {
-                tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize());
+                rerenderUnservedTiles(
+                    tile, tileCache().saveTileAndNotify(tile, buffer + offset, tile.getImgSize()));
                 offset += tile.getImgSize();
             }
         }
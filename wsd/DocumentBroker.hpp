@@ -13,6 +13,8 @@
 #include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -140,12 +142,11 @@ class ClientSession;
 /// | Uploading   | Writing | Reading | Idle    |
 /// |-------------------------------------------|
 ///
-/// Downloading is done synchronously, for now, but
-/// is provisioned for async in the state machine.
-/// Similarly, we could download asynchronously,
-/// but there is little to gain by doing that,
-/// since nothing much can happen without, or
-/// before, loading a document.
+/// Interactive sessions download asynchronously
+/// (see addSessionAsync), so that the sessions
+/// already editing don't stall behind the WOPI
+/// round trips of one joining. The others, such
+/// as convert-to, still download synchronously.
 ///
 /// The decision for Saving and Uploading are separate.
 /// Without the user's intervention, we auto-save
@@ -352,6 +353,16 @@ public:
     /// Add a new session. Returns the new number of sessions.
     std::size_t addSession(const std::shared_ptr<ClientSession>& session);
 
+    /// The asynchronous addSession completion callback function,
+    /// given the exception the load failed with, if any.
+    using AsyncAddSessionCallback = std::function<void(const std::exception_ptr&)>;
+
+    /// Add a new session without blocking on the WOPI host: CheckFileInfo and GetFile are
+    /// made on our poll, which keeps serving the other sessions meanwhile.
+    /// @asyncAddSessionCallback is invoked in our thread once the session is added, or failed.
+    void addSessionAsync(const std::shared_ptr<ClientSession>& session,
+                         const AsyncAddSessionCallback& asyncAddSessionCallback);
+
     /// Removes a session by ID. Returns the new number of sessions.
     std::size_t removeSession(const std::string& id);
 
@@ -393,6 +404,9 @@ public:
     void sendRequestedTiles(const std::shared_ptr<ClientSession>& session);
     void cancelTileRequests(const std::shared_ptr<ClientSession>& session);
 
+    /// A session that takes tile updates as deltas has joined.
+    void setTileDeltas();
+
     enum ClipboardRequest {
         CLIP_REQUEST_SET,
         CLIP_REQUEST_GET,
@@ -500,6 +514,23 @@ private:
     void handleTileCombinedResponse(const std::vector<char>& payload);
     void handleDialogRequest(const std::string& dialogCmd);
 
+    /// Whether we can serve this tile to the session from the cache.
+    bool isTileCached(const TileDesc& tile, const std::shared_ptr<ClientSession>& session);
+
+    /// Sends the tile, or the deltas the session needs, from the cache if we have them.
+    bool sendCachedTile(const TileDesc& tile, const std::shared_ptr<ClientSession>& session);
+
+    /// Renders the tiles the sessions are likely to scroll to next into the cache,
+    /// once the user pauses and the Kit is done with what was asked for.
+    void prerenderTiles(std::chrono::steady_clock::time_point now);
+
+    /// Clears the oldWireId of a tile to render, unless a delta from it is useful.
+    void setRenderBase(TileDesc& tile, const std::shared_ptr<ClientSession>& session);
+
+    /// Requests a full render of the tile for sessions a delta couldn't be sent to.
+    void rerenderUnservedTiles(const TileDesc& tile,
+                               const std::vector<std::shared_ptr<ClientSession>>& sessions);
+
     /// Invoked to issue a save before renaming the document filename.
     void startRenameFileCommand();
 
@@ -563,9 +594,80 @@ private:
     /// Loads a new session and adds to the sessions container.
     std::size_t addSessionInternal(const std::shared_ptr<ClientSession>& session);
 
+    /// Requests the session from the Kit and adds it to the sessions container.
+    std::size_t attachSession(const std::shared_ptr<ClientSession>& session);
+
+    /// Creates the Storage on the first load. Returns false if the document can't be loaded.
+    bool prepareDownload(const std::shared_ptr<ClientSession>& session, const std::string& jailId);
+
+    /// Gets the file info and downloads the document, if not yet, blocking on the Storage.
+    bool downloadSync(const std::shared_ptr<ClientSession>& session);
+
+#if !MOBILEAPP
+    /// Sets up the session with the result of CheckFileInfo, and sends it to the client.
+    void processWOPIFileInfo(const std::shared_ptr<ClientSession>& session,
+                             std::unique_ptr<WopiStorage::WOPIFileInfo>& wopifileinfo);
+#endif
+
+    /// Sets up the session with the info of a local file.
+    void processLocalFileInfo(const std::shared_ptr<ClientSession>& session);
+
+    /// Checks the file info of the Storage for a new session. Returns false if invalid.
+    /// The first valid one is the reference to detect changes behind our back.
+    bool processFileInfo(const std::shared_ptr<ClientSession>& session);
+
+    /// Locks and prepares the document just downloaded to @localPath for loading.
+    bool processDownloadedFile(const std::shared_ptr<ClientSession>& session,
+                               std::string localPath, const std::string& templateSource);
+
+#if !MOBILEAPP
+    /// Sends the session the time taken by the WOPI calls to load.
+    void finishDownload(const std::shared_ptr<ClientSession>& session,
+                        std::chrono::milliseconds wopiCallDurationMs);
+
+    /// The continuation of addSessionAsync once CheckFileInfo is done.
+    void onWOPIFileInfoAsync(const std::shared_ptr<ClientSession>& session,
+                             std::unique_ptr<WopiStorage::WOPIFileInfo>& wopifileinfo,
+                             const std::exception_ptr& error,
+                             std::chrono::milliseconds callDurationMs,
+                             const AsyncAddSessionCallback& asyncAddSessionCallback);
+
+    /// Downloads the document for a session being added asynchronously, unless
+    /// it is already, or waits for the download of another session in progress.
+    void downloadAsync(const std::shared_ptr<ClientSession>& session,
+                       const std::string& templateSource,
+                       std::chrono::milliseconds wopiCallDurationMs,
+                       const AsyncAddSessionCallback& asyncAddSessionCallback);
+
+    /// The continuation of downloadAsync once GetFile is done.
+    void onDownloadAsync(const std::shared_ptr<ClientSession>& session,
+                         const std::string& templateSource, const std::string& localPath,
+                         std::exception_ptr error, std::chrono::milliseconds wopiCallDurationMs,
+                         const AsyncAddSessionCallback& asyncAddSessionCallback);
+#endif
+
+    /// True if a session is still being added asynchronously.
+    bool hasSessionsLoading() const { return !_sessionsLoading.empty() || _downloadingAsync; }
+
+    /// True if any session is attached, or still being added asynchronously.
+    bool hasSessions() const { return !_sessions.empty() || hasSessionsLoading(); }
+
+    /// True if the session is still being added asynchronously, i.e. didn't disconnect.
+    bool isLoadingAsync(const std::shared_ptr<ClientSession>& session);
+
+    /// Attaches the session added asynchronously, unless it failed with @error,
+    /// and reports the result to @asyncAddSessionCallback.
+    void finishAddSessionAsync(const std::shared_ptr<ClientSession>& session,
+                               std::exception_ptr error,
+                               const AsyncAddSessionCallback& asyncAddSessionCallback);
+
     /// Starts the Kit <-> DocumentBroker shutdown handshake
     void disconnectSessionInternal(const std::string& id);
 
+    /// Disconnects the sessions kept for the sessions loading, once one @joined,
+    /// or else removes them as the last ones, once none is loading any more.
+    void releaseSessionsToDisconnect(bool joined);
+
     /// Forward a message from child session to its respective client session.
     bool forwardToClient(const std::shared_ptr<Message>& payload);
 
@@ -927,7 +1029,7 @@ private:
         enum class Status
         {
             None, //< Doesn't exist, pending downloading.
-            Downloading, //< Download from Storage to disk. Synchronous.
+            Downloading, //< Download from Storage to disk.
             Loading, //< Loading the document in Core.
             Live, //< General availability for viewing/editing.
             Destroying, //< End-of-life, marked to destroy.
@@ -1103,6 +1205,23 @@ private:
     /// All session of this DocBroker by ID.
     SessionMap<ClientSession> _sessions;
 
+    /// The IDs of the sessions being added asynchronously, waiting for the Storage.
+    std::set<std::string> _sessionsLoading;
+
+    /// Set while a session downloads the document asynchronously.
+    bool _downloadingAsync;
+
+    /// The last sessions, that left while others were loading: the Kit
+    /// exits with its last session, so they are kept until one joins.
+    std::set<std::string> _sessionsToDisconnect;
+
+    /// Set once we have the first valid file info, the modified time of which
+    /// is the one to compare those of the later sessions with.
+    bool _haveFileInfo;
+
+    /// The sessions being added that wait for the download in progress.
+    std::vector<std::function<void()>> _awaitingDownload;
+
     /// If we set the user-requested initial (on load) settings to be forced.
     std::set<std::string> _isInitialStateSet;
 
@@ -1128,6 +1247,13 @@ private:
 
     int _debugRenderedTileCount;
 
+    /// Whether the Kit may render tiles as deltas, for one of the sessions takes them.
+    bool _tileDeltas;
+
+    /// Whether to prerender the tiles the sessions are likely to scroll to next.
+    const bool _tilePrerender;
+    std::chrono::steady_clock::time_point _lastPrerenderTime;
+
     std::chrono::steady_clock::time_point _lastActivityTime;
     std::chrono::steady_clock::time_point _threadStart;
     std::chrono::milliseconds _loadDuration;
@@ -8,6 +8,7 @@
 #include <config.h>
 
 #include <iomanip>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -40,10 +41,12 @@
 #include <Common.hpp>
 #include <Crypto.hpp>
 #include "FileServer.hpp"
+#include <FileUtil.hpp>
 #include "LOOLWSD.hpp"
 #include "ServerURL.hpp"
 #include <Log.hpp>
 #include <Protocol.hpp>
+#include <SpookyV2.h>
 #include <Util.hpp>
 #if !MOBILEAPP
 #include <net/HttpHelper.hpp>
@@ -55,7 +58,9 @@ using Poco::Net::HTTPResponse;
 using Poco::Net::NameValueCollection;
 using Poco::Util::Application;
 
-std::map<std::string, std::pair<std::string, std::string>> FileServerRequestHandler::FileHash;
+std::map<std::string, StaticFile> FileServerRequestHandler::FileHash;
+std::map<std::string, std::shared_ptr<const PreprocessedFile>> FileServerRequestHandler::PreprocessedFiles;
+std::mutex FileServerRequestHandler::PreprocessedFilesMutex;
 
 /// Place from where we serve the welcome-<lang>.html; defaults to
 /// welcome.html if no lang matches.
@@ -406,30 +411,9 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
             else
                 mimeType = "text/plain";
 
-            auto it = request.find("If-None-Match");
-            if (it != request.end())
-            {
-                // if ETags match avoid re-sending the file.
-                if (!noCache && it->second == "\"" LOOLWSD_VERSION_HASH "\"")
-                {
-                    // TESTME: harder ... - do we even want ETag support ?
-                    std::ostringstream oss;
-                    Poco::DateTime now;
-                    Poco::DateTime later(now.utcTime(), int64_t(1000)*1000 * 60 * 60 * 24 * 128);
-                    std::string extraHeaders =
-                        "Expires: " + Poco::DateTimeFormatter::format(
-                            later, Poco::DateTimeFormat::HTTP_FORMAT) + "\r\n" +
-                        "Cache-Control: max-age=11059200\r\n";
-                    HttpHelper::sendErrorAndShutdown(304, socket, std::string(), extraHeaders);
-                    return;
-                }
-            }
-
             response.set("Server", HTTP_SERVER_STRING);
             response.set("Date", Util::getHttpTimeNow());
 
-            bool gzip = request.hasToken("Accept-Encoding", "gzip");
-            const std::string *content;
 #if ENABLE_DEBUG
             if (std::getenv("LOOL_SERVE_FROM_FS"))
             {
@@ -440,30 +424,76 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
                 return;
             }
 #endif
-            if (gzip)
+            const StaticFile* file = getFile(relPath);
+            if (!file)
+                throw Poco::FileNotFoundException("Invalid URI request: [" + requestUri.toString() + "].");
+
+            StaticFile::Encoding encoding
+                = selectEncoding(*file, request.get("Accept-Encoding", ""));
+            if (file->content(encoding)->changed())
             {
-                response.set("Content-Encoding", "gzip");
-                content = getCompressedFile(relPath);
+                // Don't touch a mapping that may fault; what we derived from it is stale too.
+                LOG_WRN("File [" << file->content(encoding)->getPath()
+                                 << "] changed on disk since it was mapped.");
+                const std::shared_ptr<const FileContent>& identity
+                    = file->content(StaticFile::Encoding::Identity);
+                if (identity->changed())
+                {
+                    HttpHelper::sendFileAndShutdown(socket, identity->getPath(), mimeType,
+                                                    &response, true);
+                    return;
+                }
+
+                encoding = StaticFile::Encoding::Identity;
             }
-            else
-                content = getUncompressedFile(relPath);
+
+            const std::string etag = file->getETag(encoding);
+
+            // If the client has this very representation, avoid re-sending the file.
+            if (!noCache && matchETag(request.get("If-None-Match", ""), etag))
+            {
+                Poco::DateTime now;
+                Poco::DateTime later(now.utcTime(), int64_t(1000)*1000 * 60 * 60 * 24 * 128);
+                std::string extraHeaders =
+                    "Expires: " + Poco::DateTimeFormatter::format(
+                        later, Poco::DateTimeFormat::HTTP_FORMAT) + "\r\n" +
+                    "Cache-Control: max-age=11059200\r\n" +
+                    "ETag: " + etag + "\r\n";
+                if (file->content(StaticFile::Encoding::Gzip) || file->content(StaticFile::Encoding::Brotli))
+                    extraHeaders += "Vary: Accept-Encoding\r\n";
+                HttpHelper::sendErrorAndShutdown(304, socket, std::string(), extraHeaders);
+                return;
+            }
+
+            if (encoding == StaticFile::Encoding::Brotli)
+                response.set("Content-Encoding", "br");
+            else if (encoding == StaticFile::Encoding::Gzip)
+                response.set("Content-Encoding", "gzip");
+            if (file->content(StaticFile::Encoding::Gzip) || file->content(StaticFile::Encoding::Brotli))
+                response.set("Vary", "Accept-Encoding");
+
+            const std::shared_ptr<const FileContent>& content = file->content(encoding);
 
             if (!noCache)
             {
                 // 60 * 60 * 24 * 128 (days) = 11059200
                 response.set("Cache-Control", "max-age=11059200");
-                response.set("ETag", "\"" LOOLWSD_VERSION_HASH "\"");
+                response.set("ETag", etag);
             }
             response.setContentType(mimeType);
+            response.setContentLength(content->size());
             response.add("X-Content-Type-Options", "nosniff");
 
             std::ostringstream oss;
             response.write(oss);
             const std::string header = oss.str();
-            LOG_TRC('#' << socket->getFD() << ": Sending " <<
-                    (!gzip ? "un":"") << "compressed : file [" << relPath << "]: " << header);
-            socket->send(header);
-            socket->send(*content);
+            LOG_TRC('#' << socket->getFD() << ": Sending " << content->size() << " bytes of "
+                        << (encoding == StaticFile::Encoding::Brotli ? "brotli"
+                            : encoding == StaticFile::Encoding::Gzip ? "gzip" : "un")
+                        << "compressed file [" << relPath << "]: " << header);
+            socket->send(header, false);
+            // The content is referenced, not copied, until written out.
+            socket->sendShared(content->data(), content->size(), content);
             // shutdown by caller
         }
     }
@@ -506,6 +536,62 @@ void FileServerRequestHandler::sendError(int errorCode, const Poco::Net::HTTPReq
     HttpHelper::sendError(errorCode, socket, body, headers);
 }
 
+namespace
+{
+/// Gzip @content at startup, for when there is no precompressed variant on disk.
+/// Returns nullptr when it wouldn't be smaller.
+std::shared_ptr<const FileContent> gzipContent(const FileContent& content)
+{
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+
+    std::string compressed(deflateBound(&strm, content.size()), '\0');
+    strm.next_in = (unsigned char *)content.data();
+    strm.avail_in = content.size();
+    strm.next_out = (unsigned char *)&compressed[0];
+    strm.avail_out = compressed.size();
+
+    const int rc = deflate(&strm, Z_FINISH);
+    const std::size_t size = compressed.size() - strm.avail_out;
+    deflateEnd(&strm);
+
+    if (rc != Z_STREAM_END || size >= content.size())
+        return nullptr;
+
+    compressed.resize(size);
+    compressed.shrink_to_fit();
+    return std::make_shared<const FileContent>(std::move(compressed));
+}
+
+/// Maps the precompressed variant at @path, if there is one that
+/// is not older than the file it is compressed from.
+std::shared_ptr<const FileContent> mapPrecompressed(const std::string& path,
+                                                    const struct stat& original)
+{
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0 || !S_ISREG(fileStat.st_mode))
+        return nullptr;
+
+    if (fileStat.st_mtime < original.st_mtime)
+    {
+        LOG_WRN("Ignoring precompressed [" << path << "], which is older than the original.");
+        return nullptr;
+    }
+
+    return FileContent::map(path);
+}
+
+bool isPrecompressedName(const std::string& name)
+{
+    return name.size() > 3 && (name.compare(name.size() - 3, 3, ".gz") == 0 ||
+                               name.compare(name.size() - 3, 3, ".br") == 0);
+}
+}
+
 void FileServerRequestHandler::readDirToHash(const std::string &basePath, const std::string &path, const std::string &prefix)
 {
     LOG_DBG("Caching files in [" << basePath + path << ']');
@@ -529,64 +615,53 @@ void FileServerRequestHandler::readDirToHash(const std::string &basePath, const
 
         const std::string relPath = path + '/' + currentFile->d_name;
         struct stat fileStat;
-        stat ((basePath + relPath).c_str(), &fileStat);
+        if (stat((basePath + relPath).c_str(), &fileStat) != 0)
+            continue;
 
         if (S_ISDIR(fileStat.st_mode))
             readDirToHash(basePath, relPath);
 
         else if (S_ISREG(fileStat.st_mode))
         {
-            fileCount++;
-            filesRead.append(currentFile->d_name);
-            filesRead += ' ';
-
-            std::ifstream file(basePath + relPath, std::ios::binary);
-
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
-
-            std::unique_ptr<char[]> buf(new char[fileStat.st_size]);
-            std::string compressedFile;
-            compressedFile.reserve(fileStat.st_size);
-            std::string uncompressedFile;
-            uncompressedFile.reserve(fileStat.st_size);
-            do
+            // Precompressed variants are served in place of the file they compress.
+            if (isPrecompressedName(relPath))
             {
-                file.read(&buf[0], fileStat.st_size);
-                const long unsigned int size = file.gcount();
-                if (size == 0)
-                    break;
+                const FileUtil::Stat original(basePath + relPath.substr(0, relPath.size() - 3));
+                if (original.good() && original.isFile())
+                    continue;
+            }
 
-                const long unsigned int compSize = compressBound(size);
-                char *cbuf = (char *)calloc(compSize, sizeof(char));
+            std::shared_ptr<const FileContent> content = FileContent::map(basePath + relPath);
+            if (!content)
+                continue;
 
-                strm.next_in = (unsigned char *)&buf[0];
-                strm.avail_in = size;
-                strm.avail_out = compSize;
-                strm.next_out = (unsigned char *)&cbuf[0];
+            fileCount++;
+            filesRead.append(currentFile->d_name);
+            filesRead += ' ';
 
-                deflate(&strm, Z_FINISH);
+            StaticFile file;
+            file._content[static_cast<int>(StaticFile::Encoding::Identity)] = content;
 
-                const long unsigned int haveComp = compSize - strm.avail_out;
-                std::string partialcompFile(cbuf, haveComp);
-                std::string partialuncompFile(buf.get(), size);
-                compressedFile += partialcompFile;
-                uncompressedFile += partialuncompFile;
-                free(cbuf);
+            std::shared_ptr<const FileContent> gzip
+                = mapPrecompressed(basePath + relPath + ".gz", fileStat);
+            file._content[static_cast<int>(StaticFile::Encoding::Gzip)]
+                = gzip ? gzip : gzipContent(*content);
+            file._content[static_cast<int>(StaticFile::Encoding::Brotli)]
+                = mapPrecompressed(basePath + relPath + ".br", fileStat);
 
-            } while(true);
+            // A strong validator, that changes with the content, not just the version.
+            std::ostringstream etag;
+            etag << '"' << std::hex << std::setw(16) << std::setfill('0')
+                 << SpookyHash::Hash64(content->data(), content->size(), 0) << '"';
+            file._etag = etag.str();
 
-            FileHash.emplace(prefix + relPath, std::make_pair(uncompressedFile, compressedFile));
-            deflateEnd(&strm);
+            FileHash.emplace(prefix + relPath, std::move(file));
         }
     }
     closedir(workingdir);
 
     if (fileCount > 0)
-        LOG_TRC("Pre-read " << fileCount << " file(s) from directory: " << basePath << path << ": " << filesRead);
+        LOG_TRC("Mapped " << fileCount << " file(s) from directory: " << basePath << path << ": " << filesRead);
 }
 
 void FileServerRequestHandler::initialize()
@@ -609,14 +684,31 @@ void FileServerRequestHandler::initialize()
     }
 }
 
-const std::string *FileServerRequestHandler::getCompressedFile(const std::string &path)
+const StaticFile* FileServerRequestHandler::getFile(const std::string &path)
 {
-    return &FileHash[path].second;
+    const auto it = FileHash.find(path);
+    return it != FileHash.end() ? &it->second : nullptr;
 }
 
-const std::string *FileServerRequestHandler::getUncompressedFile(const std::string &path)
+std::string FileServerRequestHandler::getUncompressedFile(const std::string &path)
 {
-    return &FileHash[path].first;
+    const StaticFile* file = getFile(path);
+    if (!file)
+        throw Poco::FileNotFoundException("Invalid file request: [" + path + "].");
+
+    const std::shared_ptr<const FileContent>& content = file->content(StaticFile::Encoding::Identity);
+    if (content->changed())
+    {
+        // Read it afresh rather than from a mapping that may fault.
+        LOG_WRN("File [" << content->getPath() << "] changed on disk since it was mapped.");
+        const std::shared_ptr<const FileContent> current = FileContent::map(content->getPath());
+        if (!current)
+            throw Poco::FileNotFoundException("Invalid file request: [" + path + "].");
+
+        return current->toString();
+    }
+
+    return content->toString();
 }
 
 std::string FileServerRequestHandler::getRequestPathname(const HTTPRequest& request)
@@ -645,6 +737,118 @@ constexpr char BRANDING_UNSUPPORTED[] = "branding-unsupported";
 namespace {
 }
 
+namespace
+{
+/// The placeholders of the preprocessed files that depend on the request,
+/// in the order of the values given to PreprocessedFile::substitute.
+const std::vector<std::string>& getPerRequestPlaceholders()
+{
+    static const std::vector<std::string> placeholders = {
+        "%ACCESS_TOKEN%",       "%ACCESS_TOKEN_TTL%",     "%ACCESS_HEADER%",
+        "%UI_DEFAULTS%",        "%POSTMESSAGE_ORIGIN%",   "<!--%CSS_VARIABLES%-->",
+        "%USER_INTERFACE_MODE%", "%REUSE_COOKIES%",       "%FRAME_ANCESTORS%"
+    };
+    return placeholders;
+}
+
+/// Beyond this, the host names in the requests are likely made up.
+constexpr std::size_t MaxPreprocessedFiles = 64;
+}
+
+std::shared_ptr<const PreprocessedFile>
+FileServerRequestHandler::getPreprocessedFile(const std::string& relPath,
+                                              const std::string& socketProxy,
+                                              const std::string& webSocketUrl,
+                                              const std::string& responseRoot,
+                                              const std::string& branding)
+{
+    const std::string key = relPath + '\n' + socketProxy + '\n' + webSocketUrl + '\n'
+                            + responseRoot + '\n' + branding;
+    {
+        std::lock_guard<std::mutex> lock(PreprocessedFilesMutex);
+        const auto it = PreprocessedFiles.find(key);
+        if (it != PreprocessedFiles.end())
+            return it->second;
+    }
+
+    LOG_DBG("Preprocessing file: " << relPath << " for " << webSocketUrl);
+    std::string preprocess = getUncompressedFile(relPath);
+
+    Poco::replaceInPlace(preprocess, std::string("%SOCKET_PROXY%"), socketProxy);
+    Poco::replaceInPlace(preprocess, std::string("%HOST%"), webSocketUrl);
+    Poco::replaceInPlace(preprocess, std::string("%VERSION%"), std::string(LOOLWSD_VERSION_HASH));
+    Poco::replaceInPlace(preprocess, std::string("%SERVICE_ROOT%"), responseRoot);
+
+    const auto& config = Application::instance().config();
+    std::string protocolDebug = "false";
+    if (config.getBool("logging.protocol"))
+        protocolDebug = "true";
+    Poco::replaceInPlace(preprocess, std::string("%PROTOCOL_DEBUG%"), protocolDebug);
+
+    static const std::string hexifyEmbeddedUrls =
+        LOOLWSD::getConfigValue<bool>("hexify_embedded_urls", false) ? "true" : "false";
+    Poco::replaceInPlace(preprocess, std::string("%HEXIFY_URL%"), hexifyEmbeddedUrls);
+
+    static const std::string linkCSS("<link rel=\"stylesheet\" href=\"%s/loleaflet/" LOOLWSD_VERSION_HASH "/%s.css\">");
+    static const std::string scriptJS("<script src=\"%s/loleaflet/" LOOLWSD_VERSION_HASH "/%s.js\"></script>");
+
+    const std::string brandCSS(Poco::format(linkCSS, responseRoot, branding));
+    const std::string brandJS(Poco::format(scriptJS, responseRoot, branding));
+
+    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_CSS%-->"), brandCSS);
+    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_JS%-->"), brandJS);
+
+    // Customization related to document signing.
+    std::string documentSigningDiv;
+    const std::string documentSigningURL = config.getString("per_document.document_signing_url", "");
+    if (!documentSigningURL.empty())
+    {
+        documentSigningDiv = "<div id=\"document-signing-bar\"></div>";
+    }
+    Poco::replaceInPlace(preprocess, std::string("<!--%DOCUMENT_SIGNING_DIV%-->"), documentSigningDiv);
+    Poco::replaceInPlace(preprocess, std::string("%DOCUMENT_SIGNING_URL%"), documentSigningURL);
+
+    const auto loleafletLogging = config.getString("loleaflet_logging", "false");
+    Poco::replaceInPlace(preprocess, std::string("%LOLEAFLET_LOGGING%"), loleafletLogging);
+    const std::string outOfFocusTimeoutSecs= config.getString("per_view.out_of_focus_timeout_secs", "60");
+    Poco::replaceInPlace(preprocess, std::string("%OUT_OF_FOCUS_TIMEOUT_SECS%"), outOfFocusTimeoutSecs);
+    const std::string idleTimeoutSecs= config.getString("per_view.idle_timeout_secs", "900");
+    Poco::replaceInPlace(preprocess, std::string("%IDLE_TIMEOUT_SECS%"), idleTimeoutSecs);
+
+    std::string enableWelcomeMessage = "false";
+    if (config.getBool("welcome.enable", false))
+        enableWelcomeMessage = "true";
+    Poco::replaceInPlace(preprocess, std::string("%ENABLE_WELCOME_MSG%"), enableWelcomeMessage);
+
+    std::string enableWelcomeMessageButton = "false";
+    if (config.getBool("welcome.enable_button", false))
+        enableWelcomeMessageButton = "true";
+    Poco::replaceInPlace(preprocess, std::string("%ENABLE_WELCOME_MSG_BTN%"), enableWelcomeMessageButton);
+
+    std::string enableMacrosExecution = "false";
+    if (config.getBool("security.enable_macros_execution", false))
+        enableMacrosExecution = "true";
+    Poco::replaceInPlace(preprocess, std::string("%ENABLE_MACROS_EXECUTION%"), enableMacrosExecution);
+
+#ifdef ENABLE_FEEDBACK
+    StringVector tokens = Util::tokenize(std::string(FEEDBACK_LOCATION), ' ');
+    Poco::replaceInPlace(preprocess, std::string("%FEEDBACK_LOCATION%"), tokens.size() > 0 ? tokens[0] : "");
+#endif
+
+    auto preprocessed
+        = std::make_shared<const PreprocessedFile>(std::move(preprocess), getPerRequestPlaceholders());
+
+    std::lock_guard<std::mutex> lock(PreprocessedFilesMutex);
+    if (PreprocessedFiles.size() >= MaxPreprocessedFiles)
+    {
+        LOG_DBG("Too many preprocessed files cached, dropping them all.");
+        PreprocessedFiles.clear();
+    }
+
+    PreprocessedFiles.emplace(key, preprocessed);
+    return preprocessed;
+}
+
 void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
                                               const RequestDetails &requestDetails,
                                               Poco::MemoryInputStream& message,
@@ -656,8 +860,6 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
 
     // Is this a file we read at startup - if not; it's not for serving.
     const std::string relPath = getRequestPathname(request);
-    LOG_DBG("Preprocessing file: " << relPath);
-    std::string preprocess = *getUncompressedFile(relPath);
 
     // We need to pass certain parameters from the loleaflet html GET URI
     // to the embedded document URI. Here we extract those params
@@ -705,92 +907,28 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     std::string socketProxy = "false";
     if (requestDetails.isProxy())
         socketProxy = "true";
-    Poco::replaceInPlace(preprocess, std::string("%SOCKET_PROXY%"), socketProxy);
-
-    std::string responseRoot = cnxDetails.getResponseRoot();
-    std::string userInterfaceMode;
-
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN%"), escapedAccessToken);
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN_TTL%"), std::to_string(tokenTtl));
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_HEADER%"), escapedAccessHeader);
-    Poco::replaceInPlace(preprocess, std::string("%HOST%"), cnxDetails.getWebSocketUrl());
-    Poco::replaceInPlace(preprocess, std::string("%VERSION%"), std::string(LOOLWSD_VERSION_HASH));
-    Poco::replaceInPlace(preprocess, std::string("%SERVICE_ROOT%"), responseRoot);
-    Poco::replaceInPlace(preprocess, std::string("%UI_DEFAULTS%"), uiDefaultsToJSON(uiDefaults, userInterfaceMode));
-    Poco::replaceInPlace(preprocess, std::string("%POSTMESSAGE_ORIGIN%"), escapedPostmessageOrigin);
 
+    const std::string responseRoot = cnxDetails.getResponseRoot();
     const auto& config = Application::instance().config();
-    std::string protocolDebug = "false";
-    if (config.getBool("logging.protocol"))
-        protocolDebug = "true";
-    Poco::replaceInPlace(preprocess, std::string("%PROTOCOL_DEBUG%"), protocolDebug);
-
-    static const std::string hexifyEmbeddedUrls =
-        LOOLWSD::getConfigValue<bool>("hexify_embedded_urls", false) ? "true" : "false";
-    Poco::replaceInPlace(preprocess, std::string("%HEXIFY_URL%"), hexifyEmbeddedUrls);
-
-    static const std::string linkCSS("<link rel=\"stylesheet\" href=\"%s/loleaflet/" LOOLWSD_VERSION_HASH "/%s.css\">");
-    static const std::string scriptJS("<script src=\"%s/loleaflet/" LOOLWSD_VERSION_HASH "/%s.js\"></script>");
-
-    std::string brandCSS(Poco::format(linkCSS, responseRoot, std::string(BRANDING)));
-    std::string brandJS(Poco::format(scriptJS, responseRoot, std::string(BRANDING)));
 
+    std::string branding = BRANDING;
 #if ENABLE_SUPPORT_KEY
     const std::string keyString = config.getString("support_key", "");
     SupportKey key(keyString);
     if (!key.verify() || key.validDaysRemaining() <= 0)
-    {
-        brandCSS = Poco::format(linkCSS, responseRoot, std::string(BRANDING_UNSUPPORTED));
-        brandJS = Poco::format(scriptJS, responseRoot, std::string(BRANDING_UNSUPPORTED));
-    }
+        branding = BRANDING_UNSUPPORTED;
 #endif
 
-    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_CSS%-->"), brandCSS);
-    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_JS%-->"), brandJS);
-    Poco::replaceInPlace(preprocess, std::string("<!--%CSS_VARIABLES%-->"), cssVarsToStyle(cssVars));
-
-    // Customization related to document signing.
-    std::string documentSigningDiv;
-    const std::string documentSigningURL = config.getString("per_document.document_signing_url", "");
-    if (!documentSigningURL.empty())
-    {
-        documentSigningDiv = "<div id=\"document-signing-bar\"></div>";
-    }
-    Poco::replaceInPlace(preprocess, std::string("<!--%DOCUMENT_SIGNING_DIV%-->"), documentSigningDiv);
-    Poco::replaceInPlace(preprocess, std::string("%DOCUMENT_SIGNING_URL%"), documentSigningURL);
-
-    const auto loleafletLogging = config.getString("loleaflet_logging", "false");
-    Poco::replaceInPlace(preprocess, std::string("%LOLEAFLET_LOGGING%"), loleafletLogging);
-    const std::string outOfFocusTimeoutSecs= config.getString("per_view.out_of_focus_timeout_secs", "60");
-    Poco::replaceInPlace(preprocess, std::string("%OUT_OF_FOCUS_TIMEOUT_SECS%"), outOfFocusTimeoutSecs);
-    const std::string idleTimeoutSecs= config.getString("per_view.idle_timeout_secs", "900");
-    Poco::replaceInPlace(preprocess, std::string("%IDLE_TIMEOUT_SECS%"), idleTimeoutSecs);
-
-    std::string enableWelcomeMessage = "false";
-    if (config.getBool("welcome.enable", false))
-        enableWelcomeMessage = "true";
-    Poco::replaceInPlace(preprocess, std::string("%ENABLE_WELCOME_MSG%"), enableWelcomeMessage);
-
-    std::string enableWelcomeMessageButton = "false";
-    if (config.getBool("welcome.enable_button", false))
-        enableWelcomeMessageButton = "true";
-    Poco::replaceInPlace(preprocess, std::string("%ENABLE_WELCOME_MSG_BTN%"), enableWelcomeMessageButton);
+    const std::shared_ptr<const PreprocessedFile> preprocessed = getPreprocessedFile(
+        relPath, socketProxy, cnxDetails.getWebSocketUrl(), responseRoot, branding);
 
+    std::string userInterfaceMode;
+    const std::string uiDefaultsJSON = uiDefaultsToJSON(uiDefaults, userInterfaceMode);
     if (userInterfaceMode.empty())
         userInterfaceMode = config.getString("user_interface.mode", "classic");
-    Poco::replaceInPlace(preprocess, std::string("%USER_INTERFACE_MODE%"), userInterfaceMode);
-
-    std::string enableMacrosExecution = "false";
-    if (config.getBool("security.enable_macros_execution", false))
-        enableMacrosExecution = "true";
-    Poco::replaceInPlace(preprocess, std::string("%ENABLE_MACROS_EXECUTION%"), enableMacrosExecution);
-
-#ifdef ENABLE_FEEDBACK
-    StringVector tokens = Util::tokenize(std::string(FEEDBACK_LOCATION), ' ');
-    Poco::replaceInPlace(preprocess, std::string("%FEEDBACK_LOCATION%"), tokens.size() > 0 ? tokens[0] : "");
-#endif
 
     // Capture cookies so we can optionally reuse them for the storage requests.
+    std::string cookiesString;
     {
         NameValueCollection cookies;
         request.getCookies(cookies);
@@ -798,12 +936,13 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
         for (auto it = cookies.begin(); it != cookies.end(); it++)
             cookieTokens << (*it).first << '=' << (*it).second << (std::next(it) != cookies.end() ? ":" : "");
 
-        const std::string cookiesString = cookieTokens.str();
+        cookiesString = cookieTokens.str();
         if (!cookiesString.empty())
             LOG_DBG("Captured cookies: " << cookiesString);
-        Poco::replaceInPlace(preprocess, std::string("%REUSE_COOKIES%"), cookiesString);
     }
 
+    const std::string documentSigningURL = config.getString("per_document.document_signing_url", "");
+
     const std::string mimeType = "text/html";
 
     // Document signing: if endpoint URL is configured, whitelist that for
@@ -853,7 +992,6 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
         //(it's deprecated anyway and CSP works in all major browsers)
         cspOss << "img-src 'self' data: " << frameAncestors << "; "
                 << "frame-ancestors " << frameAncestors;
-        Poco::replaceInPlace(preprocess, std::string("%FRAME_ANCESTORS%"), frameAncestors);
     }
     else
     {
@@ -863,6 +1001,13 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
 
     cspOss << "\r\n";
 
+    // Same order as getPerRequestPlaceholders().
+    const std::string preprocess = preprocessed->substitute({
+        escapedAccessToken, std::to_string(tokenTtl), escapedAccessHeader,
+        uiDefaultsJSON, escapedPostmessageOrigin, cssVarsToStyle(cssVars),
+        userInterfaceMode, cookiesString,
+        frameAncestors.empty() ? std::string("%FRAME_ANCESTORS%") : frameAncestors });
+
     std::ostringstream oss;
     oss << "HTTP/1.1 200 OK\r\n"
         "Date: " << Util::getHttpTimeNow() << "\r\n"
@@ -963,7 +1108,7 @@ void FileServerRequestHandler::preprocessAdminFile(const HTTPRequest& request,
 
     const std::string relPath = getRequestPathname(request);
     LOG_DBG("Preprocessing file: " << relPath);
-    std::string adminFile = *getUncompressedFile(relPath);
+    std::string adminFile = getUncompressedFile(relPath);
     std::vector<std::string> templatePath_vec = Util::splitStringToVector(relPath, '/');
     std::string templatePath = "";
     for (unsigned int i = 0; i < templatePath_vec.size() - 1; i++)
@@ -971,7 +1116,7 @@ void FileServerRequestHandler::preprocessAdminFile(const HTTPRequest& request,
         templatePath += templatePath_vec[i] + "/";
     }
     templatePath = "/" + templatePath + "admintemplate.html";
-    std::string templateFile = *getUncompressedFile(templatePath);
+    std::string templateFile = getUncompressedFile(templatePath);
     Poco::replaceInPlace(templateFile, std::string("<!--%MAIN_CONTENT%-->"), adminFile); // Now template has the main content..
 
     std::string brandJS(Poco::format(scriptJS, responseRoot, std::string(BRANDING)));
@@ -7,12 +7,119 @@
 
 #pragma once
 
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "Socket.hpp"
 
 #include <Poco/MemoryStream.h>
 
 class RequestDetails;
+
+/// The read-only content of a served file: read or mapped from disk,
+/// or held in memory when produced at startup (eg. compressed).
+class FileContent
+{
+    FileContent(const FileContent&) = delete;
+    FileContent& operator=(const FileContent&) = delete;
+
+public:
+    explicit FileContent(std::string data)
+        : _map(nullptr)
+        , _mapSize(0)
+        , _fd(-1)
+        , _mtime()
+        , _owned(std::move(data))
+    {
+    }
+
+    ~FileContent();
+
+    /// Files up to this size are read into memory, larger ones are mapped.
+    static constexpr std::size_t MaxReadSize = 64 * 1024;
+
+    /// Reads the file at @path into memory, or maps it if it is large.
+    /// Returns nullptr on failure.
+    static std::shared_ptr<const FileContent> map(const std::string& path);
+
+    /// True when a mapped file was truncated or rewritten in place since:
+    /// touching its mapping could fault, and it no longer matches what we
+    /// derived from it. Files in memory never change.
+    bool changed() const;
+
+    /// The file read or mapped, empty when produced in memory.
+    const std::string& getPath() const { return _path; }
+
+    const char* data() const { return _map ? static_cast<const char*>(_map) : _owned.data(); }
+    std::size_t size() const { return _map ? _mapSize : _owned.size(); }
+
+    std::string toString() const { return std::string(data(), size()); }
+
+private:
+    FileContent(const std::string& path, void* map, std::size_t mapSize, int fd,
+                const timespec& mtime)
+        : _map(map)
+        , _mapSize(mapSize)
+        , _fd(fd)
+        , _mtime(mtime)
+        , _path(path)
+    {
+    }
+
+    void* _map;
+    std::size_t _mapSize;
+    /// Kept open to check the mapped file, even once replaced under its name.
+    int _fd;
+    timespec _mtime;
+    std::string _owned;
+    std::string _path;
+};
+
+/// A file we serve, with its precompressed variants, if any.
+struct StaticFile
+{
+    enum class Encoding { Identity, Gzip, Brotli };
+
+    std::shared_ptr<const FileContent> _content[3]; //< Indexed by Encoding.
+    std::string _etag; //< Strong entity-tag of the identity content, quoted.
+
+    const std::shared_ptr<const FileContent>& content(Encoding encoding) const
+    {
+        return _content[static_cast<int>(encoding)];
+    }
+
+    /// The entity-tag of the @encoding variant, each representation having its own.
+    std::string getETag(Encoding encoding) const;
+};
+
+/// A file with placeholders that are filled in on each request; everything else
+/// is substituted once. The placeholders are located once, so filling them in
+/// is a single pass over the content.
+class PreprocessedFile
+{
+public:
+    /// Locates the occurrences of @placeholders in @data.
+    PreprocessedFile(std::string data, const std::vector<std::string>& placeholders);
+
+    /// Returns the content with each placeholder replaced by the value at
+    /// the same index in @values.
+    std::string substitute(const std::vector<std::string>& values) const;
+
+private:
+    struct Slot
+    {
+        std::size_t _offset;
+        std::size_t _length;
+        std::size_t _index;
+    };
+
+    std::string _data;
+    std::vector<Slot> _slots;
+    std::size_t _placeholderCount;
+};
 /// Handles file requests over HTTP(S).
 class FileServerRequestHandler
 {
@@ -24,6 +131,12 @@ class FileServerRequestHandler
                                const RequestDetails &requestDetails,
                                Poco::MemoryInputStream& message,
                                const std::shared_ptr<StreamSocket>& socket);
+    /// Returns @relPath with everything but the per-request values filled in, cached.
+    static std::shared_ptr<const PreprocessedFile> getPreprocessedFile(const std::string& relPath,
+                                                                      const std::string& socketProxy,
+                                                                      const std::string& webSocketUrl,
+                                                                      const std::string& responseRoot,
+                                                                      const std::string& branding);
     static void preprocessAdminFile(const Poco::Net::HTTPRequest& request,
                                     const RequestDetails &requestDetails,
                                     const std::shared_ptr<StreamSocket>& socket);
@@ -36,6 +149,14 @@ class FileServerRequestHandler
 
     static std::string cssVarsToStyle(const std::string& cssVars);
 
+    /// Picks the best variant of @file the client accepts, as per its
+    /// @acceptEncoding header (brotli, then gzip, then identity).
+    static StaticFile::Encoding selectEncoding(const StaticFile& file,
+                                               const std::string& acceptEncoding);
+
+    /// True iff the If-None-Match header value @ifNoneMatch matches @etag.
+    static bool matchETag(const std::string& ifNoneMatch, const std::string& etag);
+
 public:
     /// Evaluate if the cookie exists, and if not, ask for the credentials.
     static bool isAdminLoggedIn(const Poco::Net::HTTPRequest& request, Poco::Net::HTTPResponse& response);
@@ -45,20 +166,32 @@ public:
                               Poco::MemoryInputStream& message,
                               const std::shared_ptr<StreamSocket>& socket);
 
-    /// Read all files that we can serve into memory and compress them.
+    /// Map all files that we can serve into memory, with their compressed variants.
     static void initialize();
 
     /// Clean cached files.
-    static void uninitialize() { FileHash.clear(); }
+    static void uninitialize()
+    {
+        FileHash.clear();
+        std::lock_guard<std::mutex> lock(PreprocessedFilesMutex);
+        PreprocessedFiles.clear();
+    }
 
     static void readDirToHash(const std::string &basePath, const std::string &path, const std::string &prefix = std::string());
 
-    static const std::string *getCompressedFile(const std::string &path);
+    /// Returns the file we serve at @path, or nullptr if there is none.
+    static const StaticFile* getFile(const std::string &path);
 
-    static const std::string *getUncompressedFile(const std::string &path);
+    /// Returns the uncompressed content of the file we serve at @path.
+    static std::string getUncompressedFile(const std::string &path);
 
 private:
-    static std::map<std::string, std::pair<std::string, std::string>> FileHash;
+    static std::map<std::string, StaticFile> FileHash;
+
+    /// The templated files, by path and everything they depend on but the request.
+    static std::map<std::string, std::shared_ptr<const PreprocessedFile>> PreprocessedFiles;
+    static std::mutex PreprocessedFilesMutex;
+
     static void sendError(int errorCode, const Poco::Net::HTTPRequest& request,
                           const std::shared_ptr<StreamSocket>& socket, const std::string& shortMessage,
                           const std::string& longMessage, const std::string& extraHeader = "");
@@ -7,15 +7,257 @@
 
 #include <config.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <Poco/JSON/Object.h>
 
 #include "FileServer.hpp"
 
+namespace
+{
+timespec getModifiedTime(const struct stat& st)
+{
+#ifdef IOS
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+}
+
+FileContent::~FileContent()
+{
+    if (_map)
+        ::munmap(_map, _mapSize);
+    if (_fd >= 0)
+        ::close(_fd);
+}
+
+std::shared_ptr<const FileContent> FileContent::map(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_SYS("Failed to open [" << path << "] to map it");
+        return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    if (static_cast<std::size_t>(st.st_size) <= MaxReadSize)
+    {
+        // Small files aren't worth a mapping, nor its checks; empty ones can't be mapped.
+        std::string data(st.st_size, '\0');
+        std::size_t offset = 0;
+        while (offset < data.size())
+        {
+            const ssize_t len = ::pread(fd, &data[offset], data.size() - offset, offset);
+            if (len < 0 && errno == EINTR)
+                continue;
+
+            if (len <= 0)
+            {
+                LOG_SYS("Failed to read [" << path << ']');
+                ::close(fd);
+                return nullptr;
+            }
+
+            offset += len;
+        }
+
+        ::close(fd);
+        std::shared_ptr<FileContent> content = std::make_shared<FileContent>(std::move(data));
+        content->_path = path;
+        return content;
+    }
+
+    // Private, so that we never write through it; it still faults past a truncated end.
+    void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        LOG_SYS("Failed to map [" << path << ']');
+        ::close(fd);
+        return nullptr;
+    }
+
+    return std::shared_ptr<const FileContent>(
+        new FileContent(path, map, st.st_size, fd, getModifiedTime(st)));
+}
+
+bool FileContent::changed() const
+{
+    if (!_map)
+        return false;
+
+    struct stat st;
+    if (::fstat(_fd, &st) != 0)
+    {
+        LOG_SYS("Failed to stat mapped [" << _path << ']');
+        return true;
+    }
+
+    const timespec mtime = getModifiedTime(st);
+    return static_cast<std::size_t>(st.st_size) != _mapSize || mtime.tv_sec != _mtime.tv_sec
+           || mtime.tv_nsec != _mtime.tv_nsec;
+}
+
+std::string StaticFile::getETag(Encoding encoding) const
+{
+    if (encoding == Encoding::Identity || _etag.size() < 2)
+        return _etag;
+
+    // Insert the suffix before the closing quote.
+    return _etag.substr(0, _etag.size() - 1) + (encoding == Encoding::Gzip ? "-gz\"" : "-br\"");
+}
+
+PreprocessedFile::PreprocessedFile(std::string data, const std::vector<std::string>& placeholders)
+    : _data(std::move(data))
+    , _placeholderCount(placeholders.size())
+{
+    for (std::size_t index = 0; index < placeholders.size(); ++index)
+    {
+        const std::string& placeholder = placeholders[index];
+        if (placeholder.empty())
+            continue;
+
+        for (std::size_t pos = _data.find(placeholder); pos != std::string::npos;
+             pos = _data.find(placeholder, pos + placeholder.size()))
+        {
+            _slots.push_back(Slot{ pos, placeholder.size(), index });
+        }
+    }
+
+    std::sort(_slots.begin(), _slots.end(),
+              [](const Slot& lhs, const Slot& rhs) { return lhs._offset < rhs._offset; });
+
+    // Overlapping placeholders: the first one wins.
+    std::size_t end = 0;
+    _slots.erase(std::remove_if(_slots.begin(), _slots.end(),
+                                [&end](const Slot& slot) {
+                                    if (slot._offset < end)
+                                        return true;
+                                    end = slot._offset + slot._length;
+                                    return false;
+                                }),
+                 _slots.end());
+}
+
+std::string PreprocessedFile::substitute(const std::vector<std::string>& values) const
+{
+    assert(values.size() == _placeholderCount && "Expected a value for each placeholder");
+
+    std::size_t size = _data.size();
+    for (const Slot& slot : _slots)
+        size = size - slot._length + values[slot._index].size();
+
+    std::string result;
+    result.reserve(size);
+
+    std::size_t pos = 0;
+    for (const Slot& slot : _slots)
+    {
+        result.append(_data, pos, slot._offset - pos);
+        result.append(values[slot._index]);
+        pos = slot._offset + slot._length;
+    }
+
+    result.append(_data, pos, std::string::npos);
+    return result;
+}
+
+namespace
+{
+/// Returns the quality value (0 to 1) given to @coding by an Accept-Encoding header,
+/// or -1 when it's not listed.
+double getEncodingQuality(const std::string& acceptEncoding, const char* coding)
+{
+    double wildcard = -1;
+    StringVector items(Util::tokenize(acceptEncoding, ','));
+    for (const auto& item : items)
+    {
+        StringVector params(Util::tokenize(items.getParam(item), ';'));
+        if (params.size() == 0)
+            continue;
+
+        const std::string name = Util::trimmed(params[0]);
+        double quality = 1;
+        for (std::size_t i = 1; i < params.size(); ++i)
+        {
+            const std::string param = Util::trimmed(params[i]);
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                quality = std::strtod(param.c_str() + 2, nullptr);
+        }
+
+        if (Util::iequal(name, std::string(coding)))
+            return quality;
+
+        if (name == "*")
+            wildcard = quality;
+    }
+
+    return wildcard;
+}
+}
+
+StaticFile::Encoding FileServerRequestHandler::selectEncoding(const StaticFile& file,
+                                                              const std::string& acceptEncoding)
+{
+    const double brotli = file.content(StaticFile::Encoding::Brotli)
+                              ? getEncodingQuality(acceptEncoding, "br")
+                              : -1;
+    const double gzip = file.content(StaticFile::Encoding::Gzip)
+                            ? getEncodingQuality(acceptEncoding, "gzip")
+                            : -1;
+
+    // Prefer the smaller brotli on a tie.
+    if (brotli > 0 && brotli >= gzip)
+        return StaticFile::Encoding::Brotli;
+
+    if (gzip > 0)
+        return StaticFile::Encoding::Gzip;
+
+    return StaticFile::Encoding::Identity;
+}
+
+bool FileServerRequestHandler::matchETag(const std::string& ifNoneMatch, const std::string& etag)
+{
+    StringVector tags(Util::tokenize(ifNoneMatch, ','));
+    for (const auto& tag : tags)
+    {
+        std::string value = Util::trimmed(tags.getParam(tag));
+        if (value == "*")
+            return true;
+
+        // If-None-Match uses the weak comparison (rfc7232 3.2).
+        if (Util::startsWith(value, "W/"))
+            value = value.substr(2);
+
+        if (value == etag)
+            return true;
+    }
+
+    return false;
+}
+
 std::string FileServerRequestHandler::uiDefaultsToJSON(const std::string& uiDefaults, std::string& uiMode)
 {
-    static std::string previousUIDefaults;
-    static std::string previousJSON("{}");
-    static std::string previousUIMode;
+    // Per thread, as several web server polls can serve files.
+    static thread_local std::string previousUIDefaults;
+    static thread_local std::string previousJSON("{}");
+    static thread_local std::string previousUIMode;
 
     // early exit if we are serving the same thing
     if (uiDefaults == previousUIDefaults)
@@ -124,8 +366,8 @@ bool isValidCss(const std::string& token)
 
 std::string FileServerRequestHandler::cssVarsToStyle(const std::string& cssVars)
 {
-    static std::string previousVars;
-    static std::string previousStyle;
+    static thread_local std::string previousVars;
+    static thread_local std::string previousStyle;
 
     // early exit if we are serving the same thing
     if (cssVars == previousVars)
@@ -129,6 +129,7 @@ using Poco::Net::PartHandler;
 #  include <SslSocket.hpp>
 #endif
 #include "Storage.hpp"
+#include "TileStore.hpp"
 #include "TraceFile.hpp"
 #include <Unit.hpp>
 #include <UnitHTTP.hpp>
@@ -136,6 +137,7 @@ using Poco::Net::PartHandler;
 #include <Util.hpp>
 #include <common/ConfigUtil.hpp>
 #include <common/TraceEvent.hpp>
+#include <common/TraceEventFormat.hpp>
 
 #ifdef FUZZER
 #  include <tools/Replay.hpp>
@@ -278,22 +280,43 @@ void alertAllUsersInternal(const std::string& msg)
 
 } // end anonymous namespace
 
-void LOOLWSD::writeTraceEventRecording(const char *data, std::size_t nbytes)
+namespace
 {
-    static std::mutex traceEventFileMutex;
+std::mutex traceEventFileMutex;
+
+void writeTraceEventChunk(char kind, const char* data, std::size_t nbytes)
+{
+    std::string header;
+    TraceEventFormat::appendChunkHeader(header, kind, nbytes);
 
     std::unique_lock<std::mutex> lock(traceEventFileMutex);
 
+    // Closed on shutdown, while threads may still be flushing theirs.
+    if (LOOLWSD::TraceEventFile == NULL)
+        return;
+
+    fwrite(header.data(), header.size(), 1, LOOLWSD::TraceEventFile);
     fwrite(data, nbytes, 1, LOOLWSD::TraceEventFile);
 }
+}
+
+void LOOLWSD::writeTraceEventRecording(const char *data, std::size_t nbytes)
+{
+    writeTraceEventChunk(TraceEventFormat::ChunkJson, data, nbytes);
+}
 
 void LOOLWSD::writeTraceEventRecording(const std::string &recording)
 {
     writeTraceEventRecording(recording.data(), recording.length());
 }
 
-// FIXME: Somewhat idiotically, the parameter to emitOneRecordingIfEnabled() should end with a
-// newline, while the paramter to emitOneRecording() should not.
+void LOOLWSD::writeTraceEventBlocks(const char *data, std::size_t nbytes)
+{
+    writeTraceEventChunk(TraceEventFormat::ChunkEvents, data, nbytes);
+}
+
+// The parameter to emitOneRecordingIfEnabled() is JSON, ending with a comma and newline, while
+// emitRecordings() gets blocks of binary events.
 
 void TraceEvent::emitOneRecordingIfEnabled(const std::string &recording)
 {
@@ -303,15 +326,12 @@ void TraceEvent::emitOneRecordingIfEnabled(const std::string &recording)
     LOOLWSD::writeTraceEventRecording(recording);
 }
 
-void TraceEvent::emitOneRecording(const std::string &recording)
+void TraceEvent::emitRecordings(const char* data, std::size_t size)
 {
     if (LOOLWSD::TraceEventFile == NULL)
         return;
 
-    if (!TraceEvent::isRecordingOn())
-        return;
-
-    LOOLWSD::writeTraceEventRecording(recording + "\n");
+    LOOLWSD::writeTraceEventBlocks(data, size);
 }
 
 void LOOLWSD::checkSessionLimitsAndWarnClients()
@@ -1032,6 +1052,7 @@ void LOOLWSD::innerInitialize(Application& self)
             { "logging.anonymize.filenames", "false" }, // Deprecated.
             { "logging.anonymize.usernames", "false" }, // Deprecated.
             // { "logging.anonymize.anonymize_user_data", "false" }, // Do not set to fallback on filename/username.
+            { "logging.async", "true" },
             { "logging.color", "true" },
             { "logging.file.property[0]", "loolwsd.log" },
             { "logging.file.property[0][@name]", "path" },
@@ -1055,6 +1076,7 @@ void LOOLWSD::innerInitialize(Application& self)
             { "loleaflet_html", "loleaflet.html" },
             { "loleaflet_logging", "false" },
             { "mount_jail_tree", "true" },
+            { "net.accept_threads", "1" },
             { "net.connection_timeout_secs", "30" },
             { "net.listen", "any" },
             { "net.proto", "all" },
@@ -1083,6 +1105,8 @@ void LOOLWSD::innerInitialize(Application& self)
             { "per_document.batch_priority", "5" },
             { "per_document.pdf_resolution_dpi", "96"},
             { "per_document.redlining_as_comments", "false" },
+            { "per_document.tile_deltas", "true" },
+            { "per_document.tile_prerender", "false" },
             { "per_view.idle_timeout_secs", "900" },
             { "per_view.out_of_focus_timeout_secs", "120" },
             { "security.capabilities", "true" },
@@ -1097,19 +1121,32 @@ void LOOLWSD::innerInitialize(Application& self)
             { "ssl.hpkp[@enable]", "false" },
             { "ssl.hpkp[@report_only]", "false" },
             { "ssl.key_file_path", LOOLWSD_CONFIGDIR "/key.pem" },
+            { "ssl.ktls", "false" },
+            { "ssl.session_resumption[@enable]", "true" },
+            { "ssl.session_resumption.cache_size", "20480" },
+            { "ssl.session_resumption.timeout_secs", "3600" },
+            { "ssl.session_resumption.tickets", "true" },
+            { "ssl.session_resumption.ticket_key_rotation_secs", "3600" },
             { "ssl.termination", "true" },
             { "storage.filesystem[@allow]", "false" },
 //            "storage.ssl.enable" - deliberately not set; for back-compat
+            { "storage.ssl.ktls", "false" },
+            { "storage.ssl.session_reuse", "true" },
             { "storage.wopi.host[0]", "localhost" },
             { "storage.wopi.host[0][@allow]", "true" },
             { "storage.wopi.max_file_size", "0" },
             { "storage.wopi[@allow]", "true" },
             { "storage.wopi.locking.refresh", "900" },
+            { "storage.wopi.connection_pool[@enable]", "true" },
+            { "storage.wopi.connection_pool.max_per_host", "8" },
+            { "storage.wopi.connection_pool.idle_timeout_secs", "30" },
             { "sys_template_path", "systemplate" },
+            { "tile_cache_shared_size", "16384" },
             { "trace_event[@enable]", "false" },
             { "trace.path[@compress]", "true" },
             { "trace.path[@snapshot]", "false" },
             { "trace[@enable]", "false" },
+            { "warm_up_document_types", "" },
             { "welcome.enable", ENABLE_WELCOME_MESSAGE },
             { "welcome.enable_button", ENABLE_WELCOME_MESSAGE_BUTTON },
             { "welcome.path", "loleaflet/welcome" },
@@ -1213,8 +1250,11 @@ void LOOLWSD::innerInitialize(Application& self)
         }
     }
 
+    // Don't block the polls on writing the log out.
+    const bool logAsync = getConfigValue<bool>(conf, "logging.async", true);
+
     // Log at trace level until we complete the initialization.
-    Log::initialize("wsd", "trace", withColor, logToFile, logProperties);
+    Log::initialize("wsd", "trace", withColor, logToFile, logProperties, logAsync);
     if (LogLevel != "trace")
     {
         LOG_INF("Setting log-level to [trace] and delaying setting to configured ["
@@ -1237,12 +1277,15 @@ void LOOLWSD::innerInitialize(Application& self)
             }
             else
             {
-                fprintf(TraceEventFile, "[\n");
+                fwrite(TraceEventFormat::FileMagic, TraceEventFormat::FileMagicSize, 1, TraceEventFile);
                 // Output a metadata event that tells that this is the WSD process
-                fprintf(TraceEventFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"args\":{\"name\":\"WSD\"},\"pid\":%d,\"tid\":%ld},\n",
-                        getpid(), (long) Util::getThreadId());
-                fprintf(TraceEventFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":\"Main\"},\"pid\":%d,\"tid\":%ld},\n",
-                        getpid(), (long) Util::getThreadId());
+                const std::string pidTid = "\"pid\":" + std::to_string(getpid())
+                                           + ",\"tid\":" + std::to_string(Util::getThreadId());
+                writeTraceEventRecording(
+                    "{\"name\":\"process_name\",\"ph\":\"M\",\"args\":{\"name\":\"WSD\"},"
+                    + pidTid + "},\n"
+                    "{\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":\"Main\"},"
+                    + pidTid + "},\n");
             }
         }
     }
@@ -1455,6 +1498,9 @@ void LOOLWSD::innerInitialize(Application& self)
     if (!getConfigValue<bool>(conf, "welcome.enable", true))
         WelcomeFilesRoot = "";
 
+    TileStore::instance().setMaxKeptSize(
+        getConfigValue<int>(conf, "tile_cache_shared_size", 16384) * 1024UL);
+
     NumPreSpawnedChildren = getConfigValue<int>(conf, "num_prespawn_children", 1);
     if (NumPreSpawnedChildren < 1)
     {
@@ -1465,7 +1511,19 @@ void LOOLWSD::innerInitialize(Application& self)
 
     FileUtil::registerFileSystemForDiskSpaceChecks(ChildRoot);
 
-    const auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
+    auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
+
+    // Kits share our cgroup, so don't run more encoder threads than the CPU quota allows.
+    const int cpuLimit = Util::getCGroupCpuLimit();
+    if (maxConcurrency <= 0)
+        maxConcurrency = cpuLimit > 0 ? cpuLimit : std::thread::hardware_concurrency();
+    else if (cpuLimit > 0 && maxConcurrency > cpuLimit)
+    {
+        LOG_INF("Limiting max_concurrency from " << maxConcurrency << " to the cgroup CPU quota of "
+                                                 << cpuLimit << '.');
+        maxConcurrency = cpuLimit;
+    }
+
     if (maxConcurrency > 0)
     {
         setenv("MAX_CONCURRENCY", std::to_string(maxConcurrency).c_str(), 1);
@@ -1667,9 +1725,30 @@ void LOOLWSD::initializeSSL()
                                           ssl_cipher_list, ssl::CertificateVerification::Disabled);
 
     if (!ssl::Manager::isServerContextInitialized())
+    {
         LOG_ERR("Failed to initialize Server SSL.");
-    else
-        LOG_INF("Initialized Server SSL.");
+        return;
+    }
+
+    LOG_INF("Initialized Server SSL.");
+
+    // Reconnecting clients can skip the full handshake.
+    if (getConfigValue<bool>("ssl.session_resumption[@enable]", true))
+    {
+        const int cacheSize = getConfigValue<int>("ssl.session_resumption.cache_size", 20480);
+        const int timeoutSecs = getConfigValue<int>("ssl.session_resumption.timeout_secs", 3600);
+        const int ticketKeyRotationSecs
+            = getConfigValue<bool>("ssl.session_resumption.tickets", true)
+                  ? getConfigValue<int>("ssl.session_resumption.ticket_key_rotation_secs", 3600)
+                  : 0;
+        ssl::Manager::enableServerSessionResumption(std::max(cacheSize, 0),
+                                                    std::chrono::seconds(timeoutSecs),
+                                                    std::chrono::seconds(ticketKeyRotationSecs));
+    }
+
+    // The kernel encrypts the responses, written without copies.
+    if (getConfigValue<bool>("ssl.ktls", false))
+        ssl::Manager::setServerKernelTls(true);
 #else
     LOG_INF("SSL is unavailable in this build.");
 #endif
@@ -2374,9 +2453,11 @@ private:
         try
         {
 #if !MOBILEAPP
-            if (!socket->parseHeader("Prisoner", message, request))
+            if (!socket->parseHeader("Prisoner", message))
                 return;
 
+            socket->getRequest(request);
+
             LOG_TRC("Child connection with URI [" << LOOLWSD::anonymizeUrl(request.getURI()) << "].");
             Poco::URI requestURI(request.getURI());
 #ifndef KIT_IN_PROCESS
@@ -2650,13 +2731,12 @@ private:
         }
 #endif
 
-        Poco::Net::HTTPRequest request;
-
         StreamSocket::MessageMap map;
-        if (!socket->parseHeader("Client", startmessage, request, &map))
+        if (!socket->parseHeader("Client", startmessage, &map))
             return;
 
-        LOG_INF("Handling request: " << request.getURI());
+        LOG_INF("Handling request: "
+                << socket->getRequestHeader().url().toString(socket->getInBuffer().data()));
         try
         {
             // We may need to re-write the chunks moving the inBuffer.
@@ -2667,9 +2747,25 @@ private:
             message.seekg(startmessage.tellg(), std::ios::beg);
 
             // re-write ServiceRoot and cache.
-            RequestDetails requestDetails(request, LOOLWSD::ServiceRoot);
+            RequestDetails requestDetails(socket->getRequestHeader(),
+                                          socket->getInBuffer().data(), LOOLWSD::ServiceRoot);
             // LOG_TRC("Request details " << requestDetails.toString());
 
+            // Only built for the handlers that still take one.
+            Poco::Net::HTTPRequest pocoRequest;
+            bool hasPocoRequest = false;
+            const auto request = [&]() -> Poco::Net::HTTPRequest&
+            {
+                if (!hasPocoRequest)
+                {
+                    socket->getRequest(pocoRequest);
+                    pocoRequest.setURI(requestDetails.getURI()); // Without the ServiceRoot.
+                    hasPocoRequest = true;
+                }
+
+                return pocoRequest;
+            };
+
             // Config & security ...
             if (requestDetails.isProxy())
             {
@@ -2680,7 +2776,8 @@ private:
             }
 
             // Routing
-            if (UnitWSD::get().handleHttpRequest(request, message, socket))
+            if (UnitWSD::isUnitTesting()
+                && UnitWSD::get().handleHttpRequest(request(), message, socket))
             {
                 // Unit testing, nothing to do here
             }
@@ -2688,15 +2785,15 @@ private:
             {
                 // File server
                 assert(socket && "Must have a valid socket");
-                FileServerRequestHandler::handleRequest(request, requestDetails, message, socket);
+                FileServerRequestHandler::handleRequest(request(), requestDetails, message, socket);
                 socket->shutdown();
             }
             else if (requestDetails.equals(RequestDetails::Field::Type, "lool") &&
                      requestDetails.equals(1, "adminws"))
             {
                 // Admin connections
-                LOG_INF("Admin request: " << request.getURI());
-                if (AdminSocketHandler::handleInitialRequest(_socket, request))
+                LOG_INF("Admin request: " << requestDetails.getURI());
+                if (AdminSocketHandler::handleInitialRequest(_socket, request()))
                 {
                     disposition.setMove([](const std::shared_ptr<Socket> &moveSocket){
                             // Hand the socket over to the Admin poll.
@@ -2715,7 +2812,7 @@ private:
 
                 try
                 {
-                    if (!FileServerRequestHandler::isAdminLoggedIn(request, *response))
+                    if (!FileServerRequestHandler::isAdminLoggedIn(request(), *response))
                         throw Poco::Net::NotAuthenticatedException("Invalid admin login");
                 }
                 catch (const Poco::Net::NotAuthenticatedException& exc)
@@ -2756,29 +2853,29 @@ private:
                 handleWopiDiscoveryRequest(requestDetails, socket);
 
             else if (requestDetails.isGet(CAPABILITIES_END_POINT))
-                handleCapabilitiesRequest(request, socket);
+                handleCapabilitiesRequest(request(), socket);
 
             else if (requestDetails.isGet("/robots.txt"))
-                handleRobotsTxtRequest(request, socket);
+                handleRobotsTxtRequest(requestDetails, socket);
 
             else if (requestDetails.equals(RequestDetails::Field::Type, "lool") &&
                      requestDetails.equals(1, "clipboard"))
             {
 //              Util::dumpHex(std::cerr, socket->getInBuffer(), "clipboard:\n"); // lots of data ...
-                handleClipboardRequest(request, message, disposition, socket);
+                handleClipboardRequest(request(), message, disposition, socket);
             }
 
             else if (requestDetails.isProxy() && requestDetails.equals(2, "ws"))
-                handleClientProxyRequest(request, requestDetails, message, disposition);
+                handleClientProxyRequest(request(), requestDetails, message, disposition);
 
             else if (requestDetails.equals(RequestDetails::Field::Type, "lool") &&
                      requestDetails.equals(2, "ws") && requestDetails.isWebSocket())
-                handleClientWsUpgrade(request, requestDetails, disposition, socket);
+                handleClientWsUpgrade(request(), requestDetails, disposition, socket);
 
             else if (!requestDetails.isWebSocket() && requestDetails.equals(RequestDetails::Field::Type, "lool"))
             {
                 // All post requests have url prefix 'lool'.
-                handlePostRequest(requestDetails, request, message, disposition, socket);
+                handlePostRequest(requestDetails, request(), message, disposition, socket);
             }
             else
             {
@@ -3035,12 +3132,12 @@ private:
         }
     }
 
-    static void handleRobotsTxtRequest(const Poco::Net::HTTPRequest& request,
+    static void handleRobotsTxtRequest(const RequestDetails& requestDetails,
                                 const std::shared_ptr<StreamSocket>& socket)
     {
         assert(socket && "Must have a valid socket");
 
-        LOG_DBG("HTTP request: " << request.getURI());
+        LOG_DBG("HTTP request: " << requestDetails.getURI());
         const std::string responseString = "User-agent: *\nDisallow: /\n";
 
         http::Response httpResponse(http::StatusLine(200));
@@ -3050,7 +3147,7 @@ private:
         httpResponse.set("Connection", "close");
         httpResponse.writeData(socket->getOutBuffer());
 
-        if (request.getMethod() == Poco::Net::HTTPRequest::HTTP_GET)
+        if (requestDetails.isGet())
         {
             socket->send(responseString);
         }
@@ -3608,55 +3705,67 @@ private:
                     docBroker->setupTransfer(disposition, [docBroker, clientSession, ws]
                                             (const std::shared_ptr<Socket> &moveSocket)
                     {
-                        try
-                        {
-                            auto streamSocket = std::static_pointer_cast<StreamSocket>(moveSocket);
-
-                            // Set WebSocketHandler's socket after its construction for shared_ptr goodness.
-                            streamSocket->setHandler(ws);
-
-                            LOG_DBG("Socket #" << moveSocket->getFD() << " handler is " << clientSession->getName());
-
-                            // Add and load the session.
-                            docBroker->addSession(clientSession);
-
-                            LOOLWSD::checkDiskSpaceAndWarnClients(true);
-                            // Users of development versions get just an info
-                            // when reaching max documents or connections
-                            LOOLWSD::checkSessionLimitsAndWarnClients();
-
-                            sendLoadResult(clientSession, true, "");
-                        }
-                        catch (const UnauthorizedRequestException& exc)
-                        {
-                            LOG_ERR("Unauthorized Request while starting session on "
-                                    << docBroker->getDocKey() << " for socket #"
-                                    << moveSocket->getFD()
-                                    << ". Terminating connection. Error: " << exc.what());
-                            const std::string msg = "error: cmd=internal kind=unauthorized";
-                            ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
-                            moveSocket->ignoreInput();
-                        }
-                        catch (const StorageConnectionException& exc)
-                        {
-                            LOG_ERR("Storage error while starting session on "
-                                    << docBroker->getDocKey() << " for socket #"
-                                    << moveSocket->getFD()
-                                    << ". Terminating connection. Error: " << exc.what());
-                            const std::string msg = "error: cmd=storage kind=loadfailed";
-                            ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
-                            moveSocket->ignoreInput();
-                        }
-                        catch (const std::exception& exc)
-                        {
-                            LOG_ERR("Error while starting session on "
-                                    << docBroker->getDocKey() << " for socket #"
-                                    << moveSocket->getFD()
-                                    << ". Terminating connection. Error: " << exc.what());
-                            const std::string msg = "error: cmd=storage kind=loadfailed";
-                            ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
-                            moveSocket->ignoreInput();
-                        }
+                        auto streamSocket = std::static_pointer_cast<StreamSocket>(moveSocket);
+
+                        // Set WebSocketHandler's socket after its construction for shared_ptr goodness.
+                        streamSocket->setHandler(ws);
+
+                        LOG_DBG("Socket #" << moveSocket->getFD() << " handler is " << clientSession->getName());
+
+                        // Add and load the session, without blocking the DocBroker on the Storage.
+                        // Don't hold the socket meanwhile, it is closed should the client leave.
+                        const std::weak_ptr<Socket> weakSocket = moveSocket;
+                        docBroker->addSessionAsync(
+                            clientSession,
+                            [docBroker, clientSession, ws, weakSocket](const std::exception_ptr& error)
+                            {
+                                const std::shared_ptr<Socket> moveSocket = weakSocket.lock();
+                                if (!moveSocket)
+                                    return;
+
+                                try
+                                {
+                                    if (error)
+                                        std::rethrow_exception(error);
+
+                                    LOOLWSD::checkDiskSpaceAndWarnClients(true);
+                                    // Users of development versions get just an info
+                                    // when reaching max documents or connections
+                                    LOOLWSD::checkSessionLimitsAndWarnClients();
+
+                                    sendLoadResult(clientSession, true, "");
+                                }
+                                catch (const UnauthorizedRequestException& exc)
+                                {
+                                    LOG_ERR("Unauthorized Request while starting session on "
+                                            << docBroker->getDocKey() << " for socket #"
+                                            << moveSocket->getFD()
+                                            << ". Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=internal kind=unauthorized";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                    moveSocket->ignoreInput();
+                                }
+                                catch (const StorageConnectionException& exc)
+                                {
+                                    LOG_ERR("Storage error while starting session on "
+                                            << docBroker->getDocKey() << " for socket #"
+                                            << moveSocket->getFD()
+                                            << ". Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=storage kind=loadfailed";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                    moveSocket->ignoreInput();
+                                }
+                                catch (const std::exception& exc)
+                                {
+                                    LOG_ERR("Error while starting session on "
+                                            << docBroker->getDocKey() << " for socket #"
+                                            << moveSocket->getFD()
+                                            << ". Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=storage kind=loadfailed";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                    moveSocket->ignoreInput();
+                                }
+                            });
                     });
                 }
                 else
@@ -3880,8 +3989,7 @@ class LOOLWSDServer
     LOOLWSDServer(LOOLWSDServer&& other) = delete;
     const LOOLWSDServer& operator=(LOOLWSDServer&& other) = delete;
 public:
-    LOOLWSDServer() :
-        _acceptPoll("accept_poll")
+    LOOLWSDServer()
     {
     }
 
@@ -3890,11 +3998,43 @@ public:
         stop();
     }
 
-    // allocate port & hold temporarily.
-    std::shared_ptr<ServerSocket> _serverSocket;
+    // allocate port(s) & hold temporarily.
+    std::vector<std::shared_ptr<ServerSocket>> _serverSockets;
     void findClientPort()
     {
-        _serverSocket = findServerPort(ClientPortNumber);
+#if !MOBILEAPP
+        const int acceptThreads = std::max(1, LOOLWSD::getConfigValue<int>("net.accept_threads", 1));
+#else
+        const int acceptThreads = 1;
+#endif
+
+        // With more than one acceptor, each listens on its own socket bound
+        // with SO_REUSEPORT, dispatching the requests in its own web server poll.
+        _serverSockets.push_back(findServerPort(ClientPortNumber, acceptThreads > 1));
+        _acceptPolls.push_back(Util::make_unique<AcceptPoll>("accept_poll"));
+
+        for (int i = 1; i < acceptThreads; ++i)
+        {
+            const std::string suffix = std::to_string(i);
+            std::unique_ptr<TerminatingPoll> webServerPoll
+                = Util::make_unique<TerminatingPoll>("websrv_poll" + suffix);
+
+            std::shared_ptr<ServerSocket> socket = ServerSocket::create(
+                ClientListenAddr, ClientPortNumber, ClientPortProto, *webServerPoll,
+                createSocketFactory(), true);
+            if (!socket)
+            {
+                LOG_WRN("Failed to share client port " << ClientPortNumber << " with acceptor #"
+                        << i << ", continuing with " << i << " acceptor(s).");
+                break;
+            }
+
+            _serverSockets.push_back(socket);
+            _acceptPolls.push_back(Util::make_unique<AcceptPoll>("accept_poll" + suffix));
+            _webServerPolls.push_back(std::move(webServerPoll));
+        }
+
+        LOG_INF("Accepting client connections with " << _acceptPolls.size() << " acceptor(s).");
     }
 
     void startPrisoners()
@@ -3910,15 +4050,21 @@ public:
 
     void start()
     {
-        _acceptPoll.startThread();
-        _acceptPoll.insertNewSocket(_serverSocket);
+        assert(_acceptPolls.size() == _serverSockets.size() && "Ports not allocated.");
+        for (std::size_t i = 0; i < _acceptPolls.size(); ++i)
+        {
+            _acceptPolls[i]->startThread();
+            _acceptPolls[i]->insertNewSocket(_serverSockets[i]);
+        }
 
 #if MOBILEAPP
-        loolwsd_server_socket_fd = _serverSocket->getFD();
+        loolwsd_server_socket_fd = _serverSockets[0]->getFD();
 #endif
 
-        _serverSocket.reset();
+        _serverSockets.clear();
         LOOLWSD::WebServerPoll->startThread();
+        for (auto& webServerPoll : _webServerPolls)
+            webServerPoll->startThread();
 
 #if !MOBILEAPP
         Admin::instance().start();
@@ -3927,9 +4073,12 @@ public:
 
     void stop()
     {
-        _acceptPoll.joinThread();
+        for (auto& acceptPoll : _acceptPolls)
+            acceptPoll->joinThread();
         if (LOOLWSD::WebServerPoll)
             LOOLWSD::WebServerPoll->joinThread();
+        for (auto& webServerPoll : _webServerPolls)
+            webServerPoll->joinThread();
     }
 
     void dumpState(std::ostream& os)
@@ -3982,11 +4131,14 @@ public:
            << "\n  UserInterface: " << LOOLWSD::UserInterface
             ;
 
-        os << "\nServer poll:\n";
-        _acceptPoll.dumpState(os);
+        os << "\nServer polls [ " << _acceptPolls.size() << " ]:\n";
+        for (auto& acceptPoll : _acceptPolls)
+            acceptPoll->dumpState(os);
 
-        os << "Web Server poll:\n";
+        os << "Web Server polls [ " << _webServerPolls.size() + 1 << " ]:\n";
         LOOLWSD::WebServerPoll->dumpState(os);
+        for (auto& webServerPoll : _webServerPolls)
+            webServerPoll->dumpState(os);
 
         os << "Prisoner poll:\n";
         LOOLWSD::PrisonerPoll->dumpState(os);
@@ -4004,6 +4156,8 @@ public:
         for (auto &i : DocBrokers)
             i.second->dumpState(os);
 
+        TileStore::instance().dumpState(os);
+
 #if !MOBILEAPP
         os << "Converter count: " << ConvertToBroker::getInstanceCount() << '\n';
 #endif
@@ -4023,8 +4177,12 @@ private:
             SigUtil::checkDumpGlobalState(dump_state);
         }
     };
-    /// This thread & poll accepts incoming connections.
-    AcceptPoll _acceptPoll;
+    /// These threads & polls accept incoming connections, one per listening socket.
+    std::vector<std::unique_ptr<AcceptPoll>> _acceptPolls;
+
+    /// The polls parsing and routing the requests of the additional acceptors,
+    /// the first acceptor dispatches to LOOLWSD::WebServerPoll.
+    std::vector<std::unique_ptr<TerminatingPoll>> _webServerPolls;
 
     /// Create the internal only, local socket for forkit / kits prisoners to talk to.
     std::shared_ptr<ServerSocket> findPrisonerServerPort()
@@ -4063,20 +4221,23 @@ private:
         return socket;
     }
 
-    /// Create the externally listening public socket
-    std::shared_ptr<ServerSocket> findServerPort(int port)
+    /// Create the factory for the sockets accepted on the public port.
+    static std::shared_ptr<SocketFactory> createSocketFactory()
     {
-        std::shared_ptr<SocketFactory> factory;
-
 #if ENABLE_SSL
         if (LOOLWSD::isSSLEnabled())
-            factory = std::make_shared<SslSocketFactory>();
-        else
+            return std::make_shared<SslSocketFactory>();
 #endif
-            factory = std::make_shared<PlainSocketFactory>();
+        return std::make_shared<PlainSocketFactory>();
+    }
+
+    /// Create the externally listening public socket
+    std::shared_ptr<ServerSocket> findServerPort(int port, bool reusePort)
+    {
+        std::shared_ptr<SocketFactory> factory = createSocketFactory();
 
         std::shared_ptr<ServerSocket> socket = ServerSocket::create(
-            ClientListenAddr, port, ClientPortProto, *LOOLWSD::WebServerPoll, factory);
+            ClientListenAddr, port, ClientPortProto, *LOOLWSD::WebServerPoll, factory, reusePort);
 
         while (!socket &&
 #ifdef BUILDING_TESTS
@@ -4089,7 +4250,7 @@ private:
             ++port;
             LOG_INF("Client port " << (port - 1) << " is busy, trying " << port << '.');
             socket = ServerSocket::create(ClientListenAddr, port, ClientPortProto,
-                                          *LOOLWSD::WebServerPoll, factory);
+                                          *LOOLWSD::WebServerPoll, factory, reusePort);
         }
 
         if (!socket)
@@ -4268,6 +4429,15 @@ int LOOLWSD::innerMain()
                   : SocketPoll::DefaultPollTimeoutMicroS * 4;
         mainWait.poll(waitMicroS);
 
+        // Don't keep the events of idle threads until they exit.
+        if (TraceEvent::isRecordingOn())
+            TraceEvent::flushRecordings();
+
+#if !MOBILEAPP
+        // Don't leave the idle connections to the storage in CLOSE_WAIT until reused.
+        StorageBase::expireConnections();
+#endif
+
         // Wake the prisoner poll to spawn some children, if necessary.
         PrisonerPoll->wakeup();
 
@@ -4376,11 +4546,9 @@ int LOOLWSD::innerMain()
 
     if (TraceEventFile != NULL)
     {
-        // If we have written any objects to it, it ends with a comma and newline. Back over those.
-        if (ftell(TraceEventFile) > 2)
-            fseek(TraceEventFile, -2, SEEK_CUR);
-        // Close the JSON array.
-        fprintf(TraceEventFile, "\n]\n");
+        // The binary recording is converted to JSON with looltraceconvert.
+        TraceEvent::flushRecordings();
+        std::unique_lock<std::mutex> lock(traceEventFileMutex);
         fclose(TraceEventFile);
         TraceEventFile = NULL;
     }
@@ -4443,6 +4611,7 @@ void LOOLWSD::cleanup()
 
         FileServerRequestHandler::uninitialize();
         JWTAuth::cleanup();
+        StorageBase::uninitialize();
 
 #if ENABLE_SSL
         // Finally, we no longer need SSL.
@@ -254,6 +254,8 @@ public:
     static FILE *TraceEventFile;
     static void writeTraceEventRecording(const char *data, std::size_t nbytes);
     static void writeTraceEventRecording(const std::string &recording);
+    /// Writes blocks of binary events, as recorded by TraceEvent.
+    static void writeTraceEventBlocks(const char *data, std::size_t nbytes);
     static std::string LogLevel;
     static std::string MostVerboseLogLevelSettableFromClient;
     static std::string LeastVerboseLogLevelSettableFromClient;
@@ -300,6 +300,16 @@ int ProxyProtocolHandler::getPollEvents(std::chrono::steady_clock::time_point /*
     return events;
 }
 
+void ProxyProtocolHandler::pollEventsChanged()
+{
+    for (const auto& it : _outSockets)
+    {
+        const std::shared_ptr<StreamSocket> socket = it.lock();
+        if (socket)
+            socket->pollEventsChanged();
+    }
+}
+
 /// slurp from the core to us, @returns true if there are messages to send
 bool ProxyProtocolHandler::slurpHasMessages(std::size_t capacity)
 {
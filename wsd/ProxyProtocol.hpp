@@ -42,6 +42,8 @@ public:
 
     void performWrites(std::size_t capacity) override;
 
+    void pollEventsChanged() override;
+
     void onDisconnect() override
     {
         // connections & sockets come and go a lot.
@@ -13,6 +13,7 @@
 
 #include <Poco/URI.h>
 #include "Exceptions.hpp"
+#include <net/HttpParser.hpp>
 
 namespace
 {
@@ -93,6 +94,36 @@ RequestDetails::RequestDetails(Poco::Net::HTTPRequest &request, const std::strin
     processURI();
 }
 
+RequestDetails::RequestDetails(const http::RequestParser& header, const char* data,
+                               const std::string& serviceRoot)
+    : _isMobile(false)
+{
+    // Check and remove the ServiceRoot from the url.
+    const http::Span& url = header.url();
+    if (url._length < serviceRoot.size()
+        || serviceRoot.compare(0, serviceRoot.size(), url.data(data), serviceRoot.size()) != 0)
+        throw BadRequestException("The request does not start with prefix: " + serviceRoot);
+
+    _uriString.assign(url.data(data) + serviceRoot.size(), url._length - serviceRoot.size());
+    dehexify();
+    const std::string method = header.verb().toString(data);
+    _isGet = method == "GET";
+    _isHead = method == "HEAD";
+    http::Span value;
+    _isProxy = header.find(data, "ProxyPrefix", value);
+    if (_isProxy)
+        _proxyPrefix = value.toString(data);
+    _isWebSocket = header.find(data, "Upgrade", value) && value.iequal(data, "websocket");
+#if !MOBILEAPP
+    // As request.getHost, which fails without one.
+    if (!header.find(data, "Host", value))
+        throw BadRequestException("The request has no Host");
+    _hostUntrusted = value.toString(data);
+#endif
+
+    processURI();
+}
+
 RequestDetails::RequestDetails(const std::string &mobileURI)
     : _isGet(true)
     , _isHead(false)
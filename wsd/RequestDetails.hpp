@@ -14,6 +14,11 @@
 #include <common/Util.hpp>
 #include <common/Log.hpp>
 
+namespace http
+{
+class RequestParser;
+}
+
 /**
  * A class to encapsulate various useful pieces from the request.
  * as well as path parsing goodness.
@@ -129,6 +134,9 @@ private:
 public:
 
     RequestDetails(Poco::Net::HTTPRequest &request, const std::string& serviceRoot);
+    /// From the @header parsed in @data, without building a Poco request.
+    RequestDetails(const http::RequestParser& header, const char* data,
+                   const std::string& serviceRoot);
     RequestDetails(const std::string &mobileURI);
 
     // matches the WOPISrc if used. For load balancing
@@ -7,11 +7,14 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
+#include <iterator>
+#include <limits>
 #include <memory>
-#include <mutex>
-#include <thread>
-#include <vector>
+#include <string>
+#include <unordered_map>
 
 #include <Poco/Dynamic/Var.h>
 #include <Poco/JSON/JSON.h>
@@ -22,27 +25,126 @@
 #include "Log.hpp"
 #include "TileDesc.hpp"
 
+/// Hashes the properties TileDesc::operator== compares.
+struct TileDescSenderHasher final
+{
+    inline size_t operator()(const TileDesc& t) const
+    {
+        size_t hash = t.getPart();
+
+        hash = (hash << 5) + hash + t.getWidth();
+        hash = (hash << 5) + hash + t.getHeight();
+        hash = (hash << 5) + hash + t.getTilePosX();
+        hash = (hash << 5) + hash + t.getTilePosY();
+        hash = (hash << 5) + hash + t.getTileWidth();
+        hash = (hash << 5) + hash + t.getTileHeight();
+        hash = (hash << 5) + hash + t.getNormalizedViewId();
+
+        return hash;
+    }
+};
+
 /// A queue of data to send to certain Session's WS.
+///
+/// Lock-free for a single producer (enqueue) and a single consumer (dequeue),
+/// which may be different threads. Items live in fixed-size ring segments that
+/// are chained when full, so nothing is ever dropped for lack of space.
+///
+/// Superseded items are not erased but marked dropped in place, and the
+/// consumer skips them. The producer keeps an index from the deduplication key
+/// (the tile, or the command) to the sequence number of its latest item, so
+/// finding what a new item supersedes needs no scan nor re-parsing of the queue.
 template <typename Item>
 class SenderQueue final
 {
+    static constexpr size_t SegmentSize = 256;
+    static constexpr uint64_t NoSeq = std::numeric_limits<uint64_t>::max();
+
+    enum SlotState : uint8_t
+    {
+        Live,
+        Dropped,
+        Consumed
+    };
+
+    struct Slot
+    {
+        Item _item;
+        std::atomic<uint8_t> _state;
+        /// The previous item with the same key, which a full tile drops along
+        /// with this one (i.e. the base of a delta). Only used by the producer.
+        uint64_t _prev;
+    };
+
+    struct Segment
+    {
+        explicit Segment(uint64_t base)
+            : _base(base)
+            , _next(nullptr)
+        {
+        }
+
+        uint64_t _base;
+        std::atomic<Segment*> _next;
+        Slot _slots[SegmentSize];
+    };
+
 public:
 
     SenderQueue()
+        : _head(0)
+        , _tail(0)
+        , _size(0)
+        , _dropped(0)
+        , _readSegment(nullptr)
+        , _firstSeq(0)
     {
+        _segments.emplace_back(new Segment(0));
+        _readSegment = _segments.front().get();
     }
 
-    size_t enqueue(const Item& item)
+    SenderQueue(const SenderQueue&) = delete;
+    SenderQueue& operator=(const SenderQueue&) = delete;
+
+    /// Enqueue an item, dropping any queued item it supersedes.
+    /// @tile is the item's tile, if the caller has parsed it already.
+    /// Returns the number of items queued. Must only be called by the producer.
+    size_t enqueue(const Item& item, const TileDesc* tile = nullptr)
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        if (SigUtil::getTerminationFlag())
+            return _size;
+
+        const uint64_t head = _head.load(std::memory_order_acquire);
+        const uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (head == tail)
+        {
+            // Everything has been sent, nothing left to supersede.
+            _tileIndex.clear();
+            _commandIndex.clear();
+        }
+        else if (_tileIndex.size() > 2 * (_size + SegmentSize))
+            pruneIndex(head);
 
-        if (!SigUtil::getTerminationFlag() && deduplicate(item))
-            _queue.push_back(item);
+        reclaimSegments(head);
 
-        return _queue.size();
+        uint64_t prev = NoSeq;
+        uint64_t* indexed = deduplicate(item, tile, head, prev);
+
+        Slot& slot = claimSlot(tail);
+        slot._item = item;
+        slot._state.store(Live, std::memory_order_relaxed);
+        slot._prev = prev;
+        if (indexed)
+            *indexed = tail;
+
+        _size.fetch_add(1, std::memory_order_relaxed);
+        _tail.store(tail + 1, std::memory_order_release);
+
+        return _size;
     }
 
     /// Dequeue an item if we have one - @returns true if we do, else false.
+    /// Must only be called by the consumer.
     bool dequeue(Item& item)
     {
         // This check is always thread-safe.
@@ -52,13 +154,28 @@ public:
             return false;
         }
 
-        std::unique_lock<std::mutex> lock(_mutex);
-
-        if (!_queue.empty())
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        const uint64_t tail = _tail.load(std::memory_order_acquire);
+        while (head < tail)
         {
-            item = _queue.front();
-            _queue.pop_front();
-            return true;
+            if (head - _readSegment->_base == SegmentSize)
+                _readSegment = _readSegment->_next.load(std::memory_order_acquire);
+
+            Slot& slot = _readSegment->_slots[head - _readSegment->_base];
+            const uint8_t state = slot._state.exchange(Consumed, std::memory_order_acq_rel);
+            ++head;
+            if (state == Live)
+            {
+                item = std::move(slot._item);
+                slot._item = Item();
+                _size.fetch_sub(1, std::memory_order_relaxed);
+                _head.store(head, std::memory_order_release);
+                return true;
+            }
+
+            // Superseded while queued.
+            slot._item = Item();
+            _head.store(head, std::memory_order_release);
         }
 
         return false;
@@ -66,59 +183,72 @@ public:
 
     size_t size() const
     {
-        std::lock_guard<std::mutex> lock(_mutex);
-        return _queue.size();
+        return _size.load(std::memory_order_relaxed);
     }
 
     void dumpState(std::ostream& os)
     {
-        os << "\n\t\tqueue size " << _queue.size() << '\n';
-        std::lock_guard<std::mutex> lock(_mutex);
-        for (const Item &item : _queue)
+        // The items themselves belong to either side, so only the counters are safe here.
+        os << "\n\t\tqueue size " << size() << '\n';
+        os << "\t\tdeduplicated " << _dropped.load(std::memory_order_relaxed) << '\n';
+    }
+
+private:
+    /// Marks the item at @seq, and whatever it superseded, dropped.
+    void drop(uint64_t seq, uint64_t head)
+    {
+        while (seq != NoSeq && seq >= head && seq >= _firstSeq)
         {
-            os << "\t\t\ttype: " << (item->isBinary() ? "binary\n" : "text\n");
-            os << "\t\t\t" << item->abbr() << '\n';
+            Slot& slot = slotAt(seq);
+            uint8_t expected = Live;
+            if (slot._state.compare_exchange_strong(expected, Dropped, std::memory_order_acq_rel))
+            {
+                _size.fetch_sub(1, std::memory_order_relaxed);
+                ++_dropped;
+            }
+
+            seq = slot._prev;
         }
     }
 
-private:
     /// Deduplicate messages based on the new one.
-    /// Returns true if the new message should be
-    /// enqueued, otherwise false.
-    bool deduplicate(const Item& item)
+    /// Drops the queued items the new one supersedes, and returns the index
+    /// entry to point at the new item, if any. @prev is set to the queued item
+    /// the new one builds on, which must be dropped along with it.
+    uint64_t* deduplicate(const Item& item, const TileDesc* tile, uint64_t head, uint64_t& prev)
     {
         // Deduplicate messages based on the incoming one.
-        const std::string command = item->firstToken();
-        if (command == "tile:")
+        const StringVector& tokens = item->tokens();
+        if (tokens.equals(0, "tile:"))
         {
-            // Remove previous identical tile, if any, and use most recent (incoming).
-            const TileDesc newTile = TileDesc::parse(item->firstLine());
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&newTile](const queue_item_t& cur)
-                {
-                    return cur->firstTokenMatches("tile:") &&
-                           newTile == TileDesc::parse(cur->firstLine());
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            const TileDesc newTile = tile ? *tile : TileDesc::parse(item->firstLine());
+            uint64_t& seq = _tileIndex.emplace(newTile, NoSeq).first->second;
+
+            // A delta is applied on top of the tile queued before it, so keep that.
+            const size_t offset = item->firstLine().size() + 1;
+            if (newTile.getOldWireId() != 0 && offset < item->data().size()
+                && item->data()[offset] == 'D')
+            {
+                prev = seq;
+                return &seq;
+            }
+
+            // Remove previous identical tiles, and any deltas
+            // on top of them, and use most recent (incoming).
+            drop(seq, head);
+            return &seq;
         }
-        else if (command == "statusindicatorsetvalue:" ||
-                 command == "invalidatecursor:" ||
-                 command == "setpart:")
+        else if (tokens.equals(0, "statusindicatorsetvalue:") ||
+                 tokens.equals(0, "invalidatecursor:") ||
+                 tokens.equals(0, "setpart:"))
         {
             // Remove previous identical entries of this command,
             // if any, and use most recent (incoming).
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [&command](const queue_item_t& cur)
-                {
-                    return cur->firstTokenMatches(command);
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+            uint64_t& seq = _commandIndex.emplace(tokens[0], NoSeq).first->second;
+            drop(seq, head);
+            return &seq;
         }
-        else if (command == "invalidateviewcursor:")
+        else if (tokens.equals(0, "invalidateviewcursor:"))
         {
             // Remove previous cursor invalidation for same view,
             // if any, and use most recent (incoming).
@@ -127,32 +257,84 @@ private:
             const Poco::Dynamic::Var newResult = newParser.parse(newMsg);
             const auto& newJson = newResult.extract<Poco::JSON::Object::Ptr>();
             const std::string viewId = newJson->get("viewId").toString();
-            const auto& pos = std::find_if(_queue.begin(), _queue.end(),
-                [command, viewId](const queue_item_t& cur)
-                {
-                    if (cur->firstTokenMatches(command))
-                    {
-                        const std::string msg = cur->jsonString();
-                        Poco::JSON::Parser parser;
-                        const Poco::Dynamic::Var result = parser.parse(msg);
-                        const auto& json = result.extract<Poco::JSON::Object::Ptr>();
-                        return viewId == json->get("viewId").toString();
-                    }
-
-                    return false;
-                });
-
-            if (pos != _queue.end())
-                _queue.erase(pos);
+
+            uint64_t& seq = _commandIndex.emplace(tokens[0] + viewId, NoSeq).first->second;
+            drop(seq, head);
+            return &seq;
         }
 
-        return true;
+        return nullptr;
+    }
+
+    /// Forgets the items that have been sent already.
+    void pruneIndex(uint64_t head)
+    {
+        for (auto it = _tileIndex.begin(); it != _tileIndex.end(); )
+            it = (it->second < head ? _tileIndex.erase(it) : std::next(it));
+    }
+
+    Slot& slotAt(uint64_t seq)
+    {
+        Segment& segment = *_segments[(seq - _firstSeq) / SegmentSize];
+        return segment._slots[seq - segment._base];
+    }
+
+    /// The slot for the next item, chaining a new segment if the last is full.
+    Slot& claimSlot(uint64_t tail)
+    {
+        Segment* last = _segments.back().get();
+        if (tail - last->_base == SegmentSize)
+        {
+            std::unique_ptr<Segment> segment;
+            if (_spare)
+            {
+                segment = std::move(_spare);
+                segment->_base = tail;
+                segment->_next.store(nullptr, std::memory_order_relaxed);
+            }
+            else
+                segment.reset(new Segment(tail));
+
+            last->_next.store(segment.get(), std::memory_order_release);
+            _segments.push_back(std::move(segment));
+            last = _segments.back().get();
+        }
+
+        return last->_slots[tail - last->_base];
+    }
+
+    /// Frees the segments the consumer has moved past.
+    void reclaimSegments(uint64_t head)
+    {
+        // The consumer only leaves a segment when reading from the next one.
+        while (_segments.size() > 1 && head > _firstSeq + SegmentSize)
+        {
+            _spare = std::move(_segments.front());
+            _segments.pop_front();
+            _firstSeq += SegmentSize;
+        }
     }
 
 private:
-    mutable std::mutex _mutex;
-    std::deque<Item> _queue;
-    typedef typename std::deque<Item>::value_type queue_item_t;
+    /// The next sequence number to consume, written by the consumer.
+    std::atomic<uint64_t> _head;
+    /// The next sequence number to produce, written by the producer.
+    std::atomic<uint64_t> _tail;
+    std::atomic<size_t> _size;
+    std::atomic<size_t> _dropped;
+
+    /// Consumer only.
+    Segment* _readSegment;
+
+    /// Producer only.
+    std::deque<std::unique_ptr<Segment>> _segments;
+    std::unique_ptr<Segment> _spare;
+    uint64_t _firstSeq;
+    std::unordered_map<TileDesc, uint64_t, TileDescSenderHasher> _tileIndex;
+    std::unordered_map<std::string, uint64_t> _commandIndex;
 };
 
+template <typename Item> constexpr size_t SenderQueue<Item>::SegmentSize;
+template <typename Item> constexpr uint64_t SenderQueue<Item>::NoSeq;
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
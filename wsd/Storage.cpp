@@ -28,10 +28,8 @@
 #include <Poco/Net/AcceptCertificateHandler.h>
 #include <Poco/Net/Context.h>
 #include <Poco/Net/DNS.h>
-#include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
-#include <Poco/Net/HTTPSClientSession.h>
 #include <Poco/Net/KeyConsoleHandler.h>
 #include <Poco/Net/NameValueCollection.h>
 #include <Poco/Net/SSLManager.h>
@@ -68,6 +66,8 @@ Util::RegexListMatcher StorageBase::WopiHosts;
 
 #if !MOBILEAPP
 
+http::SessionPool StorageBase::WopiSessionPool;
+
 std::string StorageBase::getLocalRootPath() const
 {
     std::string localPath = _jailPath;
@@ -119,6 +119,17 @@ void StorageBase::initialize()
                 break;
             }
         }
+
+        // Keep the connections to the WOPI hosts alive, rather than
+        // connecting anew for every CheckFileInfo, GetFile, PutFile and lock.
+        const bool poolEnabled
+            = app.config().getBool("storage.wopi.connection_pool[@enable]", true);
+        const int maxPerHost
+            = app.config().getInt("storage.wopi.connection_pool.max_per_host", 8);
+        const int idleTimeoutSecs
+            = app.config().getInt("storage.wopi.connection_pool.idle_timeout_secs", 30);
+        WopiSessionPool.configure(poolEnabled ? std::max(maxPerHost, 0) : 0,
+                                  std::chrono::seconds(idleTimeoutSecs));
     }
 
 #if ENABLE_SSL
@@ -179,13 +190,41 @@ void StorageBase::initialize()
     if (!ssl::Manager::isClientContextInitialized())
         LOG_ERR("Failed to initialize Client SSL.");
     else
+    {
         LOG_INF("Initialized Client SSL.");
+
+        // Resume the sessions with the WOPI hosts when reconnecting.
+        if (LOOLWSD::getConfigValue<bool>("storage.ssl.session_reuse", true))
+            ssl::Manager::enableClientSessionResumption();
+
+        // The kernel encrypts the uploads, sent from the file with sendfile.
+        if (LOOLWSD::getConfigValue<bool>("storage.ssl.ktls", false))
+            ssl::Manager::setClientKernelTls(true);
+    }
 #endif
 #else
     FilesystemEnabled = true;
 #endif
 }
 
+#if !MOBILEAPP
+void StorageBase::uninitialize()
+{
+    // Close the idle connections while we can still shut down TLS.
+    WopiSessionPool.clear();
+}
+
+void StorageBase::expireConnections()
+{
+    WopiSessionPool.expire();
+}
+
+void StorageBase::getMetrics(std::ostream& os)
+{
+    WopiSessionPool.getMetrics(os, "wopi_connections");
+}
+#endif
+
 bool StorageBase::allowedWopiHost(const std::string& host)
 {
     return WopiEnabled && WopiHosts.match(host);
@@ -439,37 +478,6 @@ StorageBase::UploadResult LocalStorage::uploadLocalFileToStorage(
 
 #if !MOBILEAPP
 
-Poco::Net::HTTPClientSession* StorageBase::getHTTPClientSession(const Poco::URI& uri)
-{
-    bool useSSL = false;
-    if (SSLAsScheme)
-    {
-        // the WOPI URI itself should control whether we use SSL or not
-        // for whether we verify vs. certificates, cf. above
-        useSSL = uri.getScheme() != "http";
-    }
-    else
-    {
-        // We decoupled the Wopi communication from client communication because
-        // the Wopi communication must have an independent policy.
-        // So, we will use here only Storage settings.
-        useSSL = SSLEnabled || LOOLWSD::isSSLTermination();
-    }
-    // We decoupled the Wopi communication from client communication because
-    // the Wopi communication must have an independent policy.
-    // So, we will use here only Storage settings.
-    Poco::Net::HTTPClientSession* session = useSSL
-        ? new Poco::Net::HTTPSClientSession(uri.getHost(), uri.getPort(),
-                                            Poco::Net::SSLManager::instance().defaultClientContext())
-        : new Poco::Net::HTTPClientSession(uri.getHost(), uri.getPort());
-
-    // Set the timeout to the configured value.
-    static int timeoutSec = LOOLWSD::getConfigValue<int>("net.connection_timeout_secs", 30);
-    session->setTimeout(Poco::Timespan(timeoutSec, 0));
-
-    return session;
-}
-
 std::shared_ptr<http::Session> StorageBase::getHttpSession(const Poco::URI& uri)
 {
     bool useSSL = false;
@@ -490,8 +498,12 @@ std::shared_ptr<http::Session> StorageBase::getHttpSession(const Poco::URI& uri)
     const auto protocol
         = useSSL ? http::Session::Protocol::HttpSsl : http::Session::Protocol::HttpUnencrypted;
 
-    // Create the session.
+#if !MOBILEAPP
+    // Reuse a connection kept alive, if any.
+    auto httpSession = WopiSessionPool.acquire(uri.getHost(), protocol, uri.getPort());
+#else
     auto httpSession = http::Session::create(uri.getHost(), protocol, uri.getPort());
+#endif
 
     static int timeoutSec = LOOLWSD::getConfigValue<int>("net.connection_timeout_secs", 30);
     httpSession->setTimeout(std::chrono::seconds(timeoutSec));
@@ -562,6 +574,15 @@ std::map<std::string, std::string> GetQueryParams(const Poco::URI& uri)
     return result;
 }
 
+/// True if the WOPI host redirects the request elsewhere.
+bool isRedirection(unsigned statusCode)
+{
+    return statusCode == Poco::Net::HTTPResponse::HTTP_FOUND
+           || statusCode == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY
+           || statusCode == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT
+           || statusCode == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT;
+}
+
 } // anonymous namespace
 
 #endif // !MOBILEAPP
@@ -663,17 +684,7 @@ std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfoForUri(Po
 
         const auto startTime = std::chrono::steady_clock::now();
 
-        Log::StreamLogger logger = Log::trace();
-        if (logger.enabled())
-        {
-            logger << "WOPI::CheckFileInfo request header for URI [" << uriAnonym << "]:\n";
-            for (const auto& pair : httpRequest.header())
-            {
-                logger << '\t' << pair.first << ": " << pair.second << " / ";
-            }
-
-            LOG_END(logger, true);
-        }
+        logWOPIFileInfoRequest(uriAnonym, httpRequest);
 
         const std::shared_ptr<const http::Response> httpResponse
             = httpSession->syncRequest(httpRequest);
@@ -681,10 +692,7 @@ std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfoForUri(Po
         callDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::steady_clock::now() - startTime);
 
-        if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FOUND ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT)
+        if (isRedirection(httpResponse->statusLine().statusCode()))
         {
             if (redirectLimit)
             {
@@ -701,48 +709,178 @@ std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfoForUri(Po
             }
         }
 
-        // Note: we don't log the response if obfuscation is enabled, except for failures.
-        wopiResponse = httpResponse->getBody();
-        const bool failed
-            = (httpResponse->statusLine().statusCode() != Poco::Net::HTTPResponse::HTTP_OK);
+        wopiResponse = checkWOPIFileInfoResponse(uriAnonym, *httpResponse);
+    }
+    catch (const Poco::Exception& pexc)
+    {
+        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym << "]. Error: " <<
+                pexc.displayText() << (pexc.nested() ? " (" + pexc.nested()->displayText() + ')' : ""));
+        throw;
+    }
+    catch (const BadRequestException& exc)
+    {
+        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym << "]. Error: " << exc.what());
+    }
 
-        Log::StreamLogger logRes = failed ? Log::error() : Log::trace();
-        if (logRes.enabled())
-        {
-            logRes << "WOPI::CheckFileInfo " << (failed ? "failed" : "returned") << " for URI ["
-                   << uriAnonym << "]: " << httpResponse->statusLine().statusCode() << ' '
-                   << httpResponse->statusLine().reasonPhrase() << ". Headers: ";
-            for (const auto& pair : httpResponse->header())
+    return parseWOPIFileInfo(uriAnonym, wopiResponse, callDurationMs, lockCtx);
+}
+
+std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfo(const Authorization& auth,
+                                                                        const std::string& cookies,
+                                                                        LockContext& lockCtx)
+{
+    Poco::URI uriObject(getUri());
+    return getWOPIFileInfoForUri(uriObject, auth, cookies, lockCtx, RedirectionLimit);
+}
+
+void WopiStorage::getWOPIFileInfoAsync(const Authorization& auth, const std::string& cookies,
+                                       LockContext& lockCtx, SocketPoll& socketPoll,
+                                       const AsyncFileInfoCallback& asyncFileInfoCallback)
+{
+    getWOPIFileInfoForUriAsync(getUri(), auth, cookies, lockCtx, RedirectionLimit, socketPoll,
+                               asyncFileInfoCallback);
+}
+
+void WopiStorage::getWOPIFileInfoForUriAsync(Poco::URI uriObject, const Authorization& auth,
+                                             const std::string& cookies, LockContext& lockCtx,
+                                             unsigned redirectLimit, SocketPoll& socketPoll,
+                                             const AsyncFileInfoCallback& asyncFileInfoCallback)
+{
+    // update the access_token to the one matching to the session
+    auth.authorizeURI(uriObject);
+    const std::string uriAnonym = LOOLWSD::anonymizeUrl(uriObject.toString());
+
+    LOG_DBG("Getting info for wopi uri [" << uriAnonym << "] asynchronously.");
+
+    try
+    {
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
+        http::Request httpRequest = initHttpRequest(uriObject, auth, cookies);
+
+        logWOPIFileInfoRequest(uriAnonym, httpRequest);
+
+        const auto startTime = std::chrono::steady_clock::now();
+        LockContext* const lockCtxPtr = &lockCtx;
+        SocketPoll* const socketPollPtr = &socketPoll;
+
+        httpSession->setFinishedHandler(
+            [=](const std::shared_ptr<http::Session>& finishedSession)
             {
-                logRes << '\t' << pair.first << ": " << pair.second << " / ";
-            }
+                const std::chrono::milliseconds callDurationMs
+                    = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - startTime);
 
-            if (failed)
-                logRes << "\tBody: [" << wopiResponse << "]";
+                const std::shared_ptr<const http::Response> httpResponse
+                    = finishedSession->response();
 
-            LOG_END(logRes, true);
-        }
+                std::unique_ptr<WOPIFileInfo> wopiInfo;
+                try
+                {
+                    if (isRedirection(httpResponse->statusLine().statusCode()))
+                    {
+                        if (redirectLimit)
+                        {
+                            const std::string& location = httpResponse->get("Location");
+                            LOG_TRC("WOPI::CheckFileInfo redirect to URI ["
+                                    << LOOLWSD::anonymizeUrl(location) << "]");
+
+                            Poco::URI redirectUriObject(location);
+                            setUri(redirectUriObject);
+                            getWOPIFileInfoForUriAsync(redirectUriObject, auth, cookies,
+                                                       *lockCtxPtr, redirectLimit - 1,
+                                                       *socketPollPtr, asyncFileInfoCallback);
+                            return;
+                        }
+
+                        LOG_WRN("WOPI::CheckFileInfo redirected too many times - URI ["
+                                << uriAnonym << "]");
+                    }
 
-        if (failed)
-        {
-            if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FORBIDDEN)
-                throw UnauthorizedRequestException(
-                    "Access denied, 403. WOPI::CheckFileInfo failed on: " + uriAnonym);
+                    wopiInfo = parseWOPIFileInfo(
+                        uriAnonym, checkWOPIFileInfoResponse(uriAnonym, *httpResponse),
+                        callDurationMs, *lockCtxPtr);
+                }
+                catch (const std::exception& exc)
+                {
+                    LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym
+                                                                           << "]. Error: "
+                                                                           << exc.what());
+                    asyncFileInfoCallback(nullptr, std::current_exception());
+                    return;
+                }
 
-            throw StorageConnectionException("WOPI::CheckFileInfo failed: " + wopiResponse);
+                asyncFileInfoCallback(std::move(wopiInfo), nullptr);
+            });
+
+        if (!httpSession->asyncRequest(httpRequest, socketPoll))
+            throw StorageConnectionException("WOPI::CheckFileInfo failed to connect to: "
+                                             + uriAnonym);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym
+                                                               << "]. Error: " << exc.what());
+        asyncFileInfoCallback(nullptr, std::current_exception());
+    }
+}
+
+void WopiStorage::logWOPIFileInfoRequest(const std::string& uriAnonym,
+                                         const http::Request& httpRequest)
+{
+    Log::StreamLogger logger = Log::trace();
+    if (logger.enabled())
+    {
+        logger << "WOPI::CheckFileInfo request header for URI [" << uriAnonym << "]:\n";
+        for (const auto& pair : httpRequest.header())
+        {
+            logger << '\t' << pair.first << ": " << pair.second << " / ";
         }
+
+        LOG_END(logger, true);
     }
-    catch (const Poco::Exception& pexc)
+}
+
+std::string WopiStorage::checkWOPIFileInfoResponse(const std::string& uriAnonym,
+                                                   const http::Response& httpResponse) const
+{
+    // Note: we don't log the response if obfuscation is enabled, except for failures.
+    const std::string wopiResponse = httpResponse.getBody();
+    const bool failed
+        = (httpResponse.statusLine().statusCode() != Poco::Net::HTTPResponse::HTTP_OK);
+
+    Log::StreamLogger logRes = failed ? Log::error() : Log::trace();
+    if (logRes.enabled())
     {
-        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym << "]. Error: " <<
-                pexc.displayText() << (pexc.nested() ? " (" + pexc.nested()->displayText() + ')' : ""));
-        throw;
+        logRes << "WOPI::CheckFileInfo " << (failed ? "failed" : "returned") << " for URI ["
+               << uriAnonym << "]: " << httpResponse.statusLine().statusCode() << ' '
+               << httpResponse.statusLine().reasonPhrase() << ". Headers: ";
+        for (const auto& pair : httpResponse.header())
+        {
+            logRes << '\t' << pair.first << ": " << pair.second << " / ";
+        }
+
+        if (failed)
+            logRes << "\tBody: [" << wopiResponse << "]";
+
+        LOG_END(logRes, true);
     }
-    catch (const BadRequestException& exc)
+
+    if (failed)
     {
-        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym << "]. Error: " << exc.what());
+        if (httpResponse.statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FORBIDDEN)
+            throw UnauthorizedRequestException(
+                "Access denied, 403. WOPI::CheckFileInfo failed on: " + uriAnonym);
+
+        throw StorageConnectionException("WOPI::CheckFileInfo failed: " + wopiResponse);
     }
 
+    return wopiResponse;
+}
+
+std::unique_ptr<WopiStorage::WOPIFileInfo>
+WopiStorage::parseWOPIFileInfo(const std::string& uriAnonym, std::string wopiResponse,
+                               std::chrono::milliseconds callDurationMs, LockContext& lockCtx)
+{
     Poco::JSON::Object::Ptr object;
     if (JsonUtil::parseJSON(wopiResponse, object))
     {
@@ -789,14 +927,6 @@ std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfoForUri(Po
     }
 }
 
-std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfo(const Authorization& auth,
-                                                                        const std::string& cookies,
-                                                                        LockContext& lockCtx)
-{
-    Poco::URI uriObject(getUri());
-    return getWOPIFileInfoForUri(uriObject, auth, cookies, lockCtx, RedirectionLimit);
-}
-
 void WopiStorage::WOPIFileInfo::init()
 {
     _userCanWrite = false;
@@ -942,33 +1072,31 @@ bool WopiStorage::updateLockState(const Authorization& auth, const std::string&
 
     try
     {
-        std::unique_ptr<Poco::Net::HTTPClientSession> psession(getHTTPClientSession(uriObject));
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
 
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST,
-                                       uriObject.getPathAndQuery(),
-                                       Poco::Net::HTTPMessage::HTTP_1_1);
-        initHttpRequest(request, uriObject, auth, cookies);
+        http::Request httpRequest = initHttpRequest(uriObject, auth, cookies);
+        httpRequest.setVerb(http::Request::VERB_POST);
 
-        request.set("X-WOPI-Override", lock ? "LOCK" : "UNLOCK");
-        request.set("X-WOPI-Lock", lockCtx._lockToken);
+        http::Header& httpHeader = httpRequest.header();
+
+        httpHeader.set("X-WOPI-Override", lock ? "LOCK" : "UNLOCK");
+        httpHeader.set("X-WOPI-Lock", lockCtx._lockToken);
         if (!getExtendedData().empty())
-            request.set("X-LOOL-WOPI-ExtendedData", getExtendedData());
+            httpHeader.set("X-LOOL-WOPI-ExtendedData", getExtendedData());
 
         // IIS requires content-length for POST requests: see https://forums.iis.net/t/1119456.aspx
-        request.setContentLength(0);
+        httpHeader.setContentLength(0);
 
-        psession->sendRequest(request);
-        Poco::Net::HTTPResponse response;
-        std::istream& rs = psession->receiveResponse(response);
+        const std::shared_ptr<const http::Response> httpResponse
+            = httpSession->syncRequest(httpRequest);
 
-        std::ostringstream oss;
-        Poco::StreamCopier::copyStream(rs, oss);
-        std::string responseString = oss.str();
+        const std::string& responseString = httpResponse->getBody();
+        const unsigned statusCode = httpResponse->statusLine().statusCode();
 
-        LOG_INF(wopiLog << " response: " << responseString <<
-                " status " << response.getStatus());
+        LOG_INF(wopiLog << " response: " << responseString << " status " << statusCode);
 
-        if (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
+        if (httpResponse->state() == http::Response::State::Complete
+            && statusCode == Poco::Net::HTTPResponse::HTTP_OK)
         {
             lockCtx._isLocked = lock;
             lockCtx._lastLockTime = std::chrono::steady_clock::now();
@@ -976,13 +1104,13 @@ bool WopiStorage::updateLockState(const Authorization& auth, const std::string&
         }
         else
         {
-            std::string sMoreInfo = response.get("X-WOPI-LockFailureReason", "");
+            std::string sMoreInfo = httpResponse->get("X-WOPI-LockFailureReason", "");
             if (!sMoreInfo.empty())
             {
                 lockCtx._lockFailureReason = sMoreInfo;
                 sMoreInfo = ", failure reason: \"" + sMoreInfo + "\"";
             }
-            LOG_ERR("Un-successful " << wopiLog << " with status " << response.getStatus() <<
+            LOG_ERR("Un-successful " << wopiLog << " with status " << statusCode <<
                     sMoreInfo << " and response: " << responseString);
         }
     }
@@ -1043,15 +1171,8 @@ std::string WopiStorage::downloadStorageFileToLocal(const Authorization& auth,
     }
 
     // Try the default URL, we either don't have FileUrl, or it failed.
-    // WOPI URI to download files ends in '/contents'.
-    // Add it's here to get the payload instead of file info.
-    Poco::URI uriObject(getUri());
-    uriObject.setPath(uriObject.getPath() + "/contents");
-    auth.authorizeURI(uriObject);
-
-    Poco::URI uriObjectAnonym(getUri());
-    uriObjectAnonym.setPath(LOOLWSD::anonymizeUrl(uriObjectAnonym.getPath()) + "/contents");
-    const std::string uriAnonym = uriObjectAnonym.toString();
+    std::string uriAnonym;
+    const Poco::URI uriObject = getDefaultDownloadUri(auth, uriAnonym);
 
     try
     {
@@ -1074,6 +1195,114 @@ std::string WopiStorage::downloadStorageFileToLocal(const Authorization& auth,
     return std::string();
 }
 
+void WopiStorage::downloadStorageFileToLocalAsync(const Authorization& auth,
+                                                  const std::string& cookies,
+                                                  const std::string& templateUri,
+                                                  SocketPoll& socketPoll,
+                                                  const AsyncDownloadCallback& asyncDownloadCallback)
+{
+    if (!templateUri.empty())
+    {
+        // Download the template file and load it normally.
+        // The document will get saved once loading in Core is complete.
+        const std::string templateUriAnonym = LOOLWSD::anonymizeUrl(templateUri);
+        LOG_INF("WOPI::GetFile template source: " << templateUriAnonym);
+        downloadDocumentAsync(
+            Poco::URI(templateUri), templateUriAnonym, auth, cookies, RedirectionLimit,
+            socketPoll,
+            [=](const std::string& localPath, const std::exception_ptr& error)
+            {
+                if (error)
+                {
+                    LOG_ERR("Could not download template from [" << templateUriAnonym << "].");
+                    asyncDownloadCallback(std::string(), nullptr);
+                    return;
+                }
+
+                asyncDownloadCallback(localPath, nullptr);
+            });
+        return;
+    }
+
+    // First try the FileUrl, if provided.
+    if (!_fileUrl.empty())
+    {
+        const std::string fileUrlAnonym = LOOLWSD::anonymizeUrl(_fileUrl);
+        LOG_INF("WOPI::GetFile using FileUrl: " << fileUrlAnonym);
+        SocketPoll* const socketPollPtr = &socketPoll;
+        downloadDocumentAsync(
+            Poco::URI(_fileUrl), fileUrlAnonym, auth, cookies, RedirectionLimit, socketPoll,
+            [=](const std::string& localPath, const std::exception_ptr& error)
+            {
+                if (error)
+                {
+                    LOG_ERR("Could not download document from WOPI FileUrl ["
+                            << fileUrlAnonym << "]. Will use default URL.");
+                    downloadDefaultUriAsync(auth, cookies, *socketPollPtr, asyncDownloadCallback);
+                    return;
+                }
+
+                asyncDownloadCallback(localPath, nullptr);
+            });
+        return;
+    }
+
+    downloadDefaultUriAsync(auth, cookies, socketPoll, asyncDownloadCallback);
+}
+
+void WopiStorage::downloadDefaultUriAsync(const Authorization& auth, const std::string& cookies,
+                                          SocketPoll& socketPoll,
+                                          const AsyncDownloadCallback& asyncDownloadCallback)
+{
+    std::string uriAnonym;
+    const Poco::URI uriObject = getDefaultDownloadUri(auth, uriAnonym);
+
+    LOG_INF("WOPI::GetFile using default URI: " << uriAnonym);
+    downloadDocumentAsync(
+        uriObject, uriAnonym, auth, cookies, RedirectionLimit, socketPoll,
+        [=](const std::string& localPath, const std::exception_ptr& error)
+        {
+            if (error)
+            {
+                // As downloadStorageFileToLocal, only Poco exceptions are propagated,
+                // other failures just leave the path empty.
+                try
+                {
+                    std::rethrow_exception(error);
+                }
+                catch (const Poco::Exception&)
+                {
+                    asyncDownloadCallback(std::string(), error);
+                    return;
+                }
+                catch (const std::exception&)
+                {
+                }
+
+                asyncDownloadCallback(std::string(), nullptr);
+                return;
+            }
+
+            asyncDownloadCallback(localPath, nullptr);
+        });
+}
+
+Poco::URI WopiStorage::getDefaultDownloadUri(const Authorization& auth,
+                                             std::string& uriAnonym) const
+{
+    // WOPI URI to download files ends in '/contents'.
+    // Add it's here to get the payload instead of file info.
+    Poco::URI uriObject(getUri());
+    uriObject.setPath(uriObject.getPath() + "/contents");
+    auth.authorizeURI(uriObject);
+
+    Poco::URI uriObjectAnonym(getUri());
+    uriObjectAnonym.setPath(LOOLWSD::anonymizeUrl(uriObjectAnonym.getPath()) + "/contents");
+    uriAnonym = uriObjectAnonym.toString();
+
+    return uriObject;
+}
+
 std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std::string& uriAnonym,
                                           const Authorization& auth, const std::string& cookies,
                                           unsigned redirectLimit)
@@ -1094,25 +1323,7 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
     const std::chrono::milliseconds diff = std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::steady_clock::now() - startTime);
 
-    if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_OK)
-    {
-        // Log the response header.
-        Log::StreamLogger logger = Log::trace();
-        if (logger.enabled())
-        {
-            logger << "WOPI::GetFile response header for URI [" << uriAnonym << "]:\n";
-            for (const auto& pair : httpResponse->header())
-            {
-                logger << '\t' << pair.first << ": " << pair.second << " / ";
-            }
-
-            LOG_END(logger, true);
-        }
-    }
-    else if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FOUND ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT)
+    if (isRedirection(httpResponse->statusLine().statusCode()))
     {
         if (redirectLimit)
         {
@@ -1128,11 +1339,108 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
                                          + "] failed: redirected too many times");
         }
     }
+
+    return handleDownloadResponse(uriAnonym, *httpResponse, diff);
+}
+
+void WopiStorage::downloadDocumentAsync(const Poco::URI& uriObject, const std::string& uriAnonym,
+                                        const Authorization& auth, const std::string& cookies,
+                                        unsigned redirectLimit, SocketPoll& socketPoll,
+                                        const AsyncDownloadCallback& asyncDownloadCallback)
+{
+    try
+    {
+        const auto startTime = std::chrono::steady_clock::now();
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
+
+        http::Request httpRequest = initHttpRequest(uriObject, auth, cookies);
+
+        setRootFilePath(Poco::Path(getLocalRootPath(), getFileInfo().getFilename()).toString());
+        setRootFilePathAnonym(LOOLWSD::anonymizeUrl(getRootFilePath()));
+
+        LOG_TRC("Downloading asynchronously from [" << uriAnonym << "] to [" << getRootFilePath()
+                                                    << "]: " << httpRequest.header().toString());
+
+        SocketPoll* const socketPollPtr = &socketPoll;
+        httpSession->setFinishedHandler(
+            [=](const std::shared_ptr<http::Session>& finishedSession)
+            {
+                const std::chrono::milliseconds diff
+                    = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - startTime);
+
+                const std::shared_ptr<const http::Response> httpResponse
+                    = finishedSession->response();
+
+                std::string localPath;
+                try
+                {
+                    if (isRedirection(httpResponse->statusLine().statusCode()))
+                    {
+                        if (!redirectLimit)
+                            throw StorageConnectionException(
+                                "WOPI::GetFile [" + uriAnonym
+                                + "] failed: redirected too many times");
+
+                        const std::string& location = httpResponse->get("Location");
+                        LOG_TRC("WOPI::GetFile redirect to URI ["
+                                << LOOLWSD::anonymizeUrl(location) << "]");
+
+                        downloadDocumentAsync(Poco::URI(location), uriAnonym, auth, cookies,
+                                              redirectLimit - 1, *socketPollPtr,
+                                              asyncDownloadCallback);
+                        return;
+                    }
+
+                    localPath = handleDownloadResponse(uriAnonym, *httpResponse, diff);
+                }
+                catch (const std::exception& exc)
+                {
+                    LOG_ERR("Cannot download document from WOPI storage uri ["
+                            << uriAnonym << "]. Error: " << exc.what());
+                    asyncDownloadCallback(std::string(), std::current_exception());
+                    return;
+                }
+
+                asyncDownloadCallback(localPath, nullptr);
+            });
+
+        if (!httpSession->asyncDownload(httpRequest, getRootFilePath(), socketPoll))
+            throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
+                                             + "] failed: cannot connect");
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERR("Cannot download document from WOPI storage uri [" << uriAnonym
+                                                                   << "]. Error: " << exc.what());
+        asyncDownloadCallback(std::string(), std::current_exception());
+    }
+}
+
+std::string WopiStorage::handleDownloadResponse(const std::string& uriAnonym,
+                                                const http::Response& httpResponse,
+                                                std::chrono::milliseconds callDurationMs)
+{
+    if (httpResponse.statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_OK)
+    {
+        // Log the response header.
+        Log::StreamLogger logger = Log::trace();
+        if (logger.enabled())
+        {
+            logger << "WOPI::GetFile response header for URI [" << uriAnonym << "]:\n";
+            for (const auto& pair : httpResponse.header())
+            {
+                logger << '\t' << pair.first << ": " << pair.second << " / ";
+            }
+
+            LOG_END(logger, true);
+        }
+    }
     else
     {
-        const std::string responseString = httpResponse->getBody();
+        const std::string responseString = httpResponse.getBody();
         LOG_ERR("WOPI::GetFile [" << uriAnonym << "] failed with Status Code: "
-                                  << httpResponse->statusLine().statusCode());
+                                  << httpResponse.statusLine().statusCode());
         throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
                                          + "] failed: " + responseString);
     }
@@ -1141,7 +1449,7 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
     const FileUtil::Stat fileStat(getRootFilePath());
     const std::size_t filesize = (fileStat.good() ? fileStat.size() : 0);
     LOG_INF("WOPI::GetFile downloaded " << filesize << " bytes from [" << uriAnonym << "] -> "
-                                        << getRootFilePathAnonym() << " in " << diff);
+                                        << getRootFilePathAnonym() << " in " << callDurationMs);
     setDownloaded(true);
 
     // Now return the jailed path.
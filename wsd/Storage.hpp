@@ -9,6 +9,7 @@
 
 #pragma once
 
+#include <exception>
 #include <set>
 #include <string>
 #include <chrono>
@@ -24,19 +25,11 @@
 #include "Util.hpp"
 #include <common/Authorization.hpp>
 #include <net/HttpRequest.hpp>
+#include <net/HttpSessionPool.hpp>
 
 /// Limits number of HTTP redirections to prevent from redirection loops
 static constexpr auto RedirectionLimit = 21;
 
-namespace Poco
-{
-namespace Net
-{
-class HTTPClientSession;
-}
-
-} // namespace Poco
-
 /// Represents whether the underlying file is locked
 /// and with what token.
 struct LockContext
@@ -329,6 +322,17 @@ public:
     /// Must be called at startup to configure.
     static void initialize();
 
+#if !MOBILEAPP
+    /// Must be called at shutdown, before uninitializing SSL.
+    static void uninitialize();
+
+    /// Closes the connections to the storage idle for too long, or closed by it.
+    static void expireConnections();
+
+    /// Writes the metrics of the connections to the storage.
+    static void getMetrics(std::ostream& os);
+#endif
+
     /// Storage object creation factory.
     /// @takeOwnership is for local files that are temporary,
     /// such as convert-to requests.
@@ -336,7 +340,6 @@ public:
                                                const std::string& jailPath, bool takeOwnership);
 
     static bool allowedWopiHost(const std::string& host);
-    static Poco::Net::HTTPClientSession* getHTTPClientSession(const Poco::URI& uri);
     static std::shared_ptr<http::Session> getHttpSession(const Poco::URI& uri);
 
 protected:
@@ -399,6 +402,10 @@ private:
     static bool SSLEnabled;
     /// Allowed/denied WOPI hosts, if any and if WOPI is enabled.
     static Util::RegexListMatcher WopiHosts;
+#if !MOBILEAPP
+    /// The connections to the WOPI hosts kept alive.
+    static http::SessionPool WopiSessionPool;
+#endif
 };
 
 /// Trivial implementation of local storage that does not need do anything.
@@ -603,6 +610,17 @@ public:
                                                   const std::string& cookies, LockContext& lockCtx,
                                                   unsigned redirectLimit);
 
+    /// The asynchronous CheckFileInfo completion callback function,
+    /// given the file info, or the exception the request failed with.
+    using AsyncFileInfoCallback
+        = std::function<void(std::unique_ptr<WOPIFileInfo>, const std::exception_ptr&)>;
+
+    /// As getWOPIFileInfo, without blocking: the request is made on @socketPoll,
+    /// and @asyncFileInfoCallback is invoked with the result in its thread.
+    void getWOPIFileInfoAsync(const Authorization& auth, const std::string& cookies,
+                              LockContext& lockCtx, SocketPoll& socketPoll,
+                              const AsyncFileInfoCallback& asyncFileInfoCallback);
+
     /// Update the locking state (check-in/out) of the associated file
     bool updateLockState(const Authorization& auth, const std::string& cookies,
                          LockContext& lockCtx, bool lock) override;
@@ -612,6 +630,17 @@ public:
                                            const std::string& /*cookies*/, LockContext& lockCtx,
                                            const std::string& templateUri) override;
 
+    /// The asynchronous GetFile completion callback function, given the jailed
+    /// path of the document, or the exception the download failed with.
+    using AsyncDownloadCallback
+        = std::function<void(const std::string& localPath, const std::exception_ptr&)>;
+
+    /// As downloadStorageFileToLocal, without blocking: the requests are made on
+    /// @socketPoll, and @asyncDownloadCallback is invoked with the result in its thread.
+    void downloadStorageFileToLocalAsync(const Authorization& auth, const std::string& cookies,
+                                         const std::string& templateUri, SocketPoll& socketPoll,
+                                         const AsyncDownloadCallback& asyncDownloadCallback);
+
     UploadResult uploadLocalFileToStorage(const Authorization& auth, const std::string& /*cookies*/,
                                           LockContext& lockCtx, const std::string& saveAsPath,
                                           const std::string& saveAsFilename,
@@ -666,6 +695,46 @@ private:
                                  const Authorization& auth, const std::string& cookies,
                                  unsigned redirectLimit);
 
+    /// Download the document from the given URI asynchronously, as downloadDocument.
+    void downloadDocumentAsync(const Poco::URI& uriObject, const std::string& uriAnonym,
+                               const Authorization& auth, const std::string& cookies,
+                               unsigned redirectLimit, SocketPoll& socketPoll,
+                               const AsyncDownloadCallback& asyncDownloadCallback);
+
+    /// Download the document from the default WOPI URI asynchronously.
+    void downloadDefaultUriAsync(const Authorization& auth, const std::string& cookies,
+                                 SocketPoll& socketPoll,
+                                 const AsyncDownloadCallback& asyncDownloadCallback);
+
+    /// The default WOPI URI to download the document from, and its anonymized version.
+    Poco::URI getDefaultDownloadUri(const Authorization& auth, std::string& uriAnonym) const;
+
+    /// Make the CheckFileInfo request for the given URI asynchronously, following redirects.
+    void getWOPIFileInfoForUriAsync(Poco::URI uriObject, const Authorization& auth,
+                                    const std::string& cookies, LockContext& lockCtx,
+                                    unsigned redirectLimit, SocketPoll& socketPoll,
+                                    const AsyncFileInfoCallback& asyncFileInfoCallback);
+
+    /// Logs the headers of the CheckFileInfo request, when tracing.
+    static void logWOPIFileInfoRequest(const std::string& uriAnonym,
+                                       const http::Request& httpRequest);
+
+    /// Logs the CheckFileInfo response and returns its body; throws if it failed.
+    std::string checkWOPIFileInfoResponse(const std::string& uriAnonym,
+                                          const http::Response& httpResponse) const;
+
+    /// Parses the body of the CheckFileInfo response, updating the file info and lock context.
+    std::unique_ptr<WOPIFileInfo> parseWOPIFileInfo(const std::string& uriAnonym,
+                                                    std::string wopiResponse,
+                                                    std::chrono::milliseconds callDurationMs,
+                                                    LockContext& lockCtx);
+
+    /// Handles the GetFile response, once saved to the root file path.
+    /// Returns the jailed path of the document; throws if the download failed.
+    std::string handleDownloadResponse(const std::string& uriAnonym,
+                                       const http::Response& httpResponse,
+                                       std::chrono::milliseconds callDurationMs);
+
 private:
     /// A URl provided by the WOPI host to use for GetFile.
     std::string _fileUrl;
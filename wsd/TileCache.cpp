@@ -9,9 +9,11 @@
 
 #include "TileCache.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
@@ -22,6 +24,7 @@
 #include <vector>
 
 #include "ClientSession.hpp"
+#include "TileStore.hpp"
 #include <Common.hpp>
 #include <Protocol.hpp>
 #include <Unit.hpp>
@@ -34,8 +37,10 @@ TileCache::TileCache(std::string docURL, const std::chrono::system_clock::time_p
                      bool dontCache)
     : _docURL(std::move(docURL))
     , _dontCache(dontCache)
+    , _tileDeltas(false)
     , _cacheSize(0)
     , _maxCacheSize(512 * 1024)
+    , _clockHand(_clock.end())
 {
 #ifndef BUILDING_TESTS
     LOG_INF("TileCache ctor for uri [" << LOOLWSD::anonymizeUrl(_docURL) <<
@@ -56,6 +61,9 @@ TileCache::~TileCache()
 void TileCache::clear()
 {
     _cache.clear();
+    _index.clear();
+    _clock.clear();
+    _clockHand = _clock.end();
     _cacheSize = 0;
     for (auto i : _streamCache)
         i.clear();
@@ -165,28 +173,130 @@ TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
     return ret;
 }
 
-void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
+bool TileCache::lookupTileUpdates(const TileDesc& tile, TileWireId knownWireId,
+                                  std::vector<TileUpdate>& updates)
+{
+    if (_dontCache)
+        return false;
+
+    TileData* tileData = findTileData(tile);
+    if (!tileData || !tileData->_valid)
+        return false;
+
+    tileData->_credit = tileData->_weight;
+
+    // Start after the one the client has, or else from the last full image.
+    size_t first = 0;
+    for (size_t i = tileData->_wids.size(); knownWireId != 0 && i-- > 0; )
+    {
+        if (tileData->_wids[i] == knownWireId)
+        {
+            first = i + 1;
+            break;
+        }
+    }
+
+    for (size_t i = first; i < tileData->_frames.size(); ++i)
+    {
+        updates.emplace_back(i == 0 ? 0 : tileData->_wids[i - 1], tileData->_wids[i],
+                             tileData->_frames[i]);
+    }
+
+    LOG_TRC("Found " << updates.size() << " updates for tile " << tile.serialize()
+                     << " known wid: " << knownWireId);
+    return true;
+}
+
+bool TileCache::wantsKeyframe(const TileDesc& tile)
+{
+    // Past this, catching up a client costs more than sending it a fresh image.
+    constexpr size_t MaxDeltas = 8;
+
+    const TileData* tileData = findTileData(tile);
+    if (!tileData)
+        return false;
+
+    const size_t keyframeSize = tileData->_frames.front()->size();
+    return tileData->_frames.size() > MaxDeltas
+           || tileData->size() - keyframeSize >= keyframeSize;
+}
+
+std::vector<std::shared_ptr<ClientSession>>
+TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size)
 {
     assertCorrectThread();
 
+    std::vector<std::shared_ptr<ClientSession>> unserved;
+    // Only the Kit makes deltas, when we give it the oldWireId to base them on.
+    const bool isDelta = size > 0 && tile.getOldWireId() != 0 && data[0] == 'D';
+
+    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
+    const std::chrono::milliseconds renderTime
+        = tileBeingRendered ? tileBeingRendered->getElapsedTimeMs() : std::chrono::milliseconds(0);
     if (size > 0)
     {
         // Save to in-memory cache.
 
         // Ignore if we can't save the tile, things will work anyway, but slower.
         // An error indication is supposed to be sent to all users in that case.
-        saveDataToCache(tile, data, size);
+        if (isDelta)
+            saveDeltaToCache(tile, data, size);
+        else
+            saveDataToCache(tile, data, size, renderTime);
         LOG_TRC("Saved cache tile: " << cacheFileName(tile) << " of size " << size << " bytes");
     }
     else
         LOG_TRC("Zero sized cache tile: " << cacheFileName(tile));
 
     // Notify subscribers, if any.
-    std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
     if (tileBeingRendered)
     {
         const size_t subscriberCount = tileBeingRendered->getSubscribers().size();
-        if (size > 0 && subscriberCount > 0)
+        if (isDelta && subscriberCount > 0)
+        {
+            // Only those who have the tile the delta is based on can apply it as-is,
+            // the others have to catch up from the cache or get a fresh render.
+            std::shared_ptr<Message> payload;
+            for (const auto& subscriber : tileBeingRendered->getSubscribers())
+            {
+                std::shared_ptr<ClientSession> session = subscriber.lock();
+                if (!session)
+                    continue;
+
+                const TileWireId knownWireId = session->getSentWireId(tile);
+                std::vector<TileUpdate> updates;
+                if (!session->getTileDeltas())
+                {
+                    unserved.push_back(session);
+                }
+                else if (knownWireId == tile.getOldWireId())
+                {
+                    if (!payload)
+                    {
+                        const std::string response = tile.serialize("tile:");
+                        payload = std::make_shared<Message>(response, Message::Dir::Out,
+                                                            response.size() + 1 + size);
+                        payload->append("\n", 1);
+                        payload->append(data, size);
+                    }
+
+                    session->enqueueSendMessage(payload);
+                }
+                else if (lookupTileUpdates(tile, knownWireId, updates))
+                {
+                    session->sendTileUpdates(tile, updates);
+                }
+                else
+                {
+                    LOG_DBG("Can't send delta from " << tile.getOldWireId() << " to "
+                                                     << session->getName() << " who has "
+                                                     << knownWireId << " for "
+                                                     << tile.debugName());
+                    unserved.push_back(session);
+                }
+            }
+        }
+        else if (size > 0 && subscriberCount > 0)
         {
             std::string response = tile.serialize("tile:");
             LOG_DBG("Sending tile message to " << subscriberCount << " subscribers: " << response);
@@ -242,6 +352,8 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
     }
     else
         LOG_DBG("No subscribers for: " << cacheFileName(tile));
+
+    return unserved;
 }
 
 bool TileCache::getTextStream(StreamType type, const std::string& fileName, std::string& content)
@@ -300,18 +412,28 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height, i
 
     assertCorrectThread();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
+    // Only look at the parts of this view we have to.
+    std::vector<TileDesc> tiles;
+    for (auto shard = _index.lower_bound(std::make_pair(normalizedViewId, part == -1 ? INT_MIN : part));
+         shard != _index.end() && shard->first.first == normalizedViewId
+             && (part == -1 || shard->first.second == part);
+         ++shard)
     {
-        if (intersectsTile(it->first, part, x, y, width, height, normalizedViewId))
-        {
-            LOG_TRC("Removing tile: " << it->first.serialize());
-            _cacheSize -= itemCacheSize(it->second);
-            it = _cache.erase(it);
-        }
-        else
+        shard->second.findIntersecting(x, y, width, height, tiles);
+    }
+
+    for (const TileDesc& tile : tiles)
+    {
+        if (_tileDeltas)
         {
-            ++it;
+            // Keep it as the base for the delta we'll get next.
+            LOG_TRC("Invalidating tile: " << tile.serialize());
+            findTileData(tile)->_valid = false;
+            continue;
         }
+
+        LOG_TRC("Removing tile: " << tile.serialize());
+        removeTile(tile);
     }
 }
 
@@ -527,37 +649,174 @@ void TileCache::assertCorrectThread()
 
 TileCache::Tile TileCache::findTile(const TileDesc &desc)
 {
-    const auto it = _cache.find(desc);
-    if (it != _cache.end() && it->first.getNormalizedViewId() == desc.getNormalizedViewId())
+    // Clients that don't take deltas can only be served a single, up to date image.
+    TileData* tileData = findTileData(desc);
+    if (tileData && tileData->_valid && tileData->_frames.size() == 1)
     {
-        LOG_TRC("Found cache tile: " << desc.serialize() << " of size " << it->second->size() << " bytes");
-        return it->second;
+        tileData->_credit = tileData->_weight;
+        LOG_TRC("Found cache tile: " << desc.serialize() << " of size "
+                                     << tileData->_frames[0]->size() << " bytes");
+        return tileData->_frames[0];
     }
 
     return TileCache::Tile();
 }
 
-void TileCache::saveDataToCache(const TileDesc &desc, const char *data, const size_t size)
+TileCache::TileData* TileCache::findTileData(const TileDesc &desc)
+{
+    const auto it = _cache.find(desc);
+    if (it != _cache.end() && it->first.getNormalizedViewId() == desc.getNormalizedViewId())
+        return &it->second;
+
+    return nullptr;
+}
+
+void TileCache::saveDataToCache(const TileDesc &desc, const char *data, const size_t size,
+                                const std::chrono::milliseconds renderTime)
 {
     if (_dontCache)
         return;
 
     ensureCacheSize();
 
-    TileCache::Tile tile = std::make_shared<std::vector<char>>(size);
-    std::memcpy(tile->data(), data, size);
-    auto res = _cache.emplace(desc, tile);
+    // Shared with any other document that has the same tile.
+    TileCache::Tile tile = TileStore::instance().intern(data, size);
+    const unsigned weight = evictionWeight(size, renderTime);
+    auto res = _cache.emplace(desc, TileData(desc.getWireId(), tile, weight));
+    TileData& tileData = res.first->second;
     if (!res.second)
     {
-        _cacheSize -= itemCacheSize(res.first->second);
-        _cache[desc] = tile;
+        _cacheSize -= itemCacheSize(tileData);
+        const std::list<TileDesc>::iterator clockPos = tileData._clockPos;
+        tileData = TileData(desc.getWireId(), tile, weight);
+        tileData._clockPos = clockPos;
+        tileData._credit = weight; // Rendered again, so someone is looking at it.
     }
-    _cacheSize += itemCacheSize(tile);
+    else
+    {
+        tileData._clockPos = _clock.insert(_clockHand, desc);
+        _index[std::make_pair(desc.getNormalizedViewId(), desc.getPart())].add(desc);
+    }
+    _cacheSize += itemCacheSize(tileData);
 }
 
-size_t TileCache::itemCacheSize(const Tile &tile)
+void TileCache::saveDeltaToCache(const TileDesc &desc, const char *data, const size_t size)
 {
-    return tile->size() + sizeof(TileDesc);
+    if (_dontCache)
+        return;
+
+    ensureCacheSize();
+
+    const auto it = _cache.find(desc);
+    if (it == _cache.end())
+    {
+        LOG_TRC("No base to save delta on for tile: " << desc.serialize());
+        return;
+    }
+
+    TileData& tileData = it->second;
+    if (tileData.getWireId() != desc.getOldWireId())
+    {
+        // We can't get to this version from what we have any more.
+        LOG_TRC("Removing tile with wid " << tileData.getWireId() << " not matching delta: "
+                                          << desc.serialize());
+        removeTile(desc);
+        return;
+    }
+
+    tileData._wids.push_back(desc.getWireId());
+    tileData._frames.push_back(std::make_shared<std::vector<char>>(data, data + size));
+    tileData._valid = true;
+    tileData._credit = tileData._weight;
+    _cacheSize += size;
+}
+
+void TileCache::removeTile(const TileDesc& desc)
+{
+    const auto it = _cache.find(desc);
+    if (it == _cache.end())
+        return;
+
+    TileData& tileData = it->second;
+    if (_clockHand == tileData._clockPos)
+        ++_clockHand;
+    _clock.erase(tileData._clockPos);
+
+    const auto shard = _index.find(std::make_pair(it->first.getNormalizedViewId(), it->first.getPart()));
+    if (shard != _index.end() && shard->second.remove(it->first))
+        _index.erase(shard);
+
+    _cacheSize -= itemCacheSize(tileData);
+    _cache.erase(it);
+}
+
+void TileCache::TileIndex::add(const TileDesc& desc)
+{
+    _rows[desc.getTilePosY()].emplace(desc.getTilePosX(), desc);
+    _maxTileWidth = std::max(_maxTileWidth, desc.getTileWidth());
+    _maxTileHeight = std::max(_maxTileHeight, desc.getTileHeight());
+}
+
+bool TileCache::TileIndex::remove(const TileDesc& desc)
+{
+    const auto row = _rows.find(desc.getTilePosY());
+    if (row != _rows.end())
+    {
+        const auto range = row->second.equal_range(desc.getTilePosX());
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (TileDescCacheCompareEq()(it->second, desc))
+            {
+                row->second.erase(it);
+                break;
+            }
+        }
+
+        if (row->second.empty())
+            _rows.erase(row);
+    }
+
+    return _rows.empty();
+}
+
+void TileCache::TileIndex::findIntersecting(int x, int y, int width, int height,
+                                            std::vector<TileDesc>& tiles) const
+{
+    // A tile starting up to a tile size before the area can still reach into it.
+    const int64_t top = std::max<int64_t>(static_cast<int64_t>(y) - _maxTileHeight, INT_MIN);
+    const int64_t bottom = static_cast<int64_t>(y) + height;
+    const int64_t left = std::max<int64_t>(static_cast<int64_t>(x) - _maxTileWidth, INT_MIN);
+    const int64_t right = static_cast<int64_t>(x) + width;
+
+    for (auto row = _rows.lower_bound(static_cast<int>(top)); row != _rows.end() && row->first <= bottom; ++row)
+    {
+        for (auto it = row->second.lower_bound(static_cast<int>(left));
+             it != row->second.end() && it->first <= right; ++it)
+        {
+            const TileDesc& desc = it->second;
+            if (intersectsTile(desc, desc.getPart(), x, y, width, height,
+                               desc.getNormalizedViewId()))
+                tiles.push_back(desc);
+        }
+    }
+}
+
+unsigned TileCache::evictionWeight(size_t size, std::chrono::milliseconds renderTime)
+{
+    // Blank and mostly empty tiles are small; text and images cost more.
+    unsigned weight = 1;
+    if (size <= 4096)
+        ++weight;
+    if (renderTime >= std::chrono::milliseconds(50))
+        ++weight;
+    if (renderTime >= std::chrono::milliseconds(250))
+        ++weight;
+    return weight;
+}
+
+size_t TileCache::itemCacheSize(const TileData &tile)
+{
+    return tile.size() + sizeof(TileDesc);
 }
 
 void TileCache::assertCacheSize()
@@ -582,53 +841,26 @@ void TileCache::ensureCacheSize()
     LOG_TRC("Cleaning tile cache of size " << _cacheSize << " vs. " << _maxCacheSize <<
             " with " << _cache.size() << " entries");
 
-    struct WidSize {
-        TileWireId _wid;
-        size_t     _size;
-        WidSize(TileWireId w, size_t s) : _wid(w), _size(s) {}
-    };
-    std::vector<WidSize> wids;
-    for (const auto& it : _cache)
-        wids.emplace_back(it.first.getWireId(), itemCacheSize(it.second));
-
-    std::sort(wids.begin(), wids.end(),
-              [](const WidSize &a, const WidSize &b) { return a._wid < b._wid; });
-
-    // FIXME: should we just take a wid 25% into the list ?
-    TileWireId maxToRemove = wids.front()._wid;
-
-    // do we have (the very rare) WID wrap-around
-    if (wids.back()._wid - wids.front()._wid > 256 * 256 * 256)
+    // Free a quarter, so we don't have to come back for every new tile.
+    const size_t targetSize = _maxCacheSize - _maxCacheSize / 4;
+    while (_cacheSize > targetSize && _cache.size() > 1)
     {
-        maxToRemove = wids.back()._wid;
-    }
-    else
-    {
-        // calculate which wid to start at.
-        size_t total = 0;
-        for (const auto &it : wids)
-        {
-            total += it._size;
-            maxToRemove = it._wid;
-            if (total > _maxCacheSize / 4)
-                break;
-        }
-    }
-    LOG_TRC("cleaning up to wid " << maxToRemove << " between " <<
-            wids.front()._wid << " and " << wids.back()._wid);
+        if (_clockHand == _clock.end())
+            _clockHand = _clock.begin();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
-    {
-        if (it->first.getWireId() <= maxToRemove)
-        {
-            LOG_TRC("cleaned out tile: " << it->first.serialize());
-            _cacheSize -= itemCacheSize(it->second);
-            it = _cache.erase(it);
-        }
-        else
+        TileData* tileData = findTileData(*_clockHand);
+        assert(tileData && "Tile in the eviction clock is not cached");
+        if (tileData->_credit > 0)
         {
-            ++it;
+            // Give it another chance.
+            --tileData->_credit;
+            ++_clockHand;
+            continue;
         }
+
+        const TileDesc desc = *_clockHand;
+        LOG_TRC("cleaned out tile: " << desc.serialize());
+        removeTile(desc);
     }
 
     LOG_TRC("Cache is now of size " << _cacheSize << " and " <<
@@ -670,11 +902,15 @@ void TileCache::TileBeingRendered::dumpState(std::ostream& os)
 
 void TileCache::dumpState(std::ostream& os)
 {
-    os << "  tile cache: num: " << _cache.size() << " size: " << _cacheSize << " bytes\n";
+    os << "  tile cache: num: " << _cache.size() << " size: " << _cacheSize << " bytes"
+       << " views/parts: " << _index.size() << '\n';
     for (const auto& it : _cache)
     {
-        os << "    " << std::setw(4) << it.first.getWireId()
-           << '\t' << std::setw(6) << it.second->size() << " bytes"
+        os << "    " << std::setw(4) << it.second.getWireId()
+           << '\t' << std::setw(6) << it.second.size() << " bytes"
+           << "\tcredit " << it.second._credit << '/' << it.second._weight
+           << '\t' << it.second._frames.size() - 1 << " deltas"
+           << (it.second._valid ? "" : "\tinvalid")
            << "\t'" << it.first.serialize() << "'\n" ;
     }
 
@@ -7,11 +7,15 @@
 
 #pragma once
 
+#include <chrono>
 #include <iosfwd>
+#include <list>
+#include <map>
 #include <memory>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <Rectangle.hpp>
 
@@ -64,6 +68,21 @@ class TileCache
 public:
     using Tile = std::shared_ptr<std::vector<char>>;
 
+    /// A full tile image, or a delta from the tile with _oldWireId, as sent to the client.
+    struct TileUpdate
+    {
+        TileUpdate(TileWireId oldWireId, TileWireId wireId, const Tile& data)
+            : _oldWireId(oldWireId)
+            , _wireId(wireId)
+            , _data(data)
+        {
+        }
+
+        TileWireId _oldWireId;
+        TileWireId _wireId;
+        Tile _data;
+    };
+
     /// When the docURL is a non-file:// url, the timestamp has to be provided by the caller.
     /// For file:// url's, it's ignored.
     /// When it is missing for non-file:// url, it is assumed the document must be read, and no cached value used.
@@ -93,7 +112,24 @@ public:
     /// Find the tile with this description
     Tile lookupTile(const TileDesc& tile);
 
-    void saveTileAndNotify(const TileDesc& tile, const char* data, size_t size);
+    /// Find what a client that has the tile with @knownWireId needs to bring it up to date:
+    /// the deltas after that, or the last full image and all deltas on top of it.
+    /// @return false if we have nothing valid for this tile.
+    bool lookupTileUpdates(const TileDesc& tile, TileWireId knownWireId,
+                           std::vector<TileUpdate>& updates);
+
+    /// True when the cached deltas of this tile are long enough that the next
+    /// render should be a full image rather than yet another delta.
+    bool wantsKeyframe(const TileDesc& tile);
+
+    /// Keep invalidated tiles around as the base for the deltas rendered next.
+    void setTileDeltas(bool tileDeltas) { _tileDeltas = tileDeltas; }
+
+    /// Caches the rendered tile and sends it to the subscribers.
+    /// @return the subscribers that couldn't be served, because they don't
+    /// have the tile the delta in @data is based on.
+    std::vector<std::shared_ptr<ClientSession>> saveTileAndNotify(const TileDesc& tile,
+                                                                  const char* data, size_t size);
 
     enum StreamType {
         Font,
@@ -143,13 +179,77 @@ public:
     void assertCacheSize();
 
 private:
+    /// The last full image of a tile and the deltas rendered on top of it since.
+    struct TileData
+    {
+        TileData(TileWireId wireId, const Tile& keyframe, unsigned weight)
+            : _valid(true)
+            , _wids(1, wireId)
+            , _frames(1, keyframe)
+            , _weight(weight)
+            , _credit(weight - 1) // Has to be used again to earn the rest.
+        {
+        }
+
+        TileWireId getWireId() const { return _wids.back(); }
+
+        size_t size() const
+        {
+            size_t size = 0;
+            for (const Tile& frame : _frames)
+                size += frame->size();
+            return size;
+        }
+
+        /// False once invalidated, until a delta brings it up to date again.
+        bool _valid;
+        std::vector<TileWireId> _wids;
+        std::vector<Tile> _frames;
+
+        /// The credit the tile gets back whenever it is used.
+        unsigned _weight;
+        /// How many more passes of the clock hand the tile survives unused.
+        unsigned _credit;
+        /// Our position in the eviction clock.
+        std::list<TileDesc>::iterator _clockPos;
+    };
+
+    /// The cached tiles of one part in one view, by position,
+    /// so invalidations only look at the tiles near the invalid area.
+    struct TileIndex
+    {
+        TileIndex() : _maxTileWidth(0), _maxTileHeight(0) {}
+
+        void add(const TileDesc& desc);
+        /// @return true when the index is empty after removing @desc.
+        bool remove(const TileDesc& desc);
+
+        /// Appends the tiles that intersect the given area to @tiles.
+        void findIntersecting(int x, int y, int width, int height,
+                              std::vector<TileDesc>& tiles) const;
+
+        /// Tiles by row then by column position.
+        std::map<int, std::multimap<int, TileDesc>> _rows;
+        /// The largest tiles we have, for how far back a tile can reach into an area.
+        int _maxTileWidth;
+        int _maxTileHeight;
+    };
+
     void ensureCacheSize();
-    static size_t itemCacheSize(const Tile &tile);
+    static size_t itemCacheSize(const TileData &tile);
+
+    /// How many passes of the clock hand a tile survives before eviction,
+    /// more for those that are small or were slow to render.
+    static unsigned evictionWeight(size_t size, std::chrono::milliseconds renderTime);
+
+    /// Drop the tile from the cache, the index and the eviction clock.
+    void removeTile(const TileDesc& desc);
 
     void invalidateTiles(int part, int x, int y, int width, int height, int normalizedViewId);
 
     /// Lookup tile in our cache.
     TileCache::Tile findTile(const TileDesc &desc);
+    TileData* findTileData(const TileDesc &desc);
 
     /// Lookup tile in our stream cache.
     TileCache::Tile findStreamTile(StreamType type, const std::string &fileName);
@@ -163,7 +263,9 @@ private:
     /// Extract location from fileName, and check if it intersects with [x, y, width, height].
     static bool intersectsTile(const TileDesc &tileDesc, int part, int x, int y, int width, int height, int normalizedViewId);
 
-    void saveDataToCache(const TileDesc& desc, const char* data, size_t size);
+    void saveDataToCache(const TileDesc& desc, const char* data, size_t size,
+                         std::chrono::milliseconds renderTime);
+    void saveDeltaToCache(const TileDesc& desc, const char* data, size_t size);
     void saveDataToStreamCache(StreamType type, const std::string& fileName, const char* data,
                                size_t size);
 
@@ -173,6 +275,9 @@ private:
 
     const bool _dontCache;
 
+    /// Whether any of the sessions takes tile updates as deltas.
+    bool _tileDeltas;
+
     /// Approximate size of tilecache in bytes
     size_t _cacheSize;
 
@@ -180,9 +285,18 @@ private:
     size_t _maxCacheSize;
 
     // FIXME: should we have a tile-desc to WID map instead and a simpler lookup ?
-    std::unordered_map<TileDesc, Tile,
+    std::unordered_map<TileDesc, TileData,
                        TileDescCacheHasher,
                        TileDescCacheCompareEq> _cache;
+
+    /// The cached tiles of each view and part, keyed by normalized view id then part.
+    std::map<std::pair<int, int>, TileIndex> _index;
+
+    /// Cached tiles in CLOCK order: the hand takes a credit from each tile it
+    /// passes, and evicts the first that has none left. New tiles go right
+    /// behind the hand, so they are the last to be looked at.
+    std::list<TileDesc> _clock;
+    std::list<TileDesc>::iterator _clockHand;
     // FIXME: TileBeingRendered contains TileDesc too ...
     std::unordered_map<TileDesc, std::shared_ptr<TileBeingRendered>,
                        TileDescCacheHasher,
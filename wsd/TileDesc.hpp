@@ -8,9 +8,14 @@
 #pragma once
 
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <unordered_map>
 #include <sstream>
 #include <string>
+#include <utility>
 
 
 #include "Exceptions.hpp"
@@ -20,6 +25,215 @@
 using TileWireId = uint32_t;
 using TileBinaryHash = uint64_t;
 
+/// The identity of a tile as the client knows it: part, position,
+/// zoom (as the tile size in twips) and view, packed in integers.
+/// Its string form is TileDesc::generateID(), as used on the wire.
+class TileKey final
+{
+public:
+    TileKey()
+        : _position(0)
+        , _zoom(0)
+        , _partView(0)
+    {
+    }
+
+    TileKey(int part, int tilePosX, int tilePosY, int tileWidth, int tileHeight,
+            int normalizedViewId)
+        : _position(pack(tilePosX, tilePosY))
+        , _zoom(pack(tileWidth, tileHeight))
+        , _partView(pack(part, normalizedViewId))
+    {
+    }
+
+    int getPart() const { return high(_partView); }
+    int getTilePosX() const { return high(_position); }
+    int getTilePosY() const { return low(_position); }
+    int getTileWidth() const { return high(_zoom); }
+    int getTileHeight() const { return low(_zoom); }
+    int getNormalizedViewId() const { return low(_partView); }
+
+    bool operator==(const TileKey& other) const
+    {
+        return _position == other._position && _zoom == other._zoom
+               && _partView == other._partView;
+    }
+
+    bool operator!=(const TileKey& other) const { return !(*this == other); }
+
+    std::size_t hash() const
+    {
+        uint64_t hash = _position;
+        hash ^= _zoom + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        hash ^= _partView + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        return static_cast<std::size_t>(hash);
+    }
+
+    /// The "part:x:y:width:height:view" form of the tileprocessed message.
+    std::string toString() const
+    {
+        std::ostringstream oss;
+        oss << getPart() << ':' << getTilePosX() << ':' << getTilePosY() << ':'
+            << getTileWidth() << ':' << getTileHeight() << ':' << getNormalizedViewId();
+        return oss.str();
+    }
+
+    /// Parses the form of toString(). Returns false if @id is malformed.
+    static bool parse(const std::string& id, TileKey& key)
+    {
+        int values[6];
+        const char* pos = id.c_str();
+        for (int i = 0; i < 6; ++i)
+        {
+            char* end = nullptr;
+            const long value = std::strtol(pos, &end, 10);
+            if (end == pos || value < INT32_MIN || value > INT32_MAX
+                || *end != (i < 5 ? ':' : '\0'))
+                return false;
+
+            values[i] = value;
+            pos = end + 1;
+        }
+
+        key = TileKey(values[0], values[1], values[2], values[3], values[4], values[5]);
+        return true;
+    }
+
+private:
+    static uint64_t pack(int high, int low)
+    {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(high)) << 32)
+               | static_cast<uint32_t>(low);
+    }
+
+    static int high(uint64_t value) { return static_cast<int32_t>(value >> 32); }
+    static int low(uint64_t value) { return static_cast<int32_t>(value & 0xffffffff); }
+
+    uint64_t _position;
+    uint64_t _zoom;
+    uint64_t _partView;
+};
+
+struct TileKeyHasher final
+{
+    inline std::size_t operator()(const TileKey& key) const { return key.hash(); }
+};
+
+/// The tiles sent to a client, not yet acknowledged by a tileprocessed message.
+/// The same tile may be on the fly a few times, in different versions: the
+/// sends are counted per key, and queued in the order they happened, so the
+/// ones that time out are found at the front.
+class TilesOnFly final
+{
+public:
+    TilesOnFly()
+        : _count(0)
+    {
+    }
+
+    /// The number of sends on the fly.
+    std::size_t size() const { return _count; }
+
+    /// The number of sends of the tile @key on the fly.
+    std::size_t count(const TileKey& key) const
+    {
+        const auto it = _tiles.find(key);
+        return it != _tiles.end() ? it->second._onFly : 0;
+    }
+
+    void add(const TileKey& key, std::chrono::steady_clock::time_point now)
+    {
+        Entry& entry = _tiles[key];
+        ++entry._queued;
+        ++entry._onFly;
+        ++_count;
+        _queue.emplace_back(key, now);
+    }
+
+    /// Acknowledges the oldest send of the tile @key.
+    /// Returns false if none is on the fly.
+    bool remove(const TileKey& key)
+    {
+        const auto it = _tiles.find(key);
+        if (it == _tiles.end() || it->second._onFly == 0)
+            return false;
+
+        --it->second._onFly;
+        --_count;
+
+        // Acknowledged sends are left in the queue until they reach its front.
+        while (!_queue.empty() && popFront(true))
+            ;
+
+        return true;
+    }
+
+    /// Drops the sends older than @timeout, calling @expired(key, elapsed)
+    /// for each of them that was not acknowledged.
+    template <typename Callback>
+    void expire(std::chrono::steady_clock::time_point now,
+                std::chrono::steady_clock::duration timeout, Callback expired)
+    {
+        while (!_queue.empty())
+        {
+            const std::pair<TileKey, std::chrono::steady_clock::time_point> front = _queue.front();
+            const std::chrono::steady_clock::duration elapsed = now - front.second;
+            if (elapsed <= timeout)
+            {
+                if (!popFront(true))
+                    break;
+            }
+            else if (!popFront(false))
+            {
+                expired(front.first, elapsed);
+            }
+        }
+    }
+
+    void clear()
+    {
+        _tiles.clear();
+        _queue.clear();
+        _count = 0;
+    }
+
+private:
+    /// Pops the front of the queue, if acknowledged or @onlyAcknowledged is false.
+    /// Returns whether it was acknowledged.
+    bool popFront(bool onlyAcknowledged)
+    {
+        const auto it = _tiles.find(_queue.front().first);
+        assert(it != _tiles.end() && "Queued tile is not counted");
+
+        // Acknowledgements go to the oldest sends, and the front is the oldest send of its key.
+        Entry& entry = it->second;
+        const bool acknowledged = entry._queued > entry._onFly;
+        if (!acknowledged)
+        {
+            if (onlyAcknowledged)
+                return false;
+
+            --entry._onFly;
+            --_count;
+        }
+
+        if (--entry._queued == 0)
+            _tiles.erase(it);
+        _queue.pop_front();
+        return acknowledged;
+    }
+
+    struct Entry
+    {
+        uint32_t _queued; //< Sends in the queue, acknowledged or not.
+        uint32_t _onFly; //< Sends not acknowledged yet.
+    };
+
+    std::unordered_map<TileKey, Entry, TileKeyHasher> _tiles;
+    std::deque<std::pair<TileKey, std::chrono::steady_clock::time_point>> _queue;
+    std::size_t _count;
+};
+
 /// Tile Descriptor
 /// Represents a tile's coordinates and dimensions.
 class TileDesc final
@@ -251,14 +465,14 @@ public:
         return parse(Util::tokenize(message.data(), message.size()));
     }
 
-    std::string generateID() const
+    TileKey generateKey() const
     {
-        std::ostringstream tileID;
-        tileID << getPart() << ':' << getTilePosX() << ':' << getTilePosY() << ':'
-               << getTileWidth() << ':' << getTileHeight() << ':' << getNormalizedViewId();
-        return tileID.str();
+        return TileKey(getPart(), getTilePosX(), getTilePosY(), getTileWidth(), getTileHeight(),
+                       getNormalizedViewId());
     }
 
+    std::string generateID() const { return generateKey().toString(); }
+
 private:
     int _normalizedViewId;
     int _part;
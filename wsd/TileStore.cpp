@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "TileStore.hpp"
+
+#include <cstring>
+#include <ostream>
+
+#include <Log.hpp>
+#include <SpookyV2.h>
+
+TileStore& TileStore::instance()
+{
+    // Never destroyed: tiles may be released by caches that outlive static destruction.
+    static TileStore* store = new TileStore();
+    return *store;
+}
+
+TileStore::TileStore()
+    : _keptSize(0)
+    , _maxKeptSize(16 * 1024 * 1024)
+    , _size(0)
+    , _count(0)
+    , _hits(0)
+    , _misses(0)
+{
+}
+
+TileStore::Tile TileStore::intern(const char* data, const std::size_t size)
+{
+    const uint64_t hash = SpookyHash::Hash64(data, size, 1073741789);
+    Shard& shard = _shards[hash % ShardCount];
+
+    Tile tile;
+    {
+        // The tiles we look at are only let go of after unlocking,
+        // as releasing the last reference takes the lock again.
+        std::vector<Tile> seen;
+
+        std::unique_lock<std::mutex> lock(shard._mutex);
+        const auto range = shard._entries.equal_range(hash);
+        for (auto it = range.first; it != range.second && !tile; ++it)
+        {
+            seen.push_back(it->second._tile.lock());
+            const Tile& candidate = seen.back();
+            if (candidate && candidate->size() == size
+                && std::memcmp(candidate->data(), data, size) == 0)
+                tile = candidate;
+        }
+
+        if (!tile)
+        {
+            tile = Tile(new std::vector<char>(data, data + size), Release{ this, hash });
+            shard._entries.emplace(hash, Entry{ tile.get(), tile });
+            _size += size;
+            ++_count;
+            ++_misses;
+        }
+        else
+            ++_hits;
+    }
+
+    keep(tile);
+    return tile;
+}
+
+void TileStore::release(const uint64_t hash, std::vector<char>* tile)
+{
+    {
+        Shard& shard = _shards[hash % ShardCount];
+        std::unique_lock<std::mutex> lock(shard._mutex);
+        const auto range = shard._entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second._data == tile)
+            {
+                shard._entries.erase(it);
+                break;
+            }
+        }
+    }
+
+    _size -= tile->size();
+    --_count;
+    delete tile;
+}
+
+void TileStore::keep(const Tile& tile)
+{
+    // Dropped outside of the lock, for the same reason as in intern().
+    std::vector<Tile> dropped;
+
+    std::unique_lock<std::mutex> lock(_keptMutex);
+    const auto it = _keptIndex.find(tile.get());
+    if (it != _keptIndex.end())
+    {
+        _kept.splice(_kept.begin(), _kept, it->second);
+        return;
+    }
+
+    _kept.push_front(tile);
+    _keptIndex.emplace(tile.get(), _kept.begin());
+    _keptSize += tile->size();
+
+    while (_keptSize > _maxKeptSize && !_kept.empty())
+    {
+        _keptSize -= _kept.back()->size();
+        _keptIndex.erase(_kept.back().get());
+        dropped.push_back(std::move(_kept.back()));
+        _kept.pop_back();
+    }
+}
+
+void TileStore::setMaxKeptSize(const std::size_t size)
+{
+    std::vector<Tile> dropped;
+
+    std::unique_lock<std::mutex> lock(_keptMutex);
+    _maxKeptSize = size;
+    while (_keptSize > _maxKeptSize && !_kept.empty())
+    {
+        _keptSize -= _kept.back()->size();
+        _keptIndex.erase(_kept.back().get());
+        dropped.push_back(std::move(_kept.back()));
+        _kept.pop_back();
+    }
+
+    lock.unlock();
+    LOG_INF("Keeping up to " << size << " bytes of unused tiles in the shared tile store.");
+}
+
+void TileStore::dumpState(std::ostream& os)
+{
+    std::size_t keptCount;
+    std::size_t keptSize;
+    std::size_t maxKeptSize;
+    {
+        std::unique_lock<std::mutex> lock(_keptMutex);
+        keptCount = _kept.size();
+        keptSize = _keptSize;
+        maxKeptSize = _maxKeptSize;
+    }
+
+    os << "  shared tile store: num: " << _count << " size: " << _size << " bytes"
+       << " kept: " << keptCount << " (" << keptSize << '/' << maxKeptSize << " bytes)"
+       << " hits: " << _hits << " misses: " << _misses << '\n';
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
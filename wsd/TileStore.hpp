@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Tile images shared by the TileCache of every document, by content.
+/// Identical tiles, such as blank ones, backgrounds and the pages of
+/// common templates, are held in memory only once, however many
+/// documents have them. An image lives for as long as any cache uses
+/// it, and the most recently used ones are kept for a while longer,
+/// within a budget, for the next document that needs them.
+class TileStore
+{
+public:
+    using Tile = std::shared_ptr<std::vector<char>>;
+
+    /// The store of this process.
+    static TileStore& instance();
+
+    TileStore(const TileStore&) = delete;
+    TileStore& operator=(const TileStore&) = delete;
+
+    /// Returns the stored tile with this content, or a new one with a copy of it.
+    Tile intern(const char* data, std::size_t size);
+
+    /// Set how many bytes of recently used tiles to keep when no cache has them.
+    void setMaxKeptSize(std::size_t size);
+
+    /// The size of all the distinct tiles alive.
+    std::size_t getSize() const { return _size; }
+
+    /// The number of distinct tiles alive.
+    std::size_t getCount() const { return _count; }
+
+    void dumpState(std::ostream& os);
+
+private:
+    TileStore();
+
+    struct Entry
+    {
+        const std::vector<char>* _data;
+        std::weak_ptr<std::vector<char>> _tile;
+    };
+
+    /// Each has its own lock, so documents don't wait on each other.
+    struct Shard
+    {
+        std::mutex _mutex;
+        std::unordered_multimap<uint64_t, Entry> _entries;
+    };
+
+    /// Deletes the tile once the last user has let go of it.
+    struct Release
+    {
+        TileStore* _store;
+        uint64_t _hash;
+        void operator()(std::vector<char>* tile) const { _store->release(_hash, tile); }
+    };
+
+    void release(uint64_t hash, std::vector<char>* tile);
+
+    /// Marks the tile as recently used, dropping the oldest ones over the budget.
+    void keep(const Tile& tile);
+
+    static constexpr std::size_t ShardCount = 16;
+    Shard _shards[ShardCount];
+
+    /// Recently used tiles, most recent first. Never locked together with a shard.
+    std::mutex _keptMutex;
+    std::list<Tile> _kept;
+    std::unordered_map<const std::vector<char>*, std::list<Tile>::iterator> _keptIndex;
+    std::size_t _keptSize;
+    std::size_t _maxKeptSize;
+
+    std::atomic<std::size_t> _size;
+    std::atomic<std::size_t> _count;
+    std::atomic<std::size_t> _hits;
+    std::atomic<std::size_t> _misses;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */